@@ -1,7 +1,7 @@
 #include "avcc_parser.h"
 #include "rtmp_tools.h"
-
-#include <iostream>
+#include "rtmp_log.h"
+#include "rtmp_simd.h"
 
 
 //------------------------------------------------------------------------------
@@ -17,21 +17,338 @@ void ConvertToAnnexB(
 {
     AppendDataToVector(out_buffer, kStartCode, sizeof(kStartCode));
 
+    // Copies the bytes between 00 00 00 runs in bulk, replacing each run
     while (size > 0) {
-        const uint8_t ch = data[0];
-        if (size >= 3 && ch == 0 && data[1] == 0 && data[2] == 0) {
-            AppendDataToVector(out_buffer, kPrefixCode, sizeof(kPrefixCode));
-            data += 3;
-            size -= 3;
-        } else {
-            out_buffer.push_back(ch);
-            ++data;
-            --size;
+        const size_t run = FindZeroZeroPattern(data, size, 0);
+        AppendDataToVector(out_buffer, data, static_cast<int>( run ));
+        if (run == size) {
+            break;
+        }
+        AppendDataToVector(out_buffer, kPrefixCode, sizeof(kPrefixCode));
+        data += run + 3;
+        size -= run + 3;
+    }
+}
+
+bool FindNalUnits(
+    const uint8_t* data,
+    size_t size,
+    int length_bytes,
+    std::vector<NalUnitSpan>& units)
+{
+    units.clear();
+
+    size_t offset = 0;
+    while (offset + length_bytes <= size) {
+        const uint8_t* prefix = data + offset;
+        uint32_t nal_bytes;
+        switch (length_bytes) {
+        case 4: nal_bytes = LoadBigEndian32(prefix); break;
+        case 3: nal_bytes = LoadBigEndian24(prefix); break;
+        case 2: nal_bytes = LoadBigEndian16(prefix); break;
+        default: nal_bytes = prefix[0]; break;
         }
+        offset += length_bytes;
+        if (nal_bytes > size - offset) {
+            return false;
+        }
+
+        NalUnitSpan unit;
+        unit.Data = data + offset;
+        unit.Bytes = nal_bytes;
+        units.push_back(unit);
+        offset += nal_bytes;
     }
+    return offset == size;
 }
 
 
+//------------------------------------------------------------------------------
+// H264SpsInfo
+
+// Exp-Golomb bit reader over an RBSP (emulation prevention bytes removed)
+class RbspBitReader {
+public:
+    RbspBitReader(const uint8_t* data, int bytes) {
+        Rbsp.reserve(bytes);
+        const uint8_t* end = data + bytes;
+        while (data < end) {
+            const size_t remaining = static_cast<size_t>( end - data );
+            const size_t run = FindZeroZeroPattern(data, remaining, 0x03);
+            if (run == remaining) {
+                Rbsp.insert(Rbsp.end(), data, end);
+                break;
+            }
+            if (data[run + 2] == 0x03) {
+                Rbsp.insert(Rbsp.end(), data, data + run + 2);
+                data += run + 3; // emulation_prevention_three_byte
+            } else {
+                Rbsp.insert(Rbsp.end(), data, data + run + 1);
+                data += run + 1;
+            }
+        }
+    }
+
+    uint32_t ReadBits(int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; ++i) {
+            value = (value << 1) | ReadBit();
+        }
+        return value;
+    }
+
+    uint32_t ReadBit() {
+        if (BitOffset >= Rbsp.size() * 8) {
+            Error = true;
+            return 0;
+        }
+        const uint32_t bit = (Rbsp[BitOffset / 8] >> (7 - BitOffset % 8)) & 1;
+        ++BitOffset;
+        return bit;
+    }
+
+    // ue(v)
+    uint32_t ReadUE() {
+        int leading_zeros = 0;
+        while (ReadBit() == 0) {
+            if (Error || ++leading_zeros > 31) {
+                Error = true;
+                return 0;
+            }
+        }
+        return ((1u << leading_zeros) - 1) + ReadBits(leading_zeros);
+    }
+
+    // se(v)
+    int32_t ReadSE() {
+        const uint32_t k = ReadUE();
+        return (k & 1) ? static_cast<int32_t>( (k + 1) / 2 ) : -static_cast<int32_t>( k / 2 );
+    }
+
+    bool HasError() const {
+        return Error;
+    }
+
+private:
+    std::vector<uint8_t> Rbsp;
+    size_t BitOffset = 0;
+    bool Error = false;
+};
+
+static void SkipScalingList(RbspBitReader& reader, int size) {
+    int last_scale = 8, next_scale = 8;
+    for (int j = 0; j < size; ++j) {
+        if (next_scale != 0) {
+            const int delta_scale = reader.ReadSE();
+            next_scale = (last_scale + delta_scale + 256) % 256;
+        }
+        last_scale = (next_scale == 0) ? last_scale : next_scale;
+    }
+}
+
+static void SkipHrdParameters(RbspBitReader& reader) {
+    const uint32_t cpb_cnt = reader.ReadUE() + 1;
+    reader.ReadBits(4); // bit_rate_scale
+    reader.ReadBits(4); // cpb_size_scale
+    for (uint32_t i = 0; i < cpb_cnt && !reader.HasError(); ++i) {
+        reader.ReadUE(); // bit_rate_value_minus1
+        reader.ReadUE(); // cpb_size_value_minus1
+        reader.ReadBit(); // cbr_flag
+    }
+    reader.ReadBits(5); // initial_cpb_removal_delay_length_minus1
+    reader.ReadBits(5); // cpb_removal_delay_length_minus1
+    reader.ReadBits(5); // dpb_output_delay_length_minus1
+    reader.ReadBits(5); // time_offset_length
+}
+
+// MaxDpbMbs from Table A-1
+static int GetMaxDpbMbs(int level_idc) {
+    if (level_idc <= 10) return 396;
+    if (level_idc <= 11) return 900;
+    if (level_idc <= 20) return 2376;
+    if (level_idc <= 21) return 4752;
+    if (level_idc <= 30) return 8100;
+    if (level_idc <= 31) return 18000;
+    if (level_idc <= 32) return 20480;
+    if (level_idc <= 41) return 32768;
+    if (level_idc <= 42) return 34816;
+    if (level_idc <= 50) return 110400;
+    if (level_idc <= 52) return 184320;
+    return 696320;
+}
+
+// Sqrt(MaxFS * 8) at level 6.2, the widest or tallest a picture can be in
+// macroblocks (A.3.1)
+static const uint32_t kMaxPicSideMbs = 1055;
+
+bool ParseH264Sps(const uint8_t* data, int bytes, H264SpsInfo& info)
+{
+    if (bytes < 4 || (data[0] & 0x1F) != 7) {
+        return false;
+    }
+
+    RbspBitReader reader(data + 1, bytes - 1);
+
+    info.ProfileIdc = reader.ReadBits(8);
+    const uint32_t constraint_flags = reader.ReadBits(8);
+    info.LevelIdc = reader.ReadBits(8);
+    reader.ReadUE(); // seq_parameter_set_id
+
+    int chroma_format_idc = 1;
+    const int profile = info.ProfileIdc;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+        profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+        profile == 139 || profile == 134 || profile == 135)
+    {
+        chroma_format_idc = reader.ReadUE();
+        if (chroma_format_idc == 3) {
+            reader.ReadBit(); // separate_colour_plane_flag
+        }
+        reader.ReadUE(); // bit_depth_luma_minus8
+        reader.ReadUE(); // bit_depth_chroma_minus8
+        reader.ReadBit(); // qpprime_y_zero_transform_bypass_flag
+        if (reader.ReadBit()) { // seq_scaling_matrix_present_flag
+            const int lists = (chroma_format_idc != 3) ? 8 : 12;
+            for (int i = 0; i < lists; ++i) {
+                if (reader.ReadBit()) {
+                    SkipScalingList(reader, i < 6 ? 16 : 64);
+                }
+            }
+        }
+    }
+
+    reader.ReadUE(); // log2_max_frame_num_minus4
+    const uint32_t pic_order_cnt_type = reader.ReadUE();
+    if (pic_order_cnt_type == 0) {
+        reader.ReadUE(); // log2_max_pic_order_cnt_lsb_minus4
+    } else if (pic_order_cnt_type == 1) {
+        reader.ReadBit(); // delta_pic_order_always_zero_flag
+        reader.ReadSE(); // offset_for_non_ref_pic
+        reader.ReadSE(); // offset_for_top_to_bottom_field
+        const uint32_t cycle = reader.ReadUE();
+        for (uint32_t i = 0; i < cycle && !reader.HasError(); ++i) {
+            reader.ReadSE(); // offset_for_ref_frame
+        }
+    }
+
+    reader.ReadUE(); // max_num_ref_frames
+    reader.ReadBit(); // gaps_in_frame_num_value_allowed_flag
+    const uint32_t width_mbs = reader.ReadUE() + 1;
+    const uint32_t height_map_units = reader.ReadUE() + 1;
+    const int frame_mbs_only = reader.ReadBit();
+    if (!frame_mbs_only) {
+        reader.ReadBit(); // mb_adaptive_frame_field_flag
+    }
+    reader.ReadBit(); // direct_8x8_inference_flag
+
+    // Also rejects the ue(v) wrap when a field is all ones
+    if (width_mbs == 0 || width_mbs > kMaxPicSideMbs ||
+        height_map_units == 0 || height_map_units > kMaxPicSideMbs)
+    {
+        return false;
+    }
+
+    const uint32_t height_mbs = (2 - frame_mbs_only) * height_map_units;
+    info.Width = static_cast<int>( width_mbs * 16 );
+    info.Height = static_cast<int>( height_mbs * 16 );
+
+    if (reader.ReadBit()) { // frame_cropping_flag
+        const uint64_t crop_left = reader.ReadUE();
+        const uint64_t crop_right = reader.ReadUE();
+        const uint64_t crop_top = reader.ReadUE();
+        const uint64_t crop_bottom = reader.ReadUE();
+
+        const uint64_t crop_unit_x = (chroma_format_idc == 1 || chroma_format_idc == 2) ? 2 : 1;
+        const uint64_t crop_unit_y = (chroma_format_idc == 1 ? 2 : 1) * (2 - frame_mbs_only);
+        const uint64_t crop_x = (crop_left + crop_right) * crop_unit_x;
+        const uint64_t crop_y = (crop_top + crop_bottom) * crop_unit_y;
+        if (crop_x >= static_cast<uint64_t>( info.Width ) || crop_y >= static_cast<uint64_t>( info.Height )) {
+            return false;
+        }
+        info.Width -= static_cast<int>( crop_x );
+        info.Height -= static_cast<int>( crop_y );
+    }
+
+    if (reader.HasError()) {
+        return false;
+    }
+
+    // Inferred when the VUI does not say (E.2.1).  Baseline has no B slices so is never reordered
+    const bool intra_profile = (constraint_flags & 0x10) != 0 &&
+        (profile == 44 || profile == 86 || profile == 100 || profile == 110 || profile == 122 || profile == 244);
+    if (intra_profile || profile == 66) {
+        info.NumReorderFrames = 0;
+    } else {
+        // Keeps the default depth if the picture does not fit the level
+        const uint64_t frame_mbs = static_cast<uint64_t>( width_mbs ) * height_mbs;
+        const uint64_t max_dpb_mbs = static_cast<uint64_t>( GetMaxDpbMbs(info.LevelIdc) );
+        if (frame_mbs > 0 && frame_mbs <= max_dpb_mbs) {
+            const uint64_t max_dpb_frames = max_dpb_mbs / frame_mbs;
+            info.NumReorderFrames = max_dpb_frames < 16 ? static_cast<int>( max_dpb_frames ) : 16;
+        }
+    }
+
+    if (!reader.ReadBit()) { // vui_parameters_present_flag
+        return true;
+    }
+
+    if (reader.ReadBit()) { // aspect_ratio_info_present_flag
+        if (reader.ReadBits(8) == 255) { // Extended_SAR
+            reader.ReadBits(16); // sar_width
+            reader.ReadBits(16); // sar_height
+        }
+    }
+    if (reader.ReadBit()) { // overscan_info_present_flag
+        reader.ReadBit(); // overscan_appropriate_flag
+    }
+    if (reader.ReadBit()) { // video_signal_type_present_flag
+        reader.ReadBits(3); // video_format
+        reader.ReadBit(); // video_full_range_flag
+        if (reader.ReadBit()) { // colour_description_present_flag
+            reader.ReadBits(24);
+        }
+    }
+    if (reader.ReadBit()) { // chroma_loc_info_present_flag
+        reader.ReadUE();
+        reader.ReadUE();
+    }
+    if (reader.ReadBit()) { // timing_info_present_flag
+        reader.ReadBits(32); // num_units_in_tick
+        reader.ReadBits(32); // time_scale
+        reader.ReadBit(); // fixed_frame_rate_flag
+    }
+    const uint32_t nal_hrd = reader.ReadBit();
+    if (nal_hrd) {
+        SkipHrdParameters(reader);
+    }
+    const uint32_t vcl_hrd = reader.ReadBit();
+    if (vcl_hrd) {
+        SkipHrdParameters(reader);
+    }
+    if (nal_hrd || vcl_hrd) {
+        reader.ReadBit(); // low_delay_hrd_flag
+    }
+    reader.ReadBit(); // pic_struct_present_flag
+
+    if (reader.ReadBit()) { // bitstream_restriction_flag
+        reader.ReadBit(); // motion_vectors_over_pic_boundaries_flag
+        reader.ReadUE(); // max_bytes_per_pic_denom
+        reader.ReadUE(); // max_bits_per_mb_denom
+        reader.ReadUE(); // log2_max_mv_length_horizontal
+        reader.ReadUE(); // log2_max_mv_length_vertical
+        const uint32_t max_num_reorder_frames = reader.ReadUE();
+        reader.ReadUE(); // max_dec_frame_buffering
+
+        if (!reader.HasError()) {
+            info.NumReorderFrames = static_cast<int>( max_num_reorder_frames );
+            info.HasBitstreamRestriction = true;
+        }
+    }
+
+    // Keep the inferred value if the VUI is truncated
+    return true;
+}
+
 //------------------------------------------------------------------------------
 // AVCCParser
 
@@ -42,23 +359,43 @@ void AVCCParser::parseAvcc(const uint8_t* data, size_t size) {
     ByteStream stream(data, size);
 
     int type = stream.ReadUInt8();
-    int skip = stream.ReadUInt24();
-    UNUSED(skip);
+
+    // SI24 composition time offset
+    const uint32_t cts = stream.ReadUInt24();
+    CompositionTime = static_cast<int32_t>( cts << 8 ) >> 8;
 
     if (type == 0) {
+        Extradata.assign(stream.PeekData(), stream.PeekData() + stream.RemainingBytes());
         parseExtradata(stream);
     } else if (type == 1) {
         parseCodedVideo(stream);
     } else {
-        std::cout << "Unsupported AVCC type " << type << std::endl;
+        RTMP_LOG(RTMP_LOG_WARNING, "Unsupported AVCC type ", type);
     }
 
     if (stream.HasError()) {
-        std::cout << "Truncated parsing AVCC" << std::endl;
+        RTMP_LOG(RTMP_LOG_WARNING, "Truncated parsing AVCC");
     }
 }
 
+bool AVCCParser::RestoreExtradata(const uint8_t* data, int bytes) {
+    Extradata.assign(data, data + bytes);
+    SetupResult = RTMPSetupResult();
+    HasParams = false;
+
+    ByteStream stream(Extradata.data(), Extradata.size());
+    parseExtradata(stream);
+    return HasParams;
+}
+
 void AVCCParser::parseExtradata(ByteStream& stream) {
+    // Drop the previous sequence header, whose parameter sets point into a
+    // message buffer that may have been recycled
+    SetupResult.SPS.clear();
+    SetupResult.PPS.clear();
+    SetupResult.SpsInfo = H264SpsInfo();
+    HasParams = false;
+
     SetupResult.Extradata = stream.PeekData();
     SetupResult.ExtradataSize = stream.RemainingBytes();
 
@@ -77,13 +414,19 @@ void AVCCParser::parseExtradata(ByteStream& stream) {
         int paramSize = stream.ReadUInt16();
         const uint8_t* paramData = stream.ReadData(paramSize);
         if (stream.HasError()) {
-            std::cout << "Truncated while reading SPS" << std::endl;
+            RTMP_LOG(RTMP_LOG_WARNING, "Truncated while reading SPS");
             return;
         }
         ParameterData data;
         data.Data = paramData;
         data.Size = paramSize;
         SetupResult.SPS.push_back(data);
+
+        if (i == 0) {
+            if (!ParseH264Sps(paramData, paramSize, SetupResult.SpsInfo)) {
+                RTMP_LOG(RTMP_LOG_WARNING, "Failed to parse SPS");
+            }
+        }
     }
 
     int numPPS = stream.ReadUInt8();
@@ -91,7 +434,7 @@ void AVCCParser::parseExtradata(ByteStream& stream) {
         int paramSize = stream.ReadUInt16();
         const uint8_t* paramData = stream.ReadData(paramSize);
         if (stream.HasError()) {
-            std::cout << "Truncated while reading PPS" << std::endl;
+            RTMP_LOG(RTMP_LOG_WARNING, "Truncated while reading PPS");
             return;
         }
         ParameterData data;
@@ -101,7 +444,7 @@ void AVCCParser::parseExtradata(ByteStream& stream) {
     }
 
     if (stream.HasError()) {
-        std::cout << "Truncated while reading parameters" << std::endl;
+        RTMP_LOG(RTMP_LOG_WARNING, "Truncated while reading parameters");
         return;
     }
 
@@ -15,6 +15,42 @@ void ConvertToAnnexB(
     size_t size,
     std::vector<uint8_t>& out_buffer);
 
+// One NAL unit of an AVCC frame, without its length prefix
+struct NalUnitSpan {
+    const uint8_t* Data = nullptr;
+    uint32_t Bytes = 0;
+};
+
+// Walks every length prefix of an AVCC frame in one pass, filling units with
+// the NAL units it holds.  length_bytes is RTMPSetupResult::VideoSizeBytes.
+// Returns false if a length runs past the end of the frame
+bool FindNalUnits(
+    const uint8_t* data,
+    size_t size,
+    int length_bytes,
+    std::vector<NalUnitSpan>& units);
+
+//------------------------------------------------------------------------------
+// H264SpsInfo
+
+// Fields of an H.264 sequence parameter set
+struct H264SpsInfo {
+    int ProfileIdc = 0;
+    int LevelIdc = 0;
+    int Width = 0, Height = 0;
+
+    // Maximum number of frames that precede any frame in decode order and
+    // follow it in presentation order.  From the VUI bitstream_restriction
+    // when present, otherwise inferred from the profile and level.
+    // -1 if the SPS could not be parsed
+    int NumReorderFrames = -1;
+    bool HasBitstreamRestriction = false;
+};
+
+// Parses an SPS NAL unit including its header byte, with emulation prevention bytes
+bool ParseH264Sps(const uint8_t* data, int bytes, H264SpsInfo& info);
+
+
 //------------------------------------------------------------------------------
 // AVCCParser
 
@@ -24,6 +60,10 @@ struct ParameterData {
 };
 
 struct RTMPSetupResult {
+    // Connection number on the receiver, as in RTMPVideoFrame.  Set by the
+    // receiver before the setup callback
+    uint32_t Connection = 0;
+
     // Raw input
     const uint8_t* Extradata = nullptr;
     int ExtradataSize = 0;
@@ -31,6 +71,9 @@ struct RTMPSetupResult {
     // Parsed input
     std::vector<ParameterData> SPS, PPS;
     int VideoSizeBytes;
+
+    // Parsed from the first SPS
+    H264SpsInfo SpsInfo;
 };
 
 class AVCCParser {
@@ -40,9 +83,20 @@ public:
     bool HasParams = false;
     RTMPSetupResult SetupResult;
 
+    // Copy of the last AVCDecoderConfigurationRecord, which outlives the
+    // message SetupResult points into
+    std::vector<uint8_t> Extradata;
+
+    // Hot restart: Parses a copy of extradata saved by another receiver, so
+    // SetupResult points into Extradata.  Returns false if it has no parameters
+    bool RestoreExtradata(const uint8_t* data, int bytes);
+
     const uint8_t* VideoData = nullptr;
     int VideoSize = 0;
 
+    // Signed presentation - decode time offset of the last frame, in milliseconds
+    int32_t CompositionTime = 0;
+
 private:
     void parseExtradata(ByteStream& stream);
     void parseCodedVideo(ByteStream& stream);
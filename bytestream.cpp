@@ -13,6 +13,10 @@ size_t ByteStreamWriter::GetLength() const {
     return buffer_.size();
 }
 
+void ByteStreamWriter::Clear() {
+    buffer_.clear();
+}
+
 void ByteStreamWriter::WriteUInt8(uint8_t value) {
     buffer_.push_back(value);
 }
@@ -76,6 +80,118 @@ void ByteStreamWriter::WriteAmf0String(const std::string& value) {
 }
 
 
+//------------------------------------------------------------------------------
+// FixedByteStreamWriter
+
+FixedByteStreamWriter::FixedByteStreamWriter(uint8_t* buffer, size_t capacity)
+    : buffer_(buffer), capacity_(capacity), length_(0), error_(false) {}
+
+const uint8_t* FixedByteStreamWriter::GetData() const {
+    return buffer_;
+}
+
+size_t FixedByteStreamWriter::GetLength() const {
+    return length_;
+}
+
+bool FixedByteStreamWriter::HasError() const {
+    return error_;
+}
+
+void FixedByteStreamWriter::Clear() {
+    length_ = 0;
+    error_ = false;
+}
+
+void FixedByteStreamWriter::WriteUInt8(uint8_t value) {
+    if (length_ >= capacity_) {
+        error_ = true;
+        return;
+    }
+    buffer_[length_++] = value;
+}
+
+void FixedByteStreamWriter::WriteUInt16(uint16_t value) {
+    uint8_t data[2] = {
+        static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value)
+    };
+    WriteData(data, sizeof(data));
+}
+
+void FixedByteStreamWriter::WriteUInt24(uint32_t value) {
+    uint8_t data[3] = {
+        static_cast<uint8_t>(value >> 16),
+        static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value)
+    };
+    WriteData(data, sizeof(data));
+}
+
+void FixedByteStreamWriter::WriteUInt32(uint32_t value) {
+    uint8_t data[4] = {
+        static_cast<uint8_t>(value >> 24),
+        static_cast<uint8_t>(value >> 16),
+        static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value)
+    };
+    WriteData(data, sizeof(data));
+}
+
+void FixedByteStreamWriter::WriteUInt64(uint64_t value) {
+    uint8_t data[8] = {
+        static_cast<uint8_t>(value >> 56),
+        static_cast<uint8_t>(value >> 48),
+        static_cast<uint8_t>(value >> 40),
+        static_cast<uint8_t>(value >> 32),
+        static_cast<uint8_t>(value >> 24),
+        static_cast<uint8_t>(value >> 16),
+        static_cast<uint8_t>(value >> 8),
+        static_cast<uint8_t>(value)
+    };
+    WriteData(data, sizeof(data));
+}
+
+void FixedByteStreamWriter::WriteDouble(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    WriteUInt64(bits);
+}
+
+void FixedByteStreamWriter::WriteData(const void* data, size_t length) {
+    if (data == nullptr || length == 0) {
+        return;
+    }
+    if (length > capacity_ - length_) {
+        error_ = true;
+        return;
+    }
+    memcpy(buffer_ + length_, data, length);
+    length_ += length;
+}
+
+void FixedByteStreamWriter::WriteAmf0String(const char* value) {
+    const size_t length = strlen(value);
+    WriteUInt16(static_cast<uint16_t>( length ));
+    WriteData(value, length);
+}
+
+void FixedByteStreamWriter::WriteAmf0String(const std::string& value) {
+    WriteUInt16(static_cast<uint16_t>( value.length() ));
+    WriteData(value.c_str(), value.length());
+}
+
+void FixedByteStreamWriter::PatchUInt24(size_t offset, uint32_t value) {
+    if (offset + 3 > length_) {
+        error_ = true;
+        return;
+    }
+    buffer_[offset] = static_cast<uint8_t>(value >> 16);
+    buffer_[offset + 1] = static_cast<uint8_t>(value >> 8);
+    buffer_[offset + 2] = static_cast<uint8_t>(value);
+}
+
+
 //------------------------------------------------------------------------------
 // ByteStream
 
@@ -96,8 +212,7 @@ uint8_t ByteStream::ReadUInt8() {
 uint16_t ByteStream::ReadUInt16() {
     uint16_t value = 0;
     if (offset_ + 2 <= size_) {
-        value = (static_cast<uint16_t>(data_[offset_]) << 8) |
-                (static_cast<uint16_t>(data_[offset_ + 1]));
+        value = LoadBigEndian16(data_ + offset_);
         offset_ += 2;
     } else {
         error_ = true;
@@ -108,9 +223,7 @@ uint16_t ByteStream::ReadUInt16() {
 uint32_t ByteStream::ReadUInt24() {
     uint32_t value = 0;
     if (offset_ + 3 <= size_) {
-        value = (static_cast<uint32_t>(data_[offset_]) << 16) |
-                (static_cast<uint32_t>(data_[offset_ + 1]) << 8) |
-                (static_cast<uint32_t>(data_[offset_ + 2]));
+        value = LoadBigEndian24(data_ + offset_);
         offset_ += 3;
     } else {
         error_ = true;
@@ -122,15 +235,9 @@ uint32_t ByteStream::ReadUInt32(bool big_endian) {
     uint32_t value = 0;
     if (offset_ + 4 <= size_) {
         if (big_endian) {
-            value = (static_cast<uint32_t>(data_[offset_]) << 24) |
-                    (static_cast<uint32_t>(data_[offset_ + 1]) << 16) |
-                    (static_cast<uint32_t>(data_[offset_ + 2]) << 8) |
-                    (static_cast<uint32_t>(data_[offset_ + 3]));
+            value = LoadBigEndian32(data_ + offset_);
         } else {
-            value = (static_cast<uint32_t>(data_[offset_ + 3]) << 24) |
-                    (static_cast<uint32_t>(data_[offset_ + 2]) << 16) |
-                    (static_cast<uint32_t>(data_[offset_ + 1]) << 8) |
-                    (static_cast<uint32_t>(data_[offset_]));
+            value = LoadLittleEndian32(data_ + offset_);
         }
         offset_ += 4;
     } else {
@@ -142,14 +249,7 @@ uint32_t ByteStream::ReadUInt32(bool big_endian) {
 uint64_t ByteStream::ReadUInt64() {
     uint64_t value = 0;
     if (offset_ + 8 <= size_) {
-        value = (static_cast<uint64_t>(data_[offset_]) << 56) |
-                (static_cast<uint64_t>(data_[offset_ + 1]) << 48) |
-                (static_cast<uint64_t>(data_[offset_ + 2]) << 40) |
-                (static_cast<uint64_t>(data_[offset_ + 3]) << 32) |
-                (static_cast<uint64_t>(data_[offset_ + 4]) << 24) |
-                (static_cast<uint64_t>(data_[offset_ + 5]) << 16) |
-                (static_cast<uint64_t>(data_[offset_ + 6]) << 8) |
-                (static_cast<uint64_t>(data_[offset_ + 7]));
+        value = LoadBigEndian64(data_ + offset_);
         offset_ += 8;
     } else {
         error_ = true;
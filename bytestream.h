@@ -7,6 +7,40 @@
 #include <string>
 
 
+//------------------------------------------------------------------------------
+// Big-Endian Loads
+
+// Single unaligned loads with no bounds check.  The caller makes sure the
+// bytes are there
+inline uint16_t LoadBigEndian16(const uint8_t* data) {
+    uint16_t value;
+    memcpy(&value, data, sizeof(value));
+    return __builtin_bswap16(value);
+}
+
+inline uint32_t LoadBigEndian24(const uint8_t* data) {
+    return (static_cast<uint32_t>(LoadBigEndian16(data)) << 8) | data[2];
+}
+
+inline uint32_t LoadBigEndian32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return __builtin_bswap32(value);
+}
+
+inline uint32_t LoadLittleEndian32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline uint64_t LoadBigEndian64(const uint8_t* data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return __builtin_bswap64(value);
+}
+
+
 //------------------------------------------------------------------------------
 // ByteStreamWriter
 
@@ -15,6 +49,9 @@ public:
     const uint8_t* GetData() const;
     size_t GetLength() const;
 
+    // Reset length to zero but keep the allocation for reuse
+    void Clear();
+
     void WriteUInt8(uint8_t value);
     void WriteUInt16(uint16_t value);
     void WriteUInt24(uint32_t value);
@@ -30,6 +67,60 @@ private:
 };
 
 
+//------------------------------------------------------------------------------
+// FixedByteStreamWriter
+
+// ByteStreamWriter over storage provided by the caller, so that messages can
+// be built without allocating.  Writes that do not fit are dropped and set
+// the error flag
+class FixedByteStreamWriter {
+public:
+    FixedByteStreamWriter(uint8_t* buffer, size_t capacity);
+
+    FixedByteStreamWriter(const FixedByteStreamWriter&) = delete;
+    FixedByteStreamWriter& operator=(const FixedByteStreamWriter&) = delete;
+
+    const uint8_t* GetData() const;
+    size_t GetLength() const;
+    bool HasError() const;
+
+    void Clear();
+
+    void WriteUInt8(uint8_t value);
+    void WriteUInt16(uint16_t value);
+    void WriteUInt24(uint32_t value);
+    void WriteUInt32(uint32_t value);
+    void WriteUInt64(uint64_t value);
+    void WriteDouble(double value);
+    void WriteData(const void* data, size_t length);
+
+    void WriteAmf0String(const char* value);
+    void WriteAmf0String(const std::string& value);
+
+    // Overwrites bytes already written, e.g. a length known only at the end
+    void PatchUInt24(size_t offset, uint32_t value);
+
+private:
+    uint8_t* buffer_;
+    size_t capacity_;
+    size_t length_;
+    bool error_;
+};
+
+// FixedByteStreamWriter with its storage inline, e.g. on the stack
+template<size_t kCapacity>
+class StackByteStreamWriter : public FixedByteStreamWriter {
+public:
+    StackByteStreamWriter()
+        : FixedByteStreamWriter(storage_, kCapacity)
+    {
+    }
+
+private:
+    uint8_t storage_[kCapacity];
+};
+
+
 //------------------------------------------------------------------------------
 // ByteStream
 
@@ -45,6 +136,27 @@ public:
     double ReadDouble();
     const uint8_t* ReadData(int bytes);
 
+    // Reads without a bounds check, for headers whose size has already been
+    // checked against RemainingBytes().  Never sets the error flag
+    uint8_t ReadUInt8Unchecked() {
+        return data_[offset_++];
+    }
+    uint16_t ReadUInt16Unchecked() {
+        const uint16_t value = LoadBigEndian16(data_ + offset_);
+        offset_ += 2;
+        return value;
+    }
+    uint32_t ReadUInt24Unchecked() {
+        const uint32_t value = LoadBigEndian24(data_ + offset_);
+        offset_ += 3;
+        return value;
+    }
+    uint32_t ReadUInt32Unchecked(bool big_endian = true) {
+        const uint8_t* data = data_ + offset_;
+        offset_ += 4;
+        return big_endian ? LoadBigEndian32(data) : LoadLittleEndian32(data);
+    }
+
     bool HasError() const;
     bool IsEndOfStream() const;
     int RemainingBytes() const;
@@ -0,0 +1,130 @@
+#include "rtmp_arena.h"
+
+#include <cstdio>
+using namespace std;
+
+// Blocks start on a cache line
+static const size_t kArenaBlockAlign = 64;
+
+// Size class index for a block of bytes, or -1 above the largest class
+static int GetClassIndex(size_t bytes)
+{
+    if (bytes > kMaxArenaBlockBytes) {
+        return -1;
+    }
+
+    int index = 0;
+    size_t class_bytes = kMinArenaBlockBytes;
+    while (class_bytes < bytes) {
+        class_bytes <<= 1;
+        ++index;
+    }
+    return index;
+}
+
+
+//------------------------------------------------------------------------------
+// BufferArena
+
+bool BufferArena::Create(size_t bytes, int node, NodeBufferPages pages)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    if (Region.data()) {
+        return true; // Blocks may still point into the region
+    }
+    if (!Region.Allocate(bytes, node, pages, false)) {
+        return false;
+    }
+    CarvedBytes = 0;
+    return true;
+}
+
+bool BufferArena::IsCreated() const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    return Region.data() != nullptr;
+}
+
+size_t BufferArena::GetBlockBytes(size_t bytes)
+{
+    const int index = GetClassIndex(bytes);
+    return index >= 0 ? kMinArenaBlockBytes << index : bytes;
+}
+
+void* BufferArena::Allocate(size_t bytes)
+{
+    const int index = GetClassIndex(bytes);
+    const size_t block_bytes = GetBlockBytes(bytes);
+
+    if (index >= 0) {
+        std::lock_guard<std::mutex> locker(Lock);
+
+        void* block = FreeLists[index];
+        if (block) {
+            FreeLists[index] = *static_cast<void**>( block );
+            InUseBytes += block_bytes;
+            return block;
+        }
+
+        const size_t offset = (CarvedBytes + kArenaBlockAlign - 1) / kArenaBlockAlign * kArenaBlockAlign;
+        if (Region.data() && offset + block_bytes <= Region.size()) {
+            CarvedBytes = offset + block_bytes;
+            InUseBytes += block_bytes;
+            return Region.data() + offset;
+        }
+    }
+
+    // Region used up, not created yet, or the block is too large
+    void* block = ::operator new(block_bytes, std::nothrow);
+    if (!block) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> locker(Lock);
+    InUseBytes += block_bytes;
+    HeapBytes += block_bytes;
+    ++HeapAllocations;
+    return block;
+}
+
+void BufferArena::Free(void* block, size_t bytes)
+{
+    if (!block) {
+        return;
+    }
+
+    const int index = GetClassIndex(bytes);
+    const size_t block_bytes = GetBlockBytes(bytes);
+    const uint8_t* p = static_cast<const uint8_t*>( block );
+
+    std::lock_guard<std::mutex> locker(Lock);
+    InUseBytes -= block_bytes;
+
+    if (index >= 0 && Region.data() && p >= Region.data() && p < Region.data() + Region.size()) {
+        *static_cast<void**>( block ) = FreeLists[index];
+        FreeLists[index] = block;
+        return;
+    }
+
+    HeapBytes -= block_bytes;
+    ::operator delete(block);
+}
+
+void BufferArena::GetStats(ArenaStats& stats) const
+{
+    stats = ArenaStats();
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        stats.ReservedBytes = Region.size();
+        stats.CarvedBytes = CarvedBytes;
+        stats.InUseBytes = InUseBytes;
+        stats.HeapBytes = HeapBytes;
+        stats.HeapAllocations = HeapAllocations;
+        stats.Pages = Region.GetPages();
+    }
+
+    // The region is only unmapped when the arena is destroyed
+    stats.HugePageBytes = Region.GetHugePageBytes();
+    stats.Node = Region.GetNode();
+}
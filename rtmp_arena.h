@@ -0,0 +1,147 @@
+#ifndef RTMP_ARENA_H
+#define RTMP_ARENA_H
+
+#include "rtmp_placement.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// BufferArena
+
+// Smallest and largest size classes.  Larger blocks come from the heap
+static const size_t kMinArenaBlockBytes = 64;
+static const size_t kMaxArenaBlockBytes = 16 * 1024 * 1024;
+static const int kArenaClassCount = 19; // 64 B .. 16 MB
+
+struct ArenaStats {
+    // Size of the region, and how much of it has been carved into blocks
+    size_t ReservedBytes = 0;
+    size_t CarvedBytes = 0;
+
+    // Bytes in blocks currently allocated, including those from the heap
+    size_t InUseBytes = 0;
+
+    // Blocks that did not fit in the region
+    size_t HeapBytes = 0;
+    uint64_t HeapAllocations = 0;
+
+    // Page size of the region, and how much of it is on hugepages
+    NodeBufferPages Pages = NODE_PAGES_DEFAULT;
+    size_t HugePageBytes = 0;
+
+    // Node holding most of the region, or -1 if unknown
+    int Node = -1;
+};
+
+// Receive, rolling, reassembly and delivery buffers of one receiver, carved
+// out of a single region reserved up front instead of the heap.  Blocks are
+// rounded up to a power of two size class.  Freed blocks go on a free list
+// for their class, so a buffer that grows and is cleared keeps reusing the
+// same few blocks, and new blocks are bumped from the region.  Once the
+// region is used up, or for blocks over kMaxArenaBlockBytes, allocations
+// fall back to the heap.
+//
+// Thread-safe: blocks are allocated on the receiver thread and may be freed
+// on the delivery thread.  Every block must be freed before the arena is
+// destroyed
+class BufferArena {
+public:
+    BufferArena() = default;
+    BufferArena(const BufferArena&) = delete;
+    BufferArena& operator=(const BufferArena&) = delete;
+
+    // Reserves the region on a node (-1 = the calling thread's), touching
+    // pages as blocks are first carved.  Until this succeeds every block
+    // comes from the heap.  Returns false if the region could not be mapped
+    bool Create(size_t bytes, int node = -1, NodeBufferPages pages = NODE_PAGES_DEFAULT);
+    bool IsCreated() const;
+
+    // Returns nullptr only if the heap is out of memory too
+    void* Allocate(size_t bytes);
+    void Free(void* block, size_t bytes);
+
+    void GetStats(ArenaStats& stats) const;
+
+    // Bytes of the size class that holds bytes, or bytes itself above the
+    // largest class
+    static size_t GetBlockBytes(size_t bytes);
+
+private:
+    mutable std::mutex Lock;
+    NodeBuffer Region;
+    size_t CarvedBytes = 0;
+    size_t InUseBytes = 0;
+    size_t HeapBytes = 0;
+    uint64_t HeapAllocations = 0;
+
+    // Singly linked through the first bytes of each free block
+    void* FreeLists[kArenaClassCount] = {};
+};
+
+
+//------------------------------------------------------------------------------
+// ArenaAllocator
+
+// Standard allocator drawing from a BufferArena, or from the heap when it has
+// none.  Containers carry their arena with them when moved or swapped
+template<typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator() noexcept = default;
+    explicit ArenaAllocator(BufferArena* arena) noexcept
+        : Arena(arena)
+    {
+    }
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+        : Arena(other.Arena)
+    {
+    }
+
+    T* allocate(size_t n) {
+        if (!Arena) {
+            return static_cast<T*>( ::operator new(n * sizeof(T)) );
+        }
+        void* block = Arena->Allocate(n * sizeof(T));
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>( block );
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        if (!Arena) {
+            ::operator delete(p);
+            return;
+        }
+        Arena->Free(p, n * sizeof(T));
+    }
+
+    BufferArena* Arena = nullptr;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.Arena == b.Arena;
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.Arena != b.Arena;
+}
+
+// Byte buffer drawing from a BufferArena.  Default constructed = heap
+using ArenaBytes = std::vector<uint8_t, ArenaAllocator<uint8_t>>;
+
+#endif // RTMP_ARENA_H
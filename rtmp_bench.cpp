@@ -0,0 +1,1780 @@
+// Microbenchmarks for the parsing and serialization hot paths.
+//
+// Usage:
+//   rtmp_bench [--filter SUBSTRING] [--min-time MSEC] [--json PATH]
+//
+// Reports ns/op, GB/s and heap allocations per operation.  --json writes the
+// same results in a machine-readable form for comparing across commits.
+
+#include "rtmp_parser.h"
+#include "rtmp_receiver.h"
+#include "rtmp_publisher.h"
+#include "rtmp_responses.h"
+#include "rtmp_output.h"
+#include "rtmp_shm.h"
+#include "avcc_parser.h"
+#include "bytestream.h"
+#include "rtmp_tools.h"
+#include "rtmp_log.h"
+#include "rtmp_simd.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Allocation Counter
+
+static std::atomic<uint64_t> AllocationCount(0);
+
+// Neither is inlined, or GCC sees malloc() and free() paired with operator
+// new and delete and warns of a mismatch
+__attribute__((noinline)) void* operator new(size_t size) {
+    AllocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+// The other forms forward to these two, so counting and freeing stay in one place
+void* operator new[](size_t size) {
+    return ::operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    ::operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    ::operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    ::operator delete(p);
+}
+
+
+//------------------------------------------------------------------------------
+// Harness
+
+struct BenchOptions {
+    std::string Filter;
+    uint64_t MinTimeUsec = 200000;
+    std::string JsonPath;
+};
+
+struct BenchResult {
+    std::string Name;
+    uint64_t Ops = 0;
+    uint64_t BytesPerOp = 0;
+    double NsPerOp = 0.0;
+    double GBps = 0.0;
+    double AllocsPerOp = 0.0;
+};
+
+// Keeps results alive so the compiler cannot remove the work
+static volatile uint64_t Sink = 0;
+
+static BenchOptions Options;
+static std::vector<BenchResult> Results;
+
+static void ReportResult(const BenchResult& result)
+{
+    Results.push_back(result);
+
+    cout << std::left << std::setw(44) << result.Name << std::right << std::fixed
+        << std::setprecision(2) << std::setw(12) << result.NsPerOp << " ns/op"
+        << std::setprecision(3) << std::setw(10) << result.GBps << " GB/s"
+        << std::setprecision(2) << std::setw(10) << result.AllocsPerOp << " allocs/op" << endl;
+}
+
+// batch() performs some operations and returns how many
+template<typename BatchT>
+static void RunBench(const std::string& name, uint64_t bytes_per_op, BatchT batch)
+{
+    if (!Options.Filter.empty() && name.find(Options.Filter) == std::string::npos) {
+        return;
+    }
+
+    // Warm up caches and any lazily allocated state
+    batch();
+
+    uint64_t ops = 0;
+    const uint64_t allocs_before = AllocationCount.load();
+    const uint64_t t0 = GetMonotonicUsec();
+    uint64_t elapsed = 0;
+
+    do {
+        ops += batch();
+        elapsed = GetMonotonicUsec() - t0;
+    } while (elapsed < Options.MinTimeUsec);
+
+    const uint64_t allocs = AllocationCount.load() - allocs_before;
+
+    BenchResult result;
+    result.Name = name;
+    result.Ops = ops;
+    result.BytesPerOp = bytes_per_op;
+    result.NsPerOp = elapsed * 1000.0 / ops;
+    result.GBps = (bytes_per_op > 0) ? (bytes_per_op / result.NsPerOp) : 0.0;
+    result.AllocsPerOp = static_cast<double>( allocs ) / ops;
+    ReportResult(result);
+}
+
+static bool WriteJson(const std::string& path)
+{
+    std::ofstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    file << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < Results.size(); ++i) {
+        const BenchResult& r = Results[i];
+        file << std::setprecision(6)
+            << "    {\"name\": \"" << r.Name << "\""
+            << ", \"ops\": " << r.Ops
+            << ", \"bytes_per_op\": " << r.BytesPerOp
+            << ", \"ns_per_op\": " << r.NsPerOp
+            << ", \"gb_per_sec\": " << r.GBps
+            << ", \"allocs_per_op\": " << r.AllocsPerOp
+            << "}" << (i + 1 < Results.size() ? "," : "") << "\n";
+    }
+    file << "  ]\n}\n";
+
+    return file.good();
+}
+
+
+//------------------------------------------------------------------------------
+// Test Data
+
+class NullHandler : public RTMPHandler {
+public:
+    uint64_t Frames = 0;
+    uint64_t Commands = 0;
+
+    void OnNeedAck(uint32_t bytes) override {
+        UNUSED(bytes);
+    }
+    void OnMessage(const RTMPCommand& command) override {
+        UNUSED(command);
+        Commands++;
+    }
+    void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace) override {
+        UNUSED(keyframe);
+        UNUSED(stream);
+        UNUSED(timestamp);
+        UNUSED(data);
+        UNUSED(bytes);
+        UNUSED(trace);
+        Frames++;
+    }
+};
+
+static std::vector<uint8_t> MakeVideoPayload(const H264AccessUnit& frame)
+{
+    std::vector<uint8_t> payload;
+    payload.push_back(static_cast<uint8_t>( ((frame.Keyframe ? VIDEO_FRAME_TYPE_KEY : VIDEO_FRAME_TYPE_INTER) << 4) | VIDEO_CODEC_H264 ));
+    payload.push_back(AVC_NALU);
+    payload.push_back(0);
+    payload.push_back(0);
+    payload.push_back(0);
+    AppendDataToVector(payload, frame.Avcc.data(), static_cast<int>( frame.Avcc.size() ));
+    return payload;
+}
+
+// Chunked session bytes as they would arrive after the handshake
+static std::vector<uint8_t> MakeSessionStream(
+    const H264Stream& video,
+    uint32_t chunk_size,
+    ChunkFmtPattern pattern)
+{
+    RTMPChunkWriter writer;
+    writer.Pattern = pattern;
+
+    ByteStreamWriter out;
+
+    uint8_t chunk_size_data[4];
+    WriteUInt32(chunk_size_data, chunk_size);
+    writer.WriteMessage(out, 2, CHUNK_SIZE, 0, 0, chunk_size_data, sizeof(chunk_size_data));
+    writer.ChunkSize = chunk_size;
+
+    for (size_t i = 0; i < video.Frames.size(); ++i) {
+        std::vector<uint8_t> payload = MakeVideoPayload(video.Frames[i]);
+        writer.WriteMessage(out, 6, VIDEO, 1, static_cast<uint32_t>( i * 33 ), payload.data(), static_cast<int>( payload.size() ));
+    }
+
+    return std::vector<uint8_t>(out.GetData(), out.GetData() + out.GetLength());
+}
+
+static std::vector<uint8_t> MakeConnectCommand()
+{
+    ByteStreamWriter amf;
+    amf.WriteUInt8(StringMarker);
+    amf.WriteAmf0String("connect");
+    amf.WriteUInt8(NumberMarker);
+    amf.WriteDouble(1.0);
+    amf.WriteUInt8(ObjectMarker);
+        amf.WriteAmf0String("app");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String("live");
+
+        amf.WriteAmf0String("type");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String("nonprivate");
+
+        amf.WriteAmf0String("flashVer");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String("FMLE/3.0 (compatible; FMSc/1.0)");
+
+        amf.WriteAmf0String("tcUrl");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String("rtmp://192.168.1.2/live");
+
+        amf.WriteUInt16(0);
+    amf.WriteUInt8(ObjectEndMarker);
+
+    return std::vector<uint8_t>(amf.GetData(), amf.GetData() + amf.GetLength());
+}
+
+static std::vector<uint8_t> MakePublishCommand()
+{
+    ByteStreamWriter amf;
+    amf.WriteUInt8(StringMarker);
+    amf.WriteAmf0String("publish");
+    amf.WriteUInt8(NumberMarker);
+    amf.WriteDouble(5.0);
+    amf.WriteUInt8(NullMarker);
+    amf.WriteUInt8(StringMarker);
+    amf.WriteAmf0String("stream");
+    amf.WriteUInt8(StringMarker);
+    amf.WriteAmf0String("live");
+
+    return std::vector<uint8_t>(amf.GetData(), amf.GetData() + amf.GetLength());
+}
+
+
+//------------------------------------------------------------------------------
+// ByteStream
+
+static void BenchByteStream()
+{
+    std::vector<uint8_t> data(64 * 1024);
+    FillRandomBuffer(data.data(), static_cast<int>( data.size() ), 1);
+
+    RunBench("bytestream/read_u8", 1, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (!stream.IsEndOfStream()) {
+            sum += stream.ReadUInt8();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_u16", 2, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (stream.RemainingBytes() >= 2) {
+            sum += stream.ReadUInt16();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_u24", 3, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (stream.RemainingBytes() >= 3) {
+            sum += stream.ReadUInt24();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_u32", 4, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (stream.RemainingBytes() >= 4) {
+            sum += stream.ReadUInt32();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    // Header fields whose size was checked once up front, as ParseChunk() reads them
+    RunBench("bytestream/read_u8_unchecked", 1, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (!stream.IsEndOfStream()) {
+            sum += stream.ReadUInt8Unchecked();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_u16_unchecked", 2, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (stream.RemainingBytes() >= 2) {
+            sum += stream.ReadUInt16Unchecked();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_u24_unchecked", 3, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (stream.RemainingBytes() >= 3) {
+            sum += stream.ReadUInt24Unchecked();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_u32_unchecked", 4, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (stream.RemainingBytes() >= 4) {
+            sum += stream.ReadUInt32Unchecked();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_u64", 8, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        uint64_t sum = 0, ops = 0;
+        while (stream.RemainingBytes() >= 8) {
+            sum += stream.ReadUInt64();
+            ++ops;
+        }
+        Sink = Sink + sum;
+        return ops;
+    });
+
+    RunBench("bytestream/read_double", 8, [&]() -> uint64_t {
+        ByteStream stream(data.data(), data.size());
+        double sum = 0.0;
+        uint64_t ops = 0;
+        while (stream.RemainingBytes() >= 8) {
+            sum += stream.ReadDouble();
+            ++ops;
+        }
+        Sink = Sink + static_cast<uint64_t>( sum != 0.0 );
+        return ops;
+    });
+}
+
+
+//------------------------------------------------------------------------------
+// ParseChunk
+
+static void BenchParseChunk()
+{
+    // One second of 8 Mbps video at 30 FPS
+    H264Stream video;
+    video.Synthesize(30, 30, 8000000 / 8 / 30, 1);
+
+    const uint32_t chunk_sizes[] = { 128, 1024, 4096, 16384, 65536 };
+    const ChunkFmtPattern patterns[] = { FMT_PATTERN_FULL, FMT_PATTERN_COMPRESSED, FMT_PATTERN_MIXED };
+    const char* pattern_names[] = { "full", "compressed", "mixed" };
+
+    // Same size as RTMPReceiver::RecvBuffer
+    const int recv_bytes = 2048 * 16;
+
+    for (uint32_t chunk_size : chunk_sizes) {
+        for (int p = 0; p < 3; ++p) {
+            const std::vector<uint8_t> session_data = MakeSessionStream(video, chunk_size, patterns[p]);
+            const uint64_t messages = video.Frames.size() + 1;
+
+            const std::string name = "parse_chunk/" + std::to_string(chunk_size) + "/" + pattern_names[p];
+
+            // One op = one message, fed in recv()-sized pieces through a fresh session
+            RunBench(name, session_data.size() / messages, [&]() -> uint64_t {
+                NullHandler handler;
+                RollingBuffer buffer;
+                RTMPSession session;
+                session.Buffer = &buffer;
+                session.Handler = &handler;
+
+                const uint8_t* data = session_data.data();
+                int remaining = static_cast<int>( session_data.size() );
+                while (remaining > 0) {
+                    int bytes = remaining < recv_bytes ? remaining : recv_bytes;
+                    session.ParseChunk(data, bytes);
+                    data += bytes;
+                    remaining -= bytes;
+                }
+
+                Sink = Sink + handler.Frames;
+                return messages;
+            });
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Dispatch
+
+// Same as NullHandler, but final so BasicRTMPSession calls it directly
+class FinalNullHandler final : public RTMPHandler {
+public:
+    uint64_t Frames = 0;
+
+    void OnNeedAck(uint32_t bytes) override {
+        UNUSED(bytes);
+    }
+    void OnMessage(const RTMPCommand& command) override {
+        UNUSED(command);
+    }
+    void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace) override {
+        UNUSED(keyframe);
+        UNUSED(stream);
+        UNUSED(timestamp);
+        UNUSED(data);
+        UNUSED(bytes);
+        UNUSED(trace);
+        Frames++;
+    }
+};
+
+// Frame handler for BasicRTMPReceiver with no indirection at all
+struct InlineFrameHandler {
+    uint64_t Frames = 0;
+
+    void OnSetup(uint32_t stream, RTMPSetupResult& result) {
+        UNUSED(stream);
+        UNUSED(result);
+    }
+    void OnFrame(const RTMPVideoFrame& frame) {
+        Frames++;
+        Sink = Sink + frame.Bytes;
+    }
+};
+
+// Sequence header followed by many small frames, so per-frame overhead dominates
+static std::vector<uint8_t> MakeDispatchStream(const H264Stream& video)
+{
+    RTMPChunkWriter writer;
+
+    ByteStreamWriter out;
+
+    uint8_t chunk_size_data[4];
+    WriteUInt32(chunk_size_data, 4096);
+    writer.WriteMessage(out, 2, CHUNK_SIZE, 0, 0, chunk_size_data, sizeof(chunk_size_data));
+    writer.ChunkSize = 4096;
+
+    std::vector<uint8_t> header;
+    header.push_back(static_cast<uint8_t>( (VIDEO_FRAME_TYPE_KEY << 4) | VIDEO_CODEC_H264 ));
+    header.push_back(AVC_SEQUENCE_HEADER);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    AppendDataToVector(header, video.Extradata.data(), static_cast<int>( video.Extradata.size() ));
+    writer.WriteMessage(out, 6, VIDEO, 1, 0, header.data(), static_cast<int>( header.size() ));
+
+    for (size_t i = 0; i < video.Frames.size(); ++i) {
+        std::vector<uint8_t> payload = MakeVideoPayload(video.Frames[i]);
+        writer.WriteMessage(out, 6, VIDEO, 1, static_cast<uint32_t>( i * 33 ), payload.data(), static_cast<int>( payload.size() ));
+    }
+
+    return std::vector<uint8_t>(out.GetData(), out.GetData() + out.GetLength());
+}
+
+static void BenchDispatch()
+{
+    H264Stream video;
+    video.Synthesize(1000, 30, 200, 1);
+
+    const std::vector<uint8_t> session_data = MakeDispatchStream(video);
+    const uint64_t frames = video.Frames.size();
+    const uint64_t bytes_per_op = session_data.size() / frames;
+    const int session_bytes = static_cast<int>( session_data.size() );
+
+    RunBench("dispatch/session_virtual", bytes_per_op, [&]() -> uint64_t {
+        NullHandler handler;
+        RollingBuffer buffer;
+        RTMPSession session;
+        session.Buffer = &buffer;
+        session.Handler = &handler;
+
+        const uint8_t* data = session_data.data();
+        int bytes = session_bytes;
+        while (session.ParseChunk(data, bytes)) {
+            data = nullptr;
+            bytes = 0;
+        }
+
+        Sink = Sink + handler.Frames;
+        return frames;
+    });
+
+    RunBench("dispatch/session_final", bytes_per_op, [&]() -> uint64_t {
+        FinalNullHandler handler;
+        RollingBuffer buffer;
+        BasicRTMPSession<FinalNullHandler> session;
+        session.Buffer = &buffer;
+        session.Handler = &handler;
+
+        const uint8_t* data = session_data.data();
+        int bytes = session_bytes;
+        while (session.ParseChunk(data, bytes)) {
+            data = nullptr;
+            bytes = 0;
+        }
+
+        Sink = Sink + handler.Frames;
+        return frames;
+    });
+
+    // Whole receiver path: AVCC parse, timeline, clock recovery, gauges and callback
+    RunBench("dispatch/receiver_function", bytes_per_op, [&]() -> uint64_t {
+        uint64_t delivered = 0;
+        RTMPCallbackHandler handler;
+        handler.SetupCallback = [](uint32_t stream, RTMPSetupResult& result) {
+            UNUSED(stream);
+            UNUSED(result);
+        };
+        handler.FrameCallback = [&delivered](const RTMPVideoFrame& frame) {
+            delivered++;
+            Sink = Sink + frame.Bytes;
+        };
+
+        RTMPReceiver receiver;
+        receiver.ParseSessionData(&handler, session_data.data(), session_bytes);
+
+        Sink = Sink + delivered;
+        return frames;
+    });
+
+    RunBench("dispatch/receiver_inline", bytes_per_op, [&]() -> uint64_t {
+        InlineFrameHandler handler;
+
+        BasicRTMPReceiver<InlineFrameHandler> receiver;
+        receiver.ParseSessionData(&handler, session_data.data(), session_bytes);
+
+        Sink = Sink + handler.Frames;
+        return frames;
+    });
+}
+
+
+//------------------------------------------------------------------------------
+// AVCC and Annex B
+
+static void BenchAvcc()
+{
+    H264Stream video;
+    video.Synthesize(1, 1, 64 * 1024, 2);
+
+    // VIDEO message body without the FLV video tag byte, as passed to OnAvccVideo()
+    const std::vector<uint8_t> frame = MakeVideoPayload(video.Frames[0]);
+    const uint8_t* avcc = frame.data() + 1;
+    const size_t avcc_bytes = frame.size() - 1;
+
+    RunBench("avcc/parse_nalu", avcc_bytes, [&]() -> uint64_t {
+        AVCCParser parser;
+        uint64_t sum = 0;
+        for (int i = 0; i < 1000; ++i) {
+            parser.parseAvcc(avcc, avcc_bytes);
+            sum += parser.VideoSize;
+        }
+        Sink = Sink + sum;
+        return 1000;
+    });
+
+    std::vector<uint8_t> header;
+    header.push_back(AVC_SEQUENCE_HEADER);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    AppendDataToVector(header, video.Extradata.data(), static_cast<int>( video.Extradata.size() ));
+
+    RunBench("avcc/parse_sequence_header", header.size(), [&]() -> uint64_t {
+        uint64_t sum = 0;
+        for (int i = 0; i < 100; ++i) {
+            AVCCParser parser;
+            parser.parseAvcc(header.data(), header.size());
+            sum += parser.SetupResult.VideoSizeBytes;
+        }
+        Sink = Sink + sum;
+        return 100;
+    });
+
+    // A repeated sequence header must replace the parameter sets, which
+    // otherwise point into the first message after it is recycled
+    const std::vector<uint8_t> second_header = header;
+    const uint8_t* second_begin = second_header.data();
+    const uint8_t* second_end = second_begin + second_header.size();
+    bool stale_params = false;
+
+    RunBench("avcc/parse_second_sequence_header", second_header.size(), [&]() -> uint64_t {
+        uint64_t sum = 0;
+        for (int i = 0; i < 100; ++i) {
+            AVCCParser parser;
+            parser.parseAvcc(header.data(), header.size());
+            parser.parseAvcc(second_header.data(), second_header.size());
+
+            const RTMPSetupResult& result = parser.SetupResult;
+            if (result.SPS.size() != 1 || result.PPS.size() != 1) {
+                stale_params = true;
+            }
+            for (const ParameterData& set : result.SPS) {
+                stale_params |= set.Data < second_begin || set.Data + set.Size > second_end;
+            }
+            for (const ParameterData& set : result.PPS) {
+                stale_params |= set.Data < second_begin || set.Data + set.Size > second_end;
+            }
+            sum += result.SPS.size() + result.PPS.size();
+        }
+        Sink = Sink + sum;
+        return 100;
+    });
+    if (stale_params) {
+        cout << "avcc/parse_second_sequence_header: parameter sets from the first header were kept" << endl;
+    }
+
+    // Includes some 00 00 00 sequences that need escaping
+    std::vector<uint8_t> nalu(256 * 1024);
+    FillRandomBuffer(nalu.data(), static_cast<int>( nalu.size() ), 3);
+    for (size_t i = 1000; i + 3 < nalu.size(); i += 4096) {
+        nalu[i] = nalu[i + 1] = nalu[i + 2] = 0;
+    }
+
+    std::vector<uint8_t> annex_b;
+    RunBench("annexb/convert_256k", nalu.size(), [&]() -> uint64_t {
+        annex_b.clear();
+        ConvertToAnnexB(nalu.data(), nalu.size(), annex_b);
+        Sink = Sink + annex_b.size();
+        return 1;
+    });
+}
+
+
+//------------------------------------------------------------------------------
+// SIMD Scanners
+
+// A 4K I-frame in AVCC form: eight slices of 128 KB, each with the 00 00 03
+// emulation prevention an encoder inserts every few KB
+static const int kIFrame4kSlices = 8;
+static const int kIFrame4kSliceBytes = 128 * 1024;
+
+static std::vector<uint8_t> MakeIFrame4k()
+{
+    std::vector<uint8_t> frame;
+    std::vector<uint8_t> slice(kIFrame4kSliceBytes);
+    for (int i = 0; i < kIFrame4kSlices; ++i) {
+        FillRandomBuffer(slice.data(), static_cast<int>( slice.size() ), 10 + i);
+        slice[0] = 0x65;
+        for (size_t j = 3000; j + 3 < slice.size(); j += 4096) {
+            slice[j] = slice[j + 1] = 0;
+            slice[j + 2] = 3;
+        }
+
+        uint8_t prefix[4];
+        WriteUInt32(prefix, static_cast<uint32_t>( slice.size() ));
+        AppendDataToVector(frame, prefix, sizeof(prefix));
+        AppendDataToVector(frame, slice.data(), static_cast<int>( slice.size() ));
+    }
+    return frame;
+}
+
+// Counts every match of the pattern in the frame
+static uint64_t CountPatterns(const std::vector<uint8_t>& frame, uint8_t max_third_byte)
+{
+    uint64_t count = 0;
+    const uint8_t* data = frame.data();
+    size_t remaining = frame.size();
+    for (;;) {
+        const size_t offset = FindZeroZeroPattern(data, remaining, max_third_byte);
+        if (offset == remaining) {
+            break;
+        }
+        ++count;
+        data += offset + 1;
+        remaining -= offset + 1;
+    }
+    return count;
+}
+
+static void BenchSimd()
+{
+    const std::vector<uint8_t> frame = MakeIFrame4k();
+    std::vector<uint8_t> annex_b;
+
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    for (SimdLevel level : levels) {
+        if (!SetSimdLevel(level)) {
+            continue;
+        }
+        const std::string suffix = std::string("/") + SimdLevelToString(level);
+
+        RunBench("simd/find_start_codes_4k_iframe" + suffix, frame.size(), [&]() -> uint64_t {
+            Sink = Sink + CountPatterns(frame, 1);
+            return 1;
+        });
+
+        RunBench("simd/find_emulation_4k_iframe" + suffix, frame.size(), [&]() -> uint64_t {
+            Sink = Sink + CountPatterns(frame, 3);
+            return 1;
+        });
+
+        RunBench("annexb/convert_4k_iframe" + suffix, frame.size(), [&]() -> uint64_t {
+            annex_b.clear();
+            ConvertToAnnexB(frame.data(), frame.size(), annex_b);
+            Sink = Sink + annex_b.size();
+            return 1;
+        });
+    }
+    SetSimdLevel(GetBestSimdLevel());
+
+    // Only the length prefixes are read, so there is no meaningful GB/s
+    std::vector<NalUnitSpan> units;
+    RunBench("avcc/find_nal_units_4k_iframe", 0, [&]() -> uint64_t {
+        for (int i = 0; i < 100; ++i) {
+            FindNalUnits(frame.data(), frame.size(), 4, units);
+            Sink = Sink + units.size();
+        }
+        return 100;
+    });
+}
+
+
+//------------------------------------------------------------------------------
+// AMF0 Commands
+
+static void BenchAmf0()
+{
+    const std::vector<uint8_t> connect = MakeConnectCommand();
+    const std::vector<uint8_t> publish = MakePublishCommand();
+
+    NullHandler handler;
+    RollingBuffer buffer;
+    RTMPSession session;
+    session.Buffer = &buffer;
+    session.Handler = &handler;
+
+    RTMPHeader head;
+    head.type_id = COMMAND_AMF0;
+    head.cs_id = 3;
+
+    RunBench("amf0/command_connect", connect.size(), [&]() -> uint64_t {
+        head.length = static_cast<uint32_t>( connect.size() );
+        for (int i = 0; i < 1000; ++i) {
+            session.OnMessage(head, connect.data(), static_cast<int>( connect.size() ));
+        }
+        Sink = Sink + handler.Commands;
+        return 1000;
+    });
+
+    RunBench("amf0/command_publish", publish.size(), [&]() -> uint64_t {
+        head.length = static_cast<uint32_t>( publish.size() );
+        for (int i = 0; i < 1000; ++i) {
+            session.OnMessage(head, publish.data(), static_cast<int>( publish.size() ));
+        }
+        Sink = Sink + handler.Commands;
+        return 1000;
+    });
+}
+
+
+//------------------------------------------------------------------------------
+// Responses
+
+static void BenchResponses()
+{
+    // Each response is built from scratch on the stack, as RTMPReceiver does
+    // for acks and window updates
+    {
+        StackByteStreamWriter<kMaxResponseBytes> msg;
+        WriteConnectResult(msg, 2500000, 2500000, LIMIT_DYNAMIC, 60000);
+        RunBench("response/connect_result", msg.GetLength(), [&]() -> uint64_t {
+            for (int i = 0; i < 1000; ++i) {
+                StackByteStreamWriter<kMaxResponseBytes> params;
+                WriteConnectResult(params, 2500000, 2500000, LIMIT_DYNAMIC, 60000);
+                Sink = Sink + params.GetLength();
+            }
+            return 1000;
+        });
+    }
+    {
+        StackByteStreamWriter<kMaxResponseBytes> msg;
+        WriteNullResult(msg, 4.0);
+        RunBench("response/null_result", msg.GetLength(), [&]() -> uint64_t {
+            for (int i = 0; i < 1000; ++i) {
+                StackByteStreamWriter<kMaxResponseBytes> params;
+                WriteNullResult(params, static_cast<double>( i ));
+                Sink = Sink + params.GetLength();
+            }
+            return 1000;
+        });
+    }
+    {
+        StackByteStreamWriter<kMaxResponseBytes> msg;
+        WriteChunkAck(msg, 0);
+        RunBench("response/chunk_ack", msg.GetLength(), [&]() -> uint64_t {
+            for (int i = 0; i < 1000; ++i) {
+                StackByteStreamWriter<kMaxResponseBytes> params;
+                WriteChunkAck(params, static_cast<uint32_t>( i ));
+                Sink = Sink + params.GetLength();
+            }
+            return 1000;
+        });
+    }
+    {
+        StackByteStreamWriter<kMaxResponseBytes> msg;
+        WriteWindowUpdate(msg, 2500000, 2500000, LIMIT_DYNAMIC);
+        RunBench("response/window_update", msg.GetLength(), [&]() -> uint64_t {
+            for (int i = 0; i < 1000; ++i) {
+                StackByteStreamWriter<kMaxResponseBytes> params;
+                WriteWindowUpdate(params, 2500000 + i, 2500000 + i, LIMIT_DYNAMIC);
+                Sink = Sink + params.GetLength();
+            }
+            return 1000;
+        });
+    }
+
+    // Responses served from RTMPResponseTemplates
+    RTMPResponseTemplates templates;
+    templates.Build(2500000, 2500000, LIMIT_DYNAMIC, 60000);
+    {
+        // Copy with the transaction number patched in
+        const std::vector<uint8_t>& result = templates.NullResult;
+        RunBench("response/null_result_template", result.size(), [&]() -> uint64_t {
+            uint8_t msg[64];
+            for (int i = 0; i < 1000; ++i) {
+                memcpy(msg, result.data(), result.size());
+                SetResultNumber(msg, static_cast<double>( i ));
+                Sink = Sink + msg[kResultNumberOffset + 7];
+            }
+            return 1000;
+        });
+    }
+    {
+        // Everything the receiver queues from connect to publish, plus an
+        // ack, into a reused OutputQueue.  Should not allocate
+        OutputQueue output;
+        uint64_t bytes_per_op = 0;
+        auto queue_setup = [&](double base) {
+            uint8_t msg[64];
+            output.AppendStatic(templates.ConnectResult.data(), static_cast<int>( templates.ConnectResult.size() ));
+            for (int j = 0; j < 3; ++j) {
+                const std::vector<uint8_t>& result = (j == 2) ? templates.CreateStreamResult : templates.NullResult;
+                memcpy(msg, result.data(), result.size());
+                SetResultNumber(msg, base + j);
+                output.Append(msg, static_cast<int>( result.size() ));
+            }
+            output.AppendStatic(templates.PublishStart.data(), static_cast<int>( templates.PublishStart.size() ));
+
+            StackByteStreamWriter<kMaxResponseBytes> ack;
+            WriteChunkAck(ack, static_cast<uint32_t>( base ));
+            output.Append(ack.GetData(), static_cast<int>( ack.GetLength() ));
+        };
+        queue_setup(2.0);
+        bytes_per_op = output.GetQueuedBytes();
+        output.Clear();
+
+        RunBench("response/control_path_queued", bytes_per_op, [&]() -> uint64_t {
+            for (int i = 0; i < 1000; ++i) {
+                queue_setup(static_cast<double>( i ));
+                Sink = Sink + output.GetQueuedBytes();
+                output.Clear();
+            }
+            return 1000;
+        });
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Connection Setup
+
+// Loopback port for the setup benchmark
+static const int kSetupBenchPort = 19350;
+
+// Time to first frame for a publisher that (re)connects: TCP connect through
+// handshake, connect/createStream/publish and the sequence header, until the
+// receiver's setup callback runs.  Unlike the other benchmarks this runs real
+// sockets and two threads, so allocs/op includes the receiver's
+static void BenchConnectionSetup()
+{
+    const std::string name = "setup/connect_to_setup_callback";
+    if (!Options.Filter.empty() && name.find(Options.Filter) == std::string::npos) {
+        return;
+    }
+
+    H264Stream video;
+    video.Synthesize(1, 1, 1000, 1);
+
+    MetricsRegistry metrics;
+    std::atomic<uint64_t> setups(0);
+    std::atomic<uint64_t> setup_usec(0);
+
+    RTMPReceiver receiver;
+    receiver.SetMetrics(&metrics);
+    receiver.Start(
+        [&](uint32_t stream, RTMPSetupResult& result) {
+            UNUSED(stream);
+            UNUSED(result);
+            setup_usec = GetMonotonicUsec();
+            ++setups;
+        },
+        [](const RTMPVideoFrame& frame) {
+            UNUSED(frame);
+        },
+        kSetupBenchPort);
+
+    RTMPPublisherSettings settings;
+
+    // Times one session, returning false if it failed.  Close() is not timed
+    auto run_session = [&](uint64_t& usec) -> bool {
+        RTMPPublisher publisher;
+        const uint64_t expected = setups + 1;
+
+        const uint64_t t0 = GetMonotonicUsec();
+        if (!publisher.Connect("127.0.0.1", kSetupBenchPort, settings) ||
+            !publisher.Handshake() ||
+            !publisher.Setup() ||
+            !publisher.SendVideoHeader(video.Extradata))
+        {
+            return false;
+        }
+        while (setups < expected) {
+            if (GetMonotonicUsec() - t0 > 1000000) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        usec = setup_usec - t0;
+        return true;
+    };
+
+    // Warm up, which also waits for the receiver to start listening
+    uint64_t usec = 0;
+    if (!run_session(usec)) {
+        cout << name << ": failed to connect on port " << kSetupBenchPort << endl;
+        return;
+    }
+
+    uint64_t ops = 0, total_usec = 0, elapsed = 0;
+    const uint64_t allocs_before = AllocationCount.load();
+    const uint64_t t0 = GetMonotonicUsec();
+    do {
+        if (!run_session(usec)) {
+            cout << name << ": session failed" << endl;
+            return;
+        }
+        ++ops;
+        total_usec += usec;
+        elapsed = GetMonotonicUsec() - t0;
+    } while (elapsed < Options.MinTimeUsec);
+    const uint64_t allocs = AllocationCount.load() - allocs_before;
+
+    receiver.Stop();
+
+    BenchResult result;
+    result.Name = name;
+    result.Ops = ops;
+    result.NsPerOp = total_usec * 1000.0 / ops;
+    result.AllocsPerOp = static_cast<double>( allocs ) / ops;
+    ReportResult(result);
+
+    // As measured by the receiver, which starts at accept()
+    MetricsSnapshot snapshot;
+    metrics.Snapshot(snapshot);
+    cout << "  receiver accept to setup callback usec: p50=" << snapshot.AcceptToSetupUsec.Percentile(0.5)
+        << " p99=" << snapshot.AcceptToSetupUsec.Percentile(0.99)
+        << " syscalls per setup: " << (snapshot.Counters[METRIC_SETUP_RECV_CALLS] + snapshot.Counters[METRIC_SETUP_SEND_CALLS])
+            / static_cast<double>( snapshot.Counters[METRIC_PUBLISHES_STARTED] ) << endl;
+}
+
+
+//------------------------------------------------------------------------------
+// Stop
+
+static const int kStopBenchPort = 19351;
+
+// Stop() must not wait on a client, so it is held to this at every point of a session
+static const uint64_t kMaxStopUsec = 1000;
+
+enum StopPoint {
+    STOP_IDLE, // Handshake done, then silence
+    STOP_MID_HANDSHAKE, // C0 and part of C1
+    STOP_MID_CHUNK // Handshake done and a message header promising more data
+};
+
+static bool SendRaw(int s, const uint8_t* data, size_t bytes)
+{
+    return send(s, data, bytes, MSG_NOSIGNAL) == static_cast<ssize_t>( bytes );
+}
+
+// Drives a raw client to the stop point.  Returns the number of bytes the
+// receiver should read, or 0 on failure
+static size_t DriveClient(int s, StopPoint point)
+{
+    uint8_t c0c1[1 + 1536] = {};
+    c0c1[0] = kRtmpS0ServerVersion;
+
+    if (point == STOP_MID_HANDSHAKE) {
+        return SendRaw(s, c0c1, 1 + 100) ? 1 + 100 : 0;
+    }
+
+    uint8_t s0s1s2[1 + 1536 + 1536];
+    size_t received = 0;
+    if (!SendRaw(s, c0c1, sizeof(c0c1))) {
+        return 0;
+    }
+    while (received < sizeof(s0s1s2)) {
+        const ssize_t bytes = recv(s, s0s1s2 + received, sizeof(s0s1s2) - received, 0);
+        if (bytes <= 0) {
+            return 0;
+        }
+        received += static_cast<size_t>( bytes );
+    }
+
+    // C2 echoes S1
+    if (!SendRaw(s, s0s1s2 + 1, 1536)) {
+        return 0;
+    }
+    size_t sent = sizeof(c0c1) + 1536;
+
+    if (point == STOP_MID_CHUNK) {
+        // fmt 0 on chunk stream 4: 100000 byte video message, 64 bytes of it sent
+        uint8_t chunk[12 + 64] = {};
+        chunk[0] = 4;
+        const uint32_t message_bytes = 100000;
+        chunk[4] = static_cast<uint8_t>( message_bytes >> 16 );
+        chunk[5] = static_cast<uint8_t>( message_bytes >> 8 );
+        chunk[6] = static_cast<uint8_t>( message_bytes );
+        chunk[7] = VIDEO;
+        chunk[8] = 1; // Little-endian message stream id
+        if (!SendRaw(s, chunk, sizeof(chunk))) {
+            return 0;
+        }
+        sent += sizeof(chunk);
+    }
+    return sent;
+}
+
+static int ConnectRaw(int port)
+{
+    const uint64_t t0 = GetMonotonicUsec();
+    while (GetMonotonicUsec() - t0 < 1000000) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0) {
+            return -1;
+        }
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return s;
+        }
+        close(s);
+
+        // Receiver thread still starting
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return -1;
+}
+
+// Stop() latency with one client parked at a point in the session.  ns/op is
+// the mean Stop() time; each op starts a fresh receiver
+static void BenchStopAt(const std::string& name, StopPoint point)
+{
+    if (!Options.Filter.empty() && name.find(Options.Filter) == std::string::npos) {
+        return;
+    }
+
+    std::vector<uint64_t> stop_usec;
+    const uint64_t t0 = GetMonotonicUsec();
+    do {
+        MetricsRegistry metrics;
+        RTMPReceiver receiver;
+        receiver.SetMetrics(&metrics);
+        receiver.Start(
+            [](uint32_t stream, RTMPSetupResult& result) {
+                UNUSED(stream);
+                UNUSED(result);
+            },
+            [](const RTMPVideoFrame& frame) {
+                UNUSED(frame);
+            },
+            kStopBenchPort);
+
+        int s = ConnectRaw(kStopBenchPort);
+        if (s < 0) {
+            cout << name << ": failed to connect on port " << kStopBenchPort << endl;
+            return;
+        }
+        AutoClose clientCloser([&]() {
+            close(s);
+        });
+
+        const size_t sent = DriveClient(s, point);
+        if (sent == 0) {
+            cout << name << ": client failed" << endl;
+            return;
+        }
+
+        // Wait until the receiver has read everything and is waiting for more
+        MetricsSnapshot snapshot;
+        const uint64_t wait_start = GetMonotonicUsec();
+        do {
+            std::this_thread::yield();
+            metrics.Snapshot(snapshot);
+        } while (snapshot.Counters[METRIC_BYTES_RECEIVED] < sent && GetMonotonicUsec() - wait_start < 1000000);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        receiver.Stop();
+        stop_usec.push_back(receiver.GetLastStopUsec());
+    } while (GetMonotonicUsec() - t0 < Options.MinTimeUsec);
+
+    std::sort(stop_usec.begin(), stop_usec.end());
+    uint64_t total_usec = 0;
+    for (uint64_t usec : stop_usec) {
+        total_usec += usec;
+    }
+
+    BenchResult result;
+    result.Name = name;
+    result.Ops = stop_usec.size();
+    result.NsPerOp = total_usec * 1000.0 / stop_usec.size();
+    ReportResult(result);
+
+    const uint64_t max_usec = stop_usec.back();
+    cout << "  stop usec: p50=" << stop_usec[stop_usec.size() / 2] << " max=" << max_usec
+        << (max_usec > kMaxStopUsec ? "  OVER LIMIT" : "") << endl;
+}
+
+static void BenchStop()
+{
+    BenchStopAt("stop/idle_session", STOP_IDLE);
+    BenchStopAt("stop/mid_handshake", STOP_MID_HANDSHAKE);
+    BenchStopAt("stop/mid_chunk", STOP_MID_CHUNK);
+}
+
+
+//------------------------------------------------------------------------------
+// Resume After Link Drop
+
+static const int kResumeBenchPort = 19352;
+static const int kResumeBenchTimeoutMsec = 100;
+
+// Waits for the frame counter to pass count.  Returns false after a second
+static bool WaitForFrames(const std::atomic<uint64_t>& frames, uint64_t count)
+{
+    const uint64_t t0 = GetMonotonicUsec();
+    while (frames < count) {
+        if (GetMonotonicUsec() - t0 > 1000000) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// A publisher goes silent with its connection left open, as after a Wi-Fi
+// drop, and immediately reconnects on the same stream key (one publisher
+// allowed).  ns/op is the mean time from the drop to the first frame of the
+// new session.  With takeover the new session preempts the stale one;
+// without, it is rejected until the no-media timer closes the stale one
+static void BenchResumeAfterDrop(const std::string& name, bool takeover)
+{
+    if (!Options.Filter.empty() && name.find(Options.Filter) == std::string::npos) {
+        return;
+    }
+
+    H264Stream video;
+    video.Synthesize(1, 1, 1000, 1);
+    const H264AccessUnit& keyframe = video.Frames[0];
+
+    MetricsRegistry metrics;
+    std::atomic<uint64_t> frames(0);
+    std::atomic<uint64_t> frame_usec(0);
+
+    RTMPTimeoutSettings timeouts;
+    timeouts.UserTimeoutMsec = 1000;
+    timeouts.KeepaliveIdleSec = 1;
+    timeouts.NoMediaTimeoutMsec = kResumeBenchTimeoutMsec;
+
+    RTMPAdmissionLimits limits;
+    limits.MaxPublishers = 1;
+    limits.Takeover = takeover;
+
+    RTMPReceiver receiver;
+    receiver.SetMetrics(&metrics);
+    receiver.SetTimeouts(timeouts);
+    receiver.SetDefaultRoute(limits);
+    receiver.Start(
+        [](uint32_t stream, RTMPSetupResult& result) {
+            UNUSED(stream);
+            UNUSED(result);
+        },
+        [&](const RTMPVideoFrame& frame) {
+            UNUSED(frame);
+            frame_usec = GetMonotonicUsec();
+            ++frames;
+        },
+        kResumeBenchPort);
+
+    RTMPPublisherSettings settings;
+
+    auto publish = [&](RTMPPublisher& publisher) -> bool {
+        const uint64_t expected = frames + 1;
+        return publisher.Connect("127.0.0.1", kResumeBenchPort, settings) &&
+            publisher.Handshake() &&
+            publisher.Setup() &&
+            publisher.SendVideoHeader(video.Extradata) &&
+            publisher.SendVideo(true, 0, keyframe.Avcc) &&
+            WaitForFrames(frames, expected);
+    };
+
+    std::vector<uint64_t> resume_usec;
+    const uint64_t t0 = GetMonotonicUsec();
+    do {
+        RTMPPublisher stale;
+        if (!publish(stale)) {
+            cout << name << ": failed to publish on port " << kResumeBenchPort << endl;
+            return;
+        }
+
+        // Link drop: stale stops sending but its connection stays open
+        const uint64_t drop_usec = GetMonotonicUsec();
+
+        RTMPPublisher fresh;
+        while (!publish(fresh)) {
+            fresh.Close();
+            if (GetMonotonicUsec() - drop_usec > 2000000) {
+                cout << name << ": reconnect failed" << endl;
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        resume_usec.push_back(frame_usec - drop_usec);
+    } while (GetMonotonicUsec() - t0 < Options.MinTimeUsec);
+
+    receiver.Stop();
+
+    std::sort(resume_usec.begin(), resume_usec.end());
+    uint64_t total_usec = 0;
+    for (uint64_t usec : resume_usec) {
+        total_usec += usec;
+    }
+
+    BenchResult result;
+    result.Name = name;
+    result.Ops = resume_usec.size();
+    result.NsPerOp = total_usec * 1000.0 / resume_usec.size();
+    ReportResult(result);
+
+    MetricsSnapshot snapshot;
+    metrics.Snapshot(snapshot);
+    cout << "  resume usec: p50=" << resume_usec[resume_usec.size() / 2] << " max=" << resume_usec.back()
+        << " takeovers=" << snapshot.Counters[METRIC_PUBLISHER_TAKEOVERS]
+        << " timed_out=" << snapshot.Counters[METRIC_SESSIONS_TIMED_OUT]
+        << " rejected=" << snapshot.Counters[METRIC_PUBLISHES_REJECTED] << endl;
+}
+
+static void BenchResume()
+{
+    BenchResumeAfterDrop("resume/takeover", true);
+    BenchResumeAfterDrop("resume/no_media_timeout", false);
+}
+
+
+//------------------------------------------------------------------------------
+// Shared Memory Handoff
+
+// A 4K60 H.264 stream at ~50 Mbps: a 1 MB keyframe then ~90 KB frames, one
+// GOP per second
+static const int kHandoffGopFrames = 60;
+static const int kHandoffKeyframeBytes = 1024 * 1024;
+static const int kHandoffFrameBytes = 90 * 1024;
+static const char* kHandoffRingName = "rtmp_bench_ring";
+
+struct HandoffFrames {
+    HandoffFrames() {
+        Keyframe = MakeFrame(kHandoffKeyframeBytes, 0x65);
+        Frame = MakeFrame(kHandoffFrameBytes, 0x41);
+
+        static const uint8_t sps[] = { 0x67, 0x64, 0x00, 0x33, 0xac, 0x2b, 0x40 };
+        static const uint8_t pps[] = { 0x68, 0xee, 0x3c, 0xb0 };
+        Setup.VideoSizeBytes = 4;
+        Setup.SPS.push_back(ParameterData{ sps, sizeof(sps) });
+        Setup.PPS.push_back(ParameterData{ pps, sizeof(pps) });
+    }
+
+    std::vector<uint8_t> Keyframe, Frame;
+    RTMPSetupResult Setup;
+
+    uint64_t GetMeanBytes() const {
+        return (Keyframe.size() + (kHandoffGopFrames - 1) * Frame.size()) / kHandoffGopFrames;
+    }
+
+private:
+    // One NAL unit with a 4-byte length prefix
+    static std::vector<uint8_t> MakeFrame(int bytes, uint8_t nal_header) {
+        std::vector<uint8_t> frame(bytes);
+        FillRandomBuffer(frame.data(), bytes, bytes);
+        WriteUInt32(frame.data(), bytes - 4);
+        frame[4] = nal_header;
+        return frame;
+    }
+};
+
+// Gets each frame's size and the usec its handoff started
+using HandoffConsumer = std::function<void(uint32_t bytes, uint64_t start_usec)>;
+
+// The ring, with a consumer thread reading it through its own mapping as a
+// separate process would
+class ShmHandoff {
+public:
+    bool Start(ShmFrameFormat format, const HandoffFrames& frames, HandoffConsumer consumer) {
+        Frames = &frames;
+
+        ShmRingSettings settings;
+        settings.Name = kHandoffRingName;
+        settings.Format = format;
+        if (!Ring.Create(settings) || !Reader.Open(kHandoffRingName)) {
+            return false;
+        }
+        Ring.WriteSetup(1, Frames->Setup);
+
+        Consumer = std::thread([this, consumer]() {
+            ShmFrameView view;
+            while (Reader.Read(view, -1) == ShmFrameReader::SHM_READ_RECORD) {
+                if (!view.IsSetup() && Reader.IsValid(view)) {
+                    consumer(view.Bytes, static_cast<uint64_t>( view.Pts ));
+                }
+            }
+        });
+        return true;
+    }
+
+    void Send(bool keyframe, uint64_t start_usec) {
+        const std::vector<uint8_t>& data = keyframe ? Frames->Keyframe : Frames->Frame;
+
+        RTMPVideoFrame frame;
+        frame.Stream = 1;
+        frame.Keyframe = keyframe;
+        frame.Pts = static_cast<int64_t>( start_usec );
+        frame.Data = data.data();
+        frame.Bytes = static_cast<int>( data.size() );
+        Ring.WriteFrame(frame);
+    }
+
+    void Stop() {
+        Ring.Close();
+        if (Consumer.joinable()) {
+            Consumer.join();
+        }
+    }
+
+    uint64_t GetSkipped() const {
+        return Reader.Skipped;
+    }
+
+private:
+    const HandoffFrames* Frames = nullptr;
+    ShmFrameRing Ring;
+    ShmFrameReader Reader;
+    std::thread Consumer;
+};
+
+// The same frames over a Unix domain socket, each behind a small header: the
+// kernel copies them in and the consumer copies them out
+class SocketHandoff {
+public:
+    bool Start(const HandoffFrames& frames, HandoffConsumer consumer) {
+        Frames = &frames;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, Sockets) < 0) {
+            return false;
+        }
+
+        Consumer = std::thread([this, consumer]() {
+            std::vector<uint8_t> buffer(kHandoffKeyframeBytes);
+            Header header;
+            while (RecvAll(&header, sizeof(header)) && RecvAll(buffer.data(), header.Bytes)) {
+                consumer(header.Bytes, header.StartUsec);
+            }
+        });
+        return true;
+    }
+
+    void Send(bool keyframe, uint64_t start_usec) {
+        const std::vector<uint8_t>& data = keyframe ? Frames->Keyframe : Frames->Frame;
+
+        Header header;
+        header.Bytes = static_cast<uint32_t>( data.size() );
+        header.StartUsec = start_usec;
+        SendRaw(Sockets[0], reinterpret_cast<const uint8_t*>( &header ), sizeof(header));
+        SendRaw(Sockets[0], data.data(), data.size());
+    }
+
+    void Stop() {
+        if (Sockets[0] >= 0) {
+            shutdown(Sockets[0], SHUT_WR);
+        }
+        if (Consumer.joinable()) {
+            Consumer.join();
+        }
+        for (int& s : Sockets) {
+            if (s >= 0) {
+                close(s);
+                s = -1;
+            }
+        }
+    }
+
+    uint64_t GetSkipped() const {
+        return 0;
+    }
+
+private:
+    struct Header {
+        uint64_t StartUsec;
+        uint32_t Bytes;
+    };
+
+    const HandoffFrames* Frames = nullptr;
+    int Sockets[2] = { -1, -1 };
+    std::thread Consumer;
+
+    bool RecvAll(void* data, size_t bytes) {
+        uint8_t* dest = static_cast<uint8_t*>( data );
+        while (bytes > 0) {
+            const ssize_t received = recv(Sockets[1], dest, bytes, 0);
+            if (received <= 0) {
+                return false;
+            }
+            dest += received;
+            bytes -= static_cast<size_t>( received );
+        }
+        return true;
+    }
+};
+
+// Frames handed off as fast as the consumer keeps up.  ns/op is per frame
+template<typename HandoffT>
+static void BenchHandoffThroughput(const std::string& name, HandoffT& handoff, const HandoffFrames& frames)
+{
+    RunBench(name, frames.GetMeanBytes(), [&]() -> uint64_t {
+        for (int i = 0; i < kHandoffGopFrames; ++i) {
+            handoff.Send(i == 0, 0);
+        }
+        return kHandoffGopFrames;
+    });
+}
+
+// Frames handed off at 60 fps for a second.  ns/op is the mean time from the
+// start of the handoff until the consumer has the frame
+template<typename HandoffT>
+static void BenchHandoffLatency(const std::string& name, HandoffT& handoff, std::vector<uint64_t>& latency_usec)
+{
+    auto next = std::chrono::steady_clock::now();
+    for (int i = 0; i < kHandoffGopFrames; ++i) {
+        std::this_thread::sleep_until(next);
+        next += std::chrono::microseconds(1000000 / 60);
+        handoff.Send(i == 0, GetShmClockUsec());
+    }
+    handoff.Stop();
+
+    if (latency_usec.empty()) {
+        cout << name << ": no frames arrived" << endl;
+        return;
+    }
+    std::sort(latency_usec.begin(), latency_usec.end());
+    uint64_t total_usec = 0;
+    for (uint64_t usec : latency_usec) {
+        total_usec += usec;
+    }
+
+    BenchResult result;
+    result.Name = name;
+    result.Ops = latency_usec.size();
+    result.NsPerOp = total_usec * 1000.0 / latency_usec.size();
+    ReportResult(result);
+
+    cout << "  handoff usec: p50=" << latency_usec[latency_usec.size() / 2]
+        << " p99=" << latency_usec[latency_usec.size() * 99 / 100]
+        << " max=" << latency_usec.back()
+        << " frames=" << latency_usec.size() << "/" << kHandoffGopFrames
+        << " skipped=" << handoff.GetSkipped() << endl;
+}
+
+static bool IsFiltered(const std::string& name)
+{
+    return !Options.Filter.empty() && name.find(Options.Filter) == std::string::npos;
+}
+
+static void BenchHandoff()
+{
+    HandoffFrames frames;
+    HandoffConsumer ignore = [](uint32_t bytes, uint64_t start_usec) {
+        UNUSED(bytes);
+        UNUSED(start_usec);
+    };
+
+    const struct {
+        const char* Name;
+        ShmFrameFormat Format;
+    } formats[] = {
+        { "annexb", SHM_FORMAT_ANNEXB },
+        { "avcc", SHM_FORMAT_AVCC },
+    };
+    for (const auto& format : formats) {
+        const std::string name = std::string("handoff/shm_") + format.Name + "_4k";
+        if (IsFiltered(name)) {
+            continue;
+        }
+        ShmHandoff handoff;
+        if (!handoff.Start(format.Format, frames, ignore)) {
+            cout << name << ": failed to create ring" << endl;
+            continue;
+        }
+        BenchHandoffThroughput(name, handoff, frames);
+        handoff.Stop();
+    }
+
+    if (!IsFiltered("handoff/unix_socket_4k")) {
+        SocketHandoff handoff;
+        if (handoff.Start(frames, ignore)) {
+            BenchHandoffThroughput("handoff/unix_socket_4k", handoff, frames);
+        }
+        handoff.Stop();
+    }
+
+    // Only the consumer thread appends, and Stop() joins it before reading
+    std::vector<uint64_t> latency_usec;
+    HandoffConsumer record = [&](uint32_t bytes, uint64_t start_usec) {
+        UNUSED(bytes);
+        latency_usec.push_back(GetShmClockUsec() - start_usec);
+    };
+
+    if (!IsFiltered("handoff/shm_4k60_latency")) {
+        ShmHandoff handoff;
+        if (handoff.Start(SHM_FORMAT_ANNEXB, frames, record)) {
+            BenchHandoffLatency("handoff/shm_4k60_latency", handoff, latency_usec);
+        }
+    }
+
+    latency_usec.clear();
+    if (!IsFiltered("handoff/unix_socket_4k60_latency")) {
+        SocketHandoff handoff;
+        if (handoff.Start(frames, record)) {
+            BenchHandoffLatency("handoff/unix_socket_4k60_latency", handoff, latency_usec);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Buffer Arena
+
+// Reserved per variant, as a receiver does with RTMPPlacementSettings::ArenaBytes
+static const size_t kBenchArenaBytes = 256 * 1024 * 1024;
+
+struct ArenaVariant {
+    const char* Name;
+
+    // nullptr = the default allocator
+    BufferArena* Arena;
+};
+
+static std::vector<ArenaVariant> GetArenaVariants()
+{
+    static BufferArena arena, arena_thp;
+    if (!arena.IsCreated()) {
+        arena.Create(kBenchArenaBytes);
+        arena_thp.Create(kBenchArenaBytes, -1, NODE_PAGES_THP);
+    }
+    return {
+        { "heap", nullptr },
+        { "arena", &arena },
+        { "arena_thp", &arena_thp }
+    };
+}
+
+static void BenchArena()
+{
+    // 4K60 at ~50 Mbps: ~100 KB frames and a 300 KB keyframe, one GOP per second
+    H264Stream video;
+    video.Synthesize(60, 60, 50000000 / 8 / 60, 1);
+    const std::vector<uint8_t> session_data = MakeSessionStream(video, 4096, FMT_PATTERN_MIXED);
+    const uint64_t messages = video.Frames.size() + 1;
+
+    const int recv_bytes = 2048 * 16;
+
+    for (const ArenaVariant& variant : GetArenaVariants()) {
+        // One op = one message reassembled through a fresh session, so every
+        // buffer grows from empty as it does for a new connection
+        RunBench(std::string("arena/reassemble_4k60/") + variant.Name, session_data.size() / messages, [&]() -> uint64_t {
+            NullHandler handler;
+            RollingBuffer buffer;
+            buffer.SetArena(variant.Arena);
+            RTMPSession session;
+            session.Buffer = &buffer;
+            session.Handler = &handler;
+            session.Arena = variant.Arena;
+
+            const uint8_t* data = session_data.data();
+            int remaining = static_cast<int>( session_data.size() );
+            while (remaining > 0) {
+                int bytes = remaining < recv_bytes ? remaining : recv_bytes;
+                session.ParseChunk(data, bytes);
+                data += bytes;
+                remaining -= bytes;
+            }
+
+            Sink = Sink + handler.Frames;
+            return messages;
+        });
+    }
+
+    // A 4K I-frame copied for delivery into a buffer that is then released,
+    // as the delivery thread does once its pool is full
+    std::vector<uint8_t> keyframe(kHandoffKeyframeBytes);
+    FillRandomBuffer(keyframe.data(), static_cast<int>( keyframe.size() ), 1);
+
+    for (const ArenaVariant& variant : GetArenaVariants()) {
+        RunBench(std::string("arena/copy_4k_iframe/") + variant.Name, keyframe.size(), [&]() -> uint64_t {
+            for (int i = 0; i < 16; ++i) {
+                ArenaBytes copy{ArenaAllocator<uint8_t>(variant.Arena)};
+                copy.assign(keyframe.begin(), keyframe.end());
+                Sink = Sink + copy[i];
+            }
+            return 16;
+        });
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Logging
+
+static void BenchLog()
+{
+    static std::atomic<uint64_t> sink_bytes(0);
+    SetLogSink([](RTMPLogLevel level, const std::string& message) {
+        UNUSED(level);
+        sink_bytes += message.size();
+    });
+
+    // Level disabled: The cost every LOG() in the parser pays by default
+    RunBench("log/disabled", 0, [&]() -> uint64_t {
+        for (int i = 0; i < 1000; ++i) {
+            RTMP_LOG(RTMP_LOG_TRACE, "Chunk: fmt=", i, " cs=", 3);
+        }
+        return 1000;
+    });
+
+    // Call site over its rate limit, as with a misbehaving stream
+    RunBench("log/rate_limited", 0, [&]() -> uint64_t {
+        for (int i = 0; i < 1000; ++i) {
+            RTMP_LOG(RTMP_LOG_WARNING, "No video data for stream ", i);
+        }
+        return 1000;
+    });
+
+    // Unlimited: Capture into the ring, then wait for the log thread to format
+    // and write each batch.  Allocations include the log thread
+    SetLogRateLimit(0);
+    RunBench("log/write_and_flush", 0, [&]() -> uint64_t {
+        for (int i = 0; i < 100; ++i) {
+            RTMP_LOG(RTMP_LOG_WARNING, "Truncated while reading SPS on stream ", i);
+        }
+        FlushLog();
+        return 100;
+    });
+    FlushLog();
+    SetLogRateLimit(10);
+    SetLogSink(nullptr);
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+static bool ParseOptions(int argc, char** argv) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string arg = argv[i];
+        const std::string value = argv[i + 1];
+
+        if (arg == "--filter") {
+            Options.Filter = value;
+        } else if (arg == "--min-time") {
+            Options.MinTimeUsec = static_cast<uint64_t>( atoi(value.c_str()) ) * 1000;
+        } else if (arg == "--json") {
+            Options.JsonPath = value;
+        } else {
+            return false;
+        }
+    }
+    return (argc % 2) == 1;
+}
+
+int main(int argc, char** argv) {
+    if (!ParseOptions(argc, argv)) {
+        cout << "Usage: rtmp_bench [--filter SUBSTRING] [--min-time MSEC] [--json PATH]" << endl;
+        return -1;
+    }
+
+    BenchByteStream();
+    BenchParseChunk();
+    BenchDispatch();
+    BenchAvcc();
+    BenchSimd();
+    BenchAmf0();
+    BenchResponses();
+    BenchConnectionSetup();
+    BenchStop();
+    BenchResume();
+    BenchHandoff();
+    BenchArena();
+    BenchLog();
+
+    if (!Options.JsonPath.empty() && !WriteJson(Options.JsonPath)) {
+        cout << "Failed to write " << Options.JsonPath << endl;
+        return -1;
+    }
+
+    return 0;
+}
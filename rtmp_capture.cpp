@@ -0,0 +1,140 @@
+#include "rtmp_capture.h"
+
+#include "bytestream.h"
+#include "rtmp_tools.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// CaptureWriter
+
+bool CaptureWriter::Open(const std::string& path, uint64_t start_usec)
+{
+    Close();
+
+    File = fopen(path.c_str(), "wb");
+    if (!File) {
+        perror("fopen failed");
+        return false;
+    }
+
+    uint8_t header[kCaptureHeaderBytes];
+    memcpy(header, kCaptureMagic, sizeof(kCaptureMagic));
+    WriteUInt32(header + 8, static_cast<uint32_t>( start_usec >> 32 ));
+    WriteUInt32(header + 12, static_cast<uint32_t>( start_usec ));
+
+    if (fwrite(header, 1, sizeof(header), File) != sizeof(header)) {
+        perror("fwrite failed");
+        Close();
+        return false;
+    }
+
+    LastUsec = start_usec;
+    return true;
+}
+
+void CaptureWriter::Close()
+{
+    if (File) {
+        fclose(File);
+        File = nullptr;
+    }
+}
+
+void CaptureWriter::WriteRecv(uint64_t usec, const uint8_t* data, int bytes)
+{
+    if (!File || bytes <= 0) {
+        return;
+    }
+
+    uint64_t delta = usec - LastUsec;
+    if (delta > UINT32_MAX) {
+        delta = UINT32_MAX;
+    }
+    LastUsec = usec;
+
+    uint8_t header[kCaptureRecordHeaderBytes];
+    WriteUInt32(header, static_cast<uint32_t>( delta ));
+    WriteUInt32(header + 4, static_cast<uint32_t>( bytes ));
+
+    if (fwrite(header, 1, sizeof(header), File) != sizeof(header) ||
+        fwrite(data, 1, bytes, File) != static_cast<size_t>( bytes ))
+    {
+        perror("fwrite failed");
+        Close();
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// CaptureReader
+
+bool CaptureReader::Open(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    FileData.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+    ByteStream stream(FileData.data(), FileData.size());
+
+    const uint8_t* magic = stream.ReadData(sizeof(kCaptureMagic));
+    StartUsec = stream.ReadUInt64();
+    if (stream.HasError() || 0 != memcmp(magic, kCaptureMagic, sizeof(kCaptureMagic))) {
+        return false;
+    }
+
+    TotalBytes = 0;
+    RecordCount = 0;
+
+    // Count complete records.  A capture cut short by a crash still replays up to the last full record
+    while (!stream.IsEndOfStream()) {
+        stream.ReadUInt32(); // Delta
+        uint32_t bytes = stream.ReadUInt32();
+        stream.ReadData(static_cast<int>( bytes ));
+        if (stream.HasError()) {
+            break;
+        }
+        TotalBytes += bytes;
+        RecordCount++;
+    }
+
+    Rewind();
+    return true;
+}
+
+void CaptureReader::Rewind()
+{
+    Offset = kCaptureHeaderBytes;
+    Usec = 0;
+}
+
+bool CaptureReader::ReadNext(CaptureRecord& record)
+{
+    if (Offset >= FileData.size()) {
+        return false;
+    }
+
+    ByteStream stream(FileData.data() + Offset, FileData.size() - Offset);
+
+    uint32_t delta = stream.ReadUInt32();
+    uint32_t bytes = stream.ReadUInt32();
+    const uint8_t* data = stream.ReadData(static_cast<int>( bytes ));
+    if (stream.HasError()) {
+        Offset = FileData.size();
+        return false;
+    }
+
+    Usec += delta;
+    Offset += kCaptureRecordHeaderBytes + bytes;
+
+    record.Usec = Usec;
+    record.Data = data;
+    record.Bytes = static_cast<int>( bytes );
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef RTMP_CAPTURE_H
+#define RTMP_CAPTURE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Capture File Format
+
+/*
+    Records each recv() result from a client connection exactly as the socket
+    returned it, so that the TCP segmentation seen in the field can be replayed.
+
+    File header:
+        8 bytes: Magic "RTMPCAP1"
+        8 bytes: Monotonic time of connection in microseconds
+
+    Each record:
+        4 bytes: Microseconds since the previous record (or connection)
+        4 bytes: Number of bytes returned by recv()
+        N bytes: Data
+
+    All integers are big-endian to match RTMP.
+*/
+
+static const char kCaptureMagic[8] = { 'R', 'T', 'M', 'P', 'C', 'A', 'P', '1' };
+static const int kCaptureHeaderBytes = 8 + 8;
+static const int kCaptureRecordHeaderBytes = 4 + 4;
+
+
+//------------------------------------------------------------------------------
+// CaptureWriter
+
+class CaptureWriter {
+public:
+    ~CaptureWriter() {
+        Close();
+    }
+
+    bool Open(const std::string& path, uint64_t start_usec);
+    void Close();
+
+    bool IsOpen() const {
+        return File != nullptr;
+    }
+
+    void WriteRecv(uint64_t usec, const uint8_t* data, int bytes);
+
+private:
+    FILE* File = nullptr;
+    uint64_t LastUsec = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// CaptureReader
+
+struct CaptureRecord {
+    // Microseconds since the connection was accepted
+    uint64_t Usec = 0;
+
+    const uint8_t* Data = nullptr;
+    int Bytes = 0;
+};
+
+class CaptureReader {
+public:
+    // Loads the whole capture into memory
+    bool Open(const std::string& path);
+
+    // Returns false at the end of the capture
+    bool ReadNext(CaptureRecord& record);
+
+    // Start over from the first record
+    void Rewind();
+
+    uint64_t StartUsec = 0;
+    uint64_t TotalBytes = 0;
+    int RecordCount = 0;
+
+private:
+    std::vector<uint8_t> FileData;
+    size_t Offset = 0;
+    uint64_t Usec = 0;
+};
+
+#endif // RTMP_CAPTURE_H
@@ -0,0 +1,130 @@
+#include "rtmp_clock.h"
+
+#include <cmath>
+
+
+//------------------------------------------------------------------------------
+// ClockRecovery
+
+// Clock drift beyond this is treated as a fitting error
+static const double kMaxDrift = 0.001;
+
+void ClockRecovery::Reset()
+{
+    HasReference = false;
+    Offset = 0.0;
+    Drift = 0.0;
+    WindowsUsed = 0;
+    NextWindow = 0;
+    LastJitterUsec = 0;
+}
+
+void ClockRecovery::Update(int64_t sender_msec, uint64_t arrival_usec)
+{
+    const int64_t sender_usec = sender_msec * 1000;
+    const int64_t delta = static_cast<int64_t>( arrival_usec ) - sender_usec;
+
+    if (HasReference) {
+        const double error = static_cast<double>( delta ) - Predict(sender_usec);
+        if (std::fabs(error) > kDiscontinuityUsec ||
+            sender_usec < WindowStartUsec - kDiscontinuityUsec)
+        {
+            Reset(); // Publisher restarted its timestamps
+        }
+    }
+
+    if (!HasReference) {
+        HasReference = true;
+        ReferenceSenderUsec = sender_usec;
+        Offset = static_cast<double>( delta );
+        Drift = 0.0;
+
+        WindowStartUsec = sender_usec;
+        Current.SenderUsec = sender_usec;
+        Current.Delta = delta;
+        LastJitterUsec = 0;
+        return;
+    }
+
+    if (sender_usec - WindowStartUsec >= kWindowUsec) {
+        CloseWindow();
+        WindowStartUsec = sender_usec;
+        Current.SenderUsec = sender_usec;
+        Current.Delta = delta;
+    } else if (delta < Current.Delta) {
+        Current.SenderUsec = sender_usec;
+        Current.Delta = delta;
+    }
+
+    // A frame faster than the envelope means the path got shorter
+    const double predicted = Predict(sender_usec);
+    if (delta < predicted) {
+        Offset -= predicted - delta;
+    }
+
+    LastJitterUsec = static_cast<int64_t>( delta - Predict(sender_usec) );
+}
+
+int64_t ClockRecovery::ToLocalUsec(int64_t sender_msec) const
+{
+    const int64_t sender_usec = sender_msec * 1000;
+    return sender_usec + static_cast<int64_t>( Predict(sender_usec) );
+}
+
+void ClockRecovery::CloseWindow()
+{
+    Windows[NextWindow] = Current;
+    NextWindow = (NextWindow + 1) % kWindowCount;
+    if (WindowsUsed < kWindowCount) {
+        ++WindowsUsed;
+    }
+
+    Refit();
+}
+
+void ClockRecovery::Refit()
+{
+    if (WindowsUsed < 3) {
+        return; // Too short to tell drift from jitter
+    }
+
+    // Least squares over the window minima, relative to the reference
+    double sum_x = 0.0, sum_y = 0.0;
+    for (int i = 0; i < WindowsUsed; ++i) {
+        sum_x += static_cast<double>( Windows[i].SenderUsec - ReferenceSenderUsec );
+        sum_y += static_cast<double>( Windows[i].Delta );
+    }
+    const double mean_x = sum_x / WindowsUsed;
+    const double mean_y = sum_y / WindowsUsed;
+
+    double sxx = 0.0, sxy = 0.0;
+    for (int i = 0; i < WindowsUsed; ++i) {
+        const double dx = static_cast<double>( Windows[i].SenderUsec - ReferenceSenderUsec ) - mean_x;
+        const double dy = static_cast<double>( Windows[i].Delta ) - mean_y;
+        sxx += dx * dx;
+        sxy += dx * dy;
+    }
+    if (sxx <= 0.0) {
+        return;
+    }
+
+    double drift = sxy / sxx;
+    if (drift > kMaxDrift) {
+        drift = kMaxDrift;
+    } else if (drift < -kMaxDrift) {
+        drift = -kMaxDrift;
+    }
+
+    // Shift the line down to the lowest minimum so it stays an envelope
+    double offset = mean_y - drift * mean_x;
+    for (int i = 0; i < WindowsUsed; ++i) {
+        const double x = static_cast<double>( Windows[i].SenderUsec - ReferenceSenderUsec );
+        const double residual = static_cast<double>( Windows[i].Delta ) - (offset + drift * x);
+        if (residual < 0.0) {
+            offset += residual;
+        }
+    }
+
+    Offset = offset;
+    Drift = drift;
+}
@@ -0,0 +1,97 @@
+#ifndef RTMP_CLOCK_H
+#define RTMP_CLOCK_H
+
+#include <cstdint>
+
+
+//------------------------------------------------------------------------------
+// ClockRecovery
+
+// Sender clock mapped onto the local monotonic clock for one frame
+struct RTMPFrameClock {
+    // False until the first frame of the stream has been seen
+    bool Valid = false;
+
+    // Local monotonic time the frame was reassembled
+    uint64_t ArrivalUsec = 0;
+
+    // Local time at which a frame with this PTS would arrive with no queuing
+    // delay.  Add a jitter buffer delay to get a release deadline
+    int64_t LocalPtsUsec = 0;
+
+    // Arrival delay beyond the best case seen recently
+    int64_t JitterUsec = 0;
+
+    // Sender clock rate relative to the local clock, in parts per million
+    double DriftPpm = 0.0;
+};
+
+// Estimates the offset and drift of a sender clock against the local
+// monotonic clock from (sender timestamp, arrival time) pairs.
+//
+// Network delay only ever adds to the arrival time, so the estimate follows
+// the lower envelope of (arrival - sender time): the minimum of each one
+// second window is kept, and a least-squares line through the recent minima,
+// shifted down to lie under all of them, gives offset and drift.
+class ClockRecovery {
+public:
+    // sender_msec: Decode timestamp on the 64-bit timeline
+    void Update(int64_t sender_msec, uint64_t arrival_usec);
+
+    bool IsValid() const {
+        return HasReference;
+    }
+
+    // Earliest local time a sender timestamp could arrive
+    int64_t ToLocalUsec(int64_t sender_msec) const;
+
+    // Positive when the sender clock runs fast.  A fast sender shrinks
+    // (arrival - sender time), so this is the negated slope
+    double GetDriftPpm() const {
+        return -Drift * 1000000.0;
+    }
+
+    int64_t GetLastJitterUsec() const {
+        return LastJitterUsec;
+    }
+
+    void Reset();
+
+private:
+    static const int kWindowCount = 16;
+    static const int64_t kWindowUsec = 1000000;
+
+    // Timestamps jumping by more than this restart the estimate
+    static const int64_t kDiscontinuityUsec = 10000000;
+
+    struct WindowMinimum {
+        int64_t SenderUsec = 0;
+        int64_t Delta = 0; // arrival - sender
+    };
+
+    bool HasReference = false;
+    int64_t ReferenceSenderUsec = 0;
+
+    // delta(sender) = Offset + Drift * (sender - ReferenceSenderUsec)
+    double Offset = 0.0;
+    double Drift = 0.0;
+
+    WindowMinimum Windows[kWindowCount];
+    int WindowsUsed = 0;
+    int NextWindow = 0;
+
+    // Window being filled
+    int64_t WindowStartUsec = 0;
+    WindowMinimum Current;
+
+    int64_t LastJitterUsec = 0;
+
+    double Predict(int64_t sender_usec) const {
+        return Offset + Drift * static_cast<double>( sender_usec - ReferenceSenderUsec );
+    }
+
+    void CloseWindow();
+    void Refit();
+};
+
+#endif // RTMP_CLOCK_H
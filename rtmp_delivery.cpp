@@ -0,0 +1,210 @@
+#include "rtmp_delivery.h"
+#include "rtmp_placement.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+using namespace std;
+
+// Delivered buffers kept for reuse
+static const size_t kMaxFreeBuffers = 64;
+
+
+//------------------------------------------------------------------------------
+// DeliveryBacklog
+
+DeliveryBacklog::DeliveryBacklog()
+{
+    ResumeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ResumeFd < 0) {
+        perror("eventfd failed");
+    }
+}
+
+DeliveryBacklog::~DeliveryBacklog()
+{
+    if (ResumeFd >= 0) {
+        close(ResumeFd);
+    }
+}
+
+void DeliveryBacklog::Release(size_t bytes)
+{
+    // Paused is set before the receiver checks QueuedBytes, so one of the two
+    // sides always sees the other and the session cannot sleep forever
+    const size_t queued = QueuedBytes.fetch_sub(bytes) - bytes;
+    if (queued <= LowWatermarkBytes && Paused.load()) {
+        Wake();
+    }
+}
+
+void DeliveryBacklog::Wake()
+{
+    const uint64_t one = 1;
+    if (ResumeFd >= 0 && write(ResumeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write failed");
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// FrameDeliveryThread
+
+void FrameDeliveryThread::Start(DeliverFunc deliver, const std::vector<int>& cpus, BufferArena* arena)
+{
+    Deliver = deliver;
+    Cpus = cpus;
+    Arena = arena;
+    Terminated = false;
+    Thread = std::make_shared<std::thread>(&FrameDeliveryThread::Loop, this);
+}
+
+void FrameDeliveryThread::Stop()
+{
+    if (!Thread) {
+        return; // Not running
+    }
+
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        Terminated = true;
+    }
+    Wakeup.notify_all();
+    Idle.notify_all();
+
+    if (Thread->joinable()) {
+        Thread->join();
+    }
+    Thread = nullptr;
+
+    Entries.clear();
+    FreeBuffers.clear();
+}
+
+void FrameDeliveryThread::WaitIdle()
+{
+    std::unique_lock<std::mutex> locker(Lock);
+    Idle.wait(locker, [this]() {
+        return Terminated || (Entries.empty() && !Delivering);
+    });
+}
+
+std::vector<int> FrameDeliveryThread::GetCpus() const
+{
+    if (!Thread) {
+        return std::vector<int>();
+    }
+    return GetThreadCpus(Thread->native_handle());
+}
+
+int FrameDeliveryThread::GetCurrentCpu() const
+{
+    const int thread_id = ThreadId.load();
+    return thread_id >= 0 ? GetThreadCurrentCpu(thread_id) : -1;
+}
+
+ArenaBytes FrameDeliveryThread::GetBuffer(const uint8_t* data, size_t bytes)
+{
+    ArenaBytes buffer{ArenaAllocator<uint8_t>(Arena)};
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        if (!FreeBuffers.empty()) {
+            buffer.swap(FreeBuffers.back());
+            FreeBuffers.pop_back();
+        }
+    }
+    buffer.assign(data, data + bytes);
+    return buffer;
+}
+
+void FrameDeliveryThread::PushFrame(
+    const std::shared_ptr<DeliveryBacklog>& backlog,
+    void* handler,
+    const RTMPVideoFrame& frame)
+{
+    DeliveryEntry entry;
+    entry.Stream = frame.Stream;
+    entry.Handler = handler;
+    entry.Frame = frame;
+    entry.Bytes = GetBuffer(frame.Data, frame.Bytes);
+    entry.Frame.Data = entry.Bytes.data();
+    entry.Backlog = backlog;
+
+    Push(std::move(entry));
+}
+
+void FrameDeliveryThread::PushSetup(
+    const std::shared_ptr<DeliveryBacklog>& backlog,
+    void* handler,
+    uint32_t stream,
+    const RTMPSetupResult& result)
+{
+    DeliveryEntry entry;
+    entry.IsSetup = true;
+    entry.Stream = stream;
+    entry.Handler = handler;
+    entry.SetupResult = result;
+    entry.Bytes = GetBuffer(result.Extradata, result.ExtradataSize);
+    entry.Backlog = backlog;
+
+    // Parameter sets point into the extradata: point them into the copy
+    const uint8_t* base = entry.Bytes.data();
+    for (auto* sets : { &entry.SetupResult.SPS, &entry.SetupResult.PPS }) {
+        for (ParameterData& set : *sets) {
+            set.Data = base + (set.Data - result.Extradata);
+        }
+    }
+    entry.SetupResult.Extradata = base;
+
+    Push(std::move(entry));
+}
+
+void FrameDeliveryThread::Push(DeliveryEntry&& entry)
+{
+    entry.Backlog->QueuedBytes += entry.Bytes.size();
+
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        Entries.push_back(std::move(entry));
+    }
+    Wakeup.notify_one();
+}
+
+void FrameDeliveryThread::Loop()
+{
+    PinCurrentThread(Cpus);
+    ThreadId = GetCurrentThreadId();
+
+    std::unique_lock<std::mutex> locker(Lock);
+
+    for (;;) {
+        Wakeup.wait(locker, [this]() {
+            return Terminated || !Entries.empty();
+        });
+        if (Terminated) {
+            return;
+        }
+
+        DeliveryEntry entry = std::move(Entries.front());
+        Entries.pop_front();
+        Delivering = true;
+
+        locker.unlock();
+
+        // Moving the entry kept the buffer, so Data still points into Bytes
+        Deliver(entry);
+        entry.Backlog->Release(entry.Bytes.size());
+
+        locker.lock();
+        if (FreeBuffers.size() < kMaxFreeBuffers) {
+            FreeBuffers.push_back(std::move(entry.Bytes));
+        }
+
+        Delivering = false;
+        if (Entries.empty()) {
+            Idle.notify_all();
+        }
+    }
+}
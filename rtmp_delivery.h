@@ -0,0 +1,135 @@
+#ifndef RTMP_DELIVERY_H
+#define RTMP_DELIVERY_H
+
+#include "rtmp_receiver.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// DeliveryBacklog
+
+// Bytes one connection has waiting for the delivery thread.  Shared with the
+// queued entries, so it outlives the connection until they are delivered
+struct DeliveryBacklog {
+    DeliveryBacklog();
+    ~DeliveryBacklog();
+
+    std::atomic<size_t> QueuedBytes = ATOMIC_VAR_INIT(0);
+
+    // Set by the receiver when it stops reading the connection.  The delivery
+    // thread writes ResumeFd once QueuedBytes drains to LowWatermarkBytes
+    std::atomic<bool> Paused = ATOMIC_VAR_INIT(false);
+    size_t LowWatermarkBytes = 0;
+
+    // Non-blocking eventfd the paused session waits on, or -1 on failure
+    int ResumeFd = -1;
+
+    // Called by the delivery thread after delivering bytes
+    void Release(size_t bytes);
+
+    // Wakes the session waiting on ResumeFd
+    void Wake();
+};
+
+
+//------------------------------------------------------------------------------
+// DeliveryEntry
+
+// A setup result or frame copied out of the receive buffer
+struct DeliveryEntry {
+    bool IsSetup = false;
+    uint32_t Stream = 0;
+
+    // BasicRTMPReceiver handler for the connection
+    void* Handler = nullptr;
+
+    // Frame with Data pointing into Bytes, or SetupResult with its
+    // parameter sets pointing into Bytes
+    RTMPVideoFrame Frame;
+    RTMPSetupResult SetupResult;
+    ArenaBytes Bytes;
+
+    std::shared_ptr<DeliveryBacklog> Backlog;
+};
+
+
+//------------------------------------------------------------------------------
+// FrameDeliveryThread
+
+// Runs frame callbacks off the receiver thread, in arrival order across all
+// connections, so a slow callback holds up its queue rather than socket reads
+class FrameDeliveryThread {
+public:
+    using DeliverFunc = std::function<void(DeliveryEntry& entry)>;
+
+    ~FrameDeliveryThread() {
+        Stop();
+    }
+
+    // cpus: Pins the thread to these CPUs.  Empty = any.  arena: Frame copies
+    // come from here instead of the heap
+    void Start(
+        DeliverFunc deliver,
+        const std::vector<int>& cpus = std::vector<int>(),
+        BufferArena* arena = nullptr);
+
+    // Entries not yet delivered are discarded
+    void Stop();
+
+    // Waits until every entry pushed so far has been delivered
+    void WaitIdle();
+
+    // CPUs the thread is allowed on, and the one it last ran on or -1
+    std::vector<int> GetCpus() const;
+    int GetCurrentCpu() const;
+
+    // Copies the frame and its data
+    void PushFrame(
+        const std::shared_ptr<DeliveryBacklog>& backlog,
+        void* handler,
+        const RTMPVideoFrame& frame);
+
+    // Copies the setup result and its extradata
+    void PushSetup(
+        const std::shared_ptr<DeliveryBacklog>& backlog,
+        void* handler,
+        uint32_t stream,
+        const RTMPSetupResult& result);
+
+private:
+    DeliverFunc Deliver;
+
+    std::mutex Lock;
+    std::condition_variable Wakeup;
+    std::deque<DeliveryEntry> Entries;
+    bool Terminated = false;
+
+    // An entry is out of Entries while its callback runs
+    bool Delivering = false;
+    std::condition_variable Idle;
+
+    // Byte buffers of delivered entries, reused to avoid an allocation per frame
+    std::vector<ArenaBytes> FreeBuffers;
+    BufferArena* Arena = nullptr;
+
+    std::shared_ptr<std::thread> Thread;
+    std::vector<int> Cpus;
+
+    // Kernel thread id, set once the thread has started
+    std::atomic<int> ThreadId = ATOMIC_VAR_INIT(-1);
+
+    ArenaBytes GetBuffer(const uint8_t* data, size_t bytes);
+    void Push(DeliveryEntry&& entry);
+    void Loop();
+};
+
+#endif // RTMP_DELIVERY_H
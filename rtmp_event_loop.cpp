@@ -0,0 +1,181 @@
+#include "rtmp_event_loop.h"
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+using namespace std;
+
+// From linux/eventpoll.h, which older userspace headers lack
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPOLL_IOC_TYPE 0x8A
+#define EPIOCSPARAMS _IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
+
+
+//------------------------------------------------------------------------------
+// EventLoop
+
+// Events handled per epoll_wait() call
+static const int kMaxEvents = 256;
+
+bool EventLoop::Initialize()
+{
+    Shutdown();
+
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (EpollFd < 0) {
+        perror("epoll_create1 failed");
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::SetBusyPoll(uint32_t usec, bool prefer_busy_poll)
+{
+    // Budget 0 = the kernel default
+    epoll_params params{};
+    params.busy_poll_usecs = usec;
+    params.prefer_busy_poll = prefer_busy_poll ? 1 : 0;
+    if (ioctl(EpollFd, EPIOCSPARAMS, &params) < 0) {
+        perror("ioctl EPIOCSPARAMS failed");
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::Shutdown()
+{
+    // Task destructors call Remove(), so take the map out first
+    std::unordered_map<void*, EventTask> tasks;
+    tasks.swap(Tasks);
+    tasks.clear();
+    Finished.clear();
+
+    FdWaiters.clear();
+
+    if (EpollFd >= 0) {
+        close(EpollFd);
+        EpollFd = -1;
+    }
+}
+
+bool EventLoop::Add(int fd)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return false;
+    }
+
+    if (static_cast<size_t>( fd ) >= FdWaiters.size()) {
+        FdWaiters.resize(fd + 1);
+    }
+    FdWaiters[fd] = Waiters();
+    return true;
+}
+
+void EventLoop::Remove(int fd)
+{
+    if (EpollFd >= 0) {
+        epoll_ctl(EpollFd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    if (static_cast<size_t>( fd ) < FdWaiters.size()) {
+        FdWaiters[fd] = Waiters();
+    }
+}
+
+void EventLoop::Spawn(EventTask task)
+{
+    std::coroutine_handle<EventTask::promise_type> handle = task.GetHandle();
+    if (!handle) {
+        return;
+    }
+    handle.promise().Loop = this;
+    Tasks.emplace(handle.address(), std::move(task));
+    Resume(handle);
+}
+
+void EventLoop::SetWaiter(int fd, int flags, std::coroutine_handle<> handle)
+{
+    if (static_cast<size_t>( fd ) >= FdWaiters.size()) {
+        FdWaiters.resize(fd + 1);
+    }
+    if (flags & AWAIT_READ) {
+        FdWaiters[fd].Reader = handle;
+    }
+    if (flags & AWAIT_WRITE) {
+        FdWaiters[fd].Writer = handle;
+    }
+}
+
+void EventLoop::ResumeWaiter(int fd, bool write)
+{
+    if (static_cast<size_t>( fd ) >= FdWaiters.size()) {
+        return;
+    }
+    Waiters& waiters = FdWaiters[fd];
+    std::coroutine_handle<> handle = write ? waiters.Writer : waiters.Reader;
+    if (!handle) {
+        return;
+    }
+
+    // A coroutine waiting for either direction is resumed only once
+    if (waiters.Reader == handle) {
+        waiters.Reader = nullptr;
+    }
+    if (waiters.Writer == handle) {
+        waiters.Writer = nullptr;
+    }
+    Resume(handle);
+}
+
+void EventLoop::Resume(std::coroutine_handle<> handle)
+{
+    handle.resume();
+
+    // Destroys the frames, which closes and removes their sockets
+    while (!Finished.empty()) {
+        void* address = Finished.back();
+        Finished.pop_back();
+        Tasks.erase(address);
+    }
+}
+
+void EventLoop::RunOnce(int timeout_msec)
+{
+    epoll_event events[kMaxEvents];
+
+    const int count = epoll_wait(EpollFd, events, kMaxEvents, timeout_msec);
+    if (count < 0) {
+        if (errno != EINTR) {
+            perror("epoll_wait failed");
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const int fd = events[i].data.fd;
+        const uint32_t flags = events[i].events;
+        const bool error = (flags & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0;
+
+        // The waiters are looked up again after each resume: the task may
+        // have finished and removed the fd
+        if ((flags & EPOLLIN) || error) {
+            ResumeWaiter(fd, false);
+        }
+        if ((flags & EPOLLOUT) || error) {
+            ResumeWaiter(fd, true);
+        }
+    }
+}
@@ -0,0 +1,279 @@
+#ifndef RTMP_EVENT_LOOP_H
+#define RTMP_EVENT_LOOP_H
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class EventLoop;
+
+
+//------------------------------------------------------------------------------
+// EventTask
+
+// Coroutine run by an EventLoop.  It starts suspended and is resumed by
+// EventLoop::Spawn(), then each time a socket it is waiting on is ready.
+// Destroying the task destroys the coroutine frame, running the destructors
+// of its locals, so a session can be torn down at any suspension point
+class EventTask {
+public:
+    struct promise_type {
+        // Set by EventLoop::Spawn()
+        EventLoop* Loop = nullptr;
+
+        // Stays suspended when done and tells the loop, which may have
+        // resumed a nested AsyncCall rather than this coroutine
+        struct FinalAwaiter {
+            bool await_ready() const noexcept {
+                return false;
+            }
+            void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+            void await_resume() const noexcept {}
+        };
+
+        EventTask get_return_object() {
+            return EventTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    EventTask() = default;
+    explicit EventTask(std::coroutine_handle<promise_type> handle)
+        : Handle(handle)
+    {
+    }
+    EventTask(EventTask&& other) noexcept
+        : Handle(std::exchange(other.Handle, nullptr))
+    {
+    }
+    EventTask& operator=(EventTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            Handle = std::exchange(other.Handle, nullptr);
+        }
+        return *this;
+    }
+    EventTask(const EventTask&) = delete;
+    EventTask& operator=(const EventTask&) = delete;
+
+    ~EventTask() {
+        Reset();
+    }
+
+    std::coroutine_handle<promise_type> GetHandle() const {
+        return Handle;
+    }
+
+    void Reset() {
+        if (Handle) {
+            Handle.destroy();
+            Handle = nullptr;
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> Handle;
+};
+
+
+//------------------------------------------------------------------------------
+// AsyncCall
+
+// Coroutine returning a T that another coroutine awaits, so a multi-step
+// exchange can be split into functions:
+//
+//     AsyncCall<bool> Flush(Connection& conn);
+//     ...
+//     if (!co_await Flush(conn)) co_return;
+//
+// The caller resumes directly when it finishes.  Destroying the caller while
+// the call is suspended destroys the call too
+template <class T>
+class AsyncCall {
+public:
+    struct promise_type {
+        T Value{};
+        std::coroutine_handle<> Caller;
+
+        struct FinalAwaiter {
+            bool await_ready() const noexcept {
+                return false;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                return handle.promise().Caller;
+            }
+            void await_resume() const noexcept {}
+        };
+
+        AsyncCall get_return_object() {
+            return AsyncCall(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+        void return_value(T value) {
+            Value = std::move(value);
+        }
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    explicit AsyncCall(std::coroutine_handle<promise_type> handle)
+        : Handle(handle)
+    {
+    }
+    AsyncCall(AsyncCall&& other) noexcept
+        : Handle(std::exchange(other.Handle, nullptr))
+    {
+    }
+    AsyncCall(const AsyncCall&) = delete;
+    AsyncCall& operator=(const AsyncCall&) = delete;
+
+    ~AsyncCall() {
+        if (Handle) {
+            Handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        Handle.promise().Caller = caller;
+        return Handle;
+    }
+    T await_resume() {
+        return std::move(Handle.promise().Value);
+    }
+
+private:
+    std::coroutine_handle<promise_type> Handle;
+};
+
+
+//------------------------------------------------------------------------------
+// EventLoop
+
+// Single-threaded epoll loop that resumes coroutines when their sockets are
+// ready.  Sockets are registered edge-triggered for both directions, so a
+// coroutine must only wait after a non-blocking call returned EAGAIN:
+//
+//     ssize_t bytes;
+//     while ((bytes = recv(fd, ...)) < 0 && errno == EAGAIN) {
+//         co_await loop.Readable(fd);
+//     }
+//
+// Wakeups may be spurious, so always retry the call after resuming
+class EventLoop {
+public:
+    ~EventLoop() {
+        Shutdown();
+    }
+
+    bool Initialize();
+
+    // Busy polls the NIC queues of the sockets inside RunOnce() for up to
+    // usec before sleeping (EPIOCSPARAMS, Linux 6.9+).  Call after
+    // Initialize().  Returns false if the kernel does not support it
+    bool SetBusyPoll(uint32_t usec, bool prefer_busy_poll);
+
+    // Destroys every task still running and closes the epoll fd
+    void Shutdown();
+
+    // Register a non-blocking socket.  Events for sockets without a waiting
+    // coroutine are dropped, which also lets a socket just wake RunOnce()
+    bool Add(int fd);
+    void Remove(int fd);
+
+    // Runs the task until its first suspension.  The loop owns it from here
+    void Spawn(EventTask task);
+
+    // Waits up to timeout_msec (-1 = forever) and resumes every ready waiter
+    void RunOnce(int timeout_msec);
+
+    // Coroutines running or waiting
+    size_t GetTaskCount() const {
+        return Tasks.size();
+    }
+
+    enum AwaitFlags {
+        AWAIT_READ = 1,
+        AWAIT_WRITE = 2
+    };
+
+    struct Awaiter {
+        EventLoop* Loop;
+        int Fd;
+        int Flags;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            Loop->SetWaiter(Fd, Flags, handle);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    Awaiter Readable(int fd) {
+        return Awaiter{ this, fd, AWAIT_READ };
+    }
+    Awaiter Writable(int fd) {
+        return Awaiter{ this, fd, AWAIT_WRITE };
+    }
+
+    // Resumes on whichever comes first
+    Awaiter ReadableOrWritable(int fd) {
+        return Awaiter{ this, fd, AWAIT_READ | AWAIT_WRITE };
+    }
+
+private:
+    int EpollFd = -1;
+
+    struct Waiters {
+        std::coroutine_handle<> Reader;
+        std::coroutine_handle<> Writer;
+    };
+
+    // Indexed by fd
+    std::vector<Waiters> FdWaiters;
+
+    // Keyed by coroutine frame address
+    std::unordered_map<void*, EventTask> Tasks;
+
+    // Tasks that ran to completion, destroyed after the resume returns
+    std::vector<void*> Finished;
+
+    friend struct EventTask::promise_type::FinalAwaiter;
+
+    void SetWaiter(int fd, int flags, std::coroutine_handle<> handle);
+    void ResumeWaiter(int fd, bool write);
+    void Resume(std::coroutine_handle<> handle);
+};
+
+inline void EventTask::promise_type::FinalAwaiter::await_suspend(
+    std::coroutine_handle<promise_type> handle) noexcept
+{
+    EventLoop* loop = handle.promise().Loop;
+    if (loop) {
+        loop->Finished.push_back(handle.address());
+    }
+}
+
+#endif // RTMP_EVENT_LOOP_H
@@ -0,0 +1,136 @@
+#include "rtmp_flow.h"
+
+#include <algorithm>
+
+
+//------------------------------------------------------------------------------
+// AckWindowController
+
+// Acks smaller than this cost more than they are worth
+static const uint32_t kMinAckIntervalBytes = 4096;
+
+void AckWindowController::Start(const RTMPFlowSettings& settings, uint64_t now_usec)
+{
+    Settings = settings;
+
+    WindowAckSize = Settings.WindowAckSize;
+    PeerBandwidth = Settings.PeerBandwidth;
+    AckIntervalBytes = Settings.AckIntervalBytes;
+    if (AckIntervalBytes == 0) {
+        AckIntervalBytes = std::max(PeerBandwidth / 2, kMinAckIntervalBytes);
+    }
+
+    GrowPending = false;
+    LastGapUsec = 0;
+    LastUpdateUsec = now_usec;
+    LastUpdateBytes = 0;
+    BytesPerSecond = 0.0;
+    RttUsec = 0;
+    Stalls = 0;
+}
+
+bool AckWindowController::CheckStall(uint64_t wait_usec, uint64_t unacked_bytes)
+{
+    LastGapUsec = wait_usec;
+    if (wait_usec < static_cast<uint64_t>( Settings.StallThresholdMsec ) * 1000) {
+        return false;
+    }
+
+    // An idle publisher is not a stalled one: it must also have been near
+    // the limit, counting what was still in flight when the gap began
+    const double in_flight = BytesPerSecond * RttUsec / 1000000.0;
+    if (unacked_bytes + in_flight < PeerBandwidth / 2) {
+        return false;
+    }
+
+    Stalls++;
+    if (Settings.Dynamic) {
+        GrowPending = true;
+    }
+    return true;
+}
+
+bool AckWindowController::IsUpdateDue(uint64_t now_usec) const
+{
+    if (!Settings.Dynamic) {
+        return false;
+    }
+    return GrowPending || now_usec - LastUpdateUsec >= static_cast<uint64_t>( Settings.UpdateIntervalMsec ) * 1000;
+}
+
+bool AckWindowController::Update(uint64_t now_usec, uint64_t total_bytes, uint32_t rtt_usec)
+{
+    const uint64_t elapsed_usec = now_usec - LastUpdateUsec;
+    if (elapsed_usec > 0) {
+        const double rate = (total_bytes - LastUpdateBytes) * 1000000.0 / elapsed_usec;
+
+        // Follow increases at once so the window opens before the publisher stalls
+        if (rate > BytesPerSecond) {
+            BytesPerSecond = rate;
+        } else {
+            BytesPerSecond = 0.75 * BytesPerSecond + 0.25 * rate;
+        }
+    }
+    LastUpdateUsec = now_usec;
+    LastUpdateBytes = total_bytes;
+
+    if (rtt_usec > 0) {
+        RttUsec = rtt_usec;
+    }
+
+    // Cover the data in flight over one RTT plus two ack intervals, with 2x headroom
+    const double cover_usec = RttUsec + 2.0 * Settings.AckIntervalMsec * 1000.0;
+    double target = 2.0 * BytesPerSecond * cover_usec / 1000000.0;
+    target = std::max(target, static_cast<double>( Settings.MinWindowBytes ));
+    target = std::min(target, static_cast<double>( Settings.MaxWindowBytes ));
+
+    uint32_t window = static_cast<uint32_t>( target );
+    if (GrowPending) {
+        const uint64_t doubled = std::min<uint64_t>(static_cast<uint64_t>( PeerBandwidth ) * 2, Settings.MaxWindowBytes);
+        window = std::max(window, static_cast<uint32_t>( doubled ));
+    }
+
+    // Grow at once, but only shrink when far oversized to avoid churn
+    bool changed = false;
+    if (window > PeerBandwidth || (!GrowPending && window < PeerBandwidth / 4)) {
+        PeerBandwidth = window;
+        WindowAckSize = window;
+        changed = true;
+    }
+    GrowPending = false;
+
+    // Ack about every AckIntervalMsec, and always before half the window
+    double interval = BytesPerSecond * Settings.AckIntervalMsec / 1000.0;
+    interval = std::max(interval, static_cast<double>( kMinAckIntervalBytes ));
+    interval = std::min(interval, static_cast<double>( PeerBandwidth / 2 ));
+    AckIntervalBytes = static_cast<uint32_t>( interval );
+
+    return changed;
+}
+
+void AckWindowController::SaveState(ByteStreamWriter& out) const
+{
+    out.WriteUInt32(WindowAckSize);
+    out.WriteUInt32(PeerBandwidth);
+    out.WriteUInt32(AckIntervalBytes);
+    out.WriteUInt64(LastUpdateBytes);
+    out.WriteDouble(BytesPerSecond);
+    out.WriteUInt32(RttUsec);
+    out.WriteUInt64(Stalls);
+}
+
+bool AckWindowController::RestoreState(const RTMPFlowSettings& settings, uint64_t now_usec, ByteStream& in)
+{
+    Start(settings, now_usec);
+
+    // The publisher still holds the windows last sent to it
+    WindowAckSize = in.ReadUInt32();
+    PeerBandwidth = in.ReadUInt32();
+    AckIntervalBytes = in.ReadUInt32();
+    LastUpdateBytes = in.ReadUInt64();
+    BytesPerSecond = in.ReadDouble();
+    RttUsec = in.ReadUInt32();
+    Stalls = in.ReadUInt64();
+
+    return !in.HasError() && AckIntervalBytes > 0;
+}
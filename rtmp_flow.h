@@ -0,0 +1,105 @@
+#ifndef RTMP_FLOW_H
+#define RTMP_FLOW_H
+
+#include "rtmp_parser.h"
+
+#include <cstdint>
+
+
+//------------------------------------------------------------------------------
+// RTMPFlowSettings
+
+// Acknowledgement window negotiated with each publisher
+struct RTMPFlowSettings {
+    // Sent after connect.  WindowAckSize is how often the publisher should ack
+    // us, PeerBandwidth is how many unacknowledged bytes it may have in flight
+    uint32_t WindowAckSize = 2500000;
+    uint32_t PeerBandwidth = 2500000;
+    int LimitType = LIMIT_DYNAMIC;
+    uint32_t ChunkSize = 60000;
+
+    // Acknowledge at least this often even if the publisher asks for a larger
+    // window.  0 = half of PeerBandwidth, so a publisher that enforces it is
+    // never left waiting for the ack that would unblock it
+    uint32_t AckIntervalBytes = 0;
+
+    // Measure each session's bitrate and RTT (TCP_INFO) and resize the
+    // windows to keep the publisher from stalling
+    bool Dynamic = false;
+
+    // Dynamic: Target time between acks, and how often to re-measure
+    int AckIntervalMsec = 50;
+    int UpdateIntervalMsec = 500;
+
+    // Dynamic: Bounds on the peer bandwidth sent
+    uint32_t MinWindowBytes = 256 * 1024;
+    uint32_t MaxWindowBytes = 64 * 1024 * 1024;
+
+    // A receive gap this long while the publisher is close to its peer
+    // bandwidth limit is reported as an ack stall
+    int StallThresholdMsec = 100;
+};
+
+
+//------------------------------------------------------------------------------
+// AckWindowController
+
+// Per-session flow control decisions, separate from the socket code.
+// Call CheckStall() after every recv(), and Update() when IsUpdateDue()
+class AckWindowController {
+public:
+    void Start(const RTMPFlowSettings& settings, uint64_t now_usec);
+
+    // wait_usec: Time blocked in recv().  unacked_bytes: Received but not yet
+    // acknowledged before it returned.  Returns true if the publisher was
+    // probably blocked waiting for an ack, so the caller should ack now
+    bool CheckStall(uint64_t wait_usec, uint64_t unacked_bytes);
+
+    bool IsUpdateDue(uint64_t now_usec) const;
+
+    // total_bytes: Received since the handshake.  rtt_usec: 0 if unknown.
+    // Returns true if the new windows should be sent to the publisher
+    bool Update(uint64_t now_usec, uint64_t total_bytes, uint32_t rtt_usec);
+
+    uint32_t GetWindowAckSize() const {
+        return WindowAckSize;
+    }
+    uint32_t GetPeerBandwidth() const {
+        return PeerBandwidth;
+    }
+    uint32_t GetAckIntervalBytes() const {
+        return AckIntervalBytes;
+    }
+    uint64_t GetLastGapUsec() const {
+        return LastGapUsec;
+    }
+    uint64_t GetBitrateBps() const {
+        return static_cast<uint64_t>( BytesPerSecond * 8.0 );
+    }
+
+    uint64_t Stalls = 0;
+
+    // Hot restart: Windows and rate estimate of a session handed to another
+    // receiver, which restores them over its own settings
+    void SaveState(ByteStreamWriter& out) const;
+    bool RestoreState(const RTMPFlowSettings& settings, uint64_t now_usec, ByteStream& in);
+
+private:
+    RTMPFlowSettings Settings;
+
+    uint32_t WindowAckSize = 0;
+    uint32_t PeerBandwidth = 0;
+    uint32_t AckIntervalBytes = 0;
+
+    // Set after a stall to grow the window at the next Update()
+    bool GrowPending = false;
+
+    uint64_t LastGapUsec = 0;
+
+    uint64_t LastUpdateUsec = 0;
+    uint64_t LastUpdateBytes = 0;
+    double BytesPerSecond = 0.0;
+    uint32_t RttUsec = 0;
+};
+
+#endif // RTMP_FLOW_H
@@ -0,0 +1,312 @@
+#include "rtmp_handoff.h"
+#include "rtmp_tools.h"
+#include "rtmp_log.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+using namespace std;
+
+// Larger payloads are rejected as malformed.  A session holds at most one
+// partly reassembled message per chunk stream
+static const uint32_t kMaxHandoffBytes = 256 * 1024 * 1024;
+
+struct HandoffHeader {
+    uint32_t Type;
+    uint32_t Bytes;
+};
+
+
+//------------------------------------------------------------------------------
+// Unix Sockets
+
+bool GetUnixAddress(const std::string& path, sockaddr_un& addr, socklen_t& addr_bytes)
+{
+    addr = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+
+    memcpy(addr.sun_path, path.data(), path.size());
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    }
+    addr_bytes = static_cast<socklen_t>( offsetof(sockaddr_un, sun_path) + path.size() );
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Handoff Messages
+
+// Waits for events on s until the deadline.  Returns false on timeout or error
+static bool WaitForSocket(int s, short events, uint64_t deadline_usec)
+{
+    for (;;) {
+        const uint64_t now_usec = GetMonotonicUsec();
+        if (now_usec >= deadline_usec) {
+            return false;
+        }
+
+        pollfd pfd{};
+        pfd.fd = s;
+        pfd.events = events;
+        const int result = poll(&pfd, 1, static_cast<int>( (deadline_usec - now_usec + 999) / 1000 ));
+        if (result > 0) {
+            return true;
+        }
+        if (result < 0 && errno != EINTR) {
+            perror("poll failed");
+            return false;
+        }
+    }
+}
+
+// The fd goes with the first byte sent
+static bool SendAll(int s, const uint8_t* data, size_t bytes, int fd, uint64_t deadline_usec)
+{
+    while (bytes > 0) {
+        iovec iov{};
+        iov.iov_base = const_cast<uint8_t*>( data );
+        iov.iov_len = bytes;
+
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        if (fd >= 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        const ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && WaitForSocket(s, POLLOUT, deadline_usec)) {
+                continue;
+            }
+            perror("sendmsg failed");
+            return false;
+        }
+
+        data += sent;
+        bytes -= static_cast<size_t>( sent );
+        fd = -1;
+    }
+    return true;
+}
+
+// Keeps the first fd that arrives in fd, and closes any other
+static bool ReceiveAll(int s, uint8_t* data, size_t bytes, int& fd, uint64_t deadline_usec)
+{
+    while (bytes > 0) {
+        iovec iov{};
+        iov.iov_base = data;
+        iov.iov_len = bytes;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        const ssize_t received = recvmsg(s, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && WaitForSocket(s, POLLIN, deadline_usec)) {
+                continue;
+            }
+            perror("recvmsg failed");
+            return false;
+        }
+        if (received == 0) {
+            return false; // Peer closed
+        }
+
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int received_fd = -1;
+            memcpy(&received_fd, CMSG_DATA(cmsg), sizeof(int));
+            if (fd < 0) {
+                fd = received_fd;
+            } else {
+                close(received_fd);
+            }
+        }
+        if (msg.msg_flags & MSG_CTRUNC) {
+            RTMP_LOG(RTMP_LOG_WARNING, "Hand off message carried more fds than expected");
+        }
+
+        data += received;
+        bytes -= static_cast<size_t>( received );
+    }
+    return true;
+}
+
+bool SendHandoffMessage(int s, uint32_t type, int fd, const void* data, size_t bytes, int timeout_msec)
+{
+    if (bytes > kMaxHandoffBytes) {
+        RTMP_LOG(RTMP_LOG_ERROR, "Hand off message of ", bytes, " bytes is too large");
+        return false;
+    }
+    const uint64_t deadline_usec = GetMonotonicUsec() + static_cast<uint64_t>( timeout_msec ) * 1000;
+
+    HandoffHeader header;
+    header.Type = type;
+    header.Bytes = static_cast<uint32_t>( bytes );
+
+    return SendAll(s, reinterpret_cast<const uint8_t*>( &header ), sizeof(header), fd, deadline_usec) &&
+        SendAll(s, static_cast<const uint8_t*>( data ), bytes, -1, deadline_usec);
+}
+
+bool ReceiveHandoffMessage(int s, HandoffMessage& message, int timeout_msec)
+{
+    const uint64_t deadline_usec = GetMonotonicUsec() + static_cast<uint64_t>( timeout_msec ) * 1000;
+
+    message = HandoffMessage();
+
+    // The header is read on its own so the fd with it is not mixed up with
+    // one sent with the next message
+    HandoffHeader header;
+    if (!ReceiveAll(s, reinterpret_cast<uint8_t*>( &header ), sizeof(header), message.Fd, deadline_usec) ||
+        header.Bytes > kMaxHandoffBytes)
+    {
+        if (message.Fd >= 0) {
+            close(message.Fd);
+            message.Fd = -1;
+        }
+        return false;
+    }
+    message.Type = header.Type;
+
+    // No fd travels with the payload
+    int unexpected_fd = -1;
+    message.Data.resize(header.Bytes);
+    const bool received = ReceiveAll(s, message.Data.data(), header.Bytes, unexpected_fd, deadline_usec);
+    if (unexpected_fd >= 0) {
+        close(unexpected_fd);
+    }
+    if (!received) {
+        if (message.Fd >= 0) {
+            close(message.Fd);
+            message.Fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+void WriteHandoffBytes(ByteStreamWriter& out, const void* data, size_t bytes)
+{
+    out.WriteUInt32(static_cast<uint32_t>( bytes ));
+    out.WriteData(data, bytes);
+}
+
+void WriteHandoffString(ByteStreamWriter& out, const std::string& value)
+{
+    WriteHandoffBytes(out, value.data(), value.size());
+}
+
+bool ReadHandoffBytes(ByteStream& in, const uint8_t*& data, uint32_t& bytes)
+{
+    bytes = in.ReadUInt32();
+    if (in.HasError() || bytes > static_cast<uint32_t>( in.RemainingBytes() )) {
+        return false;
+    }
+    data = in.ReadData(static_cast<int>( bytes ));
+    return true;
+}
+
+bool ReadHandoffString(ByteStream& in, std::string& value)
+{
+    const uint8_t* data = nullptr;
+    uint32_t bytes = 0;
+    if (!ReadHandoffBytes(in, data, bytes)) {
+        return false;
+    }
+    value.assign(reinterpret_cast<const char*>( data ), bytes);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Handoff Socket
+
+int ListenForSuccessor(const std::string& path)
+{
+    sockaddr_un addr;
+    socklen_t addr_bytes = 0;
+    if (!GetUnixAddress(path, addr, addr_bytes)) {
+        RTMP_LOG(RTMP_LOG_ERROR, "Invalid hand off socket path ", path);
+        return -1;
+    }
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    struct stat st;
+    if (path[0] != '@' && lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    if (::bind(s, reinterpret_cast<sockaddr*>( &addr ), addr_bytes) < 0 || listen(s, 1) < 0) {
+        perror("hand off socket failed");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+int ConnectToPredecessor(const std::string& path, int timeout_msec)
+{
+    sockaddr_un addr;
+    socklen_t addr_bytes = 0;
+    if (!GetUnixAddress(path, addr, addr_bytes)) {
+        RTMP_LOG(RTMP_LOG_ERROR, "Invalid hand off socket path ", path);
+        return -1;
+    }
+
+    const uint64_t deadline_usec = GetMonotonicUsec() + static_cast<uint64_t>( timeout_msec ) * 1000;
+    for (;;) {
+        int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s < 0) {
+            perror("socket failed");
+            return -1;
+        }
+        if (connect(s, reinterpret_cast<sockaddr*>( &addr ), addr_bytes) == 0) {
+            return s;
+        }
+        const int error = errno;
+        close(s);
+
+        // Not listening yet
+        if ((error != ENOENT && error != ECONNREFUSED) || GetMonotonicUsec() >= deadline_usec) {
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef RTMP_HANDOFF_H
+#define RTMP_HANDOFF_H
+
+#include "bytestream.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Unix Sockets
+
+// Fills addr for a Unix socket path, where a leading '@' is the abstract namespace
+bool GetUnixAddress(const std::string& path, sockaddr_un& addr, socklen_t& addr_bytes);
+
+
+//------------------------------------------------------------------------------
+// Handoff Messages
+
+// Hot restart: a running receiver hands its listening socket and live
+// sessions to the process replacing it over a Unix stream socket.  Each
+// message is a header carrying at most one fd (SCM_RIGHTS), then a payload:
+//
+//   HANDOFF_BEGIN    fd: Listening socket, if any.  Payload: kHandoffVersion
+//   HANDOFF_SESSION  fd: Client socket.  Payload: Connection and parser state
+//   HANDOFF_END      Payload: Number of sessions sent
+//
+// The sender has stopped reading every session before it sends the first
+// one, so each payload is the whole session between two recv() calls.  Both
+// ends are on the same machine, so the header is in host byte order
+
+static const uint32_t kHandoffVersion = 1;
+
+// How long either end waits for the other before giving up
+static const int kHandoffTimeoutMsec = 5000;
+
+enum HandoffMessageType : uint32_t {
+    HANDOFF_BEGIN = 1,
+    HANDOFF_SESSION = 2,
+    HANDOFF_END = 3
+};
+
+struct HandoffMessage {
+    uint32_t Type = 0;
+
+    // Received fd, owned by the caller, or -1
+    int Fd = -1;
+
+    std::vector<uint8_t> Data;
+};
+
+// fd: Sent with the message, or -1.  Returns false if the peer went away or
+// did not read within timeout_msec
+bool SendHandoffMessage(int s, uint32_t type, int fd, const void* data, size_t bytes, int timeout_msec);
+
+// Returns false on disconnect, a malformed message or timeout
+bool ReceiveHandoffMessage(int s, HandoffMessage& message, int timeout_msec);
+
+// Length-prefixed fields of the session payload.  The readers return false
+// if the field runs past the end
+void WriteHandoffBytes(ByteStreamWriter& out, const void* data, size_t bytes);
+void WriteHandoffString(ByteStreamWriter& out, const std::string& value);
+bool ReadHandoffBytes(ByteStream& in, const uint8_t*& data, uint32_t& bytes);
+bool ReadHandoffString(ByteStream& in, std::string& value);
+
+
+//------------------------------------------------------------------------------
+// Handoff Socket
+
+// Where a running process waits for the process that replaces it, which
+// connects with ConnectToPredecessor().  Pass each accepted socket to
+// RTMPReceiverBase::HandOff().  Replaces a stale socket file, so the successor
+// can listen at the same path once it has taken over.  -1 on failure
+int ListenForSuccessor(const std::string& path);
+
+// Connects a newly started process to the one it replaces, retrying until
+// it listens, for RTMPReceiverBase::TakeOver().  -1 on timeout
+int ConnectToPredecessor(const std::string& path, int timeout_msec);
+
+#endif // RTMP_HANDOFF_H
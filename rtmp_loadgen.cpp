@@ -0,0 +1,944 @@
+// Publishes a pre-encoded H.264 stream from N concurrent RTMP clients over
+// loopback into in-process receivers and reports how much they can ingest.
+// Each receiver serves all of its connections from one thread.
+//
+// Usage:
+//   rtmp_loadgen [options]
+//
+//   --publishers N     Concurrent publishers (default: 1)
+//   --file PATH        Annex B H.264 elementary stream (default: synthetic)
+//   --bitrate KBPS     Per-publisher bitrate (default: 5000, 0 = paced by --fps only)
+//   --fps N            Frame rate for timestamps and pacing (default: 30)
+//   --chunk-size N     RTMP chunk size (default: 4096)
+//   --fmt MODE         Chunk header compression: full, compressed, mixed (default: compressed)
+//   --c1-delay MSEC    Delay between sending C0 and C1 (default: 0)
+//   --c2-delay MSEC    Delay before sending C2 (default: 0)
+//   --duration SEC     Streaming time per round (default: 10)
+//   --rounds N         Reconnect all publishers N times (default: 1)
+//   --port N           First receiver port (default: 19350)
+//   --metrics-port N   Serve Prometheus metrics on localhost:N while running (default: off)
+//   --jitter MSEC      Delay each frame send by a random 0..MSEC (default: 0)
+//   --drift PPM        Run the publisher timestamp clock fast (+) or slow (-) (default: 0)
+//   --playout 0|1      Release frames through a PlayoutScheduler per publisher (default: 0)
+//   --peer-bandwidth N Receiver window ack size and peer bandwidth in bytes (default: 2500000)
+//   --dynamic-ack 0|1  Receiver adapts the windows to each session (default: 0)
+//   --honor-ack 0|1    Publishers stop sending at the peer bandwidth until acked (default: 0)
+//   --shared 0|1       All publishers share one receiver instead of one each (default: 0)
+//   --idle N           Sessions that publish but never send media, held open
+//                      on the first receiver for the whole run (default: 0)
+//   --short-writes N   Receivers send at most N bytes per call, to test partial
+//                      writes (default: 0 = off)
+//   --keys N           Publisher i publishes stream key "stream<i % N>", and
+//                      receivers only accept keys with a route (default: 0 =
+//                      all publish "stream" to the default route)
+//   --max-per-key N    With --keys: publishers admitted per key at once (default: 0 = unlimited)
+//   --key-max-kbps N   With --keys: bitrate cap per publisher (default: 0 = unlimited)
+//   --slow-callback USEC  Frame callback sleeps this long, as a slow consumer (default: 0)
+//   --backpressure KB  Queue frames for a delivery thread and throttle each
+//                      connection at this many KB, resuming at half (default: 0 = off)
+//   --pause 0|1        With --backpressure: Throttle by pausing reads (default: 1)
+//   --drop-after MSEC  With --backpressure: Drop to the next keyframe once paused this
+//                      long, or at once with --pause 0 (default: -1 = never)
+//   --transport T      tcp (127.0.0.1), tcp6 (::1), unix (abstract Unix socket per
+//                      receiver), or pair (socketpair() handed to AddConnection())
+//                      (default: tcp)
+//   --restart-after MSEC  Hand each receiver's listening socket and sessions
+//                      to a new receiver this far into every round, as a
+//                      hot restart under load (default: 0 = off)
+//   --loop MODE        Receiver wait: blocking (sleep in epoll_wait()), epoll-busy
+//                      (kernel busy polls in epoll_wait()) or busy (spin on
+//                      epoll_wait(), one core per receiver) (default: blocking)
+//   --busy-poll USEC   SO_BUSY_POLL on receiver sockets, and the epoll busy
+//                      poll time with --loop epoll-busy (default: 0)
+//   --prefer-busy-poll 0|1  SO_PREFER_BUSY_POLL on receiver sockets (default: 0)
+//   --rcvbuf N         Receiver SO_RCVBUF in bytes (default: 0 = kernel)
+//   --sndbuf N         Receiver SO_SNDBUF in bytes (default: 0 = kernel)
+//   --nodelay 0|1      TCP_NODELAY on receiver sockets (default: 0)
+//   --quickack 0|1     TCP_QUICKACK on receiver sockets after every read (default: 0)
+//   --recv-buffer N    Receiver bytes per recv() (default: 32768)
+
+#include "rtmp_receiver.h"
+#include "rtmp_publisher.h"
+#include "rtmp_playout.h"
+#include "rtmp_tools.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Options
+
+struct LoadOptions {
+    int Publishers = 1;
+    std::string File;
+    int BitrateKbps = 5000;
+    int Fps = 30;
+    int DurationSec = 10;
+    int Rounds = 1;
+    int Port = 19350;
+    int MetricsPort = 0;
+    int JitterMsec = 0;
+    int DriftPpm = 0;
+    bool Playout = false;
+    bool Shared = false;
+    int IdleSessions = 0;
+    int MaxSendBytes = 0;
+    int Keys = 0;
+    RTMPAdmissionLimits KeyLimits;
+    int SlowCallbackUsec = 0;
+    RTMPBackpressureSettings Backpressure;
+    std::string Transport = "tcp";
+    int RestartAfterMsec = 0;
+    RTMPSocketSettings Sockets;
+    // Receiver i is pinned to ReceiverCpus[i % size]
+    RTMPPlacementSettings Placement;
+
+    RTMPFlowSettings Flow;
+    RTMPPublisherSettings Settings;
+};
+
+static void PrintUsage() {
+    cout << "Usage: rtmp_loadgen [--publishers N] [--file PATH] [--bitrate KBPS] [--fps N] [--chunk-size N]" << endl;
+    cout << "                    [--fmt full|compressed|mixed] [--c1-delay MSEC] [--c2-delay MSEC]" << endl;
+    cout << "                    [--duration SEC] [--rounds N] [--port N] [--metrics-port N]" << endl;
+    cout << "                    [--jitter MSEC] [--drift PPM] [--playout 0|1]" << endl;
+    cout << "                    [--peer-bandwidth N] [--dynamic-ack 0|1] [--honor-ack 0|1]" << endl;
+    cout << "                    [--shared 0|1] [--idle N] [--short-writes N]" << endl;
+    cout << "                    [--keys N] [--max-per-key N] [--key-max-kbps N]" << endl;
+    cout << "                    [--slow-callback USEC] [--backpressure KB] [--pause 0|1] [--drop-after MSEC]" << endl;
+    cout << "                    [--transport tcp|tcp6|unix|pair] [--restart-after MSEC]" << endl;
+    cout << "                    [--loop blocking|epoll-busy|busy] [--busy-poll USEC] [--prefer-busy-poll 0|1]" << endl;
+    cout << "                    [--rcvbuf N] [--sndbuf N] [--nodelay 0|1] [--quickack 0|1] [--recv-buffer N]" << endl;
+    cout << "                    [--receiver-cpus LIST] [--delivery-cpus LIST] [--hugepages 0|1]" << endl;
+    cout << "                    [--arena MB] [--hugetlb 0|1]" << endl;
+}
+
+// With --shared, publisher i starts its timestamps at i * kPublisherTimestampSpan
+// so the receiver callback can tell which publisher sent a frame
+static const uint32_t kPublisherTimestampSpan = 10000000; // msec
+static const int kMaxSharedPublishers = 400;
+
+static bool ParseOptions(int argc, char** argv, LoadOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const std::string value = argv[++i];
+
+        if (arg == "--publishers") {
+            options.Publishers = atoi(value.c_str());
+        } else if (arg == "--file") {
+            options.File = value;
+        } else if (arg == "--bitrate") {
+            options.BitrateKbps = atoi(value.c_str());
+        } else if (arg == "--fps") {
+            options.Fps = atoi(value.c_str());
+        } else if (arg == "--chunk-size") {
+            options.Settings.ChunkSize = static_cast<uint32_t>( atoi(value.c_str()) );
+        } else if (arg == "--fmt") {
+            if (value == "full") {
+                options.Settings.FmtPattern = FMT_PATTERN_FULL;
+            } else if (value == "compressed") {
+                options.Settings.FmtPattern = FMT_PATTERN_COMPRESSED;
+            } else if (value == "mixed") {
+                options.Settings.FmtPattern = FMT_PATTERN_MIXED;
+            } else {
+                return false;
+            }
+        } else if (arg == "--c1-delay") {
+            options.Settings.C1DelayMsec = atoi(value.c_str());
+        } else if (arg == "--c2-delay") {
+            options.Settings.C2DelayMsec = atoi(value.c_str());
+        } else if (arg == "--duration") {
+            options.DurationSec = atoi(value.c_str());
+        } else if (arg == "--rounds") {
+            options.Rounds = atoi(value.c_str());
+        } else if (arg == "--port") {
+            options.Port = atoi(value.c_str());
+        } else if (arg == "--metrics-port") {
+            options.MetricsPort = atoi(value.c_str());
+        } else if (arg == "--jitter") {
+            options.JitterMsec = atoi(value.c_str());
+        } else if (arg == "--drift") {
+            options.DriftPpm = atoi(value.c_str());
+        } else if (arg == "--playout") {
+            options.Playout = atoi(value.c_str()) != 0;
+        } else if (arg == "--peer-bandwidth") {
+            options.Flow.PeerBandwidth = static_cast<uint32_t>( atoi(value.c_str()) );
+            options.Flow.WindowAckSize = options.Flow.PeerBandwidth;
+        } else if (arg == "--dynamic-ack") {
+            options.Flow.Dynamic = atoi(value.c_str()) != 0;
+        } else if (arg == "--honor-ack") {
+            options.Settings.HonorPeerBandwidth = atoi(value.c_str()) != 0;
+        } else if (arg == "--shared") {
+            options.Shared = atoi(value.c_str()) != 0;
+        } else if (arg == "--idle") {
+            options.IdleSessions = atoi(value.c_str());
+        } else if (arg == "--short-writes") {
+            options.MaxSendBytes = atoi(value.c_str());
+        } else if (arg == "--keys") {
+            options.Keys = atoi(value.c_str());
+        } else if (arg == "--max-per-key") {
+            options.KeyLimits.MaxPublishers = atoi(value.c_str());
+        } else if (arg == "--key-max-kbps") {
+            options.KeyLimits.MaxBitrateKbps = static_cast<uint32_t>( atoi(value.c_str()) );
+        } else if (arg == "--slow-callback") {
+            options.SlowCallbackUsec = atoi(value.c_str());
+        } else if (arg == "--backpressure") {
+            options.Backpressure.HighWatermarkBytes = static_cast<size_t>( atoi(value.c_str()) ) * 1024;
+            options.Backpressure.LowWatermarkBytes = options.Backpressure.HighWatermarkBytes / 2;
+        } else if (arg == "--pause") {
+            options.Backpressure.PauseReads = atoi(value.c_str()) != 0;
+        } else if (arg == "--drop-after") {
+            options.Backpressure.DropAfterMsec = atoi(value.c_str());
+        } else if (arg == "--transport") {
+            if (value != "tcp" && value != "tcp6" && value != "unix" && value != "pair") {
+                return false;
+            }
+            options.Transport = value;
+        } else if (arg == "--restart-after") {
+            options.RestartAfterMsec = atoi(value.c_str());
+        } else if (arg == "--loop") {
+            if (value == "blocking") {
+                options.Sockets.LoopMode = RTMP_LOOP_BLOCKING;
+            } else if (value == "epoll-busy") {
+                options.Sockets.LoopMode = RTMP_LOOP_EPOLL_BUSY_POLL;
+            } else if (value == "busy") {
+                options.Sockets.LoopMode = RTMP_LOOP_BUSY_POLL;
+            } else {
+                return false;
+            }
+        } else if (arg == "--busy-poll") {
+            options.Sockets.BusyPollUsec = atoi(value.c_str());
+        } else if (arg == "--prefer-busy-poll") {
+            options.Sockets.PreferBusyPoll = atoi(value.c_str()) != 0;
+        } else if (arg == "--rcvbuf") {
+            options.Sockets.ReceiveBufferBytes = atoi(value.c_str());
+        } else if (arg == "--sndbuf") {
+            options.Sockets.SendBufferBytes = atoi(value.c_str());
+        } else if (arg == "--nodelay") {
+            options.Sockets.NoDelay = atoi(value.c_str()) != 0;
+        } else if (arg == "--quickack") {
+            options.Sockets.QuickAck = atoi(value.c_str()) != 0;
+        } else if (arg == "--recv-buffer") {
+            options.Sockets.RecvBufferBytes = atoi(value.c_str());
+        } else if (arg == "--receiver-cpus") {
+            if (!ParseCpuList(value, options.Placement.ReceiverCpus)) {
+                return false;
+            }
+        } else if (arg == "--delivery-cpus") {
+            if (!ParseCpuList(value, options.Placement.DeliveryCpus)) {
+                return false;
+            }
+        } else if (arg == "--hugepages") {
+            options.Placement.HugePages = atoi(value.c_str()) != 0;
+        } else if (arg == "--arena") {
+            options.Placement.ArenaBytes = static_cast<size_t>( atoi(value.c_str()) ) * 1024 * 1024;
+        } else if (arg == "--hugetlb") {
+            options.Placement.HugeTlb = atoi(value.c_str()) != 0;
+        } else {
+            return false;
+        }
+    }
+
+    return options.Publishers > 0 && options.Fps > 0 && options.BitrateKbps >= 0 &&
+        options.Settings.ChunkSize >= 128 && options.DurationSec > 0 && options.Rounds > 0 &&
+        options.JitterMsec >= 0 && options.Flow.PeerBandwidth > 0 && options.IdleSessions >= 0 && options.MaxSendBytes >= 0 &&
+        options.Keys >= 0 && options.KeyLimits.MaxPublishers >= 0 && options.SlowCallbackUsec >= 0 && options.RestartAfterMsec >= 0 &&
+        options.Sockets.BusyPollUsec >= 0 && options.Sockets.RecvBufferBytes > 0 &&
+        (!options.Shared || options.Publishers <= kMaxSharedPublishers);
+}
+
+static const char* GetFmtPatternName(ChunkFmtPattern pattern) {
+    switch (pattern) {
+        case FMT_PATTERN_FULL: return "full";
+        case FMT_PATTERN_COMPRESSED: return "compressed";
+        case FMT_PATTERN_MIXED: return "mixed";
+        default: return "unknown";
+    }
+}
+
+static const char* GetLoopModeName(RTMPLoopMode mode) {
+    switch (mode) {
+        case RTMP_LOOP_BLOCKING: return "blocking";
+        case RTMP_LOOP_EPOLL_BUSY_POLL: return "epoll-busy";
+        case RTMP_LOOP_BUSY_POLL: return "busy";
+        default: return "unknown";
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// PublisherState
+
+// Shared between a publisher thread and the receiver callbacks for its port
+struct PublisherState {
+    std::mutex Lock;
+
+    // RTMP timestamp -> monotonic send time
+    std::unordered_map<uint32_t, uint64_t> SendUsec;
+
+    std::vector<uint64_t> LatencyUsec;
+    uint64_t FramesSent = 0;
+    uint64_t FramesReceived = 0;
+    uint64_t BytesReceived = 0;
+
+    // Set when the connection reached the publish state
+    uint64_t SetupUsec = 0;
+    uint64_t ReadyUsec = 0;
+    bool Failed = false;
+
+    // With --playout: released frame time minus its LocalPtsUsec, and the
+    // error in spacing between consecutive releases vs. their PTS spacing
+    std::vector<uint64_t> PlayoutDelayUsec;
+    std::vector<uint64_t> SpacingErrorUsec;
+    uint64_t LastReleaseUsec = 0;
+    int64_t LastLocalPtsUsec = 0;
+
+    // Publisher blocked waiting for acks (--honor-ack)
+    uint64_t AckWaits = 0;
+    uint64_t AckWaitUsec = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// Publisher Thread
+
+static std::string GetStreamKey(const LoadOptions& options, int index) {
+    if (options.Keys <= 0) {
+        return options.Settings.StreamKey;
+    }
+    return "stream" + std::to_string(index % options.Keys);
+}
+
+// User and system CPU time of every thread in the process
+static uint64_t GetProcessCpuUsec() {
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000 +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Listening socket of the receiver on port for --transport unix
+static std::string GetUnixSocketPath(int port) {
+    return "@rtmp_loadgen_" + std::to_string(port);
+}
+
+static RTMPListenSettings GetListenSettings(const LoadOptions& options, int port) {
+    RTMPListenSettings listen;
+    if (options.Transport == "tcp6") {
+        listen.BindAddress = "::1";
+    } else if (options.Transport == "unix") {
+        listen.Transport = RTMP_TRANSPORT_UNIX;
+        listen.UnixPath = GetUnixSocketPath(port);
+    } else if (options.Transport == "pair") {
+        listen.Transport = RTMP_TRANSPORT_NONE;
+    }
+    return listen;
+}
+
+// Connects to the receiver on port over the chosen transport
+static bool ConnectPublisher(
+    const LoadOptions& options,
+    RTMPPublisher& publisher,
+    RTMPReceiver& receiver,
+    int port,
+    const RTMPPublisherSettings& settings)
+{
+    if (options.Transport == "pair") {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+            return false;
+        }
+        if (!receiver.AddConnection(sockets[1])) {
+            close(sockets[0]); // The receiver closed its end
+            return false;
+        }
+        publisher.Attach(sockets[0], settings);
+        return true;
+    }
+
+    std::string host = "127.0.0.1";
+    if (options.Transport == "tcp6") {
+        host = "::1";
+    } else if (options.Transport == "unix") {
+        host = "unix:" + GetUnixSocketPath(port);
+    }
+    return publisher.Connect(host, port, settings);
+}
+
+static void RunPublisher(
+    const LoadOptions& options,
+    const H264Stream& video,
+    int index,
+    int port,
+    RTMPReceiver& receiver,
+    uint32_t timestamp_base,
+    uint64_t end_usec,
+    PublisherState& state,
+    std::atomic<uint64_t>& sent_bytes)
+{
+    RTMPPublisher publisher;
+
+    RTMPPublisherSettings settings = options.Settings;
+    settings.StreamKey = GetStreamKey(options, index);
+
+    const uint64_t t0 = GetMonotonicUsec();
+    if (!ConnectPublisher(options, publisher, receiver, port, settings) ||
+        !publisher.Handshake() ||
+        !publisher.Setup() ||
+        !publisher.SendVideoHeader(video.Extradata))
+    {
+        std::lock_guard<std::mutex> locker(state.Lock);
+        state.Failed = true;
+        return;
+    }
+    const uint64_t t1 = GetMonotonicUsec();
+    {
+        std::lock_guard<std::mutex> locker(state.Lock);
+        state.SetupUsec = t1 - t0;
+        state.ReadyUsec = t1;
+    }
+
+    const double frame_usec = 1000000.0 / options.Fps;
+    const double usec_per_byte = (options.BitrateKbps > 0) ? 8000.0 / options.BitrateKbps : 0.0;
+
+    double next_usec = static_cast<double>( t1 );
+    uint64_t frame_index = 0;
+
+    std::mt19937 rng(static_cast<uint32_t>( port ));
+    std::uniform_int_distribution<int> jitter_usec(0, options.JitterMsec * 1000);
+    const double timestamp_scale = 1.0 + options.DriftPpm / 1000000.0;
+
+    while (GetMonotonicUsec() < end_usec) {
+        const H264AccessUnit& frame = video.Frames[frame_index % video.Frames.size()];
+        const uint32_t timestamp = timestamp_base + static_cast<uint32_t>( frame_index * 1000 * timestamp_scale / options.Fps );
+
+        // Jitter delays this frame without shifting the schedule of later ones
+        const uint64_t send_usec = static_cast<uint64_t>( next_usec ) + (options.JitterMsec > 0 ? jitter_usec(rng) : 0);
+        const uint64_t now = GetMonotonicUsec();
+        if (send_usec > now) {
+            std::this_thread::sleep_for(std::chrono::microseconds(send_usec - now));
+        }
+
+        {
+            std::lock_guard<std::mutex> locker(state.Lock);
+            state.SendUsec[timestamp] = GetMonotonicUsec();
+            state.FramesSent++;
+        }
+
+        const uint64_t sent_before = publisher.SentBytes;
+        if (!publisher.SendVideo(frame.Keyframe, timestamp, frame.Avcc)) {
+            std::lock_guard<std::mutex> locker(state.Lock);
+            state.Failed = true;
+            break;
+        }
+        sent_bytes += publisher.SentBytes - sent_before;
+
+        publisher.DrainIncoming();
+
+        // Pace by bitrate if specified, otherwise by frame rate
+        if (usec_per_byte > 0.0) {
+            next_usec += frame.Avcc.size() * usec_per_byte;
+        } else {
+            next_usec += frame_usec;
+        }
+        ++frame_index;
+    }
+
+    {
+        std::lock_guard<std::mutex> locker(state.Lock);
+        state.AckWaits += publisher.AckWaits;
+        state.AckWaitUsec += publisher.AckWaitUsec;
+    }
+
+    publisher.Close();
+}
+
+
+//------------------------------------------------------------------------------
+// Report
+
+static uint64_t Percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>( p * (sorted.size() - 1) + 0.5 );
+    return sorted[index];
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char** argv) {
+    LoadOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return -1;
+    }
+
+    H264Stream video;
+    if (!options.File.empty()) {
+        if (!video.LoadAnnexB(options.File)) {
+            cout << "Failed to load H.264 elementary stream " << options.File << endl;
+            return -1;
+        }
+    } else {
+        const int bitrate_kbps = options.BitrateKbps > 0 ? options.BitrateKbps : 5000;
+        const int frame_bytes = bitrate_kbps * 1000 / 8 / options.Fps;
+        video.Synthesize(options.Fps * 10, options.Fps, frame_bytes, 1);
+    }
+
+    uint64_t video_bytes = 0;
+    for (const H264AccessUnit& frame : video.Frames) {
+        video_bytes += frame.Avcc.size();
+    }
+    cout << "Video: " << video.Frames.size() << " frames, average " << video_bytes / video.Frames.size() << " bytes"
+        << (options.File.empty() ? " (synthetic)" : "") << endl;
+
+    MetricsServer metrics_server;
+    if (options.MetricsPort > 0) {
+        if (!metrics_server.Start(&GetDefaultMetricsRegistry(), options.MetricsPort)) {
+            cout << "Failed to start metrics server on port " << options.MetricsPort << endl;
+            return -1;
+        }
+        cout << "Metrics: http://localhost:" << options.MetricsPort << "/metrics" << endl;
+    }
+
+    const int count = options.Publishers;
+
+    std::vector<std::unique_ptr<PublisherState>> states(count);
+    for (auto& state : states) {
+        state.reset(new PublisherState);
+    }
+
+    // Optional jitter buffer per publisher, drained by its own display thread
+    std::vector<std::unique_ptr<PlayoutScheduler>> schedulers(count);
+    std::vector<std::thread> release_threads;
+    std::atomic<bool> release_stop(false);
+    if (options.Playout) {
+        for (int i = 0; i < count; ++i) {
+            PublisherState* state = states[i].get();
+            PlayoutScheduler* scheduler = new PlayoutScheduler;
+            schedulers[i].reset(scheduler);
+
+            release_threads.emplace_back([state, scheduler, &release_stop]() {
+                auto emit = [state](const RTMPVideoFrame& frame) {
+                    const uint64_t now = GetMonotonicUsec();
+                    const int64_t delay = static_cast<int64_t>( now ) - frame.Clock.LocalPtsUsec;
+
+                    std::lock_guard<std::mutex> locker(state->Lock);
+                    state->PlayoutDelayUsec.push_back(delay > 0 ? delay : 0);
+                    if (state->LastReleaseUsec != 0) {
+                        const int64_t error = static_cast<int64_t>( now - state->LastReleaseUsec ) -
+                            (frame.Clock.LocalPtsUsec - state->LastLocalPtsUsec);
+                        state->SpacingErrorUsec.push_back(error >= 0 ? error : -error);
+                    }
+                    state->LastReleaseUsec = now;
+                    state->LastLocalPtsUsec = frame.Clock.LocalPtsUsec;
+                };
+
+                while (!release_stop) {
+                    scheduler->WaitAndRelease(emit, 100);
+                }
+            });
+        }
+    }
+
+    // handoff_socket: Take over from a running receiver instead of listening
+    auto start_receiver = [&options, &states, &schedulers](RTMPReceiver& receiver, int i, int handoff_socket) {
+        receiver.SetFlowSettings(options.Flow);
+        receiver.SetMaxSendBytes(options.MaxSendBytes);
+        receiver.SetBackpressure(options.Backpressure);
+        receiver.SetListen(GetListenSettings(options, options.Port + i));
+        receiver.SetSocketSettings(options.Sockets);
+
+        RTMPPlacementSettings placement = options.Placement;
+        if (!placement.ReceiverCpus.empty()) {
+            placement.ReceiverCpus = { options.Placement.ReceiverCpus[i % options.Placement.ReceiverCpus.size()] };
+        }
+        receiver.SetPlacement(placement);
+
+        RTMPSetupCallback setup_callback = [](uint32_t stream, RTMPSetupResult& result) {
+            UNUSED(stream);
+            UNUSED(result);
+        };
+        RTMPFrameCallback frame_callback = [i, &options, &states, &schedulers](const RTMPVideoFrame& frame) {
+            const int index = options.Shared ? static_cast<int>( frame.Timestamp / kPublisherTimestampSpan ) : i;
+            if (index >= static_cast<int>( states.size() )) {
+                return;
+            }
+            PublisherState* state = states[index].get();
+            PlayoutScheduler* scheduler = schedulers[index].get();
+
+            const uint64_t now = GetMonotonicUsec();
+            {
+                std::lock_guard<std::mutex> locker(state->Lock);
+                state->FramesReceived++;
+                state->BytesReceived += frame.Bytes;
+
+                auto iter = state->SendUsec.find(frame.Timestamp);
+                if (iter != state->SendUsec.end()) {
+                    state->LatencyUsec.push_back(now - iter->second);
+                    state->SendUsec.erase(iter);
+                }
+            }
+
+            if (scheduler) {
+                scheduler->Push(frame);
+            }
+
+            if (options.SlowCallbackUsec > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(options.SlowCallbackUsec));
+            }
+        };
+
+        // With --keys every key gets its own route and anything else is refused
+        if (options.Keys > 0) {
+            receiver.SetDefaultRoute(RTMPAdmissionLimits(), true);
+            for (int key = 0; key < options.Keys; ++key) {
+                receiver.AddRoute(options.Settings.App + "/" + GetStreamKey(options, key),
+                    setup_callback, frame_callback, options.KeyLimits);
+            }
+        }
+
+        if (handoff_socket >= 0 && !receiver.TakeOver(handoff_socket)) {
+            return false;
+        }
+        return receiver.Start(setup_callback, frame_callback, options.Port + i);
+    };
+
+    const int receiver_count = options.Shared ? 1 : count;
+    std::vector<std::unique_ptr<RTMPReceiver>> receivers(receiver_count);
+    for (int i = 0; i < receiver_count; ++i) {
+        receivers[i].reset(new RTMPReceiver);
+        start_receiver(*receivers[i], i, -1);
+    }
+
+    // Idle sessions stay connected to the first receiver for the whole run
+    std::vector<std::unique_ptr<RTMPPublisher>> idle_sessions;
+    if (options.IdleSessions > 0) {
+        const uint64_t idle_start = GetMonotonicUsec();
+        for (int i = 0; i < options.IdleSessions; ++i) {
+            std::unique_ptr<RTMPPublisher> idle(new RTMPPublisher);
+            RTMPPublisherSettings settings = options.Settings;
+            settings.StreamKey = GetStreamKey(options, i);
+            if (!ConnectPublisher(options, *idle, *receivers[0], options.Port, settings) ||
+                !idle->Handshake() ||
+                !idle->Setup())
+            {
+                cout << "Idle session " << i << " failed to connect" << endl;
+                break;
+            }
+            idle_sessions.push_back(std::move(idle));
+        }
+        cout << "Idle sessions: " << idle_sessions.size() << " open in "
+            << (GetMonotonicUsec() - idle_start) / 1000 << " msec" << endl;
+    }
+
+    std::atomic<uint64_t> sent_bytes(0);
+    uint64_t connections = 0, failures = 0;
+    double setup_wall_sec = 0.0, stream_wall_sec = 0.0;
+    uint64_t receiver_cpu_usec = 0, round_wall_usec = 0, process_cpu_usec = 0;
+    std::vector<uint64_t> setup_usec;
+
+    // --restart-after: Receivers that handed off, kept until the end since
+    // publishers over socketpairs were connected through them
+    std::vector<std::unique_ptr<RTMPReceiver>> retired_receivers;
+    uint64_t restarts = 0, restart_failures = 0;
+    std::vector<uint64_t> restart_usec;
+
+    for (int round = 0; round < options.Rounds; ++round) {
+        const uint64_t round_start = GetMonotonicUsec();
+        const uint64_t end_usec = round_start + options.DurationSec * 1000000ULL;
+
+        for (auto& state : states) {
+            std::lock_guard<std::mutex> locker(state->Lock);
+            state->SendUsec.clear();
+            state->ReadyUsec = 0;
+            state->Failed = false;
+            state->LastReleaseUsec = 0;
+        }
+
+        uint64_t cpu_start = 0;
+        const uint64_t process_cpu_start = GetProcessCpuUsec();
+        for (auto& receiver : receivers) {
+            cpu_start += receiver->GetThreadCpuUsec();
+        }
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < count; ++i) {
+            const int port = options.Shared ? options.Port : options.Port + i;
+            const uint32_t timestamp_base = options.Shared ? i * kPublisherTimestampSpan : 0;
+            threads.emplace_back(RunPublisher, std::cref(options), std::cref(video),
+                i, port, std::ref(*receivers[options.Shared ? 0 : i]), timestamp_base, end_usec, std::ref(*states[i]), std::ref(sent_bytes));
+        }
+
+        if (options.RestartAfterMsec > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.RestartAfterMsec));
+
+            for (int i = 0; i < receiver_count; ++i) {
+                int sockets[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+                    ++restart_failures;
+                    continue;
+                }
+
+                // Its thread stops with the hand off
+                const uint64_t predecessor_cpu_usec = receivers[i]->GetThreadCpuUsec();
+
+                const uint64_t restart_start = GetMonotonicUsec();
+                bool handed_off = false;
+                RTMPReceiver* predecessor = receivers[i].get();
+                std::thread handoff_thread([predecessor, &sockets, &handed_off]() {
+                    handed_off = predecessor->HandOff(sockets[0]);
+                });
+                std::unique_ptr<RTMPReceiver> successor(new RTMPReceiver);
+                const bool took_over = start_receiver(*successor, i, sockets[1]);
+                handoff_thread.join();
+                close(sockets[0]);
+                close(sockets[1]);
+
+                if (!handed_off || !took_over) {
+                    cout << "Hot restart of receiver " << i << " failed" << endl;
+                    ++restart_failures;
+                    continue;
+                }
+                restart_usec.push_back(GetMonotonicUsec() - restart_start);
+                ++restarts;
+
+                receiver_cpu_usec += predecessor_cpu_usec;
+                retired_receivers.push_back(std::move(receivers[i]));
+                receivers[i] = std::move(successor);
+            }
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        for (auto& receiver : receivers) {
+            receiver_cpu_usec += receiver->GetThreadCpuUsec();
+        }
+        receiver_cpu_usec -= cpu_start;
+        process_cpu_usec += GetProcessCpuUsec() - process_cpu_start;
+        round_wall_usec += GetMonotonicUsec() - round_start;
+
+        // Let the receivers finish delivering what was sent
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        uint64_t last_ready = round_start;
+        for (auto& state : states) {
+            std::lock_guard<std::mutex> locker(state->Lock);
+            if (state->Failed && state->ReadyUsec == 0) {
+                ++failures;
+                continue;
+            }
+            ++connections;
+            setup_usec.push_back(state->SetupUsec);
+            last_ready = std::max(last_ready, state->ReadyUsec);
+        }
+        setup_wall_sec += (last_ready - round_start) / 1000000.0;
+        stream_wall_sec += (end_usec - last_ready) / 1000000.0;
+    }
+
+    MetricsSnapshot metrics;
+    GetDefaultMetricsRegistry().Snapshot(metrics);
+    const int64_t active_sessions = metrics.ActiveSessions;
+
+    std::vector<RTMPPlacement> placements(receivers.size());
+    for (size_t i = 0; i < receivers.size(); ++i) {
+        receivers[i]->GetPlacement(placements[i]);
+    }
+
+    idle_sessions.clear();
+    for (auto& receiver : receivers) {
+        receiver->Stop();
+    }
+
+    release_stop = true;
+    for (auto& scheduler : schedulers) {
+        if (scheduler) {
+            scheduler->Stop();
+        }
+    }
+    for (auto& thread : release_threads) {
+        thread.join();
+    }
+
+    uint64_t frames_sent = 0, frames_received = 0, bytes_received = 0, ack_waits = 0, ack_wait_usec = 0;
+    std::vector<uint64_t> latency;
+    for (auto& state : states) {
+        frames_sent += state->FramesSent;
+        frames_received += state->FramesReceived;
+        bytes_received += state->BytesReceived;
+        ack_waits += state->AckWaits;
+        ack_wait_usec += state->AckWaitUsec;
+        latency.insert(latency.end(), state->LatencyUsec.begin(), state->LatencyUsec.end());
+    }
+    std::sort(latency.begin(), latency.end());
+    std::sort(setup_usec.begin(), setup_usec.end());
+
+    cout << std::fixed << std::setprecision(2);
+    cout << "Publishers: " << count << " receivers=" << receiver_count << " rounds=" << options.Rounds << " chunk_size=" << options.Settings.ChunkSize
+        << " fmt=" << GetFmtPatternName(options.Settings.FmtPattern) << " c1_delay=" << options.Settings.C1DelayMsec
+        << " c2_delay=" << options.Settings.C2DelayMsec << " loop=" << GetLoopModeName(options.Sockets.LoopMode) << endl;
+    cout << "Connections: " << connections << " ok, " << failures << " failed, "
+        << (setup_wall_sec > 0.0 ? connections / setup_wall_sec : 0.0) << " connections/s" << endl;
+    cout << "Setup usec: p50=" << Percentile(setup_usec, 0.5) << " p99=" << Percentile(setup_usec, 0.99) << endl;
+    cout << "Frames: sent=" << frames_sent << " received=" << frames_received << endl;
+    if (stream_wall_sec > 0.0) {
+        cout << "Throughput: sent " << sent_bytes * 8.0 / stream_wall_sec / 1000000.0 << " Mbps, receiver delivered "
+            << bytes_received * 8.0 / stream_wall_sec / 1000000.0 << " Mbps" << endl;
+    }
+    cout << "Publish-to-callback latency usec: p50=" << Percentile(latency, 0.5)
+        << " p99=" << Percentile(latency, 0.99)
+        << " max=" << Percentile(latency, 1.0) << endl;
+    if (round_wall_usec > 0) {
+        cout << "Receiver CPU: " << receiver_cpu_usec * 100.0 / round_wall_usec << "% of one core across "
+            << receiver_count << " thread(s), " << active_sessions << " sessions open at the end" << endl;
+        if (bytes_received > 0) {
+            // CPU seconds per Gbit delivered, which is also cores per Gbps.  The
+            // process total includes the publishers and the kernel work they
+            // cause, such as the TCP stack on loopback
+            const double gbits = bytes_received * 8.0 / 1000000000.0;
+            cout << "CPU per Gbps (" << options.Transport << "): receiver "
+                << std::setprecision(4) << receiver_cpu_usec / 1000000.0 / gbits
+                << " cores, whole process " << process_cpu_usec / 1000000.0 / gbits
+                << std::setprecision(2) << " cores" << endl;
+        }
+    }
+    if (options.RestartAfterMsec > 0) {
+        std::sort(restart_usec.begin(), restart_usec.end());
+        cout << "Hot restart: restarts=" << restarts << " failed=" << restart_failures
+            << " handed_off=" << metrics.Counters[METRIC_SESSIONS_HANDED_OFF]
+            << " adopted=" << metrics.Counters[METRIC_SESSIONS_ADOPTED]
+            << " lost_frames=" << static_cast<int64_t>( frames_sent - frames_received )
+            << " pause_usec p50=" << Percentile(restart_usec, 0.5)
+            << " max=" << Percentile(restart_usec, 1.0) << endl;
+    }
+    const bool placed = !options.Placement.ReceiverCpus.empty() || !options.Placement.DeliveryCpus.empty() ||
+        options.Placement.HugePages || options.Placement.HugeTlb || options.Placement.ArenaBytes > 0;
+    for (size_t i = 0; placed && i < placements.size() && i < 4; ++i) {
+        const RTMPPlacement& placement = placements[i];
+        cout << "Placement: receiver " << i << " cpus=" << FormatCpuList(placement.ReceiverCpus)
+            << " cpu=" << placement.ReceiverCpu << " node=" << placement.ReceiverNode
+            << " memory_node=" << placement.Memory.Node
+            << " hugepage_kb=" << placement.Memory.HugePageBytes / 1024;
+        if (options.Placement.ArenaBytes > 0) {
+            cout << " arena_kb reserved=" << placement.Memory.ReservedBytes / 1024
+                << " carved=" << placement.Memory.CarvedBytes / 1024
+                << " in_use=" << placement.Memory.InUseBytes / 1024
+                << " heap=" << placement.Memory.HeapBytes / 1024;
+        }
+        if (options.Backpressure.HighWatermarkBytes > 0) {
+            cout << " delivery cpus=" << FormatCpuList(placement.DeliveryCpus)
+                << " cpu=" << placement.DeliveryCpu << " node=" << placement.DeliveryNode;
+        }
+        cout << endl;
+    }
+    if (options.Settings.HonorPeerBandwidth) {
+        cout << "Publisher ack waits: " << ack_waits << ", " << ack_wait_usec / 1000.0 << " msec total" << endl;
+    }
+
+    if (options.Playout) {
+        PlayoutStats total;
+        double drift_ppm = 0.0;
+        std::vector<uint64_t> playout_delay, spacing_error;
+        for (int i = 0; i < count; ++i) {
+            PlayoutStats stats;
+            schedulers[i]->GetStats(stats);
+            total.TargetDelayUsec = std::max(total.TargetDelayUsec, stats.TargetDelayUsec);
+            total.JitterP99Usec = std::max(total.JitterP99Usec, stats.JitterP99Usec);
+            total.LateFrames += stats.LateFrames;
+            total.MaxLateUsec = std::max(total.MaxLateUsec, stats.MaxLateUsec);
+            drift_ppm += stats.DriftPpm / count;
+
+            PublisherState& state = *states[i];
+            playout_delay.insert(playout_delay.end(), state.PlayoutDelayUsec.begin(), state.PlayoutDelayUsec.end());
+            spacing_error.insert(spacing_error.end(), state.SpacingErrorUsec.begin(), state.SpacingErrorUsec.end());
+        }
+        std::sort(playout_delay.begin(), playout_delay.end());
+        std::sort(spacing_error.begin(), spacing_error.end());
+
+        cout << "Playout: target_delay_usec=" << total.TargetDelayUsec
+            << " jitter_p99_usec=" << total.JitterP99Usec
+            << " late=" << total.LateFrames
+            << " max_late_usec=" << total.MaxLateUsec
+            << " drift_ppm=" << drift_ppm << " (sent " << options.DriftPpm << ")" << endl;
+        cout << "Playout delay usec: p50=" << Percentile(playout_delay, 0.5)
+            << " p99=" << Percentile(playout_delay, 0.99) << endl;
+        cout << "Release spacing error usec: p50=" << Percentile(spacing_error, 0.5)
+            << " p99=" << Percentile(spacing_error, 0.99)
+            << " max=" << Percentile(spacing_error, 1.0) << endl;
+    }
+
+    GetDefaultMetricsRegistry().Snapshot(metrics);
+    cout << "Receiver metrics: chunks=" << metrics.Counters[METRIC_CHUNKS_PARSED]
+        << " reassembly_copied=" << metrics.Counters[METRIC_REASSEMBLY_BYTES]
+        << " acks=" << metrics.Counters[METRIC_ACKS_SENT]
+        << " ack_stalls=" << metrics.Counters[METRIC_ACK_STALLS]
+        << " window_updates=" << metrics.Counters[METRIC_WINDOW_UPDATES]
+        << " dropped=" << metrics.Counters[METRIC_FRAMES_DROPPED]
+        << " rejected=" << metrics.Counters[METRIC_PUBLISHES_REJECTED]
+        << " handshake_p50_usec=" << metrics.HandshakeUsec.Percentile(0.5) << endl;
+    if (options.Backpressure.HighWatermarkBytes > 0) {
+        cout << "Receiver backpressure: read_pauses=" << metrics.Counters[METRIC_READ_PAUSES]
+            << " throttled_msec=" << metrics.Counters[METRIC_THROTTLED_USEC] / 1000
+            << " frames_shed=" << metrics.Counters[METRIC_FRAMES_SHED] << endl;
+    }
+    if (metrics.AcceptToSetupUsec.Count > 0) {
+        cout << "Receiver accept to first setup callback usec: p50=" << metrics.AcceptToSetupUsec.Percentile(0.5)
+            << " p99=" << metrics.AcceptToSetupUsec.Percentile(0.99) << endl;
+    }
+
+    const uint64_t publishes = metrics.Counters[METRIC_PUBLISHES_STARTED];
+    if (publishes > 0) {
+        const uint64_t setup_recv = metrics.Counters[METRIC_SETUP_RECV_CALLS];
+        const uint64_t setup_send = metrics.Counters[METRIC_SETUP_SEND_CALLS];
+        cout << "Receiver syscalls per connection setup: " << (setup_recv + setup_send) / static_cast<double>( publishes )
+            << " (recv " << setup_recv / static_cast<double>( publishes )
+            << ", send " << setup_send / static_cast<double>( publishes ) << ")"
+            << " short_writes=" << metrics.Counters[METRIC_SHORT_WRITES] << endl;
+    }
+
+#ifdef RTMP_ENABLE_TRACING
+    RTMPLatencyStats total;
+    for (auto& receiver : receivers) {
+        RTMPLatencyStats stats;
+        receiver->GetLatencyStats(stats);
+        for (int i = 0; i < LATENCY_STAGE_COUNT; ++i) {
+            total.Stages[i].Merge(stats.Stages[i]);
+        }
+    }
+    cout << "Receiver stage latency usec:" << endl;
+    for (int i = 0; i < LATENCY_STAGE_COUNT; ++i) {
+        const LatencySnapshot& stage = total.Stages[i];
+        cout << "  " << std::left << std::setw(12) << GetLatencyStageName(i) << std::right
+            << " p50=" << stage.Percentile(0.5) / 1000.0
+            << " p99=" << stage.Percentile(0.99) / 1000.0
+            << " max=" << stage.Max / 1000.0 << endl;
+    }
+#endif // RTMP_ENABLE_TRACING
+
+    return 0;
+}
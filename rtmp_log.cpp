@@ -0,0 +1,328 @@
+#include "rtmp_log.h"
+#include "rtmp_tools.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Settings
+
+std::atomic<int> RTMPLogThreshold(RTMP_LOG_INFO);
+
+static std::atomic<int> LogRateLimit(10);
+
+const char* GetLogLevelName(int level) {
+    switch (level) {
+        case RTMP_LOG_TRACE: return "trace";
+        case RTMP_LOG_DEBUG: return "debug";
+        case RTMP_LOG_INFO: return "info";
+        case RTMP_LOG_WARNING: return "warning";
+        case RTMP_LOG_ERROR: return "error";
+        default: return "off";
+    }
+}
+
+void SetLogLevel(RTMPLogLevel level) {
+    RTMPLogThreshold.store(level, std::memory_order_relaxed);
+}
+
+void SetLogRateLimit(int messages_per_second) {
+    LogRateLimit.store(messages_per_second, std::memory_order_relaxed);
+}
+
+
+//------------------------------------------------------------------------------
+// RTMPLogSite
+
+bool RTMPLogSite::Allow(uint32_t& suppressed)
+{
+    const int limit = LogRateLimit.load(std::memory_order_relaxed);
+    if (limit <= 0) {
+        suppressed = Suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    const uint64_t now_msec = GetMonotonicUsec() / 1000;
+
+    uint64_t window_start = WindowStartMsec.load(std::memory_order_relaxed);
+    if (now_msec - window_start >= 1000) {
+        // One thread starts the new window
+        if (WindowStartMsec.compare_exchange_strong(window_start, now_msec, std::memory_order_relaxed)) {
+            WindowCount.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    if (WindowCount.fetch_add(1, std::memory_order_relaxed) >= static_cast<uint32_t>( limit )) {
+        Suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    suppressed = Suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// AsyncLogger
+
+// Bounded multi-producer ring with a sequence number per slot, drained by one
+// background thread
+class AsyncLogger {
+public:
+    static const uint64_t kSlotCount = 1024;
+
+    AsyncLogger();
+    ~AsyncLogger();
+
+    LogRecord* Begin(int level, uint32_t suppressed);
+    void End(LogRecord* record);
+
+    void SetSink(RTMPLogSink sink);
+    void Flush();
+
+    std::atomic<uint64_t> Dropped = ATOMIC_VAR_INIT(0);
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> Sequence;
+        LogRecord Record;
+    };
+
+    std::unique_ptr<Slot[]> Slots;
+
+    std::atomic<uint64_t> EnqueuePosition = ATOMIC_VAR_INIT(0);
+    std::atomic<uint64_t> DequeuePosition = ATOMIC_VAR_INIT(0);
+
+    // Everything before this position has been handed to the sink and flushed
+    std::atomic<uint64_t> WrittenPosition = ATOMIC_VAR_INIT(0);
+
+    // Signalled when WrittenPosition advances while FlushWaiters > 0
+    std::mutex FlushLock;
+    std::condition_variable FlushCondition;
+    std::atomic<int> FlushWaiters = ATOMIC_VAR_INIT(0);
+
+    std::mutex SinkLock;
+    RTMPLogSink Sink;
+
+    // Producers only take the lock to wake the consumer if it is sleeping
+    std::mutex WakeLock;
+    std::condition_variable WakeCondition;
+    std::atomic<bool> Sleeping = ATOMIC_VAR_INIT(false);
+    bool WakeRequested = false;
+
+    std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
+    std::thread Thread;
+
+    void Loop();
+    void DrainAvailable();
+    void Wake();
+};
+
+AsyncLogger::AsyncLogger()
+    : Slots(new Slot[kSlotCount])
+{
+    for (uint64_t i = 0; i < kSlotCount; ++i) {
+        Slots[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+
+    Thread = std::thread(&AsyncLogger::Loop, this);
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    Terminated = true;
+    Wake();
+    if (Thread.joinable()) {
+        Thread.join();
+    }
+}
+
+LogRecord* AsyncLogger::Begin(int level, uint32_t suppressed)
+{
+    uint64_t position = EnqueuePosition.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    for (;;) {
+        slot = &Slots[position % kSlotCount];
+        const uint64_t sequence = slot->Sequence.load(std::memory_order_acquire);
+        const int64_t diff = static_cast<int64_t>( sequence - position );
+
+        if (diff == 0) {
+            if (EnqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            Dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr; // Full
+        } else {
+            position = EnqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    LogRecord& record = slot->Record;
+    record.Level = level;
+    record.Suppressed = suppressed;
+    record.ArgCount = 0;
+    record.TextUsed = 0;
+    record.Position = position;
+    return &record;
+}
+
+void AsyncLogger::End(LogRecord* record)
+{
+    Slot& slot = Slots[record->Position % kSlotCount];
+    slot.Sequence.store(record->Position + 1, std::memory_order_release);
+
+    if (Sleeping.load(std::memory_order_relaxed)) {
+        Wake();
+    }
+}
+
+void AsyncLogger::Wake()
+{
+    std::lock_guard<std::mutex> locker(WakeLock);
+    WakeRequested = true;
+    WakeCondition.notify_one();
+}
+
+void AsyncLogger::SetSink(RTMPLogSink sink)
+{
+    std::lock_guard<std::mutex> locker(SinkLock);
+    Sink = sink;
+}
+
+void AsyncLogger::Flush()
+{
+    const uint64_t target = EnqueuePosition.load(std::memory_order_acquire);
+
+    FlushWaiters++;
+    Wake();
+
+    std::unique_lock<std::mutex> locker(FlushLock);
+    while (WrittenPosition.load(std::memory_order_acquire) < target) {
+        FlushCondition.wait_for(locker, std::chrono::milliseconds(10));
+    }
+
+    FlushWaiters--;
+}
+
+static void FormatRecord(const LogRecord& record, std::string& message)
+{
+    std::ostringstream out;
+
+    for (int i = 0; i < record.ArgCount; ++i) {
+        const LogArg& arg = record.Args[i];
+        switch (arg.Type) {
+            case LOG_ARG_INT: out << arg.Int; break;
+            case LOG_ARG_UINT: out << arg.UInt; break;
+            case LOG_ARG_FLOAT: out << arg.Float; break;
+            case LOG_ARG_TEXT: out.write(record.Text + arg.Offset, arg.Length); break;
+            default: break;
+        }
+    }
+
+    if (record.Suppressed > 0) {
+        out << " (" << record.Suppressed << " similar messages suppressed)";
+    }
+
+    message = out.str();
+}
+
+void AsyncLogger::DrainAvailable()
+{
+    bool wrote_default = false;
+    std::string message;
+
+    for (;;) {
+        const uint64_t position = DequeuePosition.load(std::memory_order_relaxed);
+        Slot& slot = Slots[position % kSlotCount];
+
+        if (slot.Sequence.load(std::memory_order_acquire) != position + 1) {
+            break; // Empty, or the producer has not finished writing
+        }
+
+        FormatRecord(slot.Record, message);
+        const RTMPLogLevel level = static_cast<RTMPLogLevel>( slot.Record.Level );
+
+        // Release the slot before calling the sink
+        slot.Sequence.store(position + kSlotCount, std::memory_order_release);
+        DequeuePosition.store(position + 1, std::memory_order_release);
+
+        std::lock_guard<std::mutex> locker(SinkLock);
+        if (Sink) {
+            Sink(level, message);
+        } else {
+            std::cout << message << '\n';
+            wrote_default = true;
+        }
+    }
+
+    // Flush once per batch rather than per message
+    if (wrote_default) {
+        std::cout.flush();
+    }
+    WrittenPosition.store(DequeuePosition.load(std::memory_order_relaxed), std::memory_order_release);
+
+    if (FlushWaiters.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> locker(FlushLock);
+        FlushCondition.notify_all();
+    }
+}
+
+void AsyncLogger::Loop()
+{
+    for (;;) {
+        DrainAvailable();
+
+        if (Terminated) {
+            DrainAvailable();
+            return;
+        }
+
+        // Producers may skip the wake-up, so poll as a fallback
+        std::unique_lock<std::mutex> locker(WakeLock);
+        Sleeping = true;
+        WakeCondition.wait_for(locker, std::chrono::milliseconds(10), [this]() {
+            return WakeRequested;
+        });
+        WakeRequested = false;
+        Sleeping = false;
+    }
+}
+
+static AsyncLogger& GetAsyncLogger()
+{
+    static AsyncLogger logger;
+    return logger;
+}
+
+
+//------------------------------------------------------------------------------
+// API
+
+LogRecord* BeginLogRecord(int level, uint32_t suppressed) {
+    return GetAsyncLogger().Begin(level, suppressed);
+}
+
+void EndLogRecord(LogRecord* record) {
+    GetAsyncLogger().End(record);
+}
+
+void SetLogSink(RTMPLogSink sink) {
+    GetAsyncLogger().SetSink(sink);
+}
+
+void FlushLog() {
+    GetAsyncLogger().Flush();
+}
+
+uint64_t GetLogDroppedCount() {
+    return GetAsyncLogger().Dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,196 @@
+#ifndef RTMP_LOG_H
+#define RTMP_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <type_traits>
+
+
+//------------------------------------------------------------------------------
+// Logging
+
+// Messages are captured into a lock-free ring on the calling thread and
+// formatted and written by a background thread, so a misbehaving stream can
+// never stall ingest on terminal I/O.  Each call site is rate limited and
+// reports how many messages it suppressed.
+//
+//   RTMP_LOG(RTMP_LOG_WARNING, "No video data for stream ", stream);
+//
+// When the level is disabled the cost is one relaxed atomic load and branch.
+
+enum RTMPLogLevel {
+    RTMP_LOG_TRACE = 0,
+    RTMP_LOG_DEBUG = 1,
+    RTMP_LOG_INFO = 2,
+    RTMP_LOG_WARNING = 3,
+    RTMP_LOG_ERROR = 4,
+    RTMP_LOG_OFF = 5
+};
+
+const char* GetLogLevelName(int level);
+
+// Default: RTMP_LOG_INFO
+void SetLogLevel(RTMPLogLevel level);
+
+// Messages per second allowed from each call site.  Default: 10, 0 = unlimited
+void SetLogRateLimit(int messages_per_second);
+
+// Called on the background thread with the formatted message (no newline).
+// Default writes to std::cout.  Pass nullptr to restore the default
+using RTMPLogSink = std::function<void(RTMPLogLevel level, const std::string& message)>;
+void SetLogSink(RTMPLogSink sink);
+
+// Blocks until everything logged so far has been written to the sink
+void FlushLog();
+
+// Messages lost because the ring was full
+uint64_t GetLogDroppedCount();
+
+extern std::atomic<int> RTMPLogThreshold;
+
+inline bool IsLogEnabled(RTMPLogLevel level) {
+    return static_cast<int>( level ) >= RTMPLogThreshold.load(std::memory_order_relaxed);
+}
+
+#define RTMP_LOG(level, ...) \
+    do { \
+        if (IsLogEnabled(level)) { \
+            static RTMPLogSite rtmp_log_site; \
+            uint32_t rtmp_log_suppressed = 0; \
+            if (rtmp_log_site.Allow(rtmp_log_suppressed)) { \
+                WriteLog(level, rtmp_log_suppressed, __VA_ARGS__); \
+            } \
+        } \
+    } while (false)
+
+
+//------------------------------------------------------------------------------
+// Implementation Details
+
+// Per call site rate limiter
+class RTMPLogSite {
+public:
+    // Returns false if the message should be suppressed.  Otherwise sets
+    // suppressed to the number of messages dropped since the last one
+    bool Allow(uint32_t& suppressed);
+
+private:
+    std::atomic<uint64_t> WindowStartMsec = ATOMIC_VAR_INIT(0);
+    std::atomic<uint32_t> WindowCount = ATOMIC_VAR_INIT(0);
+    std::atomic<uint32_t> Suppressed = ATOMIC_VAR_INIT(0);
+};
+
+enum LogArgType {
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_FLOAT,
+    LOG_ARG_TEXT
+};
+
+struct LogArg {
+    uint8_t Type;
+    uint16_t Offset, Length; // LOG_ARG_TEXT: Location in LogRecord::Text
+    union {
+        int64_t Int;
+        uint64_t UInt;
+        double Float;
+    };
+};
+
+static const int kLogMaxArgs = 12;
+static const int kLogTextBytes = 192;
+
+// Arguments are stored unformatted; strings are copied (and truncated) into Text
+struct LogRecord {
+    int Level = 0;
+    uint32_t Suppressed = 0;
+    int ArgCount = 0;
+    int TextUsed = 0;
+    LogArg Args[kLogMaxArgs];
+    char Text[kLogTextBytes];
+
+    // Ring position, used by EndLogRecord()
+    uint64_t Position = 0;
+};
+
+// Returns nullptr if the ring is full
+LogRecord* BeginLogRecord(int level, uint32_t suppressed);
+void EndLogRecord(LogRecord* record);
+
+inline void LogAppendText(LogRecord& record, const char* text, size_t length) {
+    if (record.ArgCount >= kLogMaxArgs) {
+        return;
+    }
+    const size_t available = static_cast<size_t>( kLogTextBytes - record.TextUsed );
+    if (length > available) {
+        length = available;
+    }
+    LogArg& arg = record.Args[record.ArgCount++];
+    arg.Type = LOG_ARG_TEXT;
+    arg.Offset = static_cast<uint16_t>( record.TextUsed );
+    arg.Length = static_cast<uint16_t>( length );
+    memcpy(record.Text + record.TextUsed, text, length);
+    record.TextUsed += static_cast<int>( length );
+}
+
+inline void LogAppend(LogRecord& record, const char* text) {
+    LogAppendText(record, text, strlen(text));
+}
+inline void LogAppend(LogRecord& record, const std::string& text) {
+    LogAppendText(record, text.data(), text.size());
+}
+inline void LogAppend(LogRecord& record, bool value) {
+    LogAppend(record, value ? "true" : "false");
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+LogAppend(LogRecord& record, T value) {
+    if (record.ArgCount >= kLogMaxArgs) {
+        return;
+    }
+    LogArg& arg = record.Args[record.ArgCount++];
+    if (std::is_signed<T>::value || std::is_enum<T>::value) {
+        arg.Type = LOG_ARG_INT;
+        arg.Int = static_cast<int64_t>( value );
+    } else {
+        arg.Type = LOG_ARG_UINT;
+        arg.UInt = static_cast<uint64_t>( value );
+    }
+}
+
+template<typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type
+LogAppend(LogRecord& record, T value) {
+    if (record.ArgCount >= kLogMaxArgs) {
+        return;
+    }
+    LogArg& arg = record.Args[record.ArgCount++];
+    arg.Type = LOG_ARG_FLOAT;
+    arg.Float = static_cast<double>( value );
+}
+
+inline void LogAppendAll(LogRecord& record) {
+    (void)record;
+}
+
+template<typename T, typename... Args>
+inline void LogAppendAll(LogRecord& record, const T& first, const Args&... rest) {
+    LogAppend(record, first);
+    LogAppendAll(record, rest...);
+}
+
+template<typename... Args>
+void WriteLog(RTMPLogLevel level, uint32_t suppressed, const Args&... args) {
+    LogRecord* record = BeginLogRecord(level, suppressed);
+    if (!record) {
+        return;
+    }
+    LogAppendAll(*record, args...);
+    EndLogRecord(record);
+}
+
+#endif // RTMP_LOG_H
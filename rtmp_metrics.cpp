@@ -0,0 +1,348 @@
+#include "rtmp_metrics.h"
+
+#include "rtmp_parser.h"
+#include "rtmp_tools.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+const char* GetMetricCounterName(int counter) {
+    switch (counter) {
+        case METRIC_BYTES_RECEIVED: return "bytes_received";
+        case METRIC_CHUNKS_PARSED: return "chunks_parsed";
+        case METRIC_REASSEMBLY_BYTES: return "reassembly_bytes_copied";
+        case METRIC_ACKS_SENT: return "acks_sent";
+        case METRIC_ACK_STALLS: return "ack_stalls";
+        case METRIC_WINDOW_UPDATES: return "window_updates";
+        case METRIC_FRAMES_DELIVERED: return "frames_delivered";
+        case METRIC_KEYFRAMES_DELIVERED: return "keyframes_delivered";
+        case METRIC_FRAMES_DROPPED: return "frames_dropped";
+        case METRIC_CONNECTIONS_ACCEPTED: return "connections_accepted";
+        case METRIC_HANDSHAKES_COMPLETED: return "handshakes_completed";
+        case METRIC_HANDSHAKES_FAILED: return "handshakes_failed";
+        case METRIC_PUBLISHES_STARTED: return "publishes_started";
+        case METRIC_RECV_CALLS: return "recv_calls";
+        case METRIC_SEND_CALLS: return "send_calls";
+        case METRIC_SHORT_WRITES: return "short_writes";
+        case METRIC_SETUP_RECV_CALLS: return "setup_recv_calls";
+        case METRIC_SETUP_SEND_CALLS: return "setup_send_calls";
+        case METRIC_PUBLISHES_REJECTED: return "publishes_rejected";
+        case METRIC_PUBLISHER_TAKEOVERS: return "publisher_takeovers";
+        case METRIC_SESSIONS_TIMED_OUT: return "sessions_timed_out";
+        case METRIC_READ_PAUSES: return "read_pauses";
+        case METRIC_THROTTLED_USEC: return "throttled_usec";
+        case METRIC_FRAMES_SHED: return "frames_shed";
+        case METRIC_SESSIONS_HANDED_OFF: return "sessions_handed_off";
+        case METRIC_SESSIONS_ADOPTED: return "sessions_adopted";
+        default: return "unknown";
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MetricsRegistry
+
+MetricsRegistry::MetricsRegistry()
+{
+    for (int i = 0; i < kMetricShardCount; ++i) {
+        for (int j = 0; j < METRIC_COUNTER_COUNT; ++j) {
+            Shards[i].Counters[j].store(0, std::memory_order_relaxed);
+        }
+        for (int j = 0; j < kMetricPacketTypes; ++j) {
+            Shards[i].Messages[j].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+int MetricsRegistry::GetThreadShardIndex()
+{
+    static std::atomic<unsigned> next_index(0);
+    static thread_local int index = static_cast<int>( next_index++ % kMetricShardCount );
+    return index;
+}
+
+void MetricsRegistry::SetStreamGauges(const StreamGauges& gauges)
+{
+    const auto key = std::make_tuple(gauges.Port, gauges.Connection, gauges.Stream);
+
+    std::lock_guard<std::mutex> locker(StreamsLock);
+    Streams[key] = gauges;
+}
+
+void MetricsRegistry::RemoveStreams(int port, uint32_t connection)
+{
+    std::lock_guard<std::mutex> locker(StreamsLock);
+    for (auto iter = Streams.begin(); iter != Streams.end();) {
+        if (iter->second.Port == port && iter->second.Connection == connection) {
+            iter = Streams.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+void MetricsRegistry::Snapshot(MetricsSnapshot& snapshot) const
+{
+    for (int j = 0; j < METRIC_COUNTER_COUNT; ++j) {
+        snapshot.Counters[j] = 0;
+    }
+    for (int j = 0; j < kMetricPacketTypes; ++j) {
+        snapshot.Messages[j] = 0;
+    }
+
+    for (int i = 0; i < kMetricShardCount; ++i) {
+        for (int j = 0; j < METRIC_COUNTER_COUNT; ++j) {
+            snapshot.Counters[j] += Shards[i].Counters[j].load(std::memory_order_relaxed);
+        }
+        for (int j = 0; j < kMetricPacketTypes; ++j) {
+            snapshot.Messages[j] += Shards[i].Messages[j].load(std::memory_order_relaxed);
+        }
+    }
+
+    snapshot.ActiveSessions = ActiveSessions.load(std::memory_order_relaxed);
+    HandshakeUsec.Snapshot(snapshot.HandshakeUsec);
+    AcceptToSetupUsec.Snapshot(snapshot.AcceptToSetupUsec);
+
+    std::lock_guard<std::mutex> locker(StreamsLock);
+    snapshot.Streams.clear();
+    for (const auto& entry : Streams) {
+        snapshot.Streams.push_back(entry.second);
+    }
+}
+
+std::string MetricsRegistry::FormatPrometheus() const
+{
+    MetricsSnapshot snapshot;
+    Snapshot(snapshot);
+
+    std::ostringstream out;
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+        const std::string name = std::string("rtmp_") + GetMetricCounterName(i) + "_total";
+        out << "# TYPE " << name << " counter\n";
+        out << name << " " << snapshot.Counters[i] << "\n";
+    }
+
+    out << "# TYPE rtmp_messages_total counter\n";
+    for (int i = 0; i < kMetricPacketTypes; ++i) {
+        if (snapshot.Messages[i] != 0) {
+            out << "rtmp_messages_total{type=\"" << GetPacketTypeName(i) << "\"} " << snapshot.Messages[i] << "\n";
+        }
+    }
+
+    out << "# TYPE rtmp_active_sessions gauge\n";
+    out << "rtmp_active_sessions " << snapshot.ActiveSessions << "\n";
+
+    const double quantiles[] = { 0.5, 0.9, 0.99 };
+    const LatencySnapshot& handshake = snapshot.HandshakeUsec;
+    out << "# TYPE rtmp_handshake_duration_seconds summary\n";
+    for (double q : quantiles) {
+        out << "rtmp_handshake_duration_seconds{quantile=\"" << q << "\"} " << handshake.Percentile(q) / 1000000.0 << "\n";
+    }
+    out << "rtmp_handshake_duration_seconds_sum " << handshake.Sum / 1000000.0 << "\n";
+    out << "rtmp_handshake_duration_seconds_count " << handshake.Count << "\n";
+
+    const LatencySnapshot& accept_to_setup = snapshot.AcceptToSetupUsec;
+    out << "# TYPE rtmp_accept_to_setup_seconds summary\n";
+    for (double q : quantiles) {
+        out << "rtmp_accept_to_setup_seconds{quantile=\"" << q << "\"} " << accept_to_setup.Percentile(q) / 1000000.0 << "\n";
+    }
+    out << "rtmp_accept_to_setup_seconds_sum " << accept_to_setup.Sum / 1000000.0 << "\n";
+    out << "rtmp_accept_to_setup_seconds_count " << accept_to_setup.Count << "\n";
+
+    out << "# TYPE rtmp_stream_bitrate_bps gauge\n";
+    for (const StreamGauges& stream : snapshot.Streams) {
+        out << "rtmp_stream_bitrate_bps{port=\"" << stream.Port << "\",connection=\"" << stream.Connection << "\",stream=\"" << stream.Stream << "\"} " << stream.BitrateBps << "\n";
+    }
+    out << "# TYPE rtmp_stream_keyframe_interval_seconds gauge\n";
+    for (const StreamGauges& stream : snapshot.Streams) {
+        out << "rtmp_stream_keyframe_interval_seconds{port=\"" << stream.Port << "\",connection=\"" << stream.Connection << "\",stream=\"" << stream.Stream << "\"} " << stream.KeyframeIntervalMsec / 1000.0 << "\n";
+    }
+    out << "# TYPE rtmp_stream_throttled_seconds counter\n";
+    for (const StreamGauges& stream : snapshot.Streams) {
+        out << "rtmp_stream_throttled_seconds{port=\"" << stream.Port << "\",connection=\"" << stream.Connection << "\",stream=\"" << stream.Stream << "\"} " << stream.ThrottledUsec / 1000000.0 << "\n";
+    }
+
+    return out.str();
+}
+
+MetricsRegistry& GetDefaultMetricsRegistry()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+
+//------------------------------------------------------------------------------
+// MetricsServer
+
+bool MetricsServer::Start(MetricsRegistry* registry, int port)
+{
+    Registry = registry;
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket failed");
+        return false;
+    }
+
+    int optval = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt failed");
+        close(s);
+        return false;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (::bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        perror("bind failed");
+        close(s);
+        return false;
+    }
+
+    if (listen(s, 8) < 0) {
+        perror("listen failed");
+        close(s);
+        return false;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ControlSock) < 0) {
+        perror("socketpair failed");
+        close(s);
+        return false;
+    }
+
+    ServerSocket = s;
+    Thread = std::make_shared<std::thread>(&MetricsServer::Loop, this);
+
+    return true;
+}
+
+void MetricsServer::Stop()
+{
+    if (!Thread) {
+        return; // Not running
+    }
+
+    char stop = 's';
+    if (write(ControlSock[1], &stop, sizeof(stop)) < 0) {
+        perror("write failed");
+    }
+
+    if (Thread->joinable()) {
+        Thread->join();
+    }
+    Thread = nullptr;
+
+    close(ControlSock[0]);
+    close(ControlSock[1]);
+    close(ServerSocket);
+    ServerSocket = -1;
+}
+
+void MetricsServer::Loop()
+{
+    for (;;) {
+        fd_set readfds;
+        const int maxfd = max(ServerSocket, ControlSock[0]);
+
+        FD_ZERO(&readfds);
+        FD_SET(ServerSocket, &readfds);
+        FD_SET(ControlSock[0], &readfds);
+
+        if (select(maxfd + 1, &readfds, nullptr, nullptr, nullptr) < 0) {
+            perror("select failed");
+            return;
+        }
+
+        if (FD_ISSET(ControlSock[0], &readfds)) {
+            return; // Stopped
+        }
+
+        if (FD_ISSET(ServerSocket, &readfds)) {
+            int cs = accept(ServerSocket, nullptr, nullptr);
+            if (cs < 0) {
+                perror("accept failed");
+                continue;
+            }
+
+            AutoClose clientSocketCloser([&]() {
+                close(cs);
+            });
+
+            HandleClient(cs);
+        }
+    }
+}
+
+// Do not let a stuck scraper block the listener or Stop()
+static const int kClientTimeoutMsec = 1000;
+
+bool MetricsServer::WaitForClient(int client_socket, short events)
+{
+    pollfd fds[2]{};
+    fds[0].fd = client_socket;
+    fds[0].events = events;
+    fds[1].fd = ControlSock[0];
+    fds[1].events = POLLIN;
+
+    const int result = poll(fds, 2, kClientTimeoutMsec);
+    return result > 0 && fds[1].revents == 0 && fds[0].revents != 0;
+}
+
+void MetricsServer::HandleClient(int client_socket)
+{
+    // Read the request headers.  The request itself is not interpreted
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        if (!WaitForClient(client_socket, POLLIN)) {
+            return;
+        }
+        ssize_t bytes = recv(client_socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (bytes <= 0) {
+            return;
+        }
+        request.append(buffer, static_cast<size_t>( bytes ));
+    }
+
+    const std::string body = Registry->FormatPrometheus();
+
+    std::ostringstream response;
+    response << "HTTP/1.0 200 OK\r\n"
+        << "Content-Type: text/plain; version=0.0.4\r\n"
+        << "Content-Length: " << body.size() << "\r\n"
+        << "Connection: close\r\n\r\n"
+        << body;
+    const std::string text = response.str();
+
+    size_t sent = 0;
+    while (sent < text.size()) {
+        if (!WaitForClient(client_socket, POLLOUT)) {
+            return;
+        }
+        ssize_t bytes = send(client_socket, text.data() + sent, text.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes <= 0) {
+            return;
+        }
+        sent += static_cast<size_t>( bytes );
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef RTMP_METRICS_H
+#define RTMP_METRICS_H
+
+#include "rtmp_trace.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Definitions
+
+enum MetricCounter {
+    METRIC_BYTES_RECEIVED,
+    METRIC_CHUNKS_PARSED,
+    METRIC_REASSEMBLY_BYTES, // Bytes copied to reassemble multi-chunk messages
+    METRIC_ACKS_SENT,
+    METRIC_ACK_STALLS, // Publisher probably blocked waiting for an ack
+    METRIC_WINDOW_UPDATES, // Ack windows re-sent in dynamic mode
+    METRIC_FRAMES_DELIVERED,
+    METRIC_KEYFRAMES_DELIVERED,
+    METRIC_FRAMES_DROPPED,
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_HANDSHAKES_COMPLETED,
+    METRIC_HANDSHAKES_FAILED,
+    METRIC_PUBLISHES_STARTED,
+    METRIC_RECV_CALLS,
+    METRIC_SEND_CALLS,
+    METRIC_SHORT_WRITES, // Sends that left part of the output queued
+    METRIC_SETUP_RECV_CALLS, // recv() calls from accept to publish
+    METRIC_SETUP_SEND_CALLS, // sendmsg() calls from accept to publish
+    METRIC_PUBLISHES_REJECTED, // Unknown stream key, admission limit or bitrate cap
+    METRIC_PUBLISHER_TAKEOVERS, // Publishers replaced by a new one on the same key
+    METRIC_SESSIONS_TIMED_OUT, // Sessions closed by the no-media timer
+    METRIC_READ_PAUSES, // Connections paused by backpressure
+    METRIC_THROTTLED_USEC, // Time connections spent paused
+    METRIC_FRAMES_SHED, // Frames dropped by the backpressure drop policy
+    METRIC_SESSIONS_HANDED_OFF, // Sessions sent to a successor by HandOff()
+    METRIC_SESSIONS_ADOPTED, // Sessions taken over from a predecessor
+    METRIC_COUNTER_COUNT
+};
+
+// Messages are counted by RTMPPacketType.  Larger type ids are counted as 0
+static const int kMetricPacketTypes = 32;
+
+// Hot-path counters are spread over this many shards, assigned to threads
+// round robin
+static const int kMetricShardCount = 32;
+
+const char* GetMetricCounterName(int counter);
+
+// Per-stream gauges, updated about once a second by the receiver
+struct StreamGauges {
+    int Port = 0;
+    uint32_t Connection = 0;
+    uint32_t Stream = 0;
+
+    double BitrateBps = 0.0;
+
+    // RTMP timestamp distance between the last two keyframes
+    uint32_t KeyframeIntervalMsec = 0;
+
+    // Time the connection's reads were paused by backpressure, in total
+    uint64_t ThrottledUsec = 0;
+};
+
+struct MetricsSnapshot {
+    uint64_t Counters[METRIC_COUNTER_COUNT];
+    uint64_t Messages[kMetricPacketTypes];
+
+    int64_t ActiveSessions = 0;
+
+    // Accept to C2 verified
+    LatencySnapshot HandshakeUsec;
+
+    // Accept to the first stream's parameters (setup callback)
+    LatencySnapshot AcceptToSetupUsec;
+
+    std::vector<StreamGauges> Streams;
+};
+
+
+//------------------------------------------------------------------------------
+// MetricsRegistry
+
+// Each thread increments the shard it was assigned, so the relaxed atomics
+// rarely contend.  Beyond kMetricShardCount threads some share a shard, which
+// is still correct but reduces rather than eliminates contention.  Snapshot()
+// sums all the shards.
+class MetricsRegistry {
+public:
+    MetricsRegistry();
+
+    void Add(MetricCounter counter, uint64_t value = 1) {
+        GetShard().Counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+    void AddMessage(int type_id) {
+        if (type_id < 0 || type_id >= kMetricPacketTypes) {
+            type_id = 0;
+        }
+        GetShard().Messages[type_id].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void AddActiveSessions(int64_t delta) {
+        ActiveSessions.fetch_add(delta, std::memory_order_relaxed);
+    }
+    void RecordHandshakeUsec(uint64_t usec) {
+        HandshakeUsec.Record(usec);
+    }
+    void RecordAcceptToSetupUsec(uint64_t usec) {
+        AcceptToSetupUsec.Record(usec);
+    }
+
+    void SetStreamGauges(const StreamGauges& gauges);
+    // Called when a connection closes
+    void RemoveStreams(int port, uint32_t connection);
+
+    void Snapshot(MetricsSnapshot& snapshot) const;
+
+    // Prometheus text exposition format (version 0.0.4)
+    std::string FormatPrometheus() const;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> Counters[METRIC_COUNTER_COUNT];
+        std::atomic<uint64_t> Messages[kMetricPacketTypes];
+    };
+
+    Shard Shards[kMetricShardCount];
+
+    std::atomic<int64_t> ActiveSessions = ATOMIC_VAR_INIT(0);
+    LatencyHistogram HandshakeUsec;
+    LatencyHistogram AcceptToSetupUsec;
+
+    mutable std::mutex StreamsLock;
+    // Keyed by (port, connection, stream)
+    std::map<std::tuple<int, uint32_t, uint32_t>, StreamGauges> Streams;
+
+    Shard& GetShard() {
+        return Shards[GetThreadShardIndex()];
+    }
+
+    static int GetThreadShardIndex();
+};
+
+// Registry used by RTMPReceiver unless another is provided
+MetricsRegistry& GetDefaultMetricsRegistry();
+
+
+//------------------------------------------------------------------------------
+// MetricsServer
+
+// Minimal HTTP listener serving GET /metrics from a registry.  Binds to
+// localhost only.  Every request is answered with the Prometheus text.
+class MetricsServer {
+public:
+    ~MetricsServer() {
+        Stop();
+    }
+
+    bool Start(MetricsRegistry* registry, int port = 9935);
+    void Stop();
+
+private:
+    MetricsRegistry* Registry = nullptr;
+    int ServerSocket = -1;
+
+    // Shutdown control socket
+    int ControlSock[2];
+
+    std::shared_ptr<std::thread> Thread;
+
+    void Loop();
+    void HandleClient(int client_socket);
+
+    // Returns false on timeout or Stop()
+    bool WaitForClient(int client_socket, short events);
+};
+
+#endif // RTMP_METRICS_H
@@ -0,0 +1,134 @@
+#include "rtmp_output.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <cstring>
+
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// OutputQueue
+
+// More than enough for the responses to one recv()
+static const int kMaxIovecs = 64;
+
+void OutputQueue::Append(const void* data, int bytes)
+{
+    if (bytes <= 0) {
+        return;
+    }
+
+    const size_t offset = Storage.size();
+    Storage.resize(offset + bytes);
+    memcpy(Storage.data() + offset, data, bytes);
+
+    // Consecutive copies share one iovec
+    if (Entries.size() > Head && !Entries.back().Data &&
+        Entries.back().Offset + Entries.back().Bytes == offset)
+    {
+        Entries.back().Bytes += bytes;
+    } else {
+        Entries.push_back(Entry{ nullptr, offset, static_cast<size_t>( bytes ) });
+    }
+    QueuedBytes += bytes;
+}
+
+void OutputQueue::AppendStatic(const void* data, int bytes)
+{
+    if (bytes <= 0) {
+        return;
+    }
+
+    Entries.push_back(Entry{ static_cast<const uint8_t*>( data ), 0, static_cast<size_t>( bytes ) });
+    QueuedBytes += bytes;
+}
+
+OutputQueue::FlushResult OutputQueue::Flush(int fd)
+{
+    while (Head < Entries.size()) {
+        iovec iov[kMaxIovecs];
+        int iov_count = 0;
+        size_t limit = MaxSendBytes > 0 ? static_cast<size_t>( MaxSendBytes ) : QueuedBytes;
+        size_t attempted = 0;
+
+        for (size_t i = Head; i < Entries.size() && iov_count < kMaxIovecs && limit > 0; ++i) {
+            const Entry& entry = Entries[i];
+            const uint8_t* data = entry.Data ? entry.Data : Storage.data() + entry.Offset;
+            size_t bytes = entry.Bytes;
+            if (i == Head) {
+                data += HeadSent;
+                bytes -= HeadSent;
+            }
+            if (bytes > limit) {
+                bytes = limit;
+            }
+
+            iov[iov_count].iov_base = const_cast<uint8_t*>( data );
+            iov[iov_count].iov_len = bytes;
+            ++iov_count;
+            attempted += bytes;
+            limit -= bytes;
+        }
+
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        const ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        ++SendCalls;
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return FLUSH_AGAIN;
+            }
+            return FLUSH_ERROR;
+        }
+
+        // Advance past what the socket took
+        size_t remaining = static_cast<size_t>( sent );
+        QueuedBytes -= remaining;
+        while (remaining > 0) {
+            const size_t left = Entries[Head].Bytes - HeadSent;
+            if (remaining < left) {
+                HeadSent += remaining;
+                break;
+            }
+            remaining -= left;
+            ++Head;
+            HeadSent = 0;
+        }
+
+        // Edge-triggered sockets only signal writable again after EAGAIN, so
+        // keep going until the queue is empty or the socket says it is full
+        const bool injected = MaxSendBytes > 0 && Head < Entries.size();
+        if (static_cast<size_t>( sent ) < attempted || injected) {
+            ++ShortWrites;
+        }
+    }
+
+    Clear();
+    return FLUSH_DONE;
+}
+
+void OutputQueue::Clear()
+{
+    Entries.clear();
+    Storage.clear();
+    Head = 0;
+    HeadSent = 0;
+    QueuedBytes = 0;
+}
+
+void OutputQueue::CopyQueued(std::vector<uint8_t>& out) const
+{
+    for (size_t i = Head; i < Entries.size(); ++i) {
+        const Entry& entry = Entries[i];
+        const uint8_t* data = entry.Data ? entry.Data : Storage.data() + entry.Offset;
+        const size_t skip = (i == Head) ? HeadSent : 0;
+        out.insert(out.end(), data + skip, data + entry.Bytes);
+    }
+}
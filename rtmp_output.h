@@ -0,0 +1,72 @@
+#ifndef RTMP_OUTPUT_H
+#define RTMP_OUTPUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// OutputQueue
+
+// Messages waiting to be sent on a non-blocking socket.  Everything queued
+// while handling one recv() is sent by a single sendmsg() with one iovec per
+// message, and a short write resumes from the first unsent byte
+class OutputQueue {
+public:
+    enum FlushResult {
+        FLUSH_DONE, // Queue is empty
+        FLUSH_AGAIN, // Socket is full: wait until writable and flush again
+        FLUSH_ERROR // Connection failed
+    };
+
+    // Copies the message into the queue
+    void Append(const void* data, int bytes);
+
+    // Queues the message without copying.  It must stay valid and unchanged
+    // until the queue is flushed or cleared
+    void AppendStatic(const void* data, int bytes);
+
+    bool IsEmpty() const {
+        return Entries.empty();
+    }
+    size_t GetQueuedBytes() const {
+        return QueuedBytes;
+    }
+
+    // Sends as much as the socket takes with one sendmsg()
+    FlushResult Flush(int fd);
+
+    void Clear();
+
+    // Appends the bytes not yet sent, in order, e.g. to hand them to another
+    // process that continues the connection
+    void CopyQueued(std::vector<uint8_t>& out) const;
+
+    // Testing: Sends at most this many bytes per call, to exercise short
+    // writes.  0 = no limit
+    int MaxSendBytes = 0;
+
+    // sendmsg() calls, and those that sent less than was queued
+    uint64_t SendCalls = 0;
+    uint64_t ShortWrites = 0;
+
+private:
+    struct Entry {
+        // Static data, or null if the bytes are in Storage at Offset
+        const uint8_t* Data;
+        size_t Offset;
+        size_t Bytes;
+    };
+
+    std::vector<Entry> Entries;
+    std::vector<uint8_t> Storage;
+
+    // Next entry to send, and bytes of it already sent
+    size_t Head = 0;
+    size_t HeadSent = 0;
+
+    size_t QueuedBytes = 0;
+};
+
+#endif // RTMP_OUTPUT_H
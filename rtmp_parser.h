@@ -6,6 +6,14 @@
 #include <cstdint>
 #include <memory>
 #include <unordered_map>
+#include <cassert>
+
+#include "rtmp_trace.h"
+#include "rtmp_metrics.h"
+#include "rtmp_log.h"
+#include "rtmp_tools.h"
+#include "rtmp_arena.h"
+#include "bytestream.h"
 
 
 //------------------------------------------------------------------------------
@@ -85,6 +93,9 @@ enum AvcPacketType {
 
 static const int kRtmpS0ServerVersion = 3;
 
+// Message header size for each chunk fmt, not counting an extended timestamp
+static const int kChunkMessageHeaderBytes[4] = { 11, 7, 3, 0 };
+
 
 //------------------------------------------------------------------------------
 // Tools
@@ -97,8 +108,16 @@ public:
     void StoreRemaining(const uint8_t* data, int bytes);
     void Clear();
 
+    // Draw buffers from arena instead of the heap.  Call while empty
+    void SetArena(BufferArena* arena);
+
+    // Bytes kept for the next Continue(), e.g. the start of a truncated chunk
+    const ArenaBytes& GetRemaining() const {
+        return Buffers[BufferIndex];
+    }
+
 protected:
-    std::vector<uint8_t> Buffers[2];
+    ArenaBytes Buffers[2];
     int BufferIndex = 0;
 };
 
@@ -141,30 +160,86 @@ struct RTMPHeader {
 };
 
 struct RTMPChunk {
+    explicit RTMPChunk(BufferArena* arena = nullptr)
+        : AccumulatedData(ArenaAllocator<uint8_t>(arena))
+    {
+    }
+
     RTMPHeader header;
 
+    // Timestamp field and resolved delta of the last chunk, reused by type 3 chunks
+    uint32_t TimestampField = 0;
+    uint32_t TimestampDelta = 0;
+
+    // recv() that completed the first chunk of the message being accumulated
+    RTMP_TRACE(uint64_t FirstRecvNsec = 0;)
+
     // Accumulated data from previous ChunkSize chunks
-    std::vector<uint8_t> AccumulatedData;
+    ArenaBytes AccumulatedData;
+};
+
+// Fields of an AMF0 command or data message that the receiver acts on
+struct RTMPCommand {
+    // COMMAND_AMF0 or DATA_AMF0
+    int Type = 0;
+
+    // e.g. "connect", "publish", "onStatus" or "@setDataFrame"
+    std::string Name;
+
+    // Transaction number
+    double Number = 0;
+
+    // First string argument, e.g. the stream key of publish or
+    // "onMetaData" for @setDataFrame
+    std::string Argument;
+
+    // connect: From the command object
+    std::string App;
+    std::string TcUrl;
+
+    // onStatus: From the info object
+    std::string Level;
+    std::string Code;
+
+    // onMetaData: Declared video bitrate in kbps, or 0 if not given
+    double VideoDataRate = 0;
 };
 
 class RTMPHandler {
 public:
-    // Server should send a chunk acknowledgement
+    // Server should send a chunk acknowledgement with this sequence number
     virtual void OnNeedAck(uint32_t bytes) = 0;
 
-    // Server should send a COMMAND_AMF0 acknowledgement
-    virtual void OnMessage(const std::string& name, double number) = 0;
+    // An AMF0 command (to answer) or data message arrived
+    virtual void OnMessage(const RTMPCommand& command) = 0;
 
-    virtual void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes) = 0;
+    virtual void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace) = 0;
 };
 
-class RTMPSession {
+// Parses chunks into messages, handles protocol control messages itself and
+// passes commands and video to the handler.
+//
+// HandlerType provides OnNeedAck(), OnMessage() and OnAvccVideo() as in
+// RTMPHandler.  RTMPSession calls them through RTMPHandler's virtual
+// functions; instantiating with a concrete type calls them directly so they
+// can be inlined into the parser.
+template <class HandlerType>
+class BasicRTMPSession {
 public:
     RollingBuffer* Buffer = nullptr;
-    RTMPHandler* Handler = nullptr;
+    HandlerType* Handler = nullptr;
+
+    // Optional: Counts chunks, messages and reassembly copies
+    MetricsRegistry* Metrics = nullptr;
+
+    // Optional: Reassembly buffers come from here instead of the heap
+    BufferArena* Arena = nullptr;
 
     bool ParseChunk(const void* data, int bytes);
 
+    // Set to the recv() completion time before calling ParseChunk()
+    RTMP_TRACE(uint64_t RecvNsec = 0;)
+
     void OnMessage(const RTMPHeader& header, const uint8_t* data, int bytes);
 
     uint32_t ChunkSize = 128; // default chunk size
@@ -173,10 +248,419 @@ public:
     uint32_t MaxUnackedBytes = 0;
     int LimitType = 0;
 
+    // Ack at least this often even if the peer's WindowAckSize is larger.  0 = peer's window only
+    uint32_t AckIntervalBytes = 0;
+
+    // Acknowledge everything received so far
+    void SendAck();
+
+    // Bytes parsed since the handshake
+    uint64_t GetReceivedBytes() const {
+        return ReceivedBytes;
+    }
+    uint64_t GetUnackedBytes() const {
+        return ReceivedBytes - AckedBytes;
+    }
+
+    // Hot restart: Writes everything parsed so far that later chunks depend
+    // on, between two ParseChunk() calls, and reads it into a new session so
+    // it continues mid-stream.  RestoreState() returns false if malformed
+    void SaveState(ByteStreamWriter& out) const;
+    bool RestoreState(ByteStream& in);
+
 private:
-    std::unordered_map<uint32_t, std::shared_ptr<RTMPChunk>> chunk_streams; // Active chunk streams
+    std::unordered_map<uint32_t, std::unique_ptr<RTMPChunk>> chunk_streams; // Active chunk streams
 
-    uint32_t ReceivedBytes = 0;
+    // Acks carry the low 32 bits of the total
+    uint64_t ReceivedBytes = 0;
+    uint64_t AckedBytes = 0;
+
+    // Stage timestamps for the message passed to OnMessage()
+    RTMPFrameTrace Trace;
 };
 
+using RTMPSession = BasicRTMPSession<RTMPHandler>;
+
+
+//------------------------------------------------------------------------------
+// AMF0
+
+// Logs the values in an AMF0 data message at trace level
+void TraceAmf0Data(const uint8_t* data, int bytes);
+
+// Reads the fields of RTMPCommand from an AMF0 command or data message.
+// Sets everything but Type
+void ParseAmf0Command(const uint8_t* data, int bytes, RTMPCommand& command);
+
+
+//------------------------------------------------------------------------------
+// BasicRTMPSession
+
+template <class HandlerType>
+bool BasicRTMPSession<HandlerType>::ParseChunk(const void* data, int bytes)
+{
+    const uint8_t* buffer = reinterpret_cast<const uint8_t*>(data);
+
+    // Continue from previous buffer if available
+    Buffer->Continue(buffer, bytes);
+
+    ByteStream stream(buffer, bytes);
+
+    //RTMP_LOG(RTMP_LOG_TRACE, "Received chunk bytes: ", bytes);
+    //PrintFirst64BytesAsHex(buffer, bytes);
+
+    while (!stream.IsEndOfStream()) {
+        // Store the start of this chunk in case it is truncated
+        const uint8_t* start_data = stream.PeekData();
+        int start_remaining = stream.RemainingBytes();
+
+        RTMPHeader head;
+
+        uint8_t basic_header = start_data[0];
+        head.fmt = (basic_header >> 6) & 0x03;
+        head.cs_id = basic_header & 0x3F; // Simplified, real logic for cs_id > 64 is omitted
+
+        // The first byte gives the header size, so it is checked once and the
+        // fields are read without bounds checks
+        const int cs_id_bytes = (head.cs_id == 0) ? 1 : (head.cs_id == 1) ? 2 : 0;
+        if (start_remaining < 1 + cs_id_bytes + kChunkMessageHeaderBytes[head.fmt]) {
+            Buffer->StoreRemaining(start_data, start_remaining);
+            return false;
+        }
+
+        stream.ReadUInt8Unchecked();
+        if (head.cs_id == 0) {
+            head.cs_id = stream.ReadUInt8Unchecked() + 64;
+        } else if (head.cs_id == 1) {
+            head.cs_id = stream.ReadUInt16Unchecked() + 64;
+        }
+
+        RTMPChunk* prev_chunk = nullptr;
+        auto iter = chunk_streams.find(head.cs_id);
+        if (iter != chunk_streams.end()) {
+            prev_chunk = iter->second.get();
+        }
+
+        // Parse message header based on fmt
+        head.timestamp = 0;
+        uint32_t timestamp_field = 0;
+
+        if (head.fmt <= 2) {
+            timestamp_field = stream.ReadUInt24Unchecked();
+            if (head.fmt <= 1) {
+                head.length = stream.ReadUInt24Unchecked();
+                head.type_id = stream.ReadUInt8Unchecked();
+                if (head.fmt == 0) {
+                    head.stream_id = stream.ReadUInt32Unchecked(false/*this is the only field...*/);
+                } else if (prev_chunk) {
+                    head.stream_id = prev_chunk->header.stream_id;
+                }
+            }
+            if (head.fmt == 2 && prev_chunk) {
+                head.stream_id = prev_chunk->header.stream_id;
+                head.length = prev_chunk->header.length;
+                head.type_id = prev_chunk->header.type_id;
+            }
+        } else if (head.fmt == 3 && prev_chunk) {
+            timestamp_field = prev_chunk->TimestampField;
+            head.length = prev_chunk->header.length;
+            head.type_id = prev_chunk->header.type_id;
+            head.stream_id = prev_chunk->header.stream_id;
+        }
+
+        // Check for extended timestamp.  Type 3 chunks repeat it if the previous chunk had one
+        uint32_t timestamp_delta = timestamp_field;
+        if (timestamp_field == 0xFFFFFF) {
+            timestamp_delta = stream.ReadUInt32();
+        }
+
+        if (head.fmt == 0) {
+            head.timestamp = timestamp_delta; // Absolute
+        } else if (prev_chunk) {
+            head.timestamp = prev_chunk->header.timestamp;
+
+            // Type 3 chunks continuing a message share its timestamp, otherwise the delta applies again
+            const bool continuation = (head.fmt == 3 && !prev_chunk->AccumulatedData.empty());
+            if (continuation) {
+                timestamp_delta = prev_chunk->TimestampDelta;
+            } else {
+                head.timestamp += timestamp_delta;
+            }
+        }
+
+        if (stream.HasError()) {
+            // Have not finished receiving the chunk header so save until more data arrives.
+            Buffer->StoreRemaining(start_data, start_remaining);
+            return false;
+        }
+
+        assert(head.fmt >= 0 && head.fmt <= 3);
+        assert(head.cs_id > 1);
+
+        RTMP_LOG(RTMP_LOG_TRACE, "Chunk: fmt=", (int)head.fmt, " cs=", head.cs_id, " len=", head.length, " type=", (int)head.type_id, " stream=", head.stream_id);
+
+        // If message fits in a single chunk, then attempt to read it directly.
+        uint32_t expected_bytes = head.length;
+        assert(ChunkSize > 0);
+        if (expected_bytes > ChunkSize) {
+            if (prev_chunk) {
+                const uint32_t accumulated = static_cast<uint32_t>( prev_chunk->AccumulatedData.size() );
+                if (accumulated < expected_bytes) {
+                    expected_bytes -= accumulated;
+                }
+            }
+            if (expected_bytes > ChunkSize) {
+                expected_bytes = ChunkSize;
+            }
+        }
+
+        assert(expected_bytes > 0 && expected_bytes <= ChunkSize);
+        const uint8_t* chunk_data = stream.ReadData(static_cast<int>( expected_bytes ));
+        if (stream.HasError()) {
+            //RTMP_LOG(RTMP_LOG_TRACE, "Received chunk partial (waiting for more) on cs=", head.cs_id);
+            // Have not finished receiving the current chunk so save until more data arrives.
+            Buffer->StoreRemaining(start_data, start_remaining);
+            return false;
+        }
+
+        // Accumulate bytes processed in this chunk
+        int processed_bytes = start_remaining - stream.RemainingBytes();
+        assert(processed_bytes >= 0);
+        if (Metrics) {
+            Metrics->Add(METRIC_CHUNKS_PARSED);
+        }
+        ReceivedBytes += processed_bytes;
+        uint32_t ack_window = WindowAckSize;
+        if (AckIntervalBytes > 0 && AckIntervalBytes < ack_window) {
+            ack_window = AckIntervalBytes;
+        }
+        if (ReceivedBytes - AckedBytes >= ack_window) {
+            SendAck();
+        }
+
+        if (!prev_chunk) {
+            prev_chunk = new RTMPChunk(Arena);
+            chunk_streams[head.cs_id].reset(prev_chunk);
+        }
+        prev_chunk->header = head; // Store header info for decoding the next chunk header
+        prev_chunk->TimestampField = timestamp_field;
+        prev_chunk->TimestampDelta = timestamp_delta;
+
+        RTMP_TRACE(if (prev_chunk->AccumulatedData.empty()) prev_chunk->FirstRecvNsec = RecvNsec;)
+
+        const uint8_t* message_data = chunk_data;
+
+        if (head.length > ChunkSize) {
+            AppendDataToVector(prev_chunk->AccumulatedData, chunk_data, static_cast<int>( expected_bytes ));
+            if (Metrics) {
+                Metrics->Add(METRIC_REASSEMBLY_BYTES, expected_bytes);
+            }
+            message_data = prev_chunk->AccumulatedData.data();
+
+            if (head.length > static_cast<uint32_t>( prev_chunk->AccumulatedData.size() )) {
+                //RTMP_LOG(RTMP_LOG_TRACE, "Received message partial (waiting for more) on cs=", head.cs_id);
+                continue;
+            }
+        }
+
+        RTMP_TRACE(Trace.FirstChunkRecvNsec = prev_chunk->FirstRecvNsec;)
+        RTMP_TRACE(Trace.LastChunkRecvNsec = RecvNsec;)
+        RTMP_TRACE(Trace.ReassembledNsec = GetMonotonicNsec();)
+
+        OnMessage(head, message_data, head.length);
+
+        prev_chunk->AccumulatedData.clear();
+    }
+
+    Buffer->Clear();
+    return false;
+}
+
+template <class HandlerType>
+void BasicRTMPSession<HandlerType>::SendAck()
+{
+    Handler->OnNeedAck(static_cast<uint32_t>( ReceivedBytes ));
+    AckedBytes = ReceivedBytes;
+}
+
+template <class HandlerType>
+void BasicRTMPSession<HandlerType>::SaveState(ByteStreamWriter& out) const
+{
+    out.WriteUInt32(ChunkSize);
+    out.WriteUInt32(AckSequenceNumber);
+    out.WriteUInt32(WindowAckSize);
+    out.WriteUInt32(MaxUnackedBytes);
+    out.WriteUInt8(static_cast<uint8_t>( LimitType ));
+    out.WriteUInt32(AckIntervalBytes);
+    out.WriteUInt64(ReceivedBytes);
+    out.WriteUInt64(AckedBytes);
+
+    // Type 1-3 chunks take their fields from the previous chunk on the same
+    // chunk stream, and a message split across chunks resumes from its bytes
+    out.WriteUInt32(static_cast<uint32_t>( chunk_streams.size() ));
+    for (const auto& entry : chunk_streams) {
+        const RTMPChunk& chunk = *entry.second;
+        out.WriteUInt32(entry.first);
+        out.WriteUInt8(chunk.header.fmt);
+        out.WriteUInt32(chunk.header.timestamp);
+        out.WriteUInt32(chunk.header.length);
+        out.WriteUInt8(chunk.header.type_id);
+        out.WriteUInt32(chunk.header.stream_id);
+        out.WriteUInt32(chunk.TimestampField);
+        out.WriteUInt32(chunk.TimestampDelta);
+        out.WriteUInt32(static_cast<uint32_t>( chunk.AccumulatedData.size() ));
+        out.WriteData(chunk.AccumulatedData.data(), chunk.AccumulatedData.size());
+    }
+
+    // A chunk cut off by the end of the last recv()
+    const ArenaBytes& remaining = Buffer->GetRemaining();
+    out.WriteUInt32(static_cast<uint32_t>( remaining.size() ));
+    out.WriteData(remaining.data(), remaining.size());
+}
+
+template <class HandlerType>
+bool BasicRTMPSession<HandlerType>::RestoreState(ByteStream& in)
+{
+    ChunkSize = in.ReadUInt32();
+    AckSequenceNumber = in.ReadUInt32();
+    WindowAckSize = in.ReadUInt32();
+    MaxUnackedBytes = in.ReadUInt32();
+    LimitType = in.ReadUInt8();
+    AckIntervalBytes = in.ReadUInt32();
+    ReceivedBytes = in.ReadUInt64();
+    AckedBytes = in.ReadUInt64();
+    if (ChunkSize == 0 || AckedBytes > ReceivedBytes) {
+        return false;
+    }
+
+    chunk_streams.clear();
+    const uint32_t chunk_stream_count = in.ReadUInt32();
+    for (uint32_t i = 0; i < chunk_stream_count && !in.HasError(); ++i) {
+        const uint32_t cs_id = in.ReadUInt32();
+        std::unique_ptr<RTMPChunk> chunk(new RTMPChunk(Arena));
+        chunk->header.cs_id = cs_id;
+        chunk->header.fmt = in.ReadUInt8();
+        chunk->header.timestamp = in.ReadUInt32();
+        chunk->header.length = in.ReadUInt32();
+        chunk->header.type_id = in.ReadUInt8();
+        chunk->header.stream_id = in.ReadUInt32();
+        chunk->TimestampField = in.ReadUInt32();
+        chunk->TimestampDelta = in.ReadUInt32();
+
+        const uint32_t accumulated = in.ReadUInt32();
+        // Complete messages are cleared, so this is always a partial message
+        if (accumulated > static_cast<uint32_t>( in.RemainingBytes() ) || (accumulated > 0 && accumulated >= chunk->header.length)) {
+            return false;
+        }
+        const uint8_t* data = in.ReadData(static_cast<int>( accumulated ));
+        chunk->AccumulatedData.assign(data, data + accumulated);
+
+        chunk_streams[cs_id] = std::move(chunk);
+    }
+
+    const uint32_t remaining = in.ReadUInt32();
+    if (in.HasError() || remaining > static_cast<uint32_t>( in.RemainingBytes() )) {
+        return false;
+    }
+    Buffer->Clear();
+    if (remaining > 0) {
+        Buffer->StoreRemaining(in.ReadData(static_cast<int>( remaining )), static_cast<int>( remaining ));
+    }
+    return !in.HasError();
+}
+
+template <class HandlerType>
+void BasicRTMPSession<HandlerType>::OnMessage(const RTMPHeader& head, const uint8_t* data, int bytes)
+{
+    // Note: This function only implements the subset of the RTMP protocol needed to receive video.
+    // However, the chunk parsing logic above is fully-featured and can handle the complete protocol.
+
+    RTMP_LOG(RTMP_LOG_TRACE, "Received message cs_id=", head.cs_id, " stream=", head.stream_id, " ts=", head.timestamp, " type=", GetPacketTypeName(head.type_id), " len=", head.length);
+    //PrintFirst64BytesAsHex(data, bytes);
+
+    if (Metrics) {
+        Metrics->AddMessage(head.type_id);
+    }
+
+    ByteStream stream(data, bytes);
+
+    switch (head.type_id) {
+    case CHUNK_SIZE:
+        ChunkSize = stream.ReadUInt32();
+        return;
+    case ABORT:
+        {
+            uint32_t cs_id = stream.ReadUInt32();
+            auto iter = chunk_streams.find(cs_id);
+            if (iter != chunk_streams.end()) {
+                chunk_streams.erase(iter);
+            }
+        }
+        return;
+    case ACK:
+        AckSequenceNumber = stream.ReadUInt32();
+        return;
+    case USER_CONTROL:
+        break;
+    case WINDOW_ACK_SIZE:
+        WindowAckSize = stream.ReadUInt32();
+        return;
+    case SET_PEER_BANDWIDTH:
+        MaxUnackedBytes = stream.ReadUInt32();
+        LimitType = stream.ReadUInt8();
+        return;
+    case AUDIO:
+        break;
+    case VIDEO:
+        {
+            ByteStream stream(data, bytes);
+
+            const uint8_t type_byte = stream.ReadUInt8();
+            const int frame_type = type_byte >> 4;
+            const int codec = type_byte & 0xf;
+
+            if (codec != VIDEO_CODEC_H264) {
+                RTMP_LOG(RTMP_LOG_WARNING, "Received unknown video codec type=", codec);
+                return;
+            }
+
+            if (frame_type != VIDEO_FRAME_TYPE_KEY && frame_type != VIDEO_FRAME_TYPE_INTER) {
+                RTMP_LOG(RTMP_LOG_WARNING, "Received unknown video frame type=", frame_type);
+                return;
+            }
+            const bool keyframe = (frame_type == VIDEO_FRAME_TYPE_KEY);
+
+            Handler->OnAvccVideo(keyframe, head.stream_id, head.timestamp, data + 1, bytes - 1, Trace);
+        }
+        break;
+    case DATA_AMF3:
+        break;
+    case SHARED_OBJECT_AMF3:
+        break;
+    case COMMAND_AMF3:
+        break;
+    case DATA_AMF0:
+    case COMMAND_AMF0:
+        {
+            if (head.type_id == DATA_AMF0) {
+                TraceAmf0Data(data, bytes);
+            }
+
+            RTMPCommand command;
+            ParseAmf0Command(data, bytes, command);
+            command.Type = head.type_id;
+
+            Handler->OnMessage(command);
+        }
+        break;
+    case SHARED_OBJECT_AMF0:
+        break;
+    case AGGREGATE:
+        break;
+    }
+}
+
+// Compiled once in rtmp_parser.cpp
+extern template class BasicRTMPSession<RTMPHandler>;
+
 #endif // RTMP_PARSER_H
@@ -0,0 +1,387 @@
+#include "rtmp_placement.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+using namespace std;
+
+// Transparent hugepages are only used for aligned 2 MB ranges
+static const size_t kHugePageBytes = 2 * 1024 * 1024;
+
+// Nodes mbind() can be asked for
+static const int kMaxNodes = 1024;
+
+// Pages NodeBuffer::GetNode() looks up
+static const size_t kMaxNodeSamples = 4096;
+
+
+//------------------------------------------------------------------------------
+// CPU Lists
+
+bool ParseCpuList(const std::string& text, std::vector<int>& cpus)
+{
+    cpus.clear();
+
+    std::stringstream ss(text);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        while (!range.empty() && isspace(static_cast<unsigned char>( range.back() ))) {
+            range.pop_back();
+        }
+        if (range.empty()) {
+            continue;
+        }
+
+        char* end = nullptr;
+        const long first = strtol(range.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(static_cast<int>( cpu ));
+        }
+    }
+
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return true;
+}
+
+std::string FormatCpuList(const std::vector<int>& cpus)
+{
+    if (cpus.empty()) {
+        return "any";
+    }
+
+    std::string text;
+    for (size_t i = 0; i < cpus.size(); ) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            ++j;
+        }
+        if (!text.empty()) {
+            text += ",";
+        }
+        text += std::to_string(cpus[i]);
+        if (j > i) {
+            text += "-" + std::to_string(cpus[j]);
+        }
+        i = j + 1;
+    }
+    return text;
+}
+
+
+//------------------------------------------------------------------------------
+// Threads
+
+bool PinCurrentThread(const std::vector<int>& cpus)
+{
+    if (cpus.empty()) {
+        return true;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+
+    const int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (result != 0) {
+        errno = result;
+        perror("pthread_setaffinity_np failed");
+        return false;
+    }
+    return true;
+}
+
+std::vector<int> GetThreadCpus(pthread_t thread)
+{
+    std::vector<int> cpus;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(thread, sizeof(set), &set) != 0) {
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+int GetCurrentThreadId()
+{
+    return static_cast<int>( syscall(SYS_gettid) );
+}
+
+int GetThreadCurrentCpu(int thread_id)
+{
+    std::ifstream file("/proc/self/task/" + std::to_string(thread_id) + "/stat");
+    std::string stat;
+    if (!std::getline(file, stat)) {
+        return -1;
+    }
+
+    // The name in parentheses may contain spaces.  After it, the state is
+    // field 3 and the processor is field 39
+    const size_t name_end = stat.rfind(')');
+    if (name_end == std::string::npos) {
+        return -1;
+    }
+    std::stringstream fields(stat.substr(name_end + 1));
+    std::string field;
+    for (int i = 3; i <= 39; ++i) {
+        if (!(fields >> field)) {
+            return -1;
+        }
+    }
+    return atoi(field.c_str());
+}
+
+
+//------------------------------------------------------------------------------
+// NUMA Nodes
+
+int GetCpuNode(int cpu)
+{
+    // Kernels built without NUMA have no node directories
+    DIR* nodes = opendir("/sys/devices/system/node");
+    if (!nodes) {
+        return 0;
+    }
+    closedir(nodes);
+
+    const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        return -1;
+    }
+
+    int node = -1;
+    while (dirent* entry = readdir(dir)) {
+        int n = 0;
+        if (sscanf(entry->d_name, "node%d", &n) == 1) {
+            node = n;
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+std::vector<int> GetNodeCpus(int node)
+{
+    std::vector<int> cpus;
+
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string text;
+    if (!std::getline(file, text) || !ParseCpuList(text, cpus)) {
+        cpus.clear();
+    }
+    return cpus;
+}
+
+int GetCommonNode(const std::vector<int>& cpus)
+{
+    int common = -1;
+    for (int cpu : cpus) {
+        const int node = GetCpuNode(cpu);
+        if (node < 0 || (common >= 0 && node != common)) {
+            return -1;
+        }
+        common = node;
+    }
+    return common;
+}
+
+
+//------------------------------------------------------------------------------
+// NodeBuffer
+
+// Maps bytes, a multiple of kHugePageBytes, starting on a 2 MB boundary.
+// Over-allocates by one hugepage and trims the ends
+static uint8_t* MapHugePageAligned(size_t bytes)
+{
+    const size_t reserve_bytes = bytes + kHugePageBytes;
+    void* map = mmap(nullptr, reserve_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+
+    uint8_t* base = static_cast<uint8_t*>( map );
+    const uintptr_t address = reinterpret_cast<uintptr_t>( base );
+    uint8_t* aligned = base + ((kHugePageBytes - address % kHugePageBytes) % kHugePageBytes);
+    if (aligned > base) {
+        munmap(base, static_cast<size_t>( aligned - base ));
+    }
+    uint8_t* end = aligned + bytes;
+    uint8_t* reserve_end = base + reserve_bytes;
+    if (reserve_end > end) {
+        munmap(end, static_cast<size_t>( reserve_end - end ));
+    }
+    return aligned;
+}
+
+bool NodeBuffer::Allocate(size_t bytes, int node, NodeBufferPages pages, bool prefault)
+{
+    Free();
+    if (bytes == 0) {
+        return true;
+    }
+
+    const long page_bytes = sysconf(_SC_PAGESIZE);
+    const size_t align = (pages != NODE_PAGES_DEFAULT) ? kHugePageBytes : static_cast<size_t>( page_bytes > 0 ? page_bytes : 4096 );
+    const size_t mapped_bytes = (bytes + align - 1) / align * align;
+
+    uint8_t* base = nullptr;
+    if (pages == NODE_PAGES_HUGETLB) {
+        void* map = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) {
+            base = static_cast<uint8_t*>( map );
+        } else {
+            pages = NODE_PAGES_THP; // Pool empty or too small
+        }
+    }
+    if (pages == NODE_PAGES_THP) {
+        base = MapHugePageAligned(mapped_bytes);
+
+        // Without THP in "madvise" or "always" mode this stays 4 KB pages
+        if (base) {
+            madvise(base, mapped_bytes, MADV_HUGEPAGE);
+        }
+    } else if (pages == NODE_PAGES_DEFAULT) {
+        void* map = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        base = (map != MAP_FAILED) ? static_cast<uint8_t*>( map ) : nullptr;
+    }
+    if (!base) {
+        perror("mmap failed");
+        return false;
+    }
+
+    // Without CAP_SYS_NICE (e.g. in a container) mbind() may be refused, and
+    // the pages land on the node of the thread that first touches them
+    if (node >= 0 && node < kMaxNodes) {
+        unsigned long mask[kMaxNodes / (8 * sizeof(unsigned long))] = {};
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, base, mapped_bytes, MPOL_PREFERRED, mask, kMaxNodes + 1, 0);
+    }
+
+    // Fault the pages in now rather than on first use
+    if (prefault) {
+        memset(base, 0, mapped_bytes);
+    }
+
+    Data = base;
+    Bytes = bytes;
+    Pages = pages;
+    MappedBytes = mapped_bytes;
+    return true;
+}
+
+void NodeBuffer::Free()
+{
+    if (Data) {
+        munmap(Data, MappedBytes);
+    }
+    Data = nullptr;
+    Bytes = 0;
+    MappedBytes = 0;
+}
+
+int NodeBuffer::GetNode() const
+{
+    if (!Data) {
+        return -1;
+    }
+
+    // move_pages() without target nodes only reports where each page is.
+    // Large buffers are sampled
+    const long page_bytes = sysconf(_SC_PAGESIZE);
+    const size_t page = static_cast<size_t>( page_bytes > 0 ? page_bytes : 4096 );
+    const size_t step = std::max(page, (MappedBytes / kMaxNodeSamples + page - 1) / page * page);
+    const size_t page_count = MappedBytes / step;
+    std::vector<void*> pages(page_count);
+    std::vector<int> status(page_count, -1);
+    for (size_t i = 0; i < page_count; ++i) {
+        pages[i] = Data + i * step;
+    }
+    if (syscall(SYS_move_pages, 0, page_count, pages.data(), nullptr, status.data(), 0) != 0) {
+        return -1;
+    }
+
+    // Node holding the most pages
+    std::vector<size_t> counts;
+    for (int node : status) {
+        if (node < 0) {
+            continue; // -errno for a page that is not present
+        }
+        if (static_cast<size_t>( node ) >= counts.size()) {
+            counts.resize(node + 1);
+        }
+        counts[node]++;
+    }
+    if (counts.empty()) {
+        return -1;
+    }
+    return static_cast<int>( std::max_element(counts.begin(), counts.end()) - counts.begin() );
+}
+
+size_t NodeBuffer::GetHugePageBytes() const
+{
+    if (!Data) {
+        return 0;
+    }
+
+    // e.g. "7f2a4c000000-7f2a4c400000 rw-p 00000000 00:00 0" followed by
+    // fields such as "AnonHugePages:      2048 kB" up to the next mapping.
+    // The kernel may have merged the buffer with a neighbouring mapping
+    const uintptr_t address = reinterpret_cast<uintptr_t>( Data );
+
+    std::ifstream file("/proc/self/smaps");
+    std::string line;
+    bool found = false;
+    unsigned long huge_kb = 0;
+    while (std::getline(file, line)) {
+        unsigned long start = 0, end = 0;
+        if (sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2) {
+            if (found) {
+                break;
+            }
+            found = address >= start && address < end;
+            continue;
+        }
+
+        // THP, or MAP_HUGETLB pages
+        unsigned long kb = 0;
+        if (found && (sscanf(line.c_str(), "AnonHugePages: %lu kB", &kb) == 1 ||
+            sscanf(line.c_str(), "Private_Hugetlb: %lu kB", &kb) == 1))
+        {
+            huge_kb += kb;
+        }
+    }
+    return std::min(static_cast<size_t>( huge_kb ) * 1024, MappedBytes);
+}
@@ -0,0 +1,120 @@
+#ifndef RTMP_PLACEMENT_H
+#define RTMP_PLACEMENT_H
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// CPU Lists
+
+// Parses a kernel style CPU list, e.g. "0-3,8,10-11".  Returns false on a
+// malformed list.  Empty text is an empty list
+bool ParseCpuList(const std::string& text, std::vector<int>& cpus);
+
+// Formats sorted CPUs as a kernel style CPU list, or "any" if empty
+std::string FormatCpuList(const std::vector<int>& cpus);
+
+
+//------------------------------------------------------------------------------
+// Threads
+
+// Restricts the calling thread to cpus.  Empty = leave it alone
+bool PinCurrentThread(const std::vector<int>& cpus);
+
+// CPUs a thread is allowed to run on.  Empty on failure
+std::vector<int> GetThreadCpus(pthread_t thread);
+
+// Kernel thread id of the calling thread, for GetThreadCurrentCpu()
+int GetCurrentThreadId();
+
+// CPU a thread of this process last ran on, or -1 if unknown
+int GetThreadCurrentCpu(int thread_id);
+
+
+//------------------------------------------------------------------------------
+// NUMA Nodes
+
+// Node a CPU belongs to.  0 on machines without NUMA, -1 if unknown
+int GetCpuNode(int cpu);
+
+// CPUs of a node.  Empty if unknown
+std::vector<int> GetNodeCpus(int node);
+
+// The node every one of cpus belongs to, or -1 if they span nodes
+int GetCommonNode(const std::vector<int>& cpus);
+
+
+//------------------------------------------------------------------------------
+// NodeBuffer
+
+// Page size backing a NodeBuffer
+enum NodeBufferPages {
+    // 4 KB pages
+    NODE_PAGES_DEFAULT,
+
+    // Transparent hugepages: The mapping is rounded up to whole 2 MB pages
+    // and advised with MADV_HUGEPAGE.  Needs THP in "madvise" or "always" mode
+    NODE_PAGES_THP,
+
+    // 2 MB pages reserved up front from the pool set by vm.nr_hugepages
+    // (MAP_HUGETLB).  Falls back to NODE_PAGES_THP if the pool is too small
+    NODE_PAGES_HUGETLB
+};
+
+// A fixed size buffer mapped on its own, so its pages can be placed on a
+// NUMA node and backed by hugepages.  Pages are placed when first touched,
+// so without an explicit node they land on the node of the thread that
+// touches them
+class NodeBuffer {
+public:
+    NodeBuffer() = default;
+    NodeBuffer(const NodeBuffer&) = delete;
+    NodeBuffer& operator=(const NodeBuffer&) = delete;
+    ~NodeBuffer() {
+        Free();
+    }
+
+    // node: Preferred node, or -1 for the calling thread's node.  prefault:
+    // Touch every page now, on the calling thread.  Falls back to the kernel
+    // defaults if it refuses the node or page size.  Returns false if out of
+    // memory
+    bool Allocate(
+        size_t bytes,
+        int node = -1,
+        NodeBufferPages pages = NODE_PAGES_DEFAULT,
+        bool prefault = true);
+    void Free();
+
+    uint8_t* data() const {
+        return Data;
+    }
+    size_t size() const {
+        return Bytes;
+    }
+
+    // Page size actually used
+    NodeBufferPages GetPages() const {
+        return Pages;
+    }
+
+    // Node holding most of the touched pages, or -1 if unknown
+    int GetNode() const;
+
+    // Bytes currently backed by hugepages of either kind
+    size_t GetHugePageBytes() const;
+
+private:
+    uint8_t* Data = nullptr;
+    size_t Bytes = 0;
+    NodeBufferPages Pages = NODE_PAGES_DEFAULT;
+
+    // Whole mapping, including rounding for hugepages
+    size_t MappedBytes = 0;
+};
+
+#endif // RTMP_PLACEMENT_H
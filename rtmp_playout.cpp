@@ -0,0 +1,235 @@
+#include "rtmp_playout.h"
+#include "rtmp_tools.h"
+
+#include <algorithm>
+#include <chrono>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+static uint64_t GetQuantile(const std::vector<int64_t>& samples, std::vector<int64_t>& scratch, double q)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+
+    scratch = samples;
+    const size_t index = static_cast<size_t>( q * (scratch.size() - 1) + 0.5 );
+    std::nth_element(scratch.begin(), scratch.begin() + index, scratch.end());
+    return static_cast<uint64_t>( scratch[index] );
+}
+
+// The jitter window must hold a sample, and the quantile indexes into it
+static PlayoutSettings ClampSettings(PlayoutSettings settings)
+{
+    if (settings.JitterWindow < 1) {
+        settings.JitterWindow = 1;
+    }
+    if (!(settings.JitterQuantile >= 0.0)) {
+        settings.JitterQuantile = 0.0;
+    } else if (settings.JitterQuantile > 1.0) {
+        settings.JitterQuantile = 1.0;
+    }
+    return settings;
+}
+
+
+//------------------------------------------------------------------------------
+// PlayoutScheduler
+
+PlayoutScheduler::PlayoutScheduler(const PlayoutSettings& settings)
+    : Settings(ClampSettings(settings))
+{
+    TargetDelayUsec = static_cast<double>( Settings.MinDelayUsec );
+    JitterSamples.reserve(Settings.JitterWindow);
+}
+
+uint64_t PlayoutScheduler::GetDeadlineUsec(const QueuedFrame& queued) const
+{
+    return static_cast<uint64_t>( queued.Frame.Clock.LocalPtsUsec + static_cast<int64_t>( TargetDelayUsec ) );
+}
+
+void PlayoutScheduler::UpdateTarget(int64_t jitter_usec, uint64_t now_usec)
+{
+    if (jitter_usec < 0) {
+        jitter_usec = 0;
+    }
+
+    if (static_cast<int>( JitterSamples.size() ) < Settings.JitterWindow) {
+        JitterSamples.push_back(jitter_usec);
+    } else {
+        JitterSamples[NextJitterSample] = jitter_usec;
+        NextJitterSample = (NextJitterSample + 1) % Settings.JitterWindow;
+    }
+
+    double desired = static_cast<double>( GetQuantile(JitterSamples, SortScratch, Settings.JitterQuantile) + Settings.MarginUsec );
+    desired = std::max(desired, static_cast<double>( Settings.MinDelayUsec ));
+    desired = std::min(desired, static_cast<double>( Settings.MaxDelayUsec ));
+
+    if (desired >= TargetDelayUsec || LastUpdateUsec == 0) {
+        TargetDelayUsec = desired;
+    } else {
+        const double elapsed_sec = (now_usec - LastUpdateUsec) / 1000000.0;
+        const double decayed = TargetDelayUsec - Settings.DecayUsecPerSec * elapsed_sec;
+        TargetDelayUsec = std::max(desired, decayed);
+    }
+    LastUpdateUsec = now_usec;
+}
+
+void PlayoutScheduler::Push(const RTMPVideoFrame& frame)
+{
+    const uint64_t now_usec = GetMonotonicUsec();
+
+    std::unique_ptr<QueuedFrame> queued;
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+
+        Stats.Pushed++;
+        Stats.DriftPpm = frame.Clock.DriftPpm;
+
+        UpdateTarget(frame.Clock.JitterUsec, now_usec);
+
+        const uint64_t deadline = static_cast<uint64_t>( frame.Clock.LocalPtsUsec + static_cast<int64_t>( TargetDelayUsec ) );
+        if (now_usec > deadline) {
+            Stats.LateFrames++;
+            Stats.MaxLateUsec = std::max(Stats.MaxLateUsec, now_usec - deadline);
+
+            if (Settings.DropLate && !frame.Keyframe) {
+                Stats.Dropped++;
+                return;
+            }
+        }
+
+        if (!Free.empty()) {
+            queued = std::move(Free.back());
+            Free.pop_back();
+        }
+    }
+
+    // Copy outside the lock
+    if (!queued) {
+        queued.reset(new QueuedFrame);
+    }
+    queued->Frame = frame;
+    queued->Data.assign(frame.Data, frame.Data + frame.Bytes);
+    queued->Frame.Data = queued->Data.data();
+
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+
+        // Usually appended, but keep presentation order if a frame arrives early
+        auto iter = Queue.end();
+        while (iter != Queue.begin() && (*(iter - 1))->Frame.Clock.LocalPtsUsec > frame.Clock.LocalPtsUsec) {
+            --iter;
+        }
+        Queue.insert(iter, std::move(queued));
+    }
+
+    Condition.notify_one();
+}
+
+std::unique_ptr<PlayoutScheduler::QueuedFrame> PlayoutScheduler::PopLocked()
+{
+    std::unique_ptr<QueuedFrame> queued = std::move(Queue.front());
+    Queue.pop_front();
+    Stats.Released++;
+    return queued;
+}
+
+void PlayoutScheduler::Recycle(std::unique_ptr<QueuedFrame> queued)
+{
+    std::lock_guard<std::mutex> locker(Lock);
+    if (Free.size() < 64) {
+        Free.push_back(std::move(queued));
+    }
+}
+
+int PlayoutScheduler::Poll(uint64_t now_usec, const RTMPFrameCallback& emit)
+{
+    int released = 0;
+
+    for (;;) {
+        std::unique_ptr<QueuedFrame> queued;
+        {
+            std::lock_guard<std::mutex> locker(Lock);
+            if (Queue.empty() || GetDeadlineUsec(*Queue.front()) > now_usec) {
+                break;
+            }
+            queued = PopLocked();
+        }
+
+        emit(queued->Frame);
+        ++released;
+
+        Recycle(std::move(queued));
+    }
+
+    return released;
+}
+
+bool PlayoutScheduler::WaitAndRelease(const RTMPFrameCallback& emit, int timeout_msec)
+{
+    const uint64_t give_up_usec = GetMonotonicUsec() + static_cast<uint64_t>( timeout_msec ) * 1000;
+
+    std::unique_ptr<QueuedFrame> queued;
+    {
+        std::unique_lock<std::mutex> locker(Lock);
+
+        for (;;) {
+            if (Stopped) {
+                return false;
+            }
+
+            const uint64_t now_usec = GetMonotonicUsec();
+            uint64_t wake_usec = give_up_usec;
+
+            if (!Queue.empty()) {
+                const uint64_t deadline = GetDeadlineUsec(*Queue.front());
+                if (deadline <= now_usec) {
+                    queued = PopLocked();
+                    break;
+                }
+                wake_usec = std::min(wake_usec, deadline);
+            }
+
+            if (now_usec >= give_up_usec) {
+                return false;
+            }
+
+            Condition.wait_for(locker, std::chrono::microseconds(wake_usec - now_usec));
+        }
+    }
+
+    emit(queued->Frame);
+
+    Recycle(std::move(queued));
+    return true;
+}
+
+void PlayoutScheduler::Stop()
+{
+    {
+        std::lock_guard<std::mutex> locker(Lock);
+        Stopped = true;
+    }
+    Condition.notify_all();
+}
+
+void PlayoutScheduler::GetStats(PlayoutStats& stats) const
+{
+    std::lock_guard<std::mutex> locker(Lock);
+
+    stats = Stats;
+    stats.BufferedFrames = static_cast<int>( Queue.size() );
+    stats.BufferedUsec = 0;
+    if (!Queue.empty()) {
+        stats.BufferedUsec = static_cast<uint64_t>( Queue.back()->Frame.Clock.LocalPtsUsec - Queue.front()->Frame.Clock.LocalPtsUsec );
+    }
+    stats.TargetDelayUsec = static_cast<uint64_t>( TargetDelayUsec );
+
+    std::vector<int64_t> scratch;
+    stats.JitterP50Usec = GetQuantile(JitterSamples, scratch, 0.5);
+    stats.JitterP99Usec = GetQuantile(JitterSamples, scratch, 0.99);
+}
@@ -0,0 +1,113 @@
+#ifndef RTMP_PLAYOUT_H
+#define RTMP_PLAYOUT_H
+
+#include "rtmp_receiver.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// PlayoutScheduler
+
+struct PlayoutSettings {
+    // Bounds on the jitter buffer delay added to each frame
+    uint64_t MinDelayUsec = 0;
+    uint64_t MaxDelayUsec = 500000;
+
+    // Added to the jitter quantile to get the target delay
+    uint64_t MarginUsec = 2000;
+
+    // Fraction of recent frames that should arrive before their deadline.
+    // Clamped to [0, 1]
+    double JitterQuantile = 0.99;
+
+    // Recent frames the quantile is taken over, at least 1
+    int JitterWindow = 256;
+
+    // The target rises immediately but only falls this fast once jitter
+    // subsides, so playback speeds up imperceptibly rather than skipping
+    uint64_t DecayUsecPerSec = 5000;
+
+    // Drop non-key frames that arrive after their deadline instead of
+    // releasing them immediately
+    bool DropLate = false;
+};
+
+struct PlayoutStats {
+    // Frames waiting and the presentation time they span
+    int BufferedFrames = 0;
+    uint64_t BufferedUsec = 0;
+
+    uint64_t TargetDelayUsec = 0;
+    uint64_t JitterP50Usec = 0;
+    uint64_t JitterP99Usec = 0;
+    double DriftPpm = 0.0;
+
+    uint64_t Pushed = 0;
+    uint64_t Released = 0;
+
+    // Frames that arrived after their release deadline
+    uint64_t LateFrames = 0;
+    uint64_t MaxLateUsec = 0;
+    uint64_t Dropped = 0;
+};
+
+// Jitter buffer for one stream.  Push() frames from the frame callback in
+// presentation order; a display thread calls WaitAndRelease() or Poll() to
+// receive them at LocalPtsUsec + the adaptive target delay.  Thread-safe.
+class PlayoutScheduler {
+public:
+    explicit PlayoutScheduler(const PlayoutSettings& settings = PlayoutSettings());
+
+    // Copies the frame.  The frame must carry a valid Clock
+    void Push(const RTMPVideoFrame& frame);
+
+    // Releases every frame due at now_usec.  Returns the number released
+    int Poll(uint64_t now_usec, const RTMPFrameCallback& emit);
+
+    // Blocks until the next frame is due and releases it.  Returns false on
+    // timeout or after Stop()
+    bool WaitAndRelease(const RTMPFrameCallback& emit, int timeout_msec);
+
+    // Wakes any waiting thread
+    void Stop();
+
+    void GetStats(PlayoutStats& stats) const;
+
+private:
+    struct QueuedFrame {
+        RTMPVideoFrame Frame;
+        std::vector<uint8_t> Data;
+    };
+
+    const PlayoutSettings Settings;
+
+    mutable std::mutex Lock;
+    std::condition_variable Condition;
+    bool Stopped = false;
+
+    // Ordered by LocalPtsUsec
+    std::deque<std::unique_ptr<QueuedFrame>> Queue;
+    std::vector<std::unique_ptr<QueuedFrame>> Free;
+
+    double TargetDelayUsec = 0.0;
+    uint64_t LastUpdateUsec = 0;
+
+    std::vector<int64_t> JitterSamples;
+    int NextJitterSample = 0;
+    std::vector<int64_t> SortScratch;
+
+    PlayoutStats Stats;
+
+    uint64_t GetDeadlineUsec(const QueuedFrame& queued) const;
+    void UpdateTarget(int64_t jitter_usec, uint64_t now_usec);
+    std::unique_ptr<QueuedFrame> PopLocked();
+    void Recycle(std::unique_ptr<QueuedFrame> queued);
+};
+
+#endif // RTMP_PLAYOUT_H
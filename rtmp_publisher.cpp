@@ -0,0 +1,748 @@
+#include "rtmp_publisher.h"
+
+#include "rtmp_tools.h"
+#include "rtmp_log.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+static void AppendAvccNalu(std::vector<uint8_t>& avcc, const uint8_t* data, size_t size) {
+    uint8_t length[4];
+    WriteUInt32(length, static_cast<uint32_t>( size ));
+    AppendDataToVector(avcc, length, sizeof(length));
+    AppendDataToVector(avcc, data, static_cast<int>( size ));
+}
+
+static void SleepMsec(int msec) {
+    if (msec > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(msec));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// H264Stream
+
+enum H264NaluType {
+    H264_NALU_SLICE = 1,
+    H264_NALU_IDR = 5,
+    H264_NALU_SEI = 6,
+    H264_NALU_SPS = 7,
+    H264_NALU_PPS = 8,
+    H264_NALU_AUD = 9,
+};
+
+bool H264Stream::LoadAnnexB(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    return ParseAnnexB(data.data(), data.size());
+}
+
+bool H264Stream::ParseAnnexB(const uint8_t* data, size_t size)
+{
+    Frames.clear();
+    SPS.clear();
+    PPS.clear();
+    StartNewFrame = true;
+    CurrentHasSlice = false;
+
+    size_t nal_start = 0;
+    bool in_nal = false;
+
+    size_t i = 0;
+    while (i + 3 <= size) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            if (in_nal) {
+                // Trailing zeroes belong to the next (4-byte) start code
+                size_t end = i;
+                while (end > nal_start && data[end - 1] == 0) {
+                    --end;
+                }
+                AddNalu(data + nal_start, end - nal_start);
+            }
+            i += 3;
+            nal_start = i;
+            in_nal = true;
+        } else {
+            ++i;
+        }
+    }
+    if (in_nal) {
+        AddNalu(data + nal_start, size - nal_start);
+    }
+
+    BuildExtradata();
+
+    return !Frames.empty() && !Extradata.empty();
+}
+
+void H264Stream::AddNalu(const uint8_t* data, size_t size)
+{
+    if (size < 2) {
+        return;
+    }
+
+    const int type = data[0] & 0x1F;
+
+    if (type == H264_NALU_SLICE || type == H264_NALU_IDR) {
+        // first_mb_in_slice == 0 starts a new picture
+        const bool first_slice = (data[1] & 0x80) != 0;
+        if (StartNewFrame || (CurrentHasSlice && first_slice)) {
+            Frames.push_back(H264AccessUnit());
+            StartNewFrame = false;
+        }
+        CurrentHasSlice = true;
+
+        H264AccessUnit& frame = Frames.back();
+        if (type == H264_NALU_IDR) {
+            frame.Keyframe = true;
+        }
+        AppendAvccNalu(frame.Avcc, data, size);
+        return;
+    }
+
+    // Any of these after a slice begins the next access unit
+    if (CurrentHasSlice) {
+        StartNewFrame = true;
+        CurrentHasSlice = false;
+    }
+
+    if (type == H264_NALU_SPS) {
+        if (SPS.empty()) {
+            SPS.assign(data, data + size);
+        }
+    } else if (type == H264_NALU_PPS) {
+        if (PPS.empty()) {
+            PPS.assign(data, data + size);
+        }
+    } else if (type == H264_NALU_SEI) {
+        if (StartNewFrame) {
+            Frames.push_back(H264AccessUnit());
+            StartNewFrame = false;
+        }
+        AppendAvccNalu(Frames.back().Avcc, data, size);
+    }
+    // Parameter sets travel in the sequence header and AUDs are not used by RTMP
+}
+
+void H264Stream::BuildExtradata()
+{
+    Extradata.clear();
+    if (SPS.size() < 4 || PPS.empty()) {
+        return;
+    }
+
+    ByteStreamWriter writer;
+    writer.WriteUInt8(1); // configurationVersion
+    writer.WriteUInt8(SPS[1]); // AVCProfileIndication
+    writer.WriteUInt8(SPS[2]); // profile_compatibility
+    writer.WriteUInt8(SPS[3]); // AVCLevelIndication
+    writer.WriteUInt8(0xFC | 3); // lengthSizeMinusOne
+    writer.WriteUInt8(0xE0 | 1); // numOfSequenceParameterSets
+        writer.WriteUInt16(static_cast<uint16_t>( SPS.size() ));
+        writer.WriteData(SPS.data(), SPS.size());
+    writer.WriteUInt8(1); // numOfPictureParameterSets
+        writer.WriteUInt16(static_cast<uint16_t>( PPS.size() ));
+        writer.WriteData(PPS.data(), PPS.size());
+
+    Extradata.assign(writer.GetData(), writer.GetData() + writer.GetLength());
+}
+
+void H264Stream::Synthesize(int frames, int keyframe_interval, int frame_bytes, uint32_t seed)
+{
+    // 1080p High profile parameter sets.  The slices are random so this is not decodable
+    static const uint8_t kSPS[] = {
+        0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78, 0x02, 0x27, 0xe5, 0x84,
+        0x00, 0x00, 0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00, 0xf0, 0x3c, 0x60, 0xc6, 0x58
+    };
+    static const uint8_t kPPS[] = { 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0 };
+
+    SPS.assign(kSPS, kSPS + sizeof(kSPS));
+    PPS.assign(kPPS, kPPS + sizeof(kPPS));
+    BuildExtradata();
+
+    if (frame_bytes < 16) {
+        frame_bytes = 16;
+    }
+    if (keyframe_interval <= 0) {
+        keyframe_interval = 1;
+    }
+
+    Frames.clear();
+    Frames.resize(frames);
+
+    std::vector<uint8_t> nalu;
+    for (int i = 0; i < frames; ++i) {
+        H264AccessUnit& frame = Frames[i];
+        frame.Keyframe = (i % keyframe_interval) == 0;
+
+        // Keyframes are larger, as they would be from a real encoder
+        const int bytes = frame.Keyframe ? frame_bytes * 3 : frame_bytes;
+
+        nalu.resize(bytes);
+        FillRandomBuffer(nalu.data(), bytes, seed + i);
+        nalu[0] = frame.Keyframe ? 0x65 : 0x41;
+        nalu[1] |= 0x80; // first_mb_in_slice = 0
+
+        AppendAvccNalu(frame.Avcc, nalu.data(), nalu.size());
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// RTMPChunkWriter
+
+void RTMPChunkWriter::Reset()
+{
+    Previous.clear();
+    MessageCount = 0;
+}
+
+void RTMPChunkWriter::WriteBasicHeader(ByteStreamWriter& out, int fmt, uint32_t cs_id)
+{
+    if (cs_id < 64) {
+        out.WriteUInt8(static_cast<uint8_t>( (fmt << 6) | cs_id ));
+    } else {
+        // Only the 2-byte form is supported, for chunk streams up to 319
+        out.WriteUInt8(static_cast<uint8_t>( fmt << 6 ));
+        out.WriteUInt8(static_cast<uint8_t>( cs_id - 64 ));
+    }
+}
+
+void RTMPChunkWriter::WriteMessage(
+    ByteStreamWriter& out,
+    uint32_t cs_id,
+    uint8_t type_id,
+    uint32_t stream_id,
+    uint32_t timestamp,
+    const uint8_t* data,
+    int bytes)
+{
+    int fmt = 0;
+    uint32_t delta = timestamp;
+
+    auto iter = Previous.find(cs_id);
+    if (iter != Previous.end()) {
+        const PreviousHeader& prev = iter->second;
+
+        const bool compress = (Pattern == FMT_PATTERN_COMPRESSED) ||
+            (Pattern == FMT_PATTERN_MIXED && (MessageCount % 2) != 0);
+
+        if (compress && timestamp >= prev.Timestamp && stream_id == prev.StreamId) {
+            delta = timestamp - prev.Timestamp;
+            fmt = 1;
+            if (static_cast<uint32_t>( bytes ) == prev.Length && type_id == prev.TypeId) {
+                fmt = 2;
+                if (delta == prev.Delta) {
+                    fmt = 3;
+                }
+            }
+        }
+    }
+    ++MessageCount;
+
+    const bool extended = (delta >= 0xFFFFFF);
+
+    WriteBasicHeader(out, fmt, cs_id);
+    if (fmt <= 2) {
+        out.WriteUInt24(extended ? 0xFFFFFF : delta);
+    }
+    if (fmt <= 1) {
+        out.WriteUInt24(static_cast<uint32_t>( bytes ));
+        out.WriteUInt8(type_id);
+    }
+    if (fmt == 0) {
+        // Message stream ID is little-endian
+        out.WriteUInt8(static_cast<uint8_t>( stream_id ));
+        out.WriteUInt8(static_cast<uint8_t>( stream_id >> 8 ));
+        out.WriteUInt8(static_cast<uint8_t>( stream_id >> 16 ));
+        out.WriteUInt8(static_cast<uint8_t>( stream_id >> 24 ));
+    }
+    if (extended) {
+        out.WriteUInt32(delta);
+    }
+
+    int offset = 0;
+    for (;;) {
+        int chunk_bytes = bytes - offset;
+        if (chunk_bytes > static_cast<int>( ChunkSize )) {
+            chunk_bytes = static_cast<int>( ChunkSize );
+        }
+        out.WriteData(data + offset, chunk_bytes);
+        offset += chunk_bytes;
+
+        if (offset >= bytes) {
+            break;
+        }
+
+        WriteBasicHeader(out, 3, cs_id);
+        if (extended) {
+            out.WriteUInt32(delta);
+        }
+    }
+
+    PreviousHeader& prev = Previous[cs_id];
+    prev.Timestamp = timestamp;
+    prev.Delta = delta;
+    prev.Length = static_cast<uint32_t>( bytes );
+    prev.TypeId = type_id;
+    prev.StreamId = stream_id;
+}
+
+
+//------------------------------------------------------------------------------
+// RTMPPublisher
+
+static const uint32_t kControlChunkStream = 2;
+static const uint32_t kCommandChunkStream = 3;
+static const uint32_t kVideoChunkStream = 6;
+
+bool RTMPPublisher::Connect(const std::string& host, int port, const RTMPPublisherSettings& settings, int timeout_msec)
+{
+    Close();
+
+    static const char kUnixPrefix[] = "unix:";
+    const bool unix_socket = host.compare(0, sizeof(kUnixPrefix) - 1, kUnixPrefix) == 0;
+
+    sockaddr_storage addr{};
+    socklen_t addr_bytes = 0;
+    if (unix_socket) {
+        sockaddr_un* un = reinterpret_cast<sockaddr_un*>( &addr );
+        const std::string path = host.substr(sizeof(kUnixPrefix) - 1);
+        un->sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(un->sun_path)) {
+            RTMP_LOG(RTMP_LOG_ERROR, "Invalid publisher socket path ", path);
+            return false;
+        }
+        memcpy(un->sun_path, path.data(), path.size());
+        if (path[0] == '@') {
+            un->sun_path[0] = '\0'; // Abstract namespace
+        }
+        addr_bytes = static_cast<socklen_t>( offsetof(sockaddr_un, sun_path) + path.size() );
+    } else {
+        sockaddr_in* addr4 = reinterpret_cast<sockaddr_in*>( &addr );
+        sockaddr_in6* addr6 = reinterpret_cast<sockaddr_in6*>( &addr );
+        if (inet_pton(AF_INET, host.c_str(), &addr4->sin_addr) == 1) {
+            addr4->sin_family = AF_INET;
+            addr4->sin_port = htons(port);
+            addr_bytes = sizeof(sockaddr_in);
+        } else if (inet_pton(AF_INET6, host.c_str(), &addr6->sin6_addr) == 1) {
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_port = htons(port);
+            addr_bytes = sizeof(sockaddr_in6);
+        } else {
+            RTMP_LOG(RTMP_LOG_ERROR, "Invalid publisher host ", host);
+            return false;
+        }
+    }
+
+    const uint64_t deadline = GetMonotonicUsec() + timeout_msec * 1000ULL;
+
+    int s = -1;
+    for (;;) {
+        s = socket(addr.ss_family, SOCK_STREAM, 0);
+        if (s < 0) {
+            perror("socket failed");
+            return false;
+        }
+
+        if (connect(s, reinterpret_cast<sockaddr*>(&addr), addr_bytes) == 0) {
+            break;
+        }
+        close(s);
+
+        // The receiver may still be starting up
+        if (GetMonotonicUsec() >= deadline) {
+            return false;
+        }
+        SleepMsec(10);
+    }
+
+    if (!unix_socket) {
+        int optval = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+
+    Attach(s, settings, timeout_msec);
+
+    // The tcUrl names a host: a Unix socket has none
+    Host = unix_socket ? "localhost" : host;
+    if (Host.find(':') != std::string::npos) {
+        Host = "[" + Host + "]";
+    }
+    Port = port;
+    return true;
+}
+
+void RTMPPublisher::Attach(int socket, const RTMPPublisherSettings& settings, int timeout_msec)
+{
+    Close();
+
+    Settings = settings;
+    Socket = socket;
+    Host = "localhost";
+    Port = 1935;
+
+    timeval tv{};
+    tv.tv_sec = timeout_msec / 1000;
+    tv.tv_usec = (timeout_msec % 1000) * 1000;
+    setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    RecvBuffer.resize(2048 * 16);
+
+    Session.Buffer = &Buffer;
+    Session.Handler = this;
+}
+
+void RTMPPublisher::Close()
+{
+    if (Socket >= 0) {
+        // Closing with unread acks queued resets the connection, which can
+        // discard the tail of the stream before the server reads it.  Half
+        // close instead and wait for the server to finish reading
+        if (shutdown(Socket, SHUT_WR) == 0) {
+            uint8_t discard[2048];
+            while (recv(Socket, discard, sizeof(discard), 0) > 0) {
+            }
+        }
+        close(Socket);
+        Socket = -1;
+    }
+
+    Writer.Reset();
+    Out.Clear();
+    Buffer.Clear();
+    Session = RTMPSession();
+    HandshakeDone = false;
+    TransactionId = 0;
+    Responses = 0;
+    ExpectedResponses = 0;
+    Rejected = false;
+}
+
+bool RTMPPublisher::SendAll(const uint8_t* data, size_t bytes)
+{
+    while (bytes > 0) {
+        size_t allowed_bytes = bytes;
+        if (Settings.HonorPeerBandwidth && HandshakeDone && !WaitForAckWindow(allowed_bytes)) {
+            return false;
+        }
+
+        ssize_t sent = send(Socket, data, allowed_bytes, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += sent;
+        bytes -= sent;
+        SentBytes += sent;
+    }
+    return true;
+}
+
+bool RTMPPublisher::WaitForAckWindow(size_t& allowed_bytes)
+{
+    const int kTimeoutMsec = 5000;
+    uint64_t wait_start_usec = 0;
+
+    for (;;) {
+        // Any limit type is applied as given
+        const uint32_t limit = Session.MaxUnackedBytes;
+        if (limit == 0) {
+            return true; // Server did not set one
+        }
+
+        const uint32_t unacked = static_cast<uint32_t>( SentBytes - AckBaseBytes ) - Session.AckSequenceNumber;
+        if (unacked < limit) {
+            allowed_bytes = std::min<size_t>(allowed_bytes, limit - unacked);
+            if (wait_start_usec != 0) {
+                AckWaitUsec += GetMonotonicUsec() - wait_start_usec;
+            }
+            return true;
+        }
+
+        if (wait_start_usec == 0) {
+            wait_start_usec = GetMonotonicUsec();
+            AckWaits++;
+        } else if (GetMonotonicUsec() - wait_start_usec > kTimeoutMsec * 1000ULL) {
+            RTMP_LOG(RTMP_LOG_WARNING, "Timed out waiting for an ack with ", unacked, " bytes unacknowledged");
+            return false;
+        }
+
+        pollfd pfd{};
+        pfd.fd = Socket;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+            return false;
+        }
+
+        ssize_t received = recv(Socket, RecvBuffer.data(), RecvBuffer.size(), MSG_DONTWAIT);
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return false;
+        }
+        if (received > 0) {
+            Session.ParseChunk(RecvBuffer.data(), static_cast<int>( received ));
+        }
+    }
+}
+
+bool RTMPPublisher::RecvAll(uint8_t* data, size_t bytes)
+{
+    while (bytes > 0) {
+        ssize_t received = recv(Socket, data, bytes, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += received;
+        bytes -= received;
+    }
+    return true;
+}
+
+bool RTMPPublisher::SendOut()
+{
+    bool success = SendAll(Out.GetData(), Out.GetLength());
+    Out.Clear();
+    return success;
+}
+
+bool RTMPPublisher::Handshake()
+{
+    uint8_t c0c1[1 + 1536];
+    const uint32_t timestamp = static_cast<uint32_t>( GetMsec() );
+
+    c0c1[0] = kRtmpS0ServerVersion;
+    WriteUInt32(c0c1 + 1, timestamp);
+    WriteUInt32(c0c1 + 1 + 4, 0);
+    FillRandomBuffer(c0c1 + 1 + 8, 1536 - 8, timestamp ^ static_cast<uint32_t>( Socket ));
+
+    if (Settings.C1DelayMsec > 0) {
+        if (!SendAll(c0c1, 1)) {
+            return false;
+        }
+        SleepMsec(Settings.C1DelayMsec);
+        if (!SendAll(c0c1 + 1, 1536)) {
+            return false;
+        }
+    } else if (!SendAll(c0c1, sizeof(c0c1))) {
+        return false;
+    }
+
+    uint8_t s0s1s2[1 + 1536 + 1536];
+    if (!RecvAll(s0s1s2, sizeof(s0s1s2))) {
+        return false;
+    }
+    if (s0s1s2[0] != kRtmpS0ServerVersion) {
+        RTMP_LOG(RTMP_LOG_WARNING, "Invalid version from server = ", (int)s0s1s2[0]);
+        return false;
+    }
+
+    SleepMsec(Settings.C2DelayMsec);
+
+    // C2 echoes S1
+    uint8_t c2[1536];
+    memcpy(c2, s0s1s2 + 1, 1536);
+    WriteUInt32(c2 + 4, static_cast<uint32_t>( GetMsec() ));
+
+    if (!SendAll(c2, sizeof(c2))) {
+        return false;
+    }
+
+    AckBaseBytes = SentBytes;
+    HandshakeDone = true;
+    return true;
+}
+
+bool RTMPPublisher::SendConnect()
+{
+    const std::string tc_url = "rtmp://" + Host + ":" + std::to_string(Port) + "/" + Settings.App;
+
+    ByteStreamWriter amf;
+    amf.WriteUInt8(StringMarker);
+    amf.WriteAmf0String("connect");
+    amf.WriteUInt8(NumberMarker);
+    amf.WriteDouble(++TransactionId);
+    amf.WriteUInt8(ObjectMarker);
+        amf.WriteAmf0String("app");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String(Settings.App);
+
+        amf.WriteAmf0String("type");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String("nonprivate");
+
+        amf.WriteAmf0String("flashVer");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String("FMLE/3.0 (compatible; rtmp_loadgen)");
+
+        amf.WriteAmf0String("tcUrl");
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String(tc_url);
+
+        amf.WriteUInt16(0);
+    amf.WriteUInt8(ObjectEndMarker);
+
+    Writer.WriteMessage(Out, kCommandChunkStream, COMMAND_AMF0, 0, 0, amf.GetData(), static_cast<int>( amf.GetLength() ));
+    ++ExpectedResponses;
+    return SendOut();
+}
+
+bool RTMPPublisher::SendCommand(const std::string& name, const std::string& arg)
+{
+    ByteStreamWriter amf;
+    amf.WriteUInt8(StringMarker);
+    amf.WriteAmf0String(name);
+    amf.WriteUInt8(NumberMarker);
+    amf.WriteDouble(++TransactionId);
+    amf.WriteUInt8(NullMarker);
+    if (!arg.empty()) {
+        amf.WriteUInt8(StringMarker);
+        amf.WriteAmf0String(arg);
+    }
+
+    // publish is sent on the stream created by createStream
+    const uint32_t stream_id = (name == "publish") ? StreamId : 0;
+
+    Writer.WriteMessage(Out, kCommandChunkStream, COMMAND_AMF0, stream_id, 0, amf.GetData(), static_cast<int>( amf.GetLength() ));
+    ++ExpectedResponses;
+    return SendOut();
+}
+
+bool RTMPPublisher::WaitForResponses()
+{
+    while (Responses < ExpectedResponses) {
+        ssize_t received = recv(Socket, RecvBuffer.data(), RecvBuffer.size(), 0);
+        if (received <= 0) {
+            return false;
+        }
+        Session.ParseChunk(RecvBuffer.data(), static_cast<int>( received ));
+    }
+    return true;
+}
+
+bool RTMPPublisher::Setup()
+{
+    // Larger chunks first so the commands below use them too
+    uint8_t chunk_size[4];
+    WriteUInt32(chunk_size, Settings.ChunkSize);
+    Writer.WriteMessage(Out, kControlChunkStream, CHUNK_SIZE, 0, 0, chunk_size, sizeof(chunk_size));
+    if (!SendOut()) {
+        return false;
+    }
+    Writer.ChunkSize = Settings.ChunkSize;
+
+    if (!SendConnect() || !WaitForResponses()) {
+        return false;
+    }
+
+    // Like FFmpeg and OBS, do not wait for responses to these
+    if (!SendCommand("releaseStream", Settings.StreamKey) ||
+        !SendCommand("FCPublish", Settings.StreamKey) ||
+        !SendCommand("createStream", "") ||
+        !WaitForResponses())
+    {
+        return false;
+    }
+
+    return SendCommand("publish", Settings.StreamKey) && WaitForResponses() && !Rejected;
+}
+
+bool RTMPPublisher::SendVideoHeader(const std::vector<uint8_t>& extradata)
+{
+    Payload.clear();
+    Payload.push_back((VIDEO_FRAME_TYPE_KEY << 4) | VIDEO_CODEC_H264);
+    Payload.push_back(AVC_SEQUENCE_HEADER);
+    Payload.push_back(0); // Composition time
+    Payload.push_back(0);
+    Payload.push_back(0);
+    AppendDataToVector(Payload, extradata.data(), static_cast<int>( extradata.size() ));
+
+    Writer.WriteMessage(Out, kVideoChunkStream, VIDEO, StreamId, 0, Payload.data(), static_cast<int>( Payload.size() ));
+    return SendOut();
+}
+
+bool RTMPPublisher::SendVideo(bool keyframe, uint32_t timestamp, const std::vector<uint8_t>& avcc, int32_t composition_time)
+{
+    const int frame_type = keyframe ? VIDEO_FRAME_TYPE_KEY : VIDEO_FRAME_TYPE_INTER;
+
+    Payload.clear();
+    Payload.push_back(static_cast<uint8_t>( (frame_type << 4) | VIDEO_CODEC_H264 ));
+    Payload.push_back(AVC_NALU);
+    Payload.push_back(static_cast<uint8_t>( composition_time >> 16 )); // SI24 composition time
+    Payload.push_back(static_cast<uint8_t>( composition_time >> 8 ));
+    Payload.push_back(static_cast<uint8_t>( composition_time ));
+    AppendDataToVector(Payload, avcc.data(), static_cast<int>( avcc.size() ));
+
+    Writer.WriteMessage(Out, kVideoChunkStream, VIDEO, StreamId, timestamp, Payload.data(), static_cast<int>( Payload.size() ));
+    return SendOut();
+}
+
+void RTMPPublisher::DrainIncoming()
+{
+    for (;;) {
+        ssize_t received = recv(Socket, RecvBuffer.data(), RecvBuffer.size(), MSG_DONTWAIT);
+        if (received <= 0) {
+            return;
+        }
+        Session.ParseChunk(RecvBuffer.data(), static_cast<int>( received ));
+    }
+}
+
+void RTMPPublisher::OnNeedAck(uint32_t bytes)
+{
+    // The receiver sends very little so acks are not needed
+    UNUSED(bytes);
+}
+
+void RTMPPublisher::OnMessage(const RTMPCommand& command)
+{
+    if (command.Type != COMMAND_AMF0) {
+        return;
+    }
+
+    // publish is answered with onStatus, at error level if it was refused
+    if (command.Name == "onStatus" && command.Level == "error") {
+        RTMP_LOG(RTMP_LOG_WARNING, "Publish rejected: ", command.Code);
+        Rejected = true;
+    }
+    ++Responses;
+}
+
+void RTMPPublisher::OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace)
+{
+    UNUSED(keyframe);
+    UNUSED(stream);
+    UNUSED(timestamp);
+    UNUSED(data);
+    UNUSED(bytes);
+    UNUSED(trace);
+}
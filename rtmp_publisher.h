@@ -0,0 +1,195 @@
+#ifndef RTMP_PUBLISHER_H
+#define RTMP_PUBLISHER_H
+
+#include "rtmp_parser.h"
+#include "bytestream.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+
+//------------------------------------------------------------------------------
+// H264Stream
+
+// Pre-encoded video for publishing, already converted to the AVCC format RTMP carries
+struct H264AccessUnit {
+    bool Keyframe = false;
+
+    // NALUs with 4-byte big-endian length prefixes
+    std::vector<uint8_t> Avcc;
+};
+
+class H264Stream {
+public:
+    // Load an Annex B elementary stream (e.g. from `ffmpeg -c:v copy -f h264`)
+    bool LoadAnnexB(const std::string& path);
+    bool ParseAnnexB(const uint8_t* data, size_t size);
+
+    // Generate random slice data with the given sizes when no encoded file is available
+    void Synthesize(int frames, int keyframe_interval, int frame_bytes, uint32_t seed);
+
+    // AVCDecoderConfigurationRecord from the first SPS and PPS
+    std::vector<uint8_t> Extradata;
+
+    std::vector<H264AccessUnit> Frames;
+
+private:
+    std::vector<uint8_t> SPS, PPS;
+
+    // Access unit boundary detection
+    bool StartNewFrame = true;
+    bool CurrentHasSlice = false;
+
+    void AddNalu(const uint8_t* data, size_t size);
+    void BuildExtradata();
+};
+
+
+//------------------------------------------------------------------------------
+// RTMPChunkWriter
+
+// Controls how aggressively message headers are compressed
+enum ChunkFmtPattern {
+    // Every message starts with a type 0 chunk
+    FMT_PATTERN_FULL,
+
+    // Smallest header the previous message on the chunk stream allows
+    FMT_PATTERN_COMPRESSED,
+
+    // Alternate between full and compressed headers
+    FMT_PATTERN_MIXED
+};
+
+class RTMPChunkWriter {
+public:
+    uint32_t ChunkSize = 128;
+    ChunkFmtPattern Pattern = FMT_PATTERN_COMPRESSED;
+
+    // Append a message split into ChunkSize chunks
+    void WriteMessage(
+        ByteStreamWriter& out,
+        uint32_t cs_id,
+        uint8_t type_id,
+        uint32_t stream_id,
+        uint32_t timestamp,
+        const uint8_t* data,
+        int bytes);
+
+    // Forget previous headers, e.g. for a new connection
+    void Reset();
+
+private:
+    struct PreviousHeader {
+        uint32_t Timestamp = 0;
+        uint32_t Delta = 0;
+        uint32_t Length = 0;
+        uint8_t TypeId = 0;
+        uint32_t StreamId = 0;
+    };
+
+    std::unordered_map<uint32_t, PreviousHeader> Previous;
+    uint64_t MessageCount = 0;
+
+    void WriteBasicHeader(ByteStreamWriter& out, int fmt, uint32_t cs_id);
+};
+
+
+//------------------------------------------------------------------------------
+// RTMPPublisher
+
+struct RTMPPublisherSettings {
+    uint32_t ChunkSize = 4096;
+    ChunkFmtPattern FmtPattern = FMT_PATTERN_COMPRESSED;
+
+    // Handshake timing: Delay before sending C1 (after C0) and before sending C2
+    int C1DelayMsec = 0;
+    int C2DelayMsec = 0;
+
+    std::string App = "live";
+    std::string StreamKey = "stream";
+
+    // Stop sending while the bytes not yet acknowledged by the server reach
+    // its SET_PEER_BANDWIDTH limit, as some hardware encoders do
+    bool HonorPeerBandwidth = false;
+};
+
+// Minimal blocking RTMP client used to generate load against the receiver
+class RTMPPublisher : protected RTMPHandler {
+public:
+    ~RTMPPublisher() {
+        Close();
+    }
+
+    // Retries until the server is listening or the timeout expires.  host is
+    // an IPv4 or IPv6 literal, or "unix:<path>" for a Unix domain socket
+    // (port is then only used in the tcUrl)
+    bool Connect(const std::string& host, int port, const RTMPPublisherSettings& settings, int timeout_msec = 2000);
+
+    // Publishes over a socket that is already connected, e.g. one end of a
+    // socketpair().  Takes ownership
+    void Attach(int socket, const RTMPPublisherSettings& settings, int timeout_msec = 2000);
+
+    bool Handshake();
+
+    // connect, createStream and publish, waiting for each response.  Fails
+    // if the server rejects the stream key
+    bool Setup();
+
+    bool SendVideoHeader(const std::vector<uint8_t>& extradata);
+    // composition_time: Signed PTS - DTS offset in msec, for streams with B-frames
+    bool SendVideo(bool keyframe, uint32_t timestamp, const std::vector<uint8_t>& avcc, int32_t composition_time = 0);
+
+    // Discard acks and other messages from the server without blocking
+    void DrainIncoming();
+
+    void Close();
+
+    uint64_t SentBytes = 0;
+
+    // Server answered publish with an error onStatus
+    bool Rejected = false;
+
+    // With HonorPeerBandwidth: Times sending blocked on an ack, and for how long
+    uint64_t AckWaits = 0;
+    uint64_t AckWaitUsec = 0;
+
+private:
+    int Socket = -1;
+    RTMPPublisherSettings Settings;
+    std::string Host;
+    int Port = 0;
+
+    RTMPChunkWriter Writer;
+    ByteStreamWriter Out;
+    double TransactionId = 0;
+    uint32_t StreamId = 1;
+
+    // Parses responses from the server
+    RollingBuffer Buffer;
+    RTMPSession Session;
+    int Responses = 0;
+    int ExpectedResponses = 0;
+
+    std::vector<uint8_t> RecvBuffer;
+    std::vector<uint8_t> Payload;
+
+    // SentBytes when the handshake finished.  The server acks bytes after it
+    uint64_t AckBaseBytes = 0;
+    bool HandshakeDone = false;
+
+    bool SendAll(const uint8_t* data, size_t bytes);
+    bool WaitForAckWindow(size_t& allowed_bytes);
+    bool RecvAll(uint8_t* data, size_t bytes);
+    bool SendOut();
+    bool SendConnect();
+    bool SendCommand(const std::string& name, const std::string& arg);
+    bool WaitForResponses();
+
+    void OnNeedAck(uint32_t bytes) override;
+    void OnMessage(const RTMPCommand& command) override;
+    void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace) override;
+};
+
+#endif // RTMP_PUBLISHER_H
@@ -1,454 +1,1915 @@
 #include "rtmp_receiver.h"
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 
 #include "rtmp_parser.h"
 #include "bytestream.h"
 #include "rtmp_tools.h"
+#include "rtmp_responses.h"
+#include "rtmp_log.h"
+#include "rtmp_delivery.h"
 
-#include <iostream>
-#include <iomanip>
 using namespace std;
 
 
 //------------------------------------------------------------------------------
 // Tools
 
+// Responses queued for a peer that is not reading before the session stops reading too
+static const size_t kMaxQueuedOutputBytes = 256 * 1024;
+
+// Reads a non-blocking socket until it is empty
+static void DrainSocket(int s) {
+    char buffer[64];
+    while (read(s, buffer, sizeof(buffer)) > 0) {
+    }
+}
+
 static void SetNonBlocking(int s) {
     int flags = fcntl(s, F_GETFL, 0);
     if (flags < 0) {
         perror("fcntl failed");
         return;
     }
-    flags |= O_NONBLOCK;
-    if (fcntl(s, F_SETFL, flags) < 0) {
-        perror("fcntl failed");
-        return;
+    flags |= O_NONBLOCK;
+    if (fcntl(s, F_SETFL, flags) < 0) {
+        perror("fcntl failed");
+        return;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// TimestampUnwrapper
+
+int64_t TimestampUnwrapper::Unwrap(uint32_t timestamp)
+{
+    if (!HasLast) {
+        HasLast = true;
+        Last = timestamp;
+        Extended = timestamp;
+        return Extended;
+    }
+
+    Extended += static_cast<int32_t>( timestamp - Last );
+    Last = timestamp;
+    return Extended;
+}
+
+void TimestampUnwrapper::SaveState(ByteStreamWriter& out) const
+{
+    out.WriteUInt8(HasLast ? 1 : 0);
+    out.WriteUInt32(Last);
+    out.WriteUInt64(static_cast<uint64_t>( Extended ));
+}
+
+bool TimestampUnwrapper::RestoreState(ByteStream& in)
+{
+    HasLast = in.ReadUInt8() != 0;
+    Last = in.ReadUInt32();
+    Extended = static_cast<int64_t>( in.ReadUInt64() );
+    return !in.HasError();
+}
+
+
+//------------------------------------------------------------------------------
+// PresentationReorderer
+
+void PresentationReorderer::SetDepth(int depth)
+{
+    Depth = depth > 0 ? depth : 0;
+}
+
+void PresentationReorderer::Push(const RTMPVideoFrame& frame, const RTMPFrameCallback& emit)
+{
+    if (Depth <= 0 && Held.empty()) {
+        emit(frame);
+        return;
+    }
+
+    // Frames before a keyframe in decode order are presented before it
+    if (frame.Keyframe) {
+        Flush(emit);
+    }
+
+    std::unique_ptr<HeldFrame> held;
+    if (!Free.empty()) {
+        held = std::move(Free.back());
+        Free.pop_back();
+    } else {
+        held.reset(new HeldFrame);
+    }
+
+    held->Frame = frame;
+    held->Data.assign(frame.Data, frame.Data + frame.Bytes);
+    held->Frame.Data = held->Data.data();
+    Held.push_back(std::move(held));
+
+    while (static_cast<int>( Held.size() ) > Depth) {
+        EmitEarliest(emit);
+    }
+}
+
+void PresentationReorderer::Flush(const RTMPFrameCallback& emit)
+{
+    while (!Held.empty()) {
+        EmitEarliest(emit);
+    }
+}
+
+void PresentationReorderer::EmitEarliest(const RTMPFrameCallback& emit)
+{
+    // Held is at most a few frames so a linear scan beats a heap
+    size_t earliest = 0;
+    for (size_t i = 1; i < Held.size(); ++i) {
+        if (Held[i]->Frame.Pts < Held[earliest]->Frame.Pts) {
+            earliest = i;
+        }
+    }
+
+    std::unique_ptr<HeldFrame> held = std::move(Held[earliest]);
+    Held.erase(Held.begin() + earliest);
+
+    emit(held->Frame);
+
+    Free.push_back(std::move(held));
+}
+
+
+//------------------------------------------------------------------------------
+// RTMPConnection
+
+VideoStreamState& RTMPConnection::FindStreamState(uint32_t stream)
+{
+    std::unique_ptr<VideoStreamState>& stream_state = VideoStreams[stream];
+    if (!stream_state) {
+        stream_state.reset(new VideoStreamState);
+    }
+
+    LastStreamId = stream;
+    LastStream = stream_state.get();
+    return *stream_state;
+}
+
+
+// The configured delivery CPUs, or the other CPUs on the receiver's node
+static std::vector<int> GetDeliveryCpus(const RTMPPlacementSettings& placement)
+{
+    if (!placement.DeliveryCpus.empty() || placement.ReceiverCpus.empty()) {
+        return placement.DeliveryCpus;
+    }
+
+    const int node = GetCommonNode(placement.ReceiverCpus);
+    if (node < 0) {
+        return std::vector<int>();
+    }
+    std::vector<int> cpus = GetNodeCpus(node);
+
+    // Share the receiver's CPUs only if the node has no others
+    std::vector<int> others;
+    for (int cpu : cpus) {
+        if (std::find(placement.ReceiverCpus.begin(), placement.ReceiverCpus.end(), cpu) == placement.ReceiverCpus.end()) {
+            others.push_back(cpu);
+        }
+    }
+    return others.empty() ? cpus : others;
+}
+
+
+//------------------------------------------------------------------------------
+// RTMPReceiverBase
+
+bool RTMPReceiverBase::StartServer(int port, bool enable_logging)
+{
+    Port = port;
+    EnableLogging = enable_logging;
+
+    BuildResponses();
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ControlSock) < 0) {
+        perror("socketpair failed");
+        return false;
+    }
+    SetNonBlocking(ControlSock[0]);
+    SetNonBlocking(ControlSock[1]); // Set write end non-blocking
+
+    Terminated = false;
+    HandedOff = false;
+
+    if (Backpressure.HighWatermarkBytes > 0) {
+        Delivery = std::make_shared<FrameDeliveryThread>();
+        Delivery->Start([this](DeliveryEntry& entry) {
+            if (entry.IsSetup) {
+                DeliverQueuedSetup(entry.Handler, entry.Stream, entry.SetupResult);
+            } else {
+                DeliverQueuedFrame(entry.Handler, entry.Frame);
+            }
+        }, GetDeliveryCpus(Placement), GetBufferArena());
+    }
+
+    Thread = std::make_shared<std::thread>(&RTMPReceiverBase::ThreadLoop, this);
+
+    std::lock_guard<std::mutex> locker(AddedLock);
+    AcceptingAdded = true;
+    return true;
+}
+
+void RTMPReceiverBase::BuildResponses() {
+    Responses.Build(
+        FlowSettings.WindowAckSize,
+        FlowSettings.PeerBandwidth,
+        FlowSettings.LimitType,
+        FlowSettings.ChunkSize);
+}
+
+void RTMPReceiverBase::SetCapturePath(const std::string& path_prefix) {
+    CapturePath = path_prefix;
+}
+
+void RTMPReceiverBase::SetReorder(int max_reorder_frames) {
+    MaxReorderFrames = max_reorder_frames;
+}
+
+void RTMPReceiverBase::SetFlowSettings(const RTMPFlowSettings& settings) {
+    FlowSettings = settings;
+}
+
+void RTMPReceiverBase::SetTimeouts(const RTMPTimeoutSettings& timeouts) {
+    Timeouts = timeouts;
+}
+
+void RTMPReceiverBase::SetBackpressure(const RTMPBackpressureSettings& backpressure) {
+    Backpressure = backpressure;
+}
+
+void RTMPReceiverBase::SetListen(const RTMPListenSettings& listen) {
+    Listen = listen;
+}
+
+void RTMPReceiverBase::SetPlacement(const RTMPPlacementSettings& placement) {
+    Placement = placement;
+}
+
+bool RTMPReceiverBase::GetPlacement(RTMPPlacement& placement) const {
+    placement = RTMPPlacement();
+    if (!Thread) {
+        return false;
+    }
+
+    placement.ReceiverCpus = GetThreadCpus(Thread->native_handle());
+    const int thread_id = ThreadId.load();
+    if (thread_id >= 0) {
+        placement.ReceiverCpu = GetThreadCurrentCpu(thread_id);
+    }
+    if (placement.ReceiverCpu >= 0) {
+        placement.ReceiverNode = GetCpuNode(placement.ReceiverCpu);
+    }
+
+    if (Delivery) {
+        placement.DeliveryCpus = Delivery->GetCpus();
+        placement.DeliveryCpu = Delivery->GetCurrentCpu();
+        if (placement.DeliveryCpu >= 0) {
+            placement.DeliveryNode = GetCpuNode(placement.DeliveryCpu);
+        }
+    }
+
+    Arena.GetStats(placement.Memory);
+    return true;
+}
+
+void RTMPReceiverBase::SetSocketSettings(const RTMPSocketSettings& sockets) {
+    Sockets = sockets;
+    if (Sockets.RecvBufferBytes <= 0) {
+        Sockets.RecvBufferBytes = RTMPSocketSettings().RecvBufferBytes;
+    }
+}
+
+bool RTMPReceiverBase::AddConnection(int socket) {
+    // Held across the wakeup so Stop() cannot close the control socket under it
+    std::lock_guard<std::mutex> locker(AddedLock);
+    if (!AcceptingAdded) {
+        close(socket);
+        return false;
+    }
+    AddedSockets.push_back(socket);
+    HasAddedSockets = true;
+
+    char add = 'a';
+    if (write(ControlSock[1], &add, sizeof(add)) < 0 && errno != EAGAIN) {
+        perror("write failed");
+    }
+    return true;
+}
+
+void RTMPReceiverBase::SetDefaultRoute(const RTMPAdmissionLimits& limits, bool require_route) {
+    DefaultLimits = limits;
+    RequireRoute = require_route;
+}
+
+void RTMPReceiverBase::SetMaxSendBytes(int max_bytes) {
+    MaxSendBytes = max_bytes;
+}
+
+void RTMPReceiverBase::SetMetrics(MetricsRegistry* metrics) {
+    Metrics = metrics;
+}
+
+void RTMPReceiverBase::GetLatencyStats(RTMPLatencyStats& stats) const {
+    for (int i = 0; i < LATENCY_STAGE_COUNT; ++i) {
+        stats.Stages[i] = LatencySnapshot();
+        RTMP_TRACE(LatencyHistograms[i].Snapshot(stats.Stages[i]);)
+    }
+}
+
+uint64_t RTMPReceiverBase::GetThreadCpuUsec() const {
+    if (!Thread) {
+        return 0;
+    }
+
+    clockid_t clock_id;
+    if (pthread_getcpuclockid(Thread->native_handle(), &clock_id) != 0) {
+        return 0;
+    }
+    timespec ts{};
+    if (clock_gettime(clock_id, &ts) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void RTMPReceiverBase::Stop() {
+    if (!Thread) {
+        return; // Not running
+    }
+    const uint64_t t0 = GetMonotonicUsec();
+    Terminated = true;
+
+    // Sockets added from here on are closed by AddConnection()
+    {
+        std::lock_guard<std::mutex> locker(AddedLock);
+        AcceptingAdded = false;
+    }
+
+    // The thread only ever waits in epoll_wait() or in the bind retry poll(),
+    // and both watch ControlSock[0].  Sessions waiting on a quiet client are
+    // suspended coroutines, destroyed by Loop.Shutdown() on the way out
+    char stop = 's';
+    if (write(ControlSock[1], &stop, sizeof(stop)) < 0 && errno != EAGAIN) {
+        perror("write failed"); // EAGAIN: A wakeup is already pending
+    }
+
+    // Wait for the thread to exit
+    if (Thread && Thread->joinable()) {
+        Thread->join();
+    }
+    Thread = nullptr;
+
+    // Frames still queued are discarded rather than waiting on the callback
+    if (Delivery) {
+        Delivery->Stop();
+        Delivery = nullptr;
+    }
+
+    close(ControlSock[0]);
+    close(ControlSock[1]);
+
+    // Sockets added after the thread stopped looking
+    {
+        std::lock_guard<std::mutex> locker(AddedLock);
+        for (int s : AddedSockets) {
+            close(s);
+        }
+        AddedSockets.clear();
+        HasAddedSockets = false;
+    }
+
+    if (Listen.Transport == RTMP_TRANSPORT_FD && Listen.ListenFd >= 0) {
+        close(Listen.ListenFd);
+        Listen.ListenFd = -1;
+    }
+
+    LastStopUsec = GetMonotonicUsec() - t0;
+    if (EnableLogging) {
+        RTMP_LOG(RTMP_LOG_INFO, "Receiver on port ", Port, " stopped in ", LastStopUsec, " usec");
+    }
+}
+
+// RunServer() only returns early if the listening socket could not be set up,
+// e.g. while the port is still held by a previous process.  Retry quickly so
+// publishers reconnecting to a restarted receiver are not turned away for long
+static const int kMinRetryMsec = 10;
+static const int kMaxRetryMsec = 500;
+
+void RTMPReceiverBase::ThreadLoop() {
+    // Pin before allocating, so the pages are faulted in on the right node
+    PinCurrentThread(Placement.ReceiverCpus);
+    ThreadId = GetCurrentThreadId();
+
+    // The region is kept across restarts, since blocks may still be in use.
+    // If it cannot be mapped, everything comes from the heap
+    const size_t recv_bytes = static_cast<size_t>( Sockets.RecvBufferBytes );
+    if (!Arena.IsCreated()) {
+        NodeBufferPages pages = NODE_PAGES_DEFAULT;
+        if (Placement.HugeTlb) {
+            pages = NODE_PAGES_HUGETLB;
+        } else if (Placement.HugePages) {
+            pages = NODE_PAGES_THP;
+        }
+        if (!Arena.Create(BufferArena::GetBlockBytes(recv_bytes) + Placement.ArenaBytes,
+            GetCommonNode(Placement.ReceiverCpus), pages))
+        {
+            RTMP_LOG(RTMP_LOG_WARNING, "Buffer arena unavailable: Using the heap");
+        }
+    }
+
+    // Carved first, so it always fits in the region
+    RecvBuffer = ArenaBytes(ArenaAllocator<uint8_t>(&Arena));
+    RecvBuffer.resize(recv_bytes);
+
+    int retry_msec = kMinRetryMsec;
+
+    // Keep running until the thread is stopped
+    while (!Terminated) {
+        RunServer();
+        if (Terminated) {
+            break;
+        }
+
+        // Back off without delaying Stop()
+        pollfd pfd{};
+        pfd.fd = ControlSock[0];
+        pfd.events = POLLIN;
+        poll(&pfd, 1, retry_msec);
+
+        // Wakeups from AddConnection() are handled once the server is up
+        DrainSocket(ControlSock[0]);
+
+        // No listening socket to hand over
+        CancelHandoff();
+
+        retry_msec = std::min(retry_msec * 2, kMaxRetryMsec);
+    }
+
+    CancelHandoff();
+}
+
+// Fills addr for a numeric IPv4 or IPv6 address, optionally in brackets.
+// Empty = the IPv6 or IPv4 wildcard address
+static bool GetBindAddress(
+    const std::string& address,
+    int port,
+    bool ipv6_any,
+    sockaddr_storage& addr,
+    socklen_t& addr_bytes)
+{
+    std::string host = address;
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    addr = sockaddr_storage();
+    sockaddr_in* addr4 = reinterpret_cast<sockaddr_in*>( &addr );
+    sockaddr_in6* addr6 = reinterpret_cast<sockaddr_in6*>( &addr );
+
+    if (host.empty() && !ipv6_any) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4->sin_port = htons(port);
+        addr_bytes = sizeof(sockaddr_in);
+        return true;
+    }
+    if (host.empty()) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons(port);
+        addr_bytes = sizeof(sockaddr_in6);
+        return true;
+    }
+    if (inet_pton(AF_INET, host.c_str(), &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        addr_bytes = sizeof(sockaddr_in);
+        return true;
+    }
+    if (inet_pton(AF_INET6, host.c_str(), &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        addr_bytes = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+int RTMPReceiverBase::OpenListenSocket() {
+    if (Listen.Transport == RTMP_TRANSPORT_FD) {
+        if (Listen.ListenFd < 0) {
+            RTMP_LOG(RTMP_LOG_ERROR, "No listening socket given");
+            return -1;
+        }
+        SetNonBlocking(Listen.ListenFd);
+        ListenName = "fd " + std::to_string(Listen.ListenFd);
+        return Listen.ListenFd;
+    }
+
+    sockaddr_storage addr{};
+    socklen_t addr_bytes = 0;
+    if (Listen.Transport == RTMP_TRANSPORT_UNIX) {
+        if (!GetUnixAddress(Listen.UnixPath, reinterpret_cast<sockaddr_un&>( addr ), addr_bytes)) {
+            RTMP_LOG(RTMP_LOG_ERROR, "Invalid Unix socket path ", Listen.UnixPath);
+            return -1;
+        }
+        ListenName = "unix " + Listen.UnixPath;
+    } else {
+        if (!GetBindAddress(Listen.BindAddress, Port, true, addr, addr_bytes)) {
+            RTMP_LOG(RTMP_LOG_ERROR, "Invalid bind address ", Listen.BindAddress);
+            return -1;
+        }
+    }
+
+    int s = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s < 0 && errno == EAFNOSUPPORT && Listen.Transport == RTMP_TRANSPORT_TCP && Listen.BindAddress.empty()) {
+        // Kernel without IPv6: all interfaces over IPv4
+        GetBindAddress(Listen.BindAddress, Port, false, addr, addr_bytes);
+        s = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if (s < 0) {
+        perror("socket failed");
+        return -1;
+    }
+
+    if (addr.ss_family == AF_UNIX) {
+        // A previous process that did not exit cleanly leaves its socket file
+        struct stat st;
+        if (Listen.UnixPath[0] != '@' && lstat(Listen.UnixPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(Listen.UnixPath.c_str());
+        }
+    } else {
+        int optval = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+            perror("setsockopt failed");
+            close(s);
+            return -1;
+        }
+
+        if (addr.ss_family == AF_INET6) {
+            const int v6only = Listen.DualStack ? 0 : 1;
+            if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+                perror("setsockopt IPV6_V6ONLY failed");
+            }
+        }
+
+        char host[INET6_ADDRSTRLEN] = {};
+        const void* in_addr = (addr.ss_family == AF_INET6) ?
+            static_cast<const void*>( &reinterpret_cast<sockaddr_in6*>( &addr )->sin6_addr ) :
+            static_cast<const void*>( &reinterpret_cast<sockaddr_in*>( &addr )->sin_addr );
+        inet_ntop(addr.ss_family, in_addr, host, sizeof(host));
+        ListenName = (addr.ss_family == AF_INET6) ?
+            "tcp [" + std::string(host) + "]:" + std::to_string(Port) :
+            "tcp " + std::string(host) + ":" + std::to_string(Port);
+    }
+
+    // Accepted sockets inherit these, and the window scale offered in the
+    // SYN-ACK is chosen from the receive buffer
+    if (Sockets.ReceiveBufferBytes > 0) {
+        SetSocketOption(s, SOL_SOCKET, SO_RCVBUF, Sockets.ReceiveBufferBytes, "SO_RCVBUF");
+    }
+    if (Sockets.SendBufferBytes > 0) {
+        SetSocketOption(s, SOL_SOCKET, SO_SNDBUF, Sockets.SendBufferBytes, "SO_SNDBUF");
+    }
+
+    if (::bind(s, reinterpret_cast<sockaddr*>(&addr), addr_bytes) < 0) {
+        perror("bind failed");
+        close(s);
+        return -1;
+    }
+
+    if (listen(s, SOMAXCONN) < 0) {
+        perror("listen failed");
+        CloseListenSocket(s);
+        return -1;
+    }
+
+    return s;
+}
+
+void RTMPReceiverBase::CloseListenSocket(int server_socket) {
+    // An inherited socket is kept across retries and closed by Stop()
+    if (server_socket < 0 || Listen.Transport == RTMP_TRANSPORT_FD) {
+        return;
+    }
+    close(server_socket);
+
+    // After a hand off the successor listens on the same socket
+    if (Listen.Transport == RTMP_TRANSPORT_UNIX && Listen.UnixPath[0] != '@' && !HandedOff) {
+        unlink(Listen.UnixPath.c_str());
+    }
+}
+
+void RTMPReceiverBase::RunServer() {
+    // Without a listener the loop still serves AddConnection()
+    int s = -1;
+    if (Listen.Transport != RTMP_TRANSPORT_NONE) {
+        s = OpenListenSocket();
+        if (s < 0) {
+            return;
+        }
+    } else {
+        ListenName = "added sockets only";
+    }
+
+    AutoClose serverSocketCloser([&]() {
+        // Ends every session before the listening socket goes away
+        Loop.Shutdown();
+        CloseListenSocket(s);
+    });
+
+    // The control socket wakes the loop for Stop() and AddConnection()
+    if (!Loop.Initialize() || !Loop.Add(ControlSock[0]) || (s >= 0 && !Loop.Add(s))) {
+        return;
+    }
+
+    if (Sockets.LoopMode == RTMP_LOOP_EPOLL_BUSY_POLL &&
+        !Loop.SetBusyPoll(static_cast<uint32_t>( Sockets.BusyPollUsec ), Sockets.PreferBusyPoll))
+    {
+        RTMP_LOG(RTMP_LOG_WARNING, "epoll busy polling is not available: sleeping in epoll_wait()");
+    }
+
+    if (EnableLogging) {
+        RTMP_LOG(RTMP_LOG_INFO, "RTMP server listening on ", ListenName);
+    }
+
+    // Before accepting, so new clients get Ids after the ones taken over
+    if (!AdoptedSessions.empty()) {
+        AdoptSessions();
+    }
+
+    if (s >= 0) {
+        Loop.Spawn(AcceptConnections(s));
+    }
+
+    // Wake a few times per timeout to check for quiet or throttled sessions
+    const int wait_msec = GetCheckIntervalMsec();
+    CheckIntervalUsec = wait_msec * 1000ULL;
+
+    // Busy polling never sleeps, trading a core for wakeup latency
+    const int run_msec = (Sockets.LoopMode == RTMP_LOOP_BUSY_POLL) ? 0 : wait_msec;
+
+    while (!Terminated) {
+        if (HasAddedSockets) {
+            ServeAddedSockets();
+        }
+        if (HandoffRequest.load() && ServeHandoff(s)) {
+            break;
+        }
+        Loop.RunOnce(run_msec);
+        if (wait_msec > 0) {
+            CheckSessions();
+        }
+    }
+}
+
+void RTMPReceiverBase::ServeAddedSockets() {
+    HasAddedSockets = false;
+
+    // So the edge-triggered control socket fires for the next one
+    DrainSocket(ControlSock[0]);
+
+    std::vector<int> added;
+    {
+        std::lock_guard<std::mutex> locker(AddedLock);
+        added.swap(AddedSockets);
+    }
+
+    for (int cs : added) {
+        SetNonBlocking(cs);
+        if (!Loop.Add(cs)) {
+            close(cs);
+            continue;
+        }
+        Loop.Spawn(RunConnection(cs));
+    }
+}
+
+bool RTMPReceiverBase::HandOff(int handoff_socket) {
+    if (!Thread) {
+        return false;
+    }
+
+    std::promise<bool> request;
+    std::future<bool> handed_off = request.get_future();
+    HandoffSocket = handoff_socket;
+    HandoffRequest = &request;
+
+    char handoff = 'h';
+    if (write(ControlSock[1], &handoff, sizeof(handoff)) < 0 && errno != EAGAIN) {
+        perror("write failed");
+    }
+    if (!handed_off.get()) {
+        return false;
+    }
+
+    // The thread has left its loop: close what is left
+    Stop();
+    return true;
+}
+
+bool RTMPReceiverBase::TakeOver(int handoff_socket, int timeout_msec) {
+    if (Thread) {
+        return false; // Already running
+    }
+
+    HandoffMessage begin;
+    if (!ReceiveHandoffMessage(handoff_socket, begin, timeout_msec) || begin.Type != HANDOFF_BEGIN) {
+        RTMP_LOG(RTMP_LOG_ERROR, "Nothing was handed off by the previous receiver");
+        if (begin.Fd >= 0) {
+            close(begin.Fd);
+        }
+        return false;
+    }
+
+    // Host byte order, as sent
+    uint32_t version = 0;
+    if (begin.Data.size() == sizeof(version)) {
+        memcpy(&version, begin.Data.data(), sizeof(version));
+    }
+    if (version != kHandoffVersion) {
+        RTMP_LOG(RTMP_LOG_ERROR, "Hand off from an incompatible receiver");
+        if (begin.Fd >= 0) {
+            close(begin.Fd);
+        }
+        return false;
+    }
+
+    if (begin.Fd >= 0) {
+        Listen = RTMPListenSettings();
+        Listen.Transport = RTMP_TRANSPORT_FD;
+        Listen.ListenFd = begin.Fd;
+    }
+
+    // A predecessor that fails part way through closes the sessions it did
+    // not send, so keep what arrived
+    for (;;) {
+        HandoffMessage message;
+        if (!ReceiveHandoffMessage(handoff_socket, message, timeout_msec)) {
+            RTMP_LOG(RTMP_LOG_WARNING, "Hand off ended early after ", AdoptedSessions.size(), " sessions");
+            break;
+        }
+        if (message.Type == HANDOFF_END) {
+            break;
+        }
+        if (message.Type != HANDOFF_SESSION || message.Fd < 0) {
+            if (message.Fd >= 0) {
+                close(message.Fd);
+            }
+            continue;
+        }
+        AdoptedSessions.push_back(std::move(message));
+    }
+    return true;
+}
+
+void RTMPReceiverBase::CancelHandoff() {
+    std::promise<bool>* request = HandoffRequest.exchange(nullptr);
+    if (request) {
+        request->set_value(false);
+    }
+}
+
+bool RTMPReceiverBase::ServeHandoff(int server_socket) {
+    std::promise<bool>* request = HandoffRequest.exchange(nullptr);
+
+    // So the edge-triggered control socket fires for the next request
+    DrainSocket(ControlSock[0]);
+
+    if (!request) {
+        return false;
+    }
+
+    const uint64_t t0 = GetMonotonicUsec();
+    uint32_t sent_count = 0;
+    const bool handed_off = SendHandoff(server_socket, sent_count);
+
+    if (handed_off) {
+        // Sessions that were not sent close as the loop shuts down
+        HandedOff = true;
+        Terminated = true;
+        if (EnableLogging) {
+            RTMP_LOG(RTMP_LOG_INFO, "Handed off ", sent_count, " sessions in ", GetMonotonicUsec() - t0, " usec");
+        }
+    }
+    request->set_value(handed_off);
+    return handed_off;
+}
+
+bool RTMPReceiverBase::SendHandoff(int server_socket, uint32_t& sent_count) {
+    // Nothing is given up until the successor is there to take it
+    const uint32_t version = kHandoffVersion;
+    if (!SendHandoffMessage(HandoffSocket, HANDOFF_BEGIN, server_socket, &version, sizeof(version), kHandoffTimeoutMsec)) {
+        RTMP_LOG(RTMP_LOG_ERROR, "Successor is not taking over: still running");
+        return false;
+    }
+
+    // Sessions past the handshake stop reading here.  Frames held for
+    // reordering and frames queued for the delivery thread reach the handlers
+    // before the successor delivers anything newer
+    std::vector<RTMPConnection*> handed;
+    for (auto& entry : Sessions) {
+        RTMPConnection& conn = *entry.second;
+        if (conn.Phase == PHASE_CONNECTING || conn.Phase == PHASE_PUBLISHING) {
+            FinishConnection(conn);
+            handed.push_back(&conn);
+        }
+    }
+    if (Delivery) {
+        Delivery->WaitIdle();
+    }
+
+    ByteStreamWriter state;
+    for (RTMPConnection* conn : handed) {
+        state.Clear();
+        SaveConnection(*conn, state);
+        if (!SendHandoffMessage(HandoffSocket, HANDOFF_SESSION, conn->Socket, state.GetData(), state.GetLength(), kHandoffTimeoutMsec)) {
+            RTMP_LOG(RTMP_LOG_ERROR, "Hand off failed after ", sent_count, " sessions: closing the rest");
+            break;
+        }
+        ++sent_count;
+        Metrics->Add(METRIC_SESSIONS_HANDED_OFF);
+    }
+
+    SendHandoffMessage(HandoffSocket, HANDOFF_END, -1, &sent_count, sizeof(sent_count), kHandoffTimeoutMsec);
+    return true;
+}
+
+void RTMPReceiverBase::SaveConnection(RTMPConnection& conn, ByteStreamWriter& out) {
+    out.WriteUInt32(conn.Id);
+    out.WriteUInt8(static_cast<uint8_t>( conn.Phase ));
+    WriteHandoffString(out, conn.App);
+    WriteHandoffString(out, conn.StreamKey);
+    out.WriteUInt8(conn.Admitted ? 1 : 0);
+    out.WriteDouble(conn.DeclaredKbps);
+    out.WriteUInt64(conn.ThrottledUsec);
+    out.WriteUInt8(conn.Shedding ? 1 : 0);
+
+    std::vector<uint8_t> output;
+    conn.Output.CopyQueued(output);
+    WriteHandoffBytes(out, output.data(), output.size());
+
+    conn.Flow.SaveState(out);
+    SaveSession(conn, out);
+
+    // Parameter sets, since the publisher only sends them once
+    out.WriteUInt32(static_cast<uint32_t>( conn.VideoStreams.size() ));
+    for (auto& entry : conn.VideoStreams) {
+        const VideoStreamState& stream_state = *entry.second;
+        const bool has_setup = !stream_state.NewStream && stream_state.avccParser.HasParams;
+        const std::vector<uint8_t>& extradata = stream_state.avccParser.Extradata;
+
+        out.WriteUInt32(entry.first);
+        out.WriteUInt8(has_setup ? 1 : 0);
+        WriteHandoffBytes(out, extradata.data(), has_setup ? extradata.size() : 0);
+        stream_state.Timeline.SaveState(out);
+        out.WriteUInt8(stream_state.HasKeyframe ? 1 : 0);
+        out.WriteUInt32(stream_state.LastKeyframeTimestamp);
+    }
+}
+
+bool RTMPReceiverBase::RestoreConnection(RTMPConnection& conn, ByteStream& in) {
+    const uint64_t now_usec = GetMonotonicUsec();
+
+    conn.Id = in.ReadUInt32();
+    conn.Phase = static_cast<RTMPSessionPhase>( in.ReadUInt8() );
+    if (!ReadHandoffString(in, conn.App) || !ReadHandoffString(in, conn.StreamKey)) {
+        return false;
+    }
+    const bool admitted = in.ReadUInt8() != 0;
+    conn.DeclaredKbps = in.ReadDouble();
+    conn.ThrottledUsec = in.ReadUInt64();
+    conn.Shedding = in.ReadUInt8() != 0;
+
+    const uint8_t* output = nullptr;
+    uint32_t output_bytes = 0;
+    if (!ReadHandoffBytes(in, output, output_bytes)) {
+        return false;
+    }
+    conn.Output.Append(output, static_cast<int>( output_bytes ));
+
+    if (!conn.Flow.RestoreState(FlowSettings, now_usec, in) || !RestoreSession(conn, in)) {
+        return false;
+    }
+
+    const uint32_t stream_count = in.ReadUInt32();
+    for (uint32_t i = 0; i < stream_count && !in.HasError(); ++i) {
+        const uint32_t stream = in.ReadUInt32();
+        const bool has_setup = in.ReadUInt8() != 0;
+        const uint8_t* extradata = nullptr;
+        uint32_t extradata_bytes = 0;
+        if (!ReadHandoffBytes(in, extradata, extradata_bytes)) {
+            return false;
+        }
+
+        VideoStreamState& stream_state = conn.FindStreamState(stream);
+        if (has_setup) {
+            if (!stream_state.avccParser.RestoreExtradata(extradata, static_cast<int>( extradata_bytes ))) {
+                return false;
+            }
+            stream_state.NewStream = false;
+            SetReorderDepth(stream_state);
+        }
+        if (!stream_state.Timeline.RestoreState(in)) {
+            return false;
+        }
+        stream_state.HasKeyframe = in.ReadUInt8() != 0;
+        stream_state.LastKeyframeTimestamp = in.ReadUInt32();
+    }
+    if (in.HasError() || (conn.Phase != PHASE_CONNECTING && conn.Phase != PHASE_PUBLISHING)) {
+        return false;
+    }
+
+    // Setup timing and the stall timer start over here
+    conn.AcceptUsec = 0;
+    conn.LastMediaUsec = now_usec;
+
+    // Admitted by the predecessor: route it here without applying the limits again
+    if (admitted) {
+        RTMPAdmissionLimits limits;
+        if (!FindRoute(conn, conn.StreamKey, limits)) {
+            RejectPublisher(conn, conn.StreamKey, "NetStream.Publish.BadName", "No route for stream key");
+        } else {
+            PublishersByKey[conn.StreamKey].push_back(&conn);
+            conn.Limits = limits;
+            conn.Admitted = true;
+        }
+    }
+    return true;
+}
+
+void RTMPReceiverBase::AdoptSessions() {
+    std::vector<HandoffMessage> adopted;
+    adopted.swap(AdoptedSessions);
+
+    for (HandoffMessage& message : adopted) {
+        const int cs = message.Fd;
+        SetNonBlocking(cs);
+        if (!Loop.Add(cs)) {
+            close(cs);
+            continue;
+        }
+
+        std::unique_ptr<RTMPConnection> conn = CreateConnection();
+        ByteStream in(message.Data.data(), message.Data.size());
+        if (!RestoreConnection(*conn, in)) {
+            // Not admitted yet, so only the socket needs closing
+            RTMP_LOG(RTMP_LOG_ERROR, "Invalid state for a session taken over: closing it");
+            Loop.Remove(cs);
+            close(cs);
+            continue;
+        }
+
+        ConnectionCount = std::max(ConnectionCount, conn->Id + 1);
+        Loop.Spawn(RunConnection(cs, std::move(conn)));
+    }
+}
+
+EventTask RTMPReceiverBase::AcceptConnections(int server_socket) {
+    for (;;) {
+        int cs = accept4(server_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cs < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await Loop.Readable(server_socket);
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                // Out of fds: try again when the next client arrives
+                perror("accept failed");
+                co_await Loop.Readable(server_socket);
+            }
+            continue;
+        }
+
+        if (!Loop.Add(cs)) {
+            close(cs);
+            continue;
+        }
+        Loop.Spawn(RunConnection(cs));
+    }
+}
+
+EventTask RTMPReceiverBase::RunConnection(int client_socket, std::unique_ptr<RTMPConnection> adopted) {
+    const bool resumed = (adopted != nullptr);
+    std::unique_ptr<RTMPConnection> conn = resumed ? std::move(adopted) : CreateConnection();
+    conn->Socket = client_socket;
+
+    if (!resumed) {
+        conn->Id = ConnectionCount++;
+
+        const uint64_t accept_usec = GetMonotonicUsec();
+        conn->AcceptUsec = accept_usec;
+        conn->LastMediaUsec = accept_usec;
+    }
+
+    Metrics->Add(resumed ? METRIC_SESSIONS_ADOPTED : METRIC_CONNECTIONS_ACCEPTED);
+    Metrics->AddActiveSessions(1);
+
+    ApplySocketTimeouts(client_socket);
+    ApplySocketSettings(*conn);
+    Sessions[conn->Id] = conn.get();
+
+    AutoClose clientSocketCloser([&]() {
+        if (conn->Phase == PHASE_HANDSHAKE) {
+            Metrics->Add(METRIC_HANDSHAKES_FAILED);
+        } else {
+            FinishConnection(*conn);
+        }
+
+        ReleasePublisher(*conn);
+        Sessions.erase(conn->Id);
+        if (conn->Backlog) {
+            // The eventfd stays open until the delivery thread drops the backlog
+            Loop.Remove(conn->Backlog->ResumeFd);
+        }
+
+        Loop.Remove(client_socket);
+        close(client_socket);
+
+        Metrics->AddActiveSessions(-1);
+        Metrics->RemoveStreams(Port, conn->Id);
+    });
+
+    if (Delivery) {
+        conn->Backlog = std::make_shared<DeliveryBacklog>();
+        conn->Backlog->LowWatermarkBytes = Backpressure.LowWatermarkBytes;
+        if (conn->Backlog->ResumeFd < 0 || !Loop.Add(conn->Backlog->ResumeFd)) {
+            co_return;
+        }
+    }
+
+    if (resumed) {
+        if (EnableLogging) {
+            RTMP_LOG(RTMP_LOG_INFO, "Client ", conn->Id, " taken over");
+        }
+
+        // The predecessor parsed everything it read, so there is nothing to
+        // parse until more arrives
+        ResumeStreams(*conn);
+    } else {
+        if (EnableLogging) {
+            RTMP_LOG(RTMP_LOG_INFO, "Client ", conn->Id, " connected");
+        }
+
+        OpenCapture(*conn);
+
+        if (!co_await RunHandshake(*conn)) {
+            co_return;
+        }
+
+        conn->Flow.Start(FlowSettings, GetMonotonicUsec());
+
+        // Bytes left over from the handshake are already in the connection buffer
+        ParseReceived(*conn, nullptr, 0, 0);
+    }
+
+    if (conn->Phase == PHASE_CONNECTING) {
+        // connect, createStream and publish
+        if (!co_await Flush(*conn) || !co_await ReceiveSession(*conn, PHASE_PUBLISHING)) {
+            co_return;
+        }
+        if (conn->Phase == PHASE_REJECTED) {
+            co_await Flush(*conn); // Let the client see the error status
+        }
+        if (conn->IsEnding()) {
+            co_return;
+        }
+
+        Metrics->Add(METRIC_PUBLISHES_STARTED);
+        Metrics->Add(METRIC_SETUP_RECV_CALLS, conn->RecvCalls);
+        Metrics->Add(METRIC_SETUP_SEND_CALLS, conn->Output.SendCalls);
+
+        if (EnableLogging) {
+            RTMP_LOG(RTMP_LOG_INFO, "Client ", conn->Id, " publishing");
+        }
+    } else if (!co_await Flush(*conn)) {
+        // Responses the predecessor had not sent yet
+        co_return;
+    }
+
+    // Media until the client disconnects or is dropped: the phase never
+    // returns to handshake
+    co_await ReceiveSession(*conn, PHASE_HANDSHAKE);
+    if (conn->Phase == PHASE_REJECTED) {
+        co_await Flush(*conn);
+    }
+}
+
+AsyncCall<bool> RTMPReceiverBase::RunHandshake(RTMPConnection& conn) {
+    RTMPHandshake handshake;
+    handshake.Buffer = &conn.Buffer;
+
+    // C0: version
+    if (!co_await ReceiveHandshake(conn, handshake, 1)) {
+        co_return false;
+    }
+    if (handshake.State.ClientVersion != kRtmpS0ServerVersion) {
+        RTMP_LOG(RTMP_LOG_WARNING, "Invalid version from client = ", handshake.State.ClientVersion);
+        co_return false;
+    }
+
+    // C1: client random.  The server may wait for C1 before sending S0 and
+    // S1, so S0, S1 and S2 all go out in one send.  Clients send C0 and C1
+    // together, so this does not add a round trip
+    if (!co_await ReceiveHandshake(conn, handshake, 2)) {
+        co_return false;
+    }
+    QueueS0S1(conn);
+    QueueS2(conn, handshake.State.ClientTime1, handshake.State.ClientRandom);
+    if (!co_await Flush(conn)) {
+        RTMP_LOG(RTMP_LOG_WARNING, "Failed to send S0, S1 and S2 to client");
+        co_return false;
     }
-}
 
+    // C2: echo of S1
+    if (!co_await ReceiveHandshake(conn, handshake, 3)) {
+        co_return false;
+    }
+    if (!CheckC2(conn, handshake.State.ClientEcho)) {
+        RTMP_LOG(RTMP_LOG_WARNING, "Invalid random echo from client");
+        co_return false;
+    }
 
-//------------------------------------------------------------------------------
-// RTMPReceiver
+    conn.Phase = PHASE_CONNECTING;
+    Metrics->Add(METRIC_HANDSHAKES_COMPLETED);
+    Metrics->RecordHandshakeUsec(GetMonotonicUsec() - conn.AcceptUsec);
 
-bool RTMPReceiver::Start(
-        RTMPSetupCallback setup_callback,
-        RTMPVideoCallback video_callback,
-        int port,
-        bool enable_logging)
-{
-    SetupCallback = setup_callback;
-    VideoCallback = video_callback;
-    Port = port;
-    EnableLogging = enable_logging;
+    if (EnableLogging) {
+        RTMP_LOG(RTMP_LOG_INFO, "Handshake complete");
+    }
+    co_return true;
+}
 
-    // Allocate receive buffer on heap
-    RecvBuffer.resize(2048 * 16);
+AsyncCall<bool> RTMPReceiverBase::ReceiveHandshake(RTMPConnection& conn, RTMPHandshake& handshake, int round) {
+    while (handshake.State.Round < round) {
+        const int bytes = ReceiveData(conn);
+        if (bytes == kReceiveAgain) {
+            co_await Loop.Readable(conn.Socket);
+            continue;
+        }
+        if (bytes <= 0) {
+            co_return false;
+        }
 
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ControlSock) < 0) {
-        perror("socketpair failed");
-        return false;
+        handshake.ParseMessage(RecvBuffer.data(), bytes);
     }
-    SetNonBlocking(ControlSock[1]); // Set write end non-blocking
+    co_return true;
+}
 
-    Terminated = false;
-    Thread = std::make_shared<std::thread>(&RTMPReceiver::Loop, this);
+AsyncCall<bool> RTMPReceiverBase::ReceiveSession(RTMPConnection& conn, RTMPSessionPhase until_phase) {
+    OutputQueue::FlushResult flush_result = OutputQueue::FLUSH_DONE;
 
-    return true;
+    while (conn.Phase != until_phase && !conn.IsEnding()) {
+        if (conn.Backlog && conn.Backlog->Paused.load(std::memory_order_relaxed)) {
+            co_await WaitForBacklog(conn);
+            continue;
+        }
+
+        const int bytes = ReceiveData(conn);
+        if (bytes == kReceiveAgain) {
+            // Keep reading while responses wait for the socket to drain
+            if (flush_result == OutputQueue::FLUSH_AGAIN) {
+                co_await Loop.ReadableOrWritable(conn.Socket);
+                if (!SendOutput(conn, flush_result)) {
+                    co_return false;
+                }
+            } else {
+                co_await Loop.Readable(conn.Socket);
+            }
+            continue;
+        }
+        if (bytes <= 0) {
+            co_return false;
+        }
+
+        // Time blocked waiting for this data
+        uint64_t wait_usec = 0;
+        if (conn.WaitStartUsec != 0) {
+            wait_usec = GetMonotonicUsec() - conn.WaitStartUsec;
+            conn.WaitStartUsec = 0;
+        }
+
+        ParseReceived(conn, RecvBuffer.data(), bytes, wait_usec);
+
+        // Everything queued while parsing this recv() goes out in one send
+        if (!conn.Output.IsEmpty() && !SendOutput(conn, flush_result)) {
+            co_return false;
+        }
+
+        // Stop reading rather than queue without limit for a peer that does not read
+        if (conn.Output.GetQueuedBytes() > kMaxQueuedOutputBytes) {
+            if (!co_await Flush(conn)) {
+                co_return false;
+            }
+            flush_result = OutputQueue::FLUSH_DONE;
+        }
+    }
+    co_return true;
 }
 
-void RTMPReceiver::Stop() {
-    Terminated = true;
+AsyncCall<bool> RTMPReceiverBase::WaitForBacklog(RTMPConnection& conn) {
+    DeliveryBacklog& backlog = *conn.Backlog;
 
-    char stop = 's';
-    if (write(ControlSock[1], &stop, sizeof(stop)) < 0) {
-        perror("write failed");
+    const uint64_t start_usec = GetMonotonicUsec();
+    conn.PausedSinceUsec = start_usec;
+    Metrics->Add(METRIC_READ_PAUSES);
+
+    // Paused was set before QueuedBytes is checked here, so the delivery
+    // thread wakes ResumeFd for any release that crosses the low watermark
+    for (;;) {
+        uint64_t count = 0;
+        if (read(backlog.ResumeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("eventfd read failed");
+        }
+
+        if (!backlog.Paused.load() || conn.IsEnding() ||
+            backlog.QueuedBytes.load() <= backlog.LowWatermarkBytes)
+        {
+            break;
+        }
+        co_await Loop.Readable(backlog.ResumeFd);
     }
+    backlog.Paused = false;
 
-    // Wait for the thread to exit
-    if (Thread && Thread->joinable()) {
-        Thread->join();
+    const uint64_t now_usec = GetMonotonicUsec();
+    conn.ThrottledUsec += now_usec - start_usec;
+    Metrics->Add(METRIC_THROTTLED_USEC, now_usec - start_usec);
+    conn.PausedSinceUsec = 0;
+
+    // The publisher was not the one that stalled
+    conn.LastMediaUsec = now_usec;
+
+    co_return true;
+}
+
+AsyncCall<bool> RTMPReceiverBase::Flush(RTMPConnection& conn) {
+    OutputQueue::FlushResult result = OutputQueue::FLUSH_DONE;
+    while (SendOutput(conn, result)) {
+        if (result == OutputQueue::FLUSH_DONE) {
+            co_return true;
+        }
+        co_await Loop.Writable(conn.Socket);
     }
-    Thread = nullptr;
+    co_return false;
+}
 
-    close(ControlSock[0]);
-    close(ControlSock[1]);
+bool RTMPReceiverBase::SendOutput(RTMPConnection& conn, OutputQueue::FlushResult& result) {
+    OutputQueue& output = conn.Output;
+    if (output.IsEmpty()) {
+        result = OutputQueue::FLUSH_DONE;
+        return true;
+    }
+
+    const uint64_t send_calls = output.SendCalls;
+    const uint64_t short_writes = output.ShortWrites;
+
+    result = output.Flush(conn.Socket);
+
+    Metrics->Add(METRIC_SEND_CALLS, output.SendCalls - send_calls);
+    if (output.ShortWrites != short_writes) {
+        Metrics->Add(METRIC_SHORT_WRITES, output.ShortWrites - short_writes);
+    }
+    return result != OutputQueue::FLUSH_ERROR;
 }
 
-void RTMPReceiver::Loop() {
-    // Keep running until the thread is stopped
-    while (!Terminated) {
-        RunServer();
+int RTMPReceiverBase::ReceiveData(RTMPConnection& conn) {
+    const ssize_t bytes = recv(conn.Socket, RecvBuffer.data(), RecvBuffer.size(), 0);
+    ++conn.RecvCalls;
+    Metrics->Add(METRIC_RECV_CALLS);
+    //RTMP_LOG(RTMP_LOG_DEBUG, "Session: Received ", bytes, " bytes of data from client");
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        if (conn.WaitStartUsec == 0) {
+            conn.WaitStartUsec = GetMonotonicUsec();
+        }
+        return kReceiveAgain;
+    }
+    if (bytes <= 0) {
+        if (EnableLogging) {
+            RTMP_LOG(RTMP_LOG_INFO, "Client ", conn.Id, " disconnected");
+        }
+        return 0;
+    }
+
+    if (conn.QuickAck) {
+        const int enable = 1;
+        setsockopt(conn.Socket, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(enable));
+    }
 
-        // Avoid busy-looping
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    Metrics->Add(METRIC_BYTES_RECEIVED, bytes);
+    if (conn.Capture.IsOpen()) {
+        conn.Capture.WriteRecv(GetMonotonicUsec(), RecvBuffer.data(), static_cast<int>( bytes ));
     }
+    return static_cast<int>( bytes );
 }
 
-void RTMPReceiver::RunServer() {
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) {
-        perror("socket failed");
-        return;
+bool RTMPReceiverBase::UpdateFlow(RTMPConnection& conn, uint64_t wait_usec, uint64_t received_bytes, uint64_t unacked_bytes) {
+    AckWindowController& flow = conn.Flow;
+
+    bool ack_now = false;
+    if (flow.CheckStall(wait_usec, unacked_bytes)) {
+        Metrics->Add(METRIC_ACK_STALLS);
+        RTMP_LOG(RTMP_LOG_WARNING, "Ack stall: no data for ", wait_usec / 1000, " msec with ",
+            unacked_bytes, " bytes unacknowledged, peer bandwidth ", flow.GetPeerBandwidth());
+        ack_now = true;
     }
 
-    AutoClose serverSocketCloser([&]() {
-        close(s);
-    });
+    const uint64_t now_usec = GetMonotonicUsec();
+    if (!flow.IsUpdateDue(now_usec)) {
+        return ack_now;
+    }
 
-    int optval = 1;
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-        perror("setsockopt failed");
-        return;
+    uint32_t rtt_usec = 0;
+    tcp_info info{};
+    socklen_t info_bytes = sizeof(info);
+    if (conn.Socket >= 0 && getsockopt(conn.Socket, IPPROTO_TCP, TCP_INFO, &info, &info_bytes) == 0) {
+        rtt_usec = info.tcpi_rtt;
     }
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(Port);
+    if (flow.Update(now_usec, received_bytes, rtt_usec)) {
+        // Hard, because peers ignore a dynamic limit unless the previous one was hard
+        QueueWindowUpdate(conn, flow.GetWindowAckSize(), flow.GetPeerBandwidth(), LIMIT_HARD);
+        Metrics->Add(METRIC_WINDOW_UPDATES);
+        if (EnableLogging) {
+            RTMP_LOG(RTMP_LOG_INFO, "Peer bandwidth ", flow.GetPeerBandwidth(), " bytes for ",
+                flow.GetBitrateBps() / 1000, " kbps, rtt ", rtt_usec, " usec");
+        }
+    }
+    return ack_now;
+}
 
-    if (::bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
-        perror("bind failed");
+void RTMPReceiverBase::OpenCapture(RTMPConnection& conn) {
+    if (CapturePath.empty()) {
         return;
     }
 
-    if (listen(s, 1) < 0) {
-        perror("listen failed");
+    const std::string path = CapturePath + "_" + std::to_string(conn.Id) + ".rtmpcap";
+    if (!conn.Capture.Open(path, GetMonotonicUsec())) {
+        RTMP_LOG(RTMP_LOG_ERROR, "Failed to open capture file ", path);
         return;
     }
 
     if (EnableLogging) {
-        cout << "RTMP server listening on port " << Port << endl;
+        RTMP_LOG(RTMP_LOG_INFO, "Capturing client to ", path);
     }
+}
 
-    while (!Terminated) {
-        // Reset for each new connection
-        video_streams.clear();
+void RTMPReceiverBase::QueueS0S1(RTMPConnection& conn) {
+    const uint32_t timestamp = static_cast<uint32_t>( GetMsec() );
+
+    std::vector<uint8_t>& hello = conn.ServerHello;
+    hello.resize(1 + 1536);
+    hello[0] = kRtmpS0ServerVersion;
+    WriteUInt32(hello.data() + 1, timestamp);
+    FillRandomBuffer(hello.data() + 1 + 4, 1536 - 4, timestamp);
+
+    // Kept until C2 is checked, after it has been sent
+    conn.Output.AppendStatic(hello.data(), static_cast<int>( hello.size() ));
+}
 
-        if (WaitForConnection(s)) {
-            HandleNextClient(s);
+void RTMPReceiverBase::QueueS2(RTMPConnection& conn, uint32_t peer_time, const void* client_random) {
+    uint8_t random_echo[1536];
+    WriteUInt32(random_echo, peer_time);
+    WriteUInt32(random_echo + 4, 0);
+    memcpy(random_echo + 8, client_random, 1536 - 8);
+    conn.Output.Append(random_echo, sizeof(random_echo));
+}
+
+bool RTMPReceiverBase::CheckC2(RTMPConnection& conn, const void* echo) {
+    if (conn.ServerHello.size() != 1 + 1536) {
+        return false;
+    }
+    const bool match = 0 == memcmp(conn.ServerHello.data() + 1 + 4 + 4, echo, 1536 - 8);
+
+    // Not needed after the handshake, so do not keep it for idle sessions
+    std::vector<uint8_t>().swap(conn.ServerHello);
+    return match;
+}
+
+void RTMPReceiverBase::QueueChunkAck(RTMPConnection& conn, uint32_t ack_bytes) {
+    StackByteStreamWriter<kMaxResponseBytes> msg;
+    WriteChunkAck(msg, ack_bytes);
+    conn.Output.Append(msg.GetData(), msg.GetLength());
+
+    Metrics->Add(METRIC_ACKS_SENT);
+}
+
+// "rtmp://host:1935/live/x" -> "live/x"
+static std::string ParseAppFromTcUrl(const std::string& tc_url) {
+    size_t start = tc_url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    const size_t slash = tc_url.find('/', start);
+    if (slash == std::string::npos) {
+        return std::string();
+    }
+    return tc_url.substr(slash + 1);
+}
+
+void RTMPReceiverBase::HandleCommand(RTMPConnection& conn, const RTMPCommand& command) {
+    if (command.Type == DATA_AMF0) {
+        // @setDataFrame / onMetaData
+        if (command.VideoDataRate > 0.0) {
+            conn.DeclaredKbps = command.VideoDataRate;
+        }
+        return;
+    }
+    if (conn.IsEnding()) {
+        return;
+    }
+
+    // Responses come from templates built for FlowSettings, which is also
+    // what every session's flow controller starts from
+    const std::string& name = command.Name;
+    if (name == "connect") {
+        conn.App = command.App.empty() ? ParseAppFromTcUrl(command.TcUrl) : command.App;
+        conn.Output.AppendStatic(Responses.ConnectResult.data(), static_cast<int>( Responses.ConnectResult.size() ));
+    } else if (name == "createStream") {
+        QueueResult(conn, Responses.CreateStreamResult, command.Number);
+    } else if (name == "publish") {
+        if (AdmitPublisher(conn, command.Argument)) {
+            conn.Phase = PHASE_PUBLISHING;
+            conn.Output.AppendStatic(Responses.PublishStart.data(), static_cast<int>( Responses.PublishStart.size() ));
         }
+    } else {
+        // releaseStream, FCPublish and anything else
+        QueueResult(conn, Responses.NullResult, command.Number);
     }
 }
 
-bool RTMPReceiver::WaitForConnection(int server_socket) {
-    fd_set readfds;
-    const int maxfd = max(server_socket, ControlSock[0]);
+bool RTMPReceiverBase::AdmitPublisher(RTMPConnection& conn, const std::string& stream_name) {
+    if (conn.Admitted) {
+        return true; // Repeated publish
+    }
 
-    FD_ZERO(&readfds);
-    FD_SET(server_socket, &readfds);
-    FD_SET(ControlSock[0], &readfds);
+    // OBS and ffmpeg pass tokens as "key?token=..."
+    const std::string key = conn.App + "/" + stream_name.substr(0, stream_name.find('?'));
 
-    if (select(maxfd + 1, &readfds, nullptr, nullptr, nullptr) < 0) {
-        perror("select failed");
+    RTMPAdmissionLimits limits;
+    if (!FindRoute(conn, key, limits)) {
+        RejectPublisher(conn, key, "NetStream.Publish.BadName", "No route for stream key");
         return false;
     }
 
-    if (FD_ISSET(ControlSock[0], &readfds)) {
-        char stop = 0;
-        if (read(ControlSock[0], &stop, sizeof(stop)) < 0) {
-            perror("read failed");
+    std::vector<RTMPConnection*>& publishers = PublishersByKey[key];
+    if (limits.MaxPublishers > 0 && static_cast<int>( publishers.size() ) >= limits.MaxPublishers) {
+        if (!limits.Takeover) {
+            if (publishers.empty()) {
+                PublishersByKey.erase(key);
+            }
+            RejectPublisher(conn, key, "NetStream.Publish.BadName", "Stream key is already being published");
+            return false;
         }
-        return false;
+
+        RTMPConnection* oldest = publishers.front();
+        publishers.erase(publishers.begin());
+        oldest->Admitted = false;
+        DropSession(*oldest);
+
+        Metrics->Add(METRIC_PUBLISHER_TAKEOVERS);
+        RTMP_LOG(RTMP_LOG_WARNING, "Client ", conn.Id, " took over stream key ", key, " from client ", oldest->Id);
     }
+    publishers.push_back(&conn);
+
+    conn.StreamKey = key;
+    conn.Limits = limits;
+    conn.Admitted = true;
+    return true;
+}
+
+void RTMPReceiverBase::RejectPublisher(RTMPConnection& conn, const std::string& key, const char* code, const char* description) {
+    StackByteStreamWriter<kMaxResponseBytes> msg;
+    WriteOnStatus(msg, kPublishStreamId, "error", code, description);
+    conn.Output.Append(msg.GetData(), msg.GetLength());
+
+    conn.Phase = PHASE_REJECTED;
+    Metrics->Add(METRIC_PUBLISHES_REJECTED);
+
+    RTMP_LOG(RTMP_LOG_WARNING, "Client ", conn.Id, " rejected for stream key ", key, ": ", description);
+}
 
-    if (FD_ISSET(server_socket, &readfds) && !Terminated) {
-        return true; // Connection accepted
+void RTMPReceiverBase::ReleasePublisher(RTMPConnection& conn) {
+    if (!conn.Admitted) {
+        return;
     }
+    conn.Admitted = false;
 
-    return false;
+    auto iter = PublishersByKey.find(conn.StreamKey);
+    if (iter == PublishersByKey.end()) {
+        return;
+    }
+    std::vector<RTMPConnection*>& publishers = iter->second;
+    publishers.erase(std::remove(publishers.begin(), publishers.end(), &conn), publishers.end());
+    if (publishers.empty()) {
+        PublishersByKey.erase(iter);
+    }
 }
 
-void RTMPReceiver::HandleNextClient(int server_socket) {
+void RTMPReceiverBase::ApplySocketTimeouts(int client_socket) {
+    if (Timeouts.UserTimeoutMsec <= 0 && Timeouts.KeepaliveIdleSec <= 0) {
+        return;
+    }
 
-    int cs = accept(server_socket, nullptr, nullptr);
-    if (cs < 0) {
-        perror("accept failed");
+    // TCP options do not apply to Unix domain sockets
+    int domain = 0;
+    socklen_t domain_bytes = sizeof(domain);
+    if (getsockopt(client_socket, SOL_SOCKET, SO_DOMAIN, &domain, &domain_bytes) < 0 ||
+        (domain != AF_INET && domain != AF_INET6))
+    {
         return;
     }
-    ClientSocket = cs;
 
-    AutoClose clientSocketCloser([&]() {
-        close(cs);
-    });
+    if (Timeouts.UserTimeoutMsec > 0) {
+        const unsigned user_timeout = static_cast<unsigned>( Timeouts.UserTimeoutMsec );
+        if (setsockopt(client_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout)) < 0) {
+            perror("setsockopt TCP_USER_TIMEOUT failed");
+        }
+    }
 
-    if (EnableLogging) {
-        cout << "Client connected" << endl;
+    if (Timeouts.KeepaliveIdleSec > 0) {
+        const int enable = 1;
+        if (setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) < 0 ||
+            setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPIDLE, &Timeouts.KeepaliveIdleSec, sizeof(int)) < 0 ||
+            setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPINTVL, &Timeouts.KeepaliveIntervalSec, sizeof(int)) < 0 ||
+            setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPCNT, &Timeouts.KeepaliveCount, sizeof(int)) < 0)
+        {
+            perror("setsockopt keepalive failed");
+        }
     }
+}
 
-    RollingBuffer Buffer; // Keep left-overs from previous chunks
+void RTMPReceiverBase::ApplySocketSettings(RTMPConnection& conn) {
+    const int s = conn.Socket;
 
-    RTMPHandshake handshake;
-    handshake.Buffer = &Buffer;
-    bool sent_s0s1 = false;
-    bool sent_s2 = false;
+    // Accepted sockets already have these from the listening socket
+    if (Sockets.ReceiveBufferBytes > 0) {
+        SetSocketOption(s, SOL_SOCKET, SO_RCVBUF, Sockets.ReceiveBufferBytes, "SO_RCVBUF");
+    }
+    if (Sockets.SendBufferBytes > 0) {
+        SetSocketOption(s, SOL_SOCKET, SO_SNDBUF, Sockets.SendBufferBytes, "SO_SNDBUF");
+    }
+    if (Sockets.BusyPollUsec > 0) {
+        SetSocketOption(s, SOL_SOCKET, SO_BUSY_POLL, Sockets.BusyPollUsec, "SO_BUSY_POLL");
+    }
+    if (Sockets.PreferBusyPoll) {
+        SetSocketOption(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1, "SO_PREFER_BUSY_POLL");
+    }
+
+    if (!Sockets.NoDelay && !Sockets.QuickAck) {
+        return;
+    }
 
-    while (!Terminated)
+    // TCP options do not apply to Unix domain sockets
+    int domain = 0;
+    socklen_t domain_bytes = sizeof(domain);
+    if (getsockopt(s, SOL_SOCKET, SO_DOMAIN, &domain, &domain_bytes) < 0 ||
+        (domain != AF_INET && domain != AF_INET6))
     {
-        ssize_t recv_bytes = recv(cs, RecvBuffer.data(), RecvBuffer.size(), 0);
-        if (recv_bytes <= 0) {
-            if (EnableLogging) {
-                cout << "Client disconnected" << endl;
-            }
-            return;
-        }
+        return;
+    }
+
+    if (Sockets.NoDelay) {
+        SetSocketOption(s, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (Sockets.QuickAck) {
+        SetSocketOption(s, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+        conn.QuickAck = true;
+    }
+}
 
-        handshake.ParseMessage(RecvBuffer.data(), static_cast<int>( recv_bytes ));
+void RTMPReceiverBase::SetSocketOption(int s, int level, int name, int value, const char* option_name) {
+    if (setsockopt(s, level, name, &value, sizeof(value)) < 0 && !WarnedSocketOption) {
+        // Usually the same for every socket, e.g. SO_BUSY_POLL without CAP_NET_ADMIN
+        WarnedSocketOption = true;
+        RTMP_LOG(RTMP_LOG_WARNING, "setsockopt ", option_name, " failed: ", strerror(errno));
+    }
+}
 
-        // If we have C0 but we haven't sent S0 and S1 yet:
-        if (!sent_s0s1 && handshake.State.Round >= 1) {
-            if (handshake.State.ClientVersion != kRtmpS0ServerVersion) {
-                cout << "Invalid version from client = " << handshake.State.ClientVersion << endl;
-                return;
-            }
-            if (!SendS0S1()) {
-                cout << "Failed to send S1 to client" << endl;
-                return;
-            }
-            sent_s0s1 = true;
+int RTMPReceiverBase::GetCheckIntervalMsec() const {
+    int interval_msec = -1;
+    if (Timeouts.NoMediaTimeoutMsec > 0) {
+        interval_msec = std::max(Timeouts.NoMediaTimeoutMsec / 4, 1);
+    }
+    if (Backpressure.HighWatermarkBytes > 0 && Backpressure.PauseReads && Backpressure.DropAfterMsec >= 0) {
+        const int drop_msec = std::max(Backpressure.DropAfterMsec / 4, 1);
+        interval_msec = (interval_msec < 0) ? drop_msec : std::min(interval_msec, drop_msec);
+    }
+    return interval_msec;
+}
+
+void RTMPReceiverBase::CheckSessions() {
+    const uint64_t now_usec = GetMonotonicUsec();
+    if (now_usec < NextCheckUsec) {
+        return;
+    }
+    NextCheckUsec = now_usec + CheckIntervalUsec;
+
+    const uint64_t timeout_usec = Timeouts.NoMediaTimeoutMsec * 1000ULL;
+    const uint64_t drop_usec = Backpressure.DropAfterMsec * 1000ULL;
+
+    for (auto& entry : Sessions) {
+        RTMPConnection& conn = *entry.second;
+        if (conn.Phase == PHASE_CLOSING) {
+            continue;
         }
 
-        // If we have C1 but we haven't sent S2 yet:
-        if (!sent_s2 && handshake.State.Round >= 2) {
-            if (!SendS2(handshake.State.ClientTime1, handshake.State.ClientRandom)) {
-                cout << "Failed to send random echo to client" << endl;
-                return;
+        // Paused by backpressure, not by the publisher
+        if (conn.PausedSinceUsec != 0) {
+            if (Backpressure.DropAfterMsec >= 0 && now_usec - conn.PausedSinceUsec >= drop_usec) {
+                conn.Shedding = true;
+                conn.Backlog->Paused = false;
+                conn.Backlog->Wake();
             }
-            sent_s2 = true;
+            continue;
         }
 
-        // If we have C2:
-        if (handshake.State.Round >= 3) {
-            if (!CheckC2(handshake.State.ClientEcho)) {
-                cout << "Invalid random echo from client" << endl;
-                return;
-            }
-            break; // Handshake complete
+        if (timeout_usec == 0 || now_usec - conn.LastMediaUsec < timeout_usec) {
+            continue;
         }
-    } // Continue handshake
 
-    if (EnableLogging) {
-        cout << "Handshake complete" << endl;
+        Metrics->Add(METRIC_SESSIONS_TIMED_OUT);
+        RTMP_LOG(RTMP_LOG_WARNING, "Client ", conn.Id, " sent no video for ",
+            (now_usec - conn.LastMediaUsec) / 1000, " msec: closing");
+
+        DropSession(conn);
+    }
+}
+
+void RTMPReceiverBase::DropSession(RTMPConnection& conn) {
+    // Leave the phase alone during the handshake, so it is counted as failed
+    if (conn.Phase != PHASE_HANDSHAKE) {
+        conn.Phase = PHASE_CLOSING;
     }
 
-    RTMPSession parser;
-    parser.Buffer = &Buffer;
-    parser.Handler = this;
+    // Wakes the session's coroutine, whose next recv() returns 0.  The
+    // socket is closed as usual when the coroutine ends
+    shutdown(conn.Socket, SHUT_RDWR);
+    if (conn.Backlog) {
+        conn.Backlog->Wake();
+    }
+}
 
-    const uint8_t* parse_data = nullptr;
-    ssize_t bytesRead = 0;
+void RTMPReceiverBase::QueueSetup(RTMPConnection& conn, void* handler, uint32_t stream, const RTMPSetupResult& result) {
+    Delivery->PushSetup(conn.Backlog, handler, stream, result);
+}
 
-    while (!Terminated)
-    {
-        // We parse first because there may be some data left over from the handshake
-        while (parser.ParseChunk(parse_data, static_cast<int>( bytesRead ))) {
-            // Pass null next time to continue parsing the same buffer
-            parse_data = nullptr;
-            bytesRead = 0;
-        }
-
-        parse_data = RecvBuffer.data();
-        bytesRead = recv(cs, RecvBuffer.data(), RecvBuffer.size(), 0);
-        //cout << "Session: Received " << bytesRead << " bytes of data from client" << endl;
-        if (bytesRead <= 0) {
-            if (EnableLogging) {
-                cout << "Client disconnected" << endl;
-            }
+void RTMPReceiverBase::QueueFrame(RTMPConnection& conn, void* handler, const RTMPVideoFrame& frame) {
+    DeliveryBacklog& backlog = *conn.Backlog;
+    const size_t queued = backlog.QueuedBytes.load();
+
+    if (!Backpressure.PauseReads && queued >= Backpressure.HighWatermarkBytes) {
+        conn.Shedding = true;
+    }
+
+    // Later frames depend on the dropped ones, so resume at a keyframe
+    if (conn.Shedding) {
+        if (!frame.Keyframe || queued > Backpressure.LowWatermarkBytes) {
+            Metrics->Add(METRIC_FRAMES_SHED);
             return;
         }
+        conn.Shedding = false;
     }
-}
 
-bool RTMPReceiver::SendS0S1() {
-    const uint32_t timestamp = static_cast<uint32_t>( GetMsec() );
+    Delivery->PushFrame(conn.Backlog, handler, frame);
 
-    Handshake[0] = kRtmpS0ServerVersion;
-    WriteUInt32(Handshake + 1, timestamp);
-    FillRandomBuffer(Handshake + 1 + 4, 1536 - 4, timestamp);
-    ssize_t bytes = send(ClientSocket, Handshake, sizeof(Handshake), MSG_NOSIGNAL);
-    return bytes == sizeof(Handshake);
+    // ReceiveSession() stops reading once this recv() has been parsed
+    if (Backpressure.PauseReads && queued + frame.Bytes >= Backpressure.HighWatermarkBytes) {
+        backlog.Paused = true;
+    }
 }
 
-bool RTMPReceiver::SendS2(uint32_t peer_time, const void* client_random) {
-    WriteUInt32(RandomEcho, peer_time);
-    WriteUInt32(RandomEcho + 4, 0);
-    memcpy(RandomEcho + 8, client_random, 1536 - 8);
-    ssize_t bytes = send(ClientSocket, RandomEcho, sizeof(RandomEcho), MSG_NOSIGNAL);
-    return bytes == sizeof(RandomEcho);
+void RTMPReceiverBase::QueueWindowUpdate(RTMPConnection& conn, uint32_t window_ack_size, uint32_t max_unacked_bytes, int limit_type) {
+    StackByteStreamWriter<kMaxResponseBytes> msg;
+    WriteWindowUpdate(msg, window_ack_size, max_unacked_bytes, limit_type);
+    conn.Output.Append(msg.GetData(), msg.GetLength());
 }
 
-bool RTMPReceiver::CheckC2(const void* echo) {
-    return 0 == memcmp(Handshake + 1 + 4 + 4, echo, 1536 - 8);
+void RTMPReceiverBase::QueueResult(RTMPConnection& conn, const std::vector<uint8_t>& result, double command_number) {
+    uint8_t msg[64];
+    if (result.size() > sizeof(msg)) {
+        return;
+    }
+    memcpy(msg, result.data(), result.size());
+    SetResultNumber(msg, command_number);
+    conn.Output.Append(msg, static_cast<int>( result.size() ));
 }
 
-void RTMPReceiver::OnNeedAck(uint32_t bytes) {
-    SendChunkAck(bytes);
-}
+RTMPReceiverBase::VideoResult RTMPReceiverBase::PrepareVideo(
+    RTMPConnection& conn,
+    VideoStreamState& stream_state,
+    bool keyframe,
+    uint32_t stream,
+    uint32_t timestamp,
+    const uint8_t* data,
+    int bytes,
+    const RTMPFrameTrace& trace,
+    RTMPVideoFrame& frame)
+{
+    // Routing and admission happen on publish, so media sent before it
+    // would reach a handler no route was found for
+    if (conn.Phase != PHASE_PUBLISHING) {
+        RejectPublisher(conn, conn.StreamKey, "NetStream.Publish.Rejected", "Video sent before publish");
+        Metrics->Add(METRIC_FRAMES_DROPPED);
+        return VIDEO_DROPPED;
+    }
+
+    const uint64_t now_usec = GetMonotonicUsec();
+    conn.LastMediaUsec = now_usec;
 
-bool RTMPReceiver::SendChunkAck(uint32_t ack_bytes) {
-    uint32_t timestamp = 0;
+    stream_state.avccParser.parseAvcc(data, bytes);
+    RTMP_TRACE(const uint64_t avcc_parsed_nsec = GetMonotonicNsec();)
 
-    ByteStreamWriter msg;
+    if (stream_state.NewStream) {
+        if (!stream_state.avccParser.HasParams) {
+            RTMP_LOG(RTMP_LOG_WARNING, "No parameters for stream ", stream);
+            Metrics->Add(METRIC_FRAMES_DROPPED);
+            return VIDEO_DROPPED;
+        }
+        stream_state.NewStream = false;
+
+        if (conn.Limits.MaxBitrateKbps > 0 && conn.DeclaredKbps > conn.Limits.MaxBitrateKbps) {
+            RejectPublisher(conn, conn.StreamKey, "NetStream.Publish.Rejected", "Declared bitrate is over the limit");
+            Metrics->Add(METRIC_FRAMES_DROPPED);
+            return VIDEO_DROPPED;
+        }
+
+        // Time to first frame for the connection, e.g. after a reconnect
+        if (conn.AcceptUsec != 0) {
+            Metrics->RecordAcceptToSetupUsec(now_usec - conn.AcceptUsec);
+            conn.AcceptUsec = 0;
+        }
+
+        SetReorderDepth(stream_state);
 
-    msg.WriteUInt8(3); // cs_id = 3, fmt = 0
-    msg.WriteUInt24(timestamp);
-    msg.WriteUInt24(4/*length*/);
-    msg.WriteUInt8(COMMAND_AMF0);
-    msg.WriteUInt32(0/*stream_id*/);
-        msg.WriteUInt32(ack_bytes);
+        stream_state.avccParser.SetupResult.Connection = conn.Id;
+        return VIDEO_SETUP;
+    }
 
-    //cout << "Sending chunk ack of " << ack_bytes << " bytes" << endl;
+    if (stream_state.avccParser.VideoSize <= 0) {
+        RTMP_LOG(RTMP_LOG_WARNING, "No video data for stream ", stream);
+        Metrics->Add(METRIC_FRAMES_DROPPED);
+        return VIDEO_DROPPED;
+    }
 
-    ssize_t bytes = send(ClientSocket, msg.GetData(), msg.GetLength(), MSG_NOSIGNAL);
-    return bytes == msg.GetLength();
+    frame.Connection = conn.Id;
+    frame.Stream = stream;
+    frame.Keyframe = keyframe;
+    frame.Timestamp = timestamp;
+    frame.Dts = stream_state.Timeline.Unwrap(timestamp);
+    frame.Pts = frame.Dts + stream_state.avccParser.CompositionTime;
+
+    // Arrivals are in decode order, so the clock follows Dts
+    ClockRecovery& clock = stream_state.Clock;
+    frame.Clock.ArrivalUsec = now_usec;
+    clock.Update(frame.Dts, frame.Clock.ArrivalUsec);
+    frame.Clock.Valid = true;
+    frame.Clock.LocalPtsUsec = clock.ToLocalUsec(frame.Pts);
+    frame.Clock.JitterUsec = clock.GetLastJitterUsec();
+    frame.Clock.DriftPpm = clock.GetDriftPpm();
+
+    frame.Data = stream_state.avccParser.VideoData;
+    frame.Bytes = stream_state.avccParser.VideoSize;
+    frame.Trace = trace;
+    RTMP_TRACE(frame.Trace.AvccParsedNsec = avcc_parsed_nsec;)
+
+    return VIDEO_FRAME;
 }
 
-void RTMPReceiver::OnMessage(const std::string& name, double number) {
-    if (name == "connect") {
-        const uint32_t window_ack_size = 2500000;
-        const uint32_t max_unacked_bytes = 2500000;
-        const int limit_type = LIMIT_DYNAMIC;
-        const uint32_t chunk_size = 60000;
+void RTMPReceiverBase::SetReorderDepth(VideoStreamState& stream_state)
+{
+    if (MaxReorderFrames <= 0) {
+        return;
+    }
 
-        SendConnectResult(window_ack_size, max_unacked_bytes, limit_type, chunk_size);
+    // Unknown reorder depth uses the maximum
+    const int num_reorder_frames = stream_state.avccParser.SetupResult.SpsInfo.NumReorderFrames;
+    if (num_reorder_frames >= 0 && num_reorder_frames < MaxReorderFrames) {
+        stream_state.Reorderer.SetDepth(num_reorder_frames);
     } else {
-        SendNullResult(number);
+        stream_state.Reorderer.SetDepth(MaxReorderFrames);
     }
 }
 
-bool RTMPReceiver::SendConnectResult(
-    uint32_t window_ack_size,
-    uint32_t max_unacked_bytes,
-    int limit_type,
-    uint32_t chunk_size)
-{
-    uint32_t timestamp = 0;
-
-    ByteStreamWriter params;
-
-    params.WriteUInt8(2); // cs_id = 2, fmt = 0
-    params.WriteUInt24(timestamp);
-    params.WriteUInt24(4/*length*/);
-    params.WriteUInt8(WINDOW_ACK_SIZE);
-    params.WriteUInt32(0/*stream_id*/);
-        params.WriteUInt32(window_ack_size);
-
-    params.WriteUInt8(2); // cs_id = 2, fmt = 0
-    params.WriteUInt24(timestamp);
-    params.WriteUInt24(5/*length*/);
-    params.WriteUInt8(SET_PEER_BANDWIDTH);
-    params.WriteUInt32(0/*stream_id*/);
-        params.WriteUInt32(max_unacked_bytes);
-        params.WriteUInt8(limit_type);
-
-    params.WriteUInt8(2); // cs_id = 2, fmt = 0
-    params.WriteUInt24(timestamp);
-    params.WriteUInt24(4/*length*/);
-    params.WriteUInt8(CHUNK_SIZE);
-    params.WriteUInt32(0/*stream_id*/);
-        params.WriteUInt32(chunk_size);
-
-    ByteStreamWriter amf;
-    amf.WriteUInt8(StringMarker);
-    amf.WriteAmf0String("_result");
-    amf.WriteUInt8(NumberMarker);
-    amf.WriteDouble(1.0);
-    amf.WriteUInt8(NullMarker);
-    amf.WriteUInt8(ObjectMarker);
-        amf.WriteAmf0String("level");
-        amf.WriteUInt8(StringMarker);
-        amf.WriteAmf0String("status");
-
-        amf.WriteAmf0String("code");
-        amf.WriteUInt8(StringMarker);
-        amf.WriteAmf0String("NetConnection.Connect.Success");
-
-        amf.WriteAmf0String("description");
-        amf.WriteUInt8(StringMarker);
-        amf.WriteAmf0String("Connection succeeded.");
-
-        amf.WriteUInt16(0);
-    amf.WriteUInt8(ObjectEndMarker);
-
-    params.WriteUInt8(3); // cs_id = 3, fmt = 0
-    params.WriteUInt24(timestamp);
-    params.WriteUInt24(static_cast<int>( amf.GetLength() )/*length*/);
-    params.WriteUInt8(COMMAND_AMF0);
-    params.WriteUInt32(0/*stream_id*/);
-        params.WriteData(amf.GetData(), amf.GetLength());
-
-    params.WriteUInt8(2); // cs_id = 2, fmt = 0
-    params.WriteUInt24(timestamp);
-    params.WriteUInt24(6/*length*/);
-    params.WriteUInt8(USER_CONTROL);
-    params.WriteUInt32(0/*stream_id*/);
-        params.WriteUInt16(EVENT_STREAM_BEGIN);
-        params.WriteUInt32(0);
-
-    ssize_t bytes = send(ClientSocket, params.GetData(), params.GetLength(), MSG_NOSIGNAL);
-    return bytes == params.GetLength();
-}
-
-bool RTMPReceiver::SendNullResult(double command_number) {
-    uint32_t timestamp = 0;
-
-    ByteStreamWriter msg;
-
-    ByteStreamWriter amf;
-    amf.WriteUInt8(StringMarker);
-    amf.WriteAmf0String("_result");
-    amf.WriteUInt8(NumberMarker);
-    amf.WriteDouble(command_number);
-    amf.WriteUInt8(NullMarker);
-    amf.WriteUInt8(UndefinedMarker);
-
-    msg.WriteUInt8(3); // cs_id = 3, fmt = 0
-    msg.WriteUInt24(timestamp);
-    msg.WriteUInt24(static_cast<int>( amf.GetLength() )/*length*/);
-    msg.WriteUInt8(COMMAND_AMF0);
-    msg.WriteUInt32(0/*stream_id*/);
-        msg.WriteData(amf.GetData(), amf.GetLength());
-
-    ssize_t bytes = send(ClientSocket, msg.GetData(), msg.GetLength(), MSG_NOSIGNAL);
-    return bytes == msg.GetLength();
-}
-
-void RTMPReceiver::OnAvccVideo(
-    bool keyframe,
+void RTMPReceiverBase::UpdateStreamGauges(
+    RTMPConnection& conn,
+    VideoStreamState& stream_state,
     uint32_t stream,
+    bool keyframe,
     uint32_t timestamp,
-    const uint8_t* data,
     int bytes)
 {
-    // Check if this is a new stream
-    auto iter = video_streams.find(stream);
-    std::shared_ptr<VideoStreamState> stream_state;
+    Metrics->Add(METRIC_FRAMES_DELIVERED);
 
-    if (iter == video_streams.end()) {
-        stream_state = std::make_shared<VideoStreamState>();
-        video_streams[stream] = stream_state;
-    } else {
-        stream_state = iter->second;
-    }
+    StreamGauges& gauges = stream_state.Gauges;
 
-    stream_state->avccParser.parseAvcc(data, bytes);
+    if (keyframe) {
+        Metrics->Add(METRIC_KEYFRAMES_DELIVERED);
 
-    if (stream_state->NewStream) {
-        if (!stream_state->avccParser.HasParams) {
-            std::cout << "No parameters for stream " << stream << std::endl;
-            return;
+        if (stream_state.HasKeyframe) {
+            gauges.KeyframeIntervalMsec = timestamp - stream_state.LastKeyframeTimestamp;
         }
-        stream_state->NewStream = false;
+        stream_state.HasKeyframe = true;
+        stream_state.LastKeyframeTimestamp = timestamp;
+    }
 
-        SetupCallback(stream, stream_state->avccParser.SetupResult);
-    } else {
-        if (stream_state->avccParser.VideoSize <= 0) {
-            std::cout << "No video data for stream " << stream << std::endl;
-            return;
+    const uint64_t now_usec = GetMonotonicUsec();
+    if (stream_state.WindowStartUsec == 0) {
+        stream_state.WindowStartUsec = now_usec;
+    }
+    stream_state.WindowBytes += bytes;
+
+    // Publish the gauges about once a second
+    const uint64_t window_usec = now_usec - stream_state.WindowStartUsec;
+    if (window_usec >= 1000000) {
+        gauges.Port = Port;
+        gauges.Connection = conn.Id;
+        gauges.Stream = stream;
+        gauges.BitrateBps = stream_state.WindowBytes * 8 * 1000000.0 / window_usec;
+        gauges.ThrottledUsec = conn.ThrottledUsec;
+        Metrics->SetStreamGauges(gauges);
+
+        stream_state.WindowStartUsec = now_usec;
+        stream_state.WindowBytes = 0;
+
+        // Some headroom over the cap for keyframe bursts
+        if (conn.Limits.MaxBitrateKbps > 0 && gauges.BitrateBps > 2000.0 * conn.Limits.MaxBitrateKbps) {
+            RejectPublisher(conn, conn.StreamKey, "NetStream.Publish.Rejected", "Bitrate is over the limit");
         }
-        VideoCallback(stream, keyframe, timestamp, stream_state->avccParser.VideoData, stream_state->avccParser.VideoSize);
     }
 }
+
+#ifdef RTMP_ENABLE_TRACING
+
+void RTMPReceiverBase::RecordLatency(const RTMPFrameTrace& trace, uint64_t callback_exit_nsec)
+{
+    LatencyHistograms[LATENCY_STAGE_REASSEMBLY].Record(trace.LastChunkRecvNsec - trace.FirstChunkRecvNsec);
+    LatencyHistograms[LATENCY_STAGE_PARSE].Record(trace.ReassembledNsec - trace.LastChunkRecvNsec);
+    LatencyHistograms[LATENCY_STAGE_AVCC].Record(trace.AvccParsedNsec - trace.ReassembledNsec);
+    LatencyHistograms[LATENCY_STAGE_DISPATCH].Record(trace.CallbackEntryNsec - trace.AvccParsedNsec);
+    LatencyHistograms[LATENCY_STAGE_CALLBACK].Record(callback_exit_nsec - trace.CallbackEntryNsec);
+    LatencyHistograms[LATENCY_STAGE_TOTAL].Record(callback_exit_nsec - trace.FirstChunkRecvNsec);
+}
+
+#endif // RTMP_ENABLE_TRACING
+
+
+//------------------------------------------------------------------------------
+// RTMPReceiver
+
+template class BasicRTMPReceiver<RTMPCallbackHandler>;
+
+bool RTMPReceiver::Start(
+        RTMPSetupCallback setup_callback,
+        RTMPVideoCallback video_callback,
+        int port,
+        bool enable_logging)
+{
+    RTMPFrameCallback frame_callback = [video_callback](const RTMPVideoFrame& frame) {
+        video_callback(frame.Stream, frame.Keyframe, frame.Timestamp, frame.Data, frame.Bytes);
+    };
+
+    return Start(setup_callback, frame_callback, port, enable_logging);
+}
+
+bool RTMPReceiver::Start(
+        RTMPSetupCallback setup_callback,
+        RTMPFrameCallback frame_callback,
+        int port,
+        bool enable_logging)
+{
+    Callbacks.SetupCallback = setup_callback;
+    Callbacks.FrameCallback = frame_callback;
+
+    return BasicRTMPReceiver<RTMPCallbackHandler>::Start(&Callbacks, port, enable_logging);
+}
+
+void RTMPReceiver::AddRoute(
+        const std::string& key,
+        RTMPSetupCallback setup_callback,
+        RTMPFrameCallback frame_callback,
+        const RTMPAdmissionLimits& limits)
+{
+    std::unique_ptr<RTMPCallbackHandler> handler = std::make_unique<RTMPCallbackHandler>();
+    handler->SetupCallback = setup_callback;
+    handler->FrameCallback = frame_callback;
+
+    AddRoute(key, handler.get(), limits);
+
+    std::lock_guard<std::mutex> locker(RouteCallbacksLock);
+    RouteCallbacks.push_back(std::move(handler));
+}
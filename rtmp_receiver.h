@@ -3,17 +3,32 @@
 
 #include "rtmp_parser.h"
 #include "avcc_parser.h"
+#include "rtmp_capture.h"
+#include "rtmp_metrics.h"
+#include "rtmp_clock.h"
+#include "rtmp_flow.h"
+#include "rtmp_event_loop.h"
+#include "rtmp_output.h"
+#include "rtmp_responses.h"
+#include "rtmp_handoff.h"
+#include "rtmp_arena.h"
 
 #include <thread>
+#include <memory>
 #include <vector>
 #include <functional>
+#include <future>
 #include <atomic>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <cstdint>
 
+struct DeliveryBacklog;
+class FrameDeliveryThread;
 
 //------------------------------------------------------------------------------
-// RTMPReceiver
+// Callbacks
 
 // Called to set up a new stream
 using RTMPSetupCallback = std::function<void(
@@ -28,68 +43,1087 @@ using RTMPVideoCallback = std::function<void(
     const uint8_t* data,
     int bytes)>;
 
+// Video frame with its metadata
+struct RTMPVideoFrame {
+    // Connection number on the receiver, in accept order, to tell apart
+    // publishers that use the same stream ID
+    uint32_t Connection = 0;
+
+    uint32_t Stream = 0;
+    bool Keyframe = false;
+
+    // RTMP message timestamp as received (decode order, wraps at 2^32 msec)
+    uint32_t Timestamp = 0;
+
+    // Decode and presentation timestamps in msec on a 64-bit timeline that
+    // continues across wraparound.  Pts = Dts + composition time offset
+    int64_t Dts = 0;
+    int64_t Pts = 0;
+
+    // AVCC video data, only valid during the callback
+    const uint8_t* Data = nullptr;
+    int Bytes = 0;
+
+    // Sender clock recovered onto the local monotonic clock, for scheduling
+    // playout (see PlayoutScheduler)
+    RTMPFrameClock Clock;
+
+    // Stage timestamps, when built with RTMP_ENABLE_TRACING
+    RTMPFrameTrace Trace;
+};
+
+// Called to receive video frames with their metadata
+using RTMPFrameCallback = std::function<void(const RTMPVideoFrame& frame)>;
+
+//------------------------------------------------------------------------------
+// TimestampUnwrapper
+
+// Extends 32-bit RTMP timestamps to 64 bits.  Each step is taken as a signed
+// 32-bit delta from the previous timestamp, so the timeline keeps increasing
+// when the 32-bit value wraps (every ~49.7 days)
+class TimestampUnwrapper {
+public:
+    int64_t Unwrap(uint32_t timestamp);
+
+    // Hot restart: Carries the timeline over to the successor
+    void SaveState(ByteStreamWriter& out) const;
+    bool RestoreState(ByteStream& in);
+
+private:
+    bool HasLast = false;
+    uint32_t Last = 0;
+    int64_t Extended = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// PresentationReorderer
+
+// Emits frames in presentation order.  At most Depth frames are held, so the
+// added latency is bounded by Depth frame intervals.  With Depth 0 frames pass
+// straight through without being copied
+class PresentationReorderer {
+public:
+    void SetDepth(int depth);
+    int GetDepth() const {
+        return Depth;
+    }
+
+    void Push(const RTMPVideoFrame& frame, const RTMPFrameCallback& emit);
+
+    // Emit everything still held
+    void Flush(const RTMPFrameCallback& emit);
+
+private:
+    struct HeldFrame {
+        RTMPVideoFrame Frame;
+        std::vector<uint8_t> Data;
+    };
+
+    int Depth = 0;
+
+    std::vector<std::unique_ptr<HeldFrame>> Held;
+
+    // Buffers of emitted frames, reused to avoid allocations
+    std::vector<std::unique_ptr<HeldFrame>> Free;
+
+    void EmitEarliest(const RTMPFrameCallback& emit);
+};
+
+
+//------------------------------------------------------------------------------
+// RTMPConnection
+
 struct VideoStreamState {
     AVCCParser avccParser;
     bool NewStream = true;
+
+    TimestampUnwrapper Timeline;
+    PresentationReorderer Reorderer;
+    ClockRecovery Clock;
+
+    // Bitrate measurement window
+    uint64_t WindowStartUsec = 0;
+    uint64_t WindowBytes = 0;
+
+    bool HasKeyframe = false;
+    uint32_t LastKeyframeTimestamp = 0;
+
+    StreamGauges Gauges;
+};
+
+enum RTMPSessionPhase {
+    PHASE_HANDSHAKE,
+    PHASE_CONNECTING, // Waiting for connect, createStream and publish
+    PHASE_PUBLISHING,
+    PHASE_REJECTED, // Error status queued: close once it is sent
+    PHASE_CLOSING // Dropped by the receiver: stop reading and close
+};
+
+// Limits on the publishers of one stream key.  0 = unlimited
+struct RTMPAdmissionLimits {
+    // Sessions publishing the key at once.  More are rejected at publish
+    int MaxPublishers = 0;
+
+    // A publisher is rejected before its first frame if onMetaData declares
+    // a higher videodatarate, and dropped if it sends more than twice this
+    // over one second
+    uint32_t MaxBitrateKbps = 0;
+
+    // At MaxPublishers, a new publisher replaces the one that has published
+    // longest instead of being rejected.  For a client that reconnects while
+    // its old connection is still half-open, e.g. after a Wi-Fi drop
+    bool Takeover = false;
+};
+
+enum RTMPTransport {
+    RTMP_TRANSPORT_TCP, // Port on BindAddress
+    RTMP_TRANSPORT_UNIX, // Unix domain stream socket at UnixPath
+    RTMP_TRANSPORT_FD, // ListenFd, already bound and listening
+    RTMP_TRANSPORT_NONE // Only sockets passed to AddConnection()
+};
+
+// Where the receiver accepts publishers
+struct RTMPListenSettings {
+    RTMPTransport Transport = RTMP_TRANSPORT_TCP;
+
+    // TCP: IPv4 or IPv6 literal, e.g. "127.0.0.1" or "::1".  Empty = all
+    // interfaces, over IPv6 when available
+    std::string BindAddress;
+
+    // TCP on an IPv6 address: Also accept IPv4 clients (IPV6_V6ONLY off)
+    bool DualStack = true;
+
+    // Unix: Socket path, replacing a stale socket file.  A leading '@' is
+    // the abstract namespace, which leaves no file behind
+    std::string UnixPath;
+
+    // FD: e.g. fd 3 from systemd socket activation.  Closed by Stop()
+    int ListenFd = -1;
+};
+
+// How the receiver thread waits for sockets
+enum RTMPLoopMode {
+    // Sleep in epoll_wait() until a socket is ready (default)
+    RTMP_LOOP_BLOCKING,
+
+    // The kernel polls the NIC queues inside epoll_wait() for BusyPollUsec
+    // before sleeping.  Linux 6.9 or later, and only for sockets on a NIC
+    // with NAPI (not loopback)
+    RTMP_LOOP_EPOLL_BUSY_POLL,
+
+    // Never sleep: spin on epoll_wait() without a timeout.  Lowest wakeup
+    // latency, but the receiver thread keeps one core busy even when idle.
+    // For a dedicated ingest host
+    RTMP_LOOP_BUSY_POLL
+};
+
+// Kernel socket options and receive sizing.  0 / false = kernel default
+struct RTMPSocketSettings {
+    // SO_RCVBUF and SO_SNDBUF in bytes, set on the listening socket so the
+    // TCP window scale is chosen for them, and on each client socket.  The
+    // kernel doubles the value and caps it at net.core.rmem_max / wmem_max
+    int ReceiveBufferBytes = 0;
+    int SendBufferBytes = 0;
+
+    // TCP_NODELAY.  Responses to each recv() already leave in one send, so
+    // this only matters for acks sent while the publisher waits on them
+    bool NoDelay = false;
+
+    // TCP_QUICKACK, set again after every recv() because the kernel clears
+    // it.  Costs a syscall per read
+    bool QuickAck = false;
+
+    // SO_BUSY_POLL on each client socket, and the epoll busy poll time with
+    // RTMP_LOOP_EPOLL_BUSY_POLL.  Above net.core.busy_read this needs
+    // CAP_NET_ADMIN
+    int BusyPollUsec = 0;
+
+    // SO_PREFER_BUSY_POLL: Defer NIC interrupts while busy polling
+    bool PreferBusyPoll = false;
+
+    // Bytes read per recv(), shared by every connection on the receiver
+    int RecvBufferBytes = 2048 * 16;
+
+    RTMPLoopMode LoopMode = RTMP_LOOP_BLOCKING;
+};
+
+// Detecting publishers that have gone away without closing.  0 = off
+struct RTMPTimeoutSettings {
+    // TCP_USER_TIMEOUT: Close when data we sent (acks, responses) stays
+    // unacknowledged this long
+    int UserTimeoutMsec = 0;
+
+    // TCP keepalive: Probe after this long without traffic, then every
+    // KeepaliveIntervalSec, and close after KeepaliveCount unanswered probes
+    int KeepaliveIdleSec = 0;
+    int KeepaliveIntervalSec = 1;
+    int KeepaliveCount = 3;
+
+    // Close a session that has not sent video for this long.  Before the
+    // first frame this counts from accept, so it also bounds setup
+    int NoMediaTimeoutMsec = 0;
+};
+
+// Queues frames between socket reads and the frame callback, which then runs
+// on a separate delivery thread, and bounds each connection's queue.  0 = off:
+// callbacks run on the receiver thread as frames are parsed (default)
+struct RTMPBackpressureSettings {
+    // Queued bytes per connection at which it is throttled, and below which
+    // it reads normally again
+    size_t HighWatermarkBytes = 0;
+    size_t LowWatermarkBytes = 0;
+
+    // Throttle by not reading the socket, so TCP flow control slows the
+    // publisher down to the callback's pace
+    bool PauseReads = true;
+
+    // Drop policy: Once paused this long (immediately without PauseReads),
+    // read again but drop frames until the queue is below the low watermark
+    // and a keyframe arrives.  -1 = never drop
+    int DropAfterMsec = -1;
+};
+
+// Where the receiver and delivery threads run, and so where their memory
+// lives.  Empty CPU lists = wherever the scheduler puts them (default)
+struct RTMPPlacementSettings {
+    // CPUs for the receiver thread, which reads the sockets, reassembles
+    // messages and copies frames queued for delivery.  The receive buffer and
+    // arena are mapped on their node, and heap buffers are allocated by the
+    // pinned thread so they land there too
+    std::vector<int> ReceiverCpus;
+
+    // CPUs for the delivery thread with SetBackpressure().  Empty = the other
+    // CPUs on the node of ReceiverCpus, if they are all on one node, so the
+    // callback reads frames copied on its own node
+    std::vector<int> DeliveryCpus;
+
+    // Reserve this much per receiver for rolling, reassembly and delivery
+    // buffers, carved out with BufferArena rather than taken from the heap.
+    // Buffers that do not fit fall back to the heap.  0 = heap (default)
+    size_t ArenaBytes = 0;
+
+    // Back the receive buffer and arena with transparent hugepages, rounding
+    // them up to 2 MB.  Needs THP in "madvise" or "always" mode
+    bool HugePages = false;
+
+    // Take hugepages from the pool reserved with vm.nr_hugepages instead.
+    // Falls back to HugePages if the pool is too small
+    bool HugeTlb = false;
+};
+
+// Where the threads and receive buffer actually ended up.  -1 or empty =
+// unknown, or not running
+struct RTMPPlacement {
+    // Affinity in effect, the CPU last run on, and its node
+    std::vector<int> ReceiverCpus;
+    int ReceiverCpu = -1;
+    int ReceiverNode = -1;
+
+    // Only with SetBackpressure()
+    std::vector<int> DeliveryCpus;
+    int DeliveryCpu = -1;
+    int DeliveryNode = -1;
+
+    // Region holding the receive buffer and, with ArenaBytes, the rest: its
+    // node, page size and how much of it is in use
+    ArenaStats Memory;
+};
+
+// One client connection, owned by its session coroutine
+struct RTMPConnection {
+    virtual ~RTMPConnection() = default;
+
+    // Accept order on this receiver, reported in RTMPVideoFrame::Connection
+    uint32_t Id = 0;
+    int Socket = -1;
+    RTMPSessionPhase Phase = PHASE_HANDSHAKE;
+
+    CaptureWriter Capture;
+    RollingBuffer Buffer; // Keep left-overs from previous chunks
+    AckWindowController Flow;
+
+    // S0 and S1 as sent, kept until C2 echoes S1
+    std::vector<uint8_t> ServerHello;
+
+    // Responses not yet accepted by the socket
+    OutputQueue Output;
+
+    // recv() calls, including those that returned EAGAIN
+    uint64_t RecvCalls = 0;
+
+    // Accept time, cleared once the first stream setup has been timed
+    uint64_t AcceptUsec = 0;
+
+    // Last video message, or accept time before the first
+    uint64_t LastMediaUsec = 0;
+
+    // From connect, e.g. "live"
+    std::string App;
+
+    // "<app>/<stream key>" once admitted by publish, counted against Limits
+    std::string StreamKey;
+    RTMPAdmissionLimits Limits;
+    bool Admitted = false;
+
+    // videodatarate from onMetaData in kbps, or 0 if not declared
+    double DeclaredKbps = 0;
+
+    // With backpressure: Frames waiting for the delivery thread
+    std::shared_ptr<DeliveryBacklog> Backlog;
+    // When reads were paused, or 0 if reading
+    uint64_t PausedSinceUsec = 0;
+    uint64_t ThrottledUsec = 0;
+    // Dropping frames until the next keyframe
+    bool Shedding = false;
+
+    // TCP socket with RTMPSocketSettings::QuickAck
+    bool QuickAck = false;
+
+    // Rejected or dropped: no more commands or frames are handled
+    bool IsEnding() const {
+        return Phase == PHASE_REJECTED || Phase == PHASE_CLOSING;
+    }
+
+    // When recv() last returned EAGAIN, or 0 if it has returned data since
+    uint64_t WaitStartUsec = 0;
+
+    std::unordered_map<uint32_t, std::unique_ptr<VideoStreamState>> VideoStreams;
+
+    // Most sessions carry one stream, so remember the last lookup
+    uint32_t LastStreamId = 0;
+    VideoStreamState* LastStream = nullptr;
+
+    VideoStreamState& GetStreamState(uint32_t stream) {
+        if (LastStream && LastStreamId == stream) {
+            return *LastStream;
+        }
+        return FindStreamState(stream);
+    }
+    VideoStreamState& FindStreamState(uint32_t stream);
 };
 
-class RTMPReceiver : protected RTMPHandler {
+
+//------------------------------------------------------------------------------
+// RTMPReceiverBase
+
+// Sockets, handshake, flow control, capture and metrics shared by every
+// BasicRTMPReceiver.  Nothing here depends on the frame handler type.
+//
+// All connections are served by one thread: each is a coroutine on an
+// epoll EventLoop that reads as the handshake, command exchange and media
+// phases in order, suspending whenever its socket would block
+class RTMPReceiverBase {
 public:
-    ~RTMPReceiver() {
+    virtual ~RTMPReceiverBase() {
         Stop();
     }
 
-    bool Start(
-        RTMPSetupCallback setup_callback,
-        RTMPVideoCallback video_callback,
-        int port = 1935,
-        bool enable_logging = false);
+    // Wakes the receiver thread through the control socket, which every wait
+    // in the thread also watches, so this returns promptly even while
+    // sessions are blocked mid-handshake or mid-message.  Open sessions are
+    // closed and held frames are delivered before it returns
     void Stop();
 
-private:
+    // Time the last Stop() took, from the request to the thread exiting
+    uint64_t GetLastStopUsec() const {
+        return LastStopUsec;
+    }
+
+    // Record every recv() from each client into "<path_prefix>_<n>.rtmpcap".
+    // Must be called before Start().  Replay the files with rtmp_replay
+    void SetCapturePath(const std::string& path_prefix);
+
+    // Counters are recorded into GetDefaultMetricsRegistry() unless another
+    // registry is provided.  Must be called before Start()
+    void SetMetrics(MetricsRegistry* metrics);
+
+    // Deliver frames in presentation order, holding at most the SPS
+    // num_reorder_frames and never more than max_reorder_frames.
+    // 0 = decode order (default).  Must be called before Start()
+    void SetReorder(int max_reorder_frames);
+
+    // Window ack size, peer bandwidth and chunk size sent to publishers, and
+    // whether to adapt them to each session.  Must be called before Start()
+    void SetFlowSettings(const RTMPFlowSettings& settings);
+
+    // Per-stage frame latency since Start().  Empty unless built with RTMP_ENABLE_TRACING
+    void GetLatencyStats(RTMPLatencyStats& stats) const;
+
+    // CPU time used by the receiver thread since Start(), or 0 if not running
+    uint64_t GetThreadCpuUsec() const;
+
+    // Testing: Caps each send at max_bytes to inject short writes.
+    // 0 = no limit (default).  Must be called before Start()
+    void SetMaxSendBytes(int max_bytes);
+
+    // Limits for stream keys without a route, which go to the handler given
+    // to Start().  With require_route they are rejected instead.  Must be
+    // called before Start()
+    void SetDefaultRoute(const RTMPAdmissionLimits& limits, bool require_route = false);
+
+    // Stall detection for every session.  Must be called before Start()
+    void SetTimeouts(const RTMPTimeoutSettings& timeouts);
+
+    // Queue frames for a delivery thread and throttle connections whose
+    // queue grows.  The setup and frame callbacks of every connection then
+    // run on that thread instead of the receiver thread.  Must be called
+    // before Start()
+    void SetBackpressure(const RTMPBackpressureSettings& backpressure);
+
+    // Listen on a Unix socket, an inherited fd, or a particular address
+    // instead of all interfaces.  Must be called before Start()
+    void SetListen(const RTMPListenSettings& listen);
+
+    // Socket buffer sizes, TCP options, busy polling and the receive size.
+    // Must be called before Start()
+    void SetSocketSettings(const RTMPSocketSettings& sockets);
+
+    // Pin the receiver and delivery threads to CPUs and place the receive
+    // buffer on their node.  Must be called before Start()
+    void SetPlacement(const RTMPPlacementSettings& placement);
+
+    // Where the threads run and the receive buffer lives.  Can be called from
+    // any thread after Start().  Returns false if not running
+    bool GetPlacement(RTMPPlacement& placement) const;
+
+    // Serves a socket that is already connected, e.g. one end of a
+    // socketpair() or an fd received over SCM_RIGHTS.  Takes ownership.  Can
+    // be called from any thread after Start().  Returns false, closing the
+    // socket, if not running
+    bool AddConnection(int socket);
+
+    // Hot restart, on the running receiver: Stops reading every session
+    // between two messages, then sends the listening socket, each client
+    // socket and its session state to the successor on handoff_socket (see
+    // rtmp_handoff.h) and stops.  Publishers stay connected.  Sessions still
+    // in the handshake are closed.  Can be called from any thread after
+    // Start(), but not during Stop().  Returns false, and keeps running, if
+    // the successor could not be reached
+    bool HandOff(int handoff_socket);
+
+    // Hot restart, on the successor: Receives what HandOff() sends.  The
+    // listening socket replaces SetListen(), and the sessions continue where
+    // they stopped once Start() is called.  Must be called before Start().
+    // Returns false if nothing arrived within timeout_msec
+    bool TakeOver(int handoff_socket, int timeout_msec = kHandoffTimeoutMsec);
+
+protected:
+    // Declared first so it outlives every buffer drawn from it
+    BufferArena Arena;
+
     int Port = 1935;
-    RTMPSetupCallback SetupCallback;
-    RTMPVideoCallback VideoCallback;
     bool EnableLogging = false;
 
+    std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
+
+    MetricsRegistry* Metrics = &GetDefaultMetricsRegistry();
+
+    int MaxReorderFrames = 0;
+    int MaxSendBytes = 0;
+
+    RTMPAdmissionLimits DefaultLimits;
+    bool RequireRoute = false;
+
+    RTMPTimeoutSettings Timeouts;
+
+    RTMPBackpressureSettings Backpressure;
+    RTMPListenSettings Listen;
+    RTMPSocketSettings Sockets;
+    RTMPPlacementSettings Placement;
+    // Running while Backpressure is enabled
+    std::shared_ptr<FrameDeliveryThread> Delivery;
+
+    RTMPFlowSettings FlowSettings;
+
+    // Shared by all connections: each recv() is parsed before the next.
+    // Carved from Arena by the receiver thread once it is pinned
+    ArenaBytes RecvBuffer;
+
+    // Set by the receiver thread once it is placed, for GetPlacement()
+    std::atomic<int> ThreadId = ATOMIC_VAR_INIT(-1);
+
+    enum VideoResult {
+        VIDEO_DROPPED,
+        VIDEO_SETUP, // Stream parameters arrived: SetupResult is ready
+        VIDEO_FRAME // Frame is ready to deliver
+    };
+
+    bool StartServer(int port, bool enable_logging);
+
+    // Arena for per-connection buffers, or nullptr for the heap
+    BufferArena* GetBufferArena() {
+        return Placement.ArenaBytes > 0 ? &Arena : nullptr;
+    }
+
+    // Serializes the fixed responses for the current FlowSettings
+    void BuildResponses();
+
+    // Connection with a session parser for the handler type
+    virtual std::unique_ptr<RTMPConnection> CreateConnection() = 0;
+
+    // Parses bytes received after the handshake.  wait_usec: Time the
+    // session waited for them, for flow control
+    virtual void ParseReceived(RTMPConnection& conn, const uint8_t* data, int bytes, uint64_t wait_usec) = 0;
+
+    // Called once when the connection closes, to deliver held frames
+    virtual void FinishConnection(RTMPConnection& conn) = 0;
+
+    // Looks up the handler for key ("<app>/<stream key>") and points the
+    // connection at it.  Returns false if the key should be rejected
+    virtual bool FindRoute(RTMPConnection& conn, const std::string& key, RTMPAdmissionLimits& limits) = 0;
+
+    // Called on the delivery thread with the handler the entry was queued for
+    virtual void DeliverQueuedSetup(void* handler, uint32_t stream, RTMPSetupResult& result) = 0;
+    virtual void DeliverQueuedFrame(void* handler, const RTMPVideoFrame& frame) = 0;
+
+    // Hot restart: Session parser state of the connection
+    virtual void SaveSession(RTMPConnection& conn, ByteStreamWriter& out) = 0;
+    virtual bool RestoreSession(RTMPConnection& conn, ByteStream& in) = 0;
+    // Delivers the setup of streams a session brought from its predecessor
+    virtual void ResumeStreams(RTMPConnection& conn) = 0;
+
+    // Copies into the connection's backlog for the delivery thread.  Frames
+    // may be dropped by the drop policy
+    void QueueSetup(RTMPConnection& conn, void* handler, uint32_t stream, const RTMPSetupResult& result);
+    void QueueFrame(RTMPConnection& conn, void* handler, const RTMPVideoFrame& frame);
+
+    // Returns true if the session should ack immediately
+    bool UpdateFlow(RTMPConnection& conn, uint64_t wait_usec, uint64_t received_bytes, uint64_t unacked_bytes);
+
+    void QueueChunkAck(RTMPConnection& conn, uint32_t ack_bytes);
+    void HandleCommand(RTMPConnection& conn, const RTMPCommand& command);
+
+    VideoResult PrepareVideo(
+        RTMPConnection& conn,
+        VideoStreamState& stream_state,
+        bool keyframe,
+        uint32_t stream,
+        uint32_t timestamp,
+        const uint8_t* data,
+        int bytes,
+        const RTMPFrameTrace& trace,
+        RTMPVideoFrame& frame);
+    // Reorder depth from the stream SPS, capped by MaxReorderFrames
+    void SetReorderDepth(VideoStreamState& stream_state);
+    void UpdateStreamGauges(
+        RTMPConnection& conn,
+        VideoStreamState& stream_state,
+        uint32_t stream,
+        bool keyframe,
+        uint32_t timestamp,
+        int bytes);
+    RTMP_TRACE(void RecordLatency(const RTMPFrameTrace& trace, uint64_t callback_exit_nsec);)
+
+private:
     // Shutdown control socket
     int ControlSock[2];
 
-    std::atomic<bool> Terminated = ATOMIC_VAR_INIT(false);
     std::shared_ptr<std::thread> Thread;
 
-    int ClientSocket = -1;
+    EventLoop Loop;
+
+    uint64_t LastStopUsec = 0;
+
+    uint32_t ConnectionCount = 0;
+
+    // Built by BuildResponses()
+    RTMPResponseTemplates Responses;
+
+    // Sockets from AddConnection() for the receiver thread to pick up.
+    // AcceptingAdded is set from Start() until Stop()
+    std::mutex AddedLock;
+    bool AcceptingAdded = false;
+    std::vector<int> AddedSockets;
+    std::atomic<bool> HasAddedSockets = ATOMIC_VAR_INIT(false);
+
+    // Request from HandOff() for the receiver thread
+    std::atomic<std::promise<bool>*> HandoffRequest = ATOMIC_VAR_INIT(nullptr);
+    int HandoffSocket = -1;
+    // Sessions went to a successor, which now owns the listening socket
+    bool HandedOff = false;
+
+    // From TakeOver(), started by RunServer() before accepting
+    std::vector<HandoffMessage> AdoptedSessions;
 
-    std::vector<uint8_t> RecvBuffer;
-    uint8_t Handshake[1 + 1536];
-    uint8_t RandomEcho[1536];
+    // Open sessions by Id.  Receiver thread only
+    std::unordered_map<uint32_t, RTMPConnection*> Sessions;
+    uint64_t NextCheckUsec = 0;
+    uint64_t CheckIntervalUsec = 0;
 
-    void Loop();
+    // Admitted publishers by stream key, oldest first.  Receiver thread only
+    std::unordered_map<std::string, std::vector<RTMPConnection*>> PublishersByKey;
+
+    std::string CapturePath;
+
+    RTMP_TRACE(LatencyHistogram LatencyHistograms[LATENCY_STAGE_COUNT];)
+
+    void ThreadLoop();
     void RunServer();
-    bool WaitForConnection(int server_socket);
-    void HandleNextClient(int server_socket);
 
-    bool SendS0S1();
-    bool SendS2(uint32_t peer_time, const void* client_random);
-    bool CheckC2(const void* echo);
-    void ParseRTMPPacket(const uint8_t* data, size_t size);
+    // Listening socket for the transport, or -1 on failure.  Sets ListenName
+    int OpenListenSocket();
+    void CloseListenSocket(int server_socket);
+    std::string ListenName;
+
+    EventTask AcceptConnections(int server_socket);
+
+    // Starts sessions for sockets queued by AddConnection()
+    void ServeAddedSockets();
+    // adopted: Session taken over from a predecessor, past the handshake
+    EventTask RunConnection(int client_socket, std::unique_ptr<RTMPConnection> adopted = nullptr);
+
+    // Hot restart.  ServeHandoff() returns true once the sessions are gone
+    bool ServeHandoff(int server_socket);
+    bool SendHandoff(int server_socket, uint32_t& sent_count);
+    void SaveConnection(RTMPConnection& conn, ByteStreamWriter& out);
+    bool RestoreConnection(RTMPConnection& conn, ByteStream& in);
+    void AdoptSessions();
+    // Fails a HandOff() the thread is not going to serve
+    void CancelHandoff();
+
+    // Phases of RunConnection().  Each returns false if the connection should close
+    AsyncCall<bool> RunHandshake(RTMPConnection& conn);
+    AsyncCall<bool> ReceiveHandshake(RTMPConnection& conn, RTMPHandshake& handshake, int round);
+    AsyncCall<bool> ReceiveSession(RTMPConnection& conn, RTMPSessionPhase until_phase);
+    AsyncCall<bool> Flush(RTMPConnection& conn);
+    // Stops reading until the backlog drains, or the drop policy kicks in
+    AsyncCall<bool> WaitForBacklog(RTMPConnection& conn);
+
+    // Non-blocking recv() into RecvBuffer: returns bytes, or 0 on disconnect,
+    // or kReceiveAgain if the socket has nothing to read
+    static const int kReceiveAgain = -1;
+    int ReceiveData(RTMPConnection& conn);
+
+    // One non-blocking flush.  Returns false if the connection failed
+    bool SendOutput(RTMPConnection& conn, OutputQueue::FlushResult& result);
+
+    void OpenCapture(RTMPConnection& conn);
+
+    void QueueS0S1(RTMPConnection& conn);
+    void QueueS2(RTMPConnection& conn, uint32_t peer_time, const void* client_random);
+    bool CheckC2(RTMPConnection& conn, const void* echo);
+
+    void QueueWindowUpdate(RTMPConnection& conn, uint32_t window_ack_size, uint32_t max_unacked_bytes, int limit_type);
+    // Copies a _result template with the transaction number filled in
+    void QueueResult(RTMPConnection& conn, const std::vector<uint8_t>& result, double command_number);
+
+    bool AdmitPublisher(RTMPConnection& conn, const std::string& stream_name);
+    // Queues an error onStatus and closes the connection once it is sent
+    void RejectPublisher(RTMPConnection& conn, const std::string& key, const char* code, const char* description);
+    void ReleasePublisher(RTMPConnection& conn);
+
+    void ApplySocketTimeouts(int client_socket);
+    // SO_RCVBUF, SO_SNDBUF and busy polling for any socket, and the TCP
+    // options for TCP sockets
+    void ApplySocketSettings(RTMPConnection& conn);
+    // Applies one option, warning only the first time one fails
+    void SetSocketOption(int s, int level, int name, int value, const char* option_name);
+    bool WarnedSocketOption = false;
+    // How often CheckSessions() runs, or -1 if there is nothing to check
+    int GetCheckIntervalMsec() const;
+    // Closes sessions past NoMediaTimeoutMsec, and starts the drop policy for
+    // sessions paused longer than DropAfterMsec
+    void CheckSessions();
+    // Ends a session from outside its coroutine.  It wakes to a closed socket
+    void DropSession(RTMPConnection& conn);
+};
+
+
+//------------------------------------------------------------------------------
+// BasicRTMPReceiver
+
+// Receiver that calls a handler type known at compile time, so the session
+// parser, stream lookup and frame delivery inline into one call chain with
+// no virtual or std::function call per frame.  FrameHandler provides:
+//
+//   void OnSetup(uint32_t stream, RTMPSetupResult& result);
+//   void OnFrame(const RTMPVideoFrame& frame);
+//
+// By default both are called on the receiver thread as frames are parsed.
+// After SetBackpressure() they are called instead on the delivery thread,
+// one thread shared by every connection and separate from the receiver
+// thread, so a handler must not assume it runs on the thread that reads the
+// socket.  ParseSessionData() calls them on the calling thread.  Publishers
+// are routed by stream key to handlers added with AddRoute(), or else to the
+// one given to Start().
+template <class FrameHandler>
+class BasicRTMPReceiver : public RTMPReceiverBase {
+public:
+    ~BasicRTMPReceiver() {
+        Stop();
+        delete PendingRoutes.exchange(nullptr);
+    }
+
+    // Default handler, or null to reject stream keys without a route.  The
+    // handler must stay valid until Stop()
+    bool Start(FrameHandler* handler, int port = 1935, bool enable_logging = false) {
+        Handler = handler;
+        return StartServer(port, enable_logging);
+    }
+
+    // Sends publishers of key ("<app>/<stream key>", e.g. "live/stream") to
+    // handler, which must stay valid until Stop().  Sessions already
+    // publishing keep their handler.  May be called from any thread while
+    // running: the receiver picks up the new table without taking a lock
+    void AddRoute(const std::string& key, FrameHandler* handler, const RTMPAdmissionLimits& limits = RTMPAdmissionLimits());
+    void RemoveRoute(const std::string& key);
+
+    // Parses bytes a client sent after the handshake as if they arrived on a
+    // connection, without a network.  Replies to the client are dropped.  For
+    // benchmarks and offline tools; must not be called while running
+    void ParseSessionData(FrameHandler* handler, const void* data, int bytes);
+
+private:
+    struct Connection : public RTMPConnection {
+        BasicRTMPReceiver* Receiver = nullptr;
+        BasicRTMPSession<Connection> Session;
+
+        // Default handler until publish is routed
+        FrameHandler* Handler = nullptr;
+
+        // BasicRTMPSession handler interface
+        void OnNeedAck(uint32_t bytes) {
+            Receiver->QueueChunkAck(*this, bytes);
+        }
+        void OnMessage(const RTMPCommand& command) {
+            Receiver->HandleCommand(*this, command);
+        }
+        void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace) {
+            Receiver->OnAvccVideo(*this, keyframe, stream, timestamp, data, bytes, trace);
+        }
+    };
+
+    FrameHandler* Handler = nullptr;
+
+    struct Route {
+        FrameHandler* Handler = nullptr;
+        RTMPAdmissionLimits Limits;
+    };
+    using RouteTable = std::unordered_map<std::string, Route>;
+
+    // AddRoute() edits RoutesMaster and hands the receiver thread a copy
+    // through PendingRoutes.  A copy it has not taken yet is replaced
+    std::mutex RoutesLock;
+    RouteTable RoutesMaster;
+    std::atomic<RouteTable*> PendingRoutes = ATOMIC_VAR_INIT(nullptr);
+
+    // Receiver thread only
+    std::unique_ptr<RouteTable> Routes;
+
+    // For ParseSessionData()
+    std::unique_ptr<Connection> Offline;
+
+    std::unique_ptr<RTMPConnection> CreateConnection() override;
+    void ParseReceived(RTMPConnection& conn, const uint8_t* data, int bytes, uint64_t wait_usec) override;
+    void FinishConnection(RTMPConnection& conn) override;
+    bool FindRoute(RTMPConnection& conn, const std::string& key, RTMPAdmissionLimits& limits) override;
+    void DeliverQueuedSetup(void* handler, uint32_t stream, RTMPSetupResult& result) override;
+    void DeliverQueuedFrame(void* handler, const RTMPVideoFrame& frame) override;
+    void SaveSession(RTMPConnection& conn, ByteStreamWriter& out) override;
+    bool RestoreSession(RTMPConnection& conn, ByteStream& in) override;
+    void ResumeStreams(RTMPConnection& conn) override;
+
+    // Call with RoutesLock held
+    void PublishRoutes();
+
+    void OnAvccVideo(Connection& conn, bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace);
+
+    void Deliver(Connection& conn, const RTMPVideoFrame& frame);
+    void CallHandler(FrameHandler* handler, const RTMPVideoFrame& frame);
+};
+
+template <class FrameHandler>
+std::unique_ptr<RTMPConnection> BasicRTMPReceiver<FrameHandler>::CreateConnection()
+{
+    std::unique_ptr<Connection> conn(new Connection);
+    conn->Receiver = this;
+    conn->Handler = Handler;
+    conn->Output.MaxSendBytes = MaxSendBytes;
+    conn->Session.Buffer = &conn->Buffer;
+    conn->Session.Handler = conn.get();
+    conn->Session.Metrics = Metrics;
+    conn->Session.Arena = GetBufferArena();
+    conn->Buffer.SetArena(GetBufferArena());
+    return conn;
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::ParseReceived(RTMPConnection& base_conn, const uint8_t* data, int bytes, uint64_t wait_usec)
+{
+    Connection& conn = static_cast<Connection&>( base_conn );
+    RTMP_TRACE(conn.Session.RecvNsec = GetMonotonicNsec();)
+
+    // Checked before parsing, against what was unacked while waiting
+    if (UpdateFlow(conn, wait_usec, conn.Session.GetReceivedBytes(), conn.Session.GetUnackedBytes())) {
+        // Unblock the publisher before it has to wait another window
+        conn.Session.SendAck();
+    }
+    conn.Session.AckIntervalBytes = conn.Flow.GetAckIntervalBytes();
+
+    // Pass null after the first call to continue parsing the same buffer
+    while (conn.Session.ParseChunk(data, bytes)) {
+        data = nullptr;
+        bytes = 0;
+    }
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::FinishConnection(RTMPConnection& base_conn)
+{
+    Connection& conn = static_cast<Connection&>( base_conn );
+    for (auto& entry : conn.VideoStreams) {
+        entry.second->Reorderer.Flush([this, &conn](const RTMPVideoFrame& ready) {
+            Deliver(conn, ready);
+        });
+    }
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::SaveSession(RTMPConnection& base_conn, ByteStreamWriter& out)
+{
+    static_cast<Connection&>( base_conn ).Session.SaveState(out);
+}
+
+template <class FrameHandler>
+bool BasicRTMPReceiver<FrameHandler>::RestoreSession(RTMPConnection& base_conn, ByteStream& in)
+{
+    return static_cast<Connection&>( base_conn ).Session.RestoreState(in);
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::ResumeStreams(RTMPConnection& base_conn)
+{
+    Connection& conn = static_cast<Connection&>( base_conn );
+    if (conn.IsEnding() || !conn.Handler) {
+        return;
+    }
+
+    // The publisher will not resend its parameter sets, so set up the
+    // handler from the ones the predecessor had
+    for (auto& entry : conn.VideoStreams) {
+        VideoStreamState& stream_state = *entry.second;
+        if (stream_state.NewStream) {
+            continue;
+        }
+        stream_state.avccParser.SetupResult.Connection = conn.Id;
+        if (conn.Backlog) {
+            QueueSetup(conn, conn.Handler, entry.first, stream_state.avccParser.SetupResult);
+        } else {
+            conn.Handler->OnSetup(entry.first, stream_state.avccParser.SetupResult);
+        }
+    }
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::AddRoute(const std::string& key, FrameHandler* handler, const RTMPAdmissionLimits& limits)
+{
+    std::lock_guard<std::mutex> locker(RoutesLock);
+    Route& route = RoutesMaster[key];
+    route.Handler = handler;
+    route.Limits = limits;
+    PublishRoutes();
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::RemoveRoute(const std::string& key)
+{
+    std::lock_guard<std::mutex> locker(RoutesLock);
+    RoutesMaster.erase(key);
+    PublishRoutes();
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::PublishRoutes()
+{
+    delete PendingRoutes.exchange(new RouteTable(RoutesMaster));
+}
+
+template <class FrameHandler>
+bool BasicRTMPReceiver<FrameHandler>::FindRoute(RTMPConnection& base_conn, const std::string& key, RTMPAdmissionLimits& limits)
+{
+    Connection& conn = static_cast<Connection&>( base_conn );
+
+    // Take the newest table, if any was added since the last publish
+    RouteTable* latest = PendingRoutes.exchange(nullptr);
+    if (latest) {
+        Routes.reset(latest);
+    }
+
+    if (Routes) {
+        auto iter = Routes->find(key);
+        if (iter != Routes->end()) {
+            conn.Handler = iter->second.Handler;
+            limits = iter->second.Limits;
+            return true;
+        }
+    }
+
+    if (RequireRoute || !Handler) {
+        return false;
+    }
+    conn.Handler = Handler;
+    limits = DefaultLimits;
+    return true;
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::ParseSessionData(FrameHandler* handler, const void* data, int bytes)
+{
+    Handler = handler;
+
+    if (!Offline) {
+        std::unique_ptr<RTMPConnection> conn = CreateConnection();
+        Offline.reset(static_cast<Connection*>( conn.release() ));
+        Offline->Handler = handler;
+
+        // Captured media may start without a publish command to admit it
+        Offline->Phase = PHASE_PUBLISHING;
+        BuildResponses();
+        Offline->Flow.Start(FlowSettings, GetMonotonicUsec());
+    }
+
+    ParseReceived(*Offline, static_cast<const uint8_t*>( data ), bytes, 0);
+
+    // No client to send replies to
+    Offline->Output.Clear();
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::OnAvccVideo(
+    Connection& conn,
+    bool keyframe,
+    uint32_t stream,
+    uint32_t timestamp,
+    const uint8_t* data,
+    int bytes,
+    const RTMPFrameTrace& trace)
+{
+    if (conn.IsEnding()) {
+        return;
+    }
 
-    void OnNeedAck(uint32_t bytes) override;
-    bool SendChunkAck(uint32_t ack_bytes);
+    VideoStreamState& stream_state = conn.GetStreamState(stream);
 
-    void OnMessage(const std::string& name, double number) override;
+    RTMPVideoFrame frame;
+    const VideoResult result = PrepareVideo(conn, stream_state, keyframe, stream, timestamp, data, bytes, trace, frame);
 
-    bool SendConnectResult(
-        uint32_t window_ack_size,
-        uint32_t max_unacked_bytes,
-        int limit_type,
-        uint32_t chunk_size);
+    // Only a session admitted by publish has a handler, but ParseSessionData()
+    // may have been passed none
+    if (!conn.Handler) {
+        return;
+    }
+
+    if (result == VIDEO_SETUP) {
+        if (conn.Backlog) {
+            QueueSetup(conn, conn.Handler, stream, stream_state.avccParser.SetupResult);
+        } else {
+            conn.Handler->OnSetup(stream, stream_state.avccParser.SetupResult);
+        }
+    } else if (result == VIDEO_FRAME) {
+        if (stream_state.Reorderer.GetDepth() > 0) {
+            stream_state.Reorderer.Push(frame, [this, &conn](const RTMPVideoFrame& ready) {
+                Deliver(conn, ready);
+            });
+        } else {
+            Deliver(conn, frame);
+        }
 
-    bool SendNullResult(double command_number);
+        UpdateStreamGauges(conn, stream_state, stream, keyframe, timestamp, frame.Bytes);
+    }
+}
 
-    void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes) override;
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::Deliver(Connection& conn, const RTMPVideoFrame& frame)
+{
+    if (conn.Backlog) {
+        QueueFrame(conn, conn.Handler, frame);
+    } else {
+        CallHandler(conn.Handler, frame);
+    }
+}
 
-    std::unordered_map<uint32_t, std::shared_ptr<VideoStreamState>> video_streams;
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::CallHandler(FrameHandler* handler, const RTMPVideoFrame& frame)
+{
+#ifdef RTMP_ENABLE_TRACING
+    RTMPVideoFrame traced = frame;
+    traced.Trace.CallbackEntryNsec = GetMonotonicNsec();
+
+    handler->OnFrame(traced);
+
+    RecordLatency(traced.Trace, GetMonotonicNsec());
+#else
+    handler->OnFrame(frame);
+#endif
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::DeliverQueuedSetup(void* handler, uint32_t stream, RTMPSetupResult& result)
+{
+    static_cast<FrameHandler*>( handler )->OnSetup(stream, result);
+}
+
+template <class FrameHandler>
+void BasicRTMPReceiver<FrameHandler>::DeliverQueuedFrame(void* handler, const RTMPVideoFrame& frame)
+{
+    CallHandler(static_cast<FrameHandler*>( handler ), frame);
+}
+
+
+//------------------------------------------------------------------------------
+// RTMPReceiver
+
+// Adapts std::function callbacks to the BasicRTMPReceiver handler interface
+struct RTMPCallbackHandler {
+    RTMPSetupCallback SetupCallback;
+    RTMPFrameCallback FrameCallback;
+
+    void OnSetup(uint32_t stream, RTMPSetupResult& result) {
+        SetupCallback(stream, result);
+    }
+    void OnFrame(const RTMPVideoFrame& frame) {
+        FrameCallback(frame);
+    }
 };
 
+// Receiver taking std::function callbacks.  For the lowest per-frame
+// overhead, use BasicRTMPReceiver with your own handler type instead
+class RTMPReceiver : public BasicRTMPReceiver<RTMPCallbackHandler> {
+public:
+    ~RTMPReceiver() {
+        Stop();
+    }
+
+    bool Start(
+        RTMPSetupCallback setup_callback,
+        RTMPVideoCallback video_callback,
+        int port = 1935,
+        bool enable_logging = false);
+    bool Start(
+        RTMPSetupCallback setup_callback,
+        RTMPFrameCallback frame_callback,
+        int port = 1935,
+        bool enable_logging = false);
+
+    // Routes a stream key to its own callbacks.  See BasicRTMPReceiver
+    using BasicRTMPReceiver<RTMPCallbackHandler>::AddRoute;
+    void AddRoute(
+        const std::string& key,
+        RTMPSetupCallback setup_callback,
+        RTMPFrameCallback frame_callback,
+        const RTMPAdmissionLimits& limits = RTMPAdmissionLimits());
+
+private:
+    RTMPCallbackHandler Callbacks;
+
+    // Handlers for AddRoute(), kept until the receiver is destroyed since a
+    // session may still be using a removed route
+    std::mutex RouteCallbacksLock;
+    std::vector<std::unique_ptr<RTMPCallbackHandler>> RouteCallbacks;
+};
+
+// Compiled once in rtmp_receiver.cpp
+extern template class BasicRTMPReceiver<RTMPCallbackHandler>;
+
 #endif // RTMP_RECEIVER_H
@@ -0,0 +1,381 @@
+// Replays a capture recorded with RTMPReceiver::SetCapturePath() through the
+// same handshake and session parsers used by the receiver.
+//
+// Usage:
+//   rtmp_replay <capture.rtmpcap> [options]
+//
+//   --speed N          Pace recv() results at N times real-time (default: 1)
+//   --max              Replay as fast as possible
+//   --split N          Re-split every recv() into N-byte pieces
+//   --random-split N   Re-split every recv() into random 1..N byte pieces
+//   --seed N           Seed for --random-split (default: 1)
+//   --repeat N         Replay the capture N times (default: 1)
+//   --trace            Log every chunk and message the parser sees
+//   --shm NAME         Publish frames into a shared memory ring (see rtmp_shm_dump)
+//   --shm-avcc         With --shm: Publish AVCC rather than Annex B
+
+#include "rtmp_capture.h"
+#include "rtmp_shm.h"
+#include "rtmp_parser.h"
+#include "avcc_parser.h"
+#include "rtmp_tools.h"
+#include "rtmp_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <thread>
+#include <unordered_map>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Options
+
+struct ReplayOptions {
+    std::string Path;
+
+    // 0 = as fast as possible
+    double Speed = 1.0;
+
+    // 0 = keep the original recv() boundaries
+    int SplitBytes = 0;
+    bool RandomSplit = false;
+    uint32_t Seed = 1;
+
+    int Repeat = 1;
+
+    bool Trace = false;
+
+    // Empty = no shared memory ring
+    std::string ShmName;
+    ShmFrameFormat ShmFormat = SHM_FORMAT_ANNEXB;
+};
+
+static void PrintUsage() {
+    cout << "Usage: rtmp_replay <capture.rtmpcap> [--speed N | --max] [--split N | --random-split N] [--seed N] [--repeat N] [--trace]" << endl;
+    cout << "                   [--shm NAME] [--shm-avcc]" << endl;
+}
+
+static bool ParseOptions(int argc, char** argv, ReplayOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1 < argc);
+
+        if (arg == "--max") {
+            options.Speed = 0.0;
+        } else if (arg == "--speed" && has_value) {
+            options.Speed = atof(argv[++i]);
+        } else if (arg == "--split" && has_value) {
+            options.SplitBytes = atoi(argv[++i]);
+            options.RandomSplit = false;
+        } else if (arg == "--random-split" && has_value) {
+            options.SplitBytes = atoi(argv[++i]);
+            options.RandomSplit = true;
+        } else if (arg == "--seed" && has_value) {
+            options.Seed = static_cast<uint32_t>( atoi(argv[++i]) );
+        } else if (arg == "--repeat" && has_value) {
+            options.Repeat = atoi(argv[++i]);
+        } else if (arg == "--trace") {
+            options.Trace = true;
+        } else if (arg == "--shm" && has_value) {
+            options.ShmName = argv[++i];
+        } else if (arg == "--shm-avcc") {
+            options.ShmFormat = SHM_FORMAT_AVCC;
+        } else if (!arg.empty() && arg[0] != '-' && options.Path.empty()) {
+            options.Path = arg;
+        } else {
+            return false;
+        }
+    }
+
+    return !options.Path.empty() && options.Speed >= 0.0 && options.SplitBytes >= 0 && options.Repeat > 0;
+}
+
+
+//------------------------------------------------------------------------------
+// ReplayHandler
+
+class ReplayHandler : public RTMPHandler {
+public:
+    // Time the recv() currently being parsed was handed to the parser
+    uint64_t FeedUsec = 0;
+
+    // Optional output for the frames
+    ShmFrameRing* Ring = nullptr;
+
+    std::vector<uint64_t> FrameLatencyUsec;
+    int Frames = 0;
+    int Keyframes = 0;
+    int SetupFrames = 0;
+    int Commands = 0;
+    int Acks = 0;
+
+    void OnNeedAck(uint32_t bytes) override {
+        UNUSED(bytes);
+        Acks++;
+    }
+
+    void OnMessage(const RTMPCommand& command) override {
+        if (command.Type == COMMAND_AMF0) {
+            Commands++;
+        }
+    }
+
+    void OnAvccVideo(bool keyframe, uint32_t stream, uint32_t timestamp, const uint8_t* data, int bytes, const RTMPFrameTrace& trace) override {
+        UNUSED(trace);
+
+        AVCCParser& parser = Parsers[stream];
+        parser.parseAvcc(data, bytes);
+
+        if (parser.VideoSize <= 0) {
+            if (parser.HasParams) {
+                SetupFrames++;
+                if (Ring) {
+                    Ring->WriteSetup(stream, parser.SetupResult);
+                }
+            }
+            return;
+        }
+
+        if (Ring) {
+            RTMPVideoFrame frame;
+            frame.Stream = stream;
+            frame.Keyframe = keyframe;
+            frame.Timestamp = timestamp;
+            frame.Dts = timestamp;
+            frame.Pts = timestamp + parser.CompositionTime;
+            frame.Data = parser.VideoData;
+            frame.Bytes = parser.VideoSize;
+            Ring->WriteFrame(frame);
+        }
+
+        Frames++;
+        if (keyframe) {
+            Keyframes++;
+        }
+        FrameLatencyUsec.push_back(GetMonotonicUsec() - FeedUsec);
+    }
+
+private:
+    std::unordered_map<uint32_t, AVCCParser> Parsers;
+};
+
+
+//------------------------------------------------------------------------------
+// Replay
+
+struct ReplayStats {
+    uint64_t ParseUsec = 0;
+    uint64_t WallUsec = 0;
+    uint64_t Pieces = 0;
+    bool HandshakeComplete = false;
+    bool ValidVersion = true;
+};
+
+class Replayer {
+public:
+    Replayer(const ReplayOptions& options, ReplayHandler& handler)
+        : Options(options)
+        , Handler(handler)
+        , Rng(options.Seed)
+    {
+        handshake.Buffer = &Buffer;
+        session.Buffer = &Buffer;
+        session.Handler = &handler;
+    }
+
+    void Run(CaptureReader& reader, ReplayStats& stats) {
+        const uint64_t t0 = GetMonotonicUsec();
+
+        CaptureRecord record;
+        while (reader.ReadNext(record)) {
+            if (Options.Speed > 0.0) {
+                const uint64_t target = t0 + static_cast<uint64_t>( record.Usec / Options.Speed );
+                const uint64_t now = GetMonotonicUsec();
+                if (target > now) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(target - now));
+                }
+            }
+
+            const uint8_t* data = record.Data;
+            int remaining = record.Bytes;
+
+            while (remaining > 0) {
+                int piece = NextPieceBytes(remaining);
+                Feed(data, piece, stats);
+                data += piece;
+                remaining -= piece;
+            }
+        }
+
+        stats.WallUsec += GetMonotonicUsec() - t0;
+    }
+
+private:
+    const ReplayOptions& Options;
+    ReplayHandler& Handler;
+    std::mt19937 Rng;
+
+    RollingBuffer Buffer;
+    RTMPHandshake handshake;
+    RTMPSession session;
+    bool InSession = false;
+
+    int NextPieceBytes(int remaining) {
+        if (Options.SplitBytes <= 0) {
+            return remaining;
+        }
+        int piece = Options.SplitBytes;
+        if (Options.RandomSplit) {
+            piece = 1 + static_cast<int>( Rng() % static_cast<uint32_t>( Options.SplitBytes ) );
+        }
+        return std::min(piece, remaining);
+    }
+
+    // Mirrors the recv() handling in RTMPReceiverBase::RunConnection()
+    void Feed(const uint8_t* data, int bytes, ReplayStats& stats) {
+        stats.Pieces++;
+
+        const uint64_t t0 = GetMonotonicUsec();
+        Handler.FeedUsec = t0;
+
+        if (!InSession) {
+            handshake.ParseMessage(data, bytes);
+
+            if (handshake.State.Round >= 1 && handshake.State.ClientVersion != kRtmpS0ServerVersion) {
+                stats.ValidVersion = false;
+            }
+
+            if (handshake.State.Round >= 3) {
+                stats.HandshakeComplete = true;
+                InSession = true;
+
+                // Parse any data left over from the handshake
+                session.ParseChunk(nullptr, 0);
+            }
+        } else {
+            session.ParseChunk(data, bytes);
+        }
+
+        stats.ParseUsec += GetMonotonicUsec() - t0;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Report
+
+static uint64_t Percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>( p * (sorted.size() - 1) + 0.5 );
+    return sorted[index];
+}
+
+static void PrintReport(
+    const ReplayOptions& options,
+    const CaptureReader& reader,
+    const ReplayStats& stats,
+    ReplayHandler& handler)
+{
+    const double total_bytes = static_cast<double>( reader.TotalBytes ) * options.Repeat;
+    const double parse_sec = stats.ParseUsec / 1000000.0;
+
+    cout << "Capture: " << options.Path << " records=" << reader.RecordCount << " bytes=" << reader.TotalBytes << endl;
+    cout << "Replay: speed=";
+    if (options.Speed > 0.0) {
+        cout << options.Speed << "x";
+    } else {
+        cout << "max";
+    }
+    cout << " split=";
+    if (options.SplitBytes <= 0) {
+        cout << "original";
+    } else {
+        cout << (options.RandomSplit ? "random 1.." : "") << options.SplitBytes;
+    }
+    cout << " repeat=" << options.Repeat << " pieces=" << stats.Pieces << endl;
+
+    if (!stats.ValidVersion) {
+        cout << "Warning: Client sent an invalid RTMP version" << endl;
+    }
+    if (!stats.HandshakeComplete) {
+        cout << "Warning: Handshake did not complete" << endl;
+    }
+
+    cout << "Frames: " << handler.Frames << " (keyframes=" << handler.Keyframes << " setup=" << handler.SetupFrames << ")"
+        << " commands=" << handler.Commands << " acks=" << handler.Acks << endl;
+
+    cout << std::fixed << std::setprecision(3);
+    cout << "Parse time: " << parse_sec * 1000.0 << " ms of " << stats.WallUsec / 1000.0 << " ms wall" << endl;
+    if (parse_sec > 0.0) {
+        cout << "Parse throughput: " << total_bytes / parse_sec / 1000000.0 << " MB/s" << endl;
+    }
+
+    std::vector<uint64_t>& latency = handler.FrameLatencyUsec;
+    std::sort(latency.begin(), latency.end());
+    cout << "Frame latency usec: min=" << Percentile(latency, 0.0)
+        << " p50=" << Percentile(latency, 0.5)
+        << " p99=" << Percentile(latency, 0.99)
+        << " max=" << Percentile(latency, 1.0) << endl;
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char** argv) {
+    ReplayOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return -1;
+    }
+
+    CaptureReader reader;
+    if (!reader.Open(options.Path)) {
+        cout << "Failed to read capture file " << options.Path << endl;
+        return -1;
+    }
+
+    if (options.Trace) {
+        SetLogLevel(RTMP_LOG_TRACE);
+        SetLogRateLimit(0);
+    }
+
+    ReplayHandler handler;
+    ReplayStats stats;
+
+    ShmFrameRing ring;
+    if (!options.ShmName.empty()) {
+        ShmRingSettings settings;
+        settings.Name = options.ShmName;
+        settings.Format = options.ShmFormat;
+        if (!ring.Create(settings)) {
+            cout << "Failed to create shared memory ring " << options.ShmName << endl;
+            return -1;
+        }
+        handler.Ring = &ring;
+    }
+
+    for (int i = 0; i < options.Repeat; ++i) {
+        // Each repetition is a fresh connection
+        Replayer replayer(options, handler);
+        reader.Rewind();
+        replayer.Run(reader, stats);
+    }
+
+    if (handler.Ring) {
+        cout << "Shared memory ring: written=" << ring.FramesWritten << " dropped=" << ring.FramesDropped << endl;
+        ring.Close();
+    }
+
+    FlushLog();
+    PrintReport(options, reader, stats, handler);
+    return 0;
+}
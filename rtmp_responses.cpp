@@ -0,0 +1,186 @@
+#include "rtmp_responses.h"
+
+#include "rtmp_parser.h"
+
+#include <cstring>
+
+
+//------------------------------------------------------------------------------
+// Server Responses
+
+// Writes a type 0 chunk header on cs_id with a placeholder length, and returns
+// the offset of the message body for FinishMessage()
+static size_t StartMessage(FixedByteStreamWriter& msg, uint8_t cs_id, uint8_t type_id, uint32_t stream_id) {
+    uint32_t timestamp = 0;
+
+    msg.WriteUInt8(cs_id); // fmt = 0
+    msg.WriteUInt24(timestamp);
+    msg.WriteUInt24(0/*length*/);
+    msg.WriteUInt8(type_id);
+    // Message stream id is little-endian
+    msg.WriteUInt8(static_cast<uint8_t>( stream_id ));
+    msg.WriteUInt8(static_cast<uint8_t>( stream_id >> 8 ));
+    msg.WriteUInt8(static_cast<uint8_t>( stream_id >> 16 ));
+    msg.WriteUInt8(static_cast<uint8_t>( stream_id >> 24 ));
+
+    return msg.GetLength();
+}
+
+// Fills in the length of the message started at body_offset
+static void FinishMessage(FixedByteStreamWriter& msg, size_t body_offset) {
+    msg.PatchUInt24(body_offset - 8, static_cast<uint32_t>( msg.GetLength() - body_offset ));
+}
+
+void WriteChunkAck(FixedByteStreamWriter& msg, uint32_t ack_bytes) {
+    const size_t body = StartMessage(msg, 2, ACK, 0);
+        msg.WriteUInt32(ack_bytes);
+    FinishMessage(msg, body);
+}
+
+void WriteWindowUpdate(
+    FixedByteStreamWriter& msg,
+    uint32_t window_ack_size,
+    uint32_t max_unacked_bytes,
+    int limit_type)
+{
+    size_t body = StartMessage(msg, 2, WINDOW_ACK_SIZE, 0);
+        msg.WriteUInt32(window_ack_size);
+    FinishMessage(msg, body);
+
+    body = StartMessage(msg, 2, SET_PEER_BANDWIDTH, 0);
+        msg.WriteUInt32(max_unacked_bytes);
+        msg.WriteUInt8(static_cast<uint8_t>( limit_type ));
+    FinishMessage(msg, body);
+}
+
+void WriteConnectResult(
+    FixedByteStreamWriter& params,
+    uint32_t window_ack_size,
+    uint32_t max_unacked_bytes,
+    int limit_type,
+    uint32_t chunk_size)
+{
+    WriteWindowUpdate(params, window_ack_size, max_unacked_bytes, limit_type);
+
+    size_t body = StartMessage(params, 2, CHUNK_SIZE, 0);
+        params.WriteUInt32(chunk_size);
+    FinishMessage(params, body);
+
+    body = StartMessage(params, 3, COMMAND_AMF0, 0);
+        params.WriteUInt8(StringMarker);
+        params.WriteAmf0String("_result");
+        params.WriteUInt8(NumberMarker);
+        params.WriteDouble(1.0);
+        params.WriteUInt8(NullMarker);
+        params.WriteUInt8(ObjectMarker);
+            params.WriteAmf0String("level");
+            params.WriteUInt8(StringMarker);
+            params.WriteAmf0String("status");
+
+            params.WriteAmf0String("code");
+            params.WriteUInt8(StringMarker);
+            params.WriteAmf0String("NetConnection.Connect.Success");
+
+            params.WriteAmf0String("description");
+            params.WriteUInt8(StringMarker);
+            params.WriteAmf0String("Connection succeeded.");
+
+            params.WriteUInt16(0);
+        params.WriteUInt8(ObjectEndMarker);
+    FinishMessage(params, body);
+
+    body = StartMessage(params, 2, USER_CONTROL, 0);
+        params.WriteUInt16(EVENT_STREAM_BEGIN);
+        params.WriteUInt32(0);
+    FinishMessage(params, body);
+}
+
+void WriteNullResult(FixedByteStreamWriter& msg, double command_number) {
+    const size_t body = StartMessage(msg, 3, COMMAND_AMF0, 0);
+        msg.WriteUInt8(StringMarker);
+        msg.WriteAmf0String("_result");
+        msg.WriteUInt8(NumberMarker);
+        msg.WriteDouble(command_number);
+        msg.WriteUInt8(NullMarker);
+        msg.WriteUInt8(UndefinedMarker);
+    FinishMessage(msg, body);
+}
+
+void WriteCreateStreamResult(FixedByteStreamWriter& msg, double command_number, uint32_t stream_id) {
+    const size_t body = StartMessage(msg, 3, COMMAND_AMF0, 0);
+        msg.WriteUInt8(StringMarker);
+        msg.WriteAmf0String("_result");
+        msg.WriteUInt8(NumberMarker);
+        msg.WriteDouble(command_number);
+        msg.WriteUInt8(NullMarker);
+        msg.WriteUInt8(NumberMarker);
+        msg.WriteDouble(stream_id);
+    FinishMessage(msg, body);
+}
+
+void WriteOnStatus(FixedByteStreamWriter& msg, uint32_t stream_id, const char* level, const char* code, const char* description) {
+    const size_t body = StartMessage(msg, 5, COMMAND_AMF0, stream_id);
+        msg.WriteUInt8(StringMarker);
+        msg.WriteAmf0String("onStatus");
+        msg.WriteUInt8(NumberMarker);
+        msg.WriteDouble(0.0);
+        msg.WriteUInt8(NullMarker);
+        msg.WriteUInt8(ObjectMarker);
+            msg.WriteAmf0String("level");
+            msg.WriteUInt8(StringMarker);
+            msg.WriteAmf0String(level);
+
+            msg.WriteAmf0String("code");
+            msg.WriteUInt8(StringMarker);
+            msg.WriteAmf0String(code);
+
+            msg.WriteAmf0String("description");
+            msg.WriteUInt8(StringMarker);
+            msg.WriteAmf0String(description);
+
+            msg.WriteUInt16(0);
+        msg.WriteUInt8(ObjectEndMarker);
+    FinishMessage(msg, body);
+}
+
+
+//------------------------------------------------------------------------------
+// Response Templates
+
+static void CopyMessage(const FixedByteStreamWriter& msg, std::vector<uint8_t>& out) {
+    out.assign(msg.GetData(), msg.GetData() + msg.GetLength());
+}
+
+void RTMPResponseTemplates::Build(
+    uint32_t window_ack_size,
+    uint32_t max_unacked_bytes,
+    int limit_type,
+    uint32_t chunk_size)
+{
+    StackByteStreamWriter<kMaxResponseBytes> connect_result;
+    WriteConnectResult(connect_result, window_ack_size, max_unacked_bytes, limit_type, chunk_size);
+    CopyMessage(connect_result, ConnectResult);
+
+    StackByteStreamWriter<kMaxResponseBytes> publish_start;
+    WriteOnStatus(publish_start, kPublishStreamId, "status", "NetStream.Publish.Start", "Start publishing");
+    CopyMessage(publish_start, PublishStart);
+
+    StackByteStreamWriter<kMaxResponseBytes> null_result;
+    WriteNullResult(null_result, 0.0);
+    CopyMessage(null_result, NullResult);
+
+    StackByteStreamWriter<kMaxResponseBytes> create_stream_result;
+    WriteCreateStreamResult(create_stream_result, 0.0, kPublishStreamId);
+    CopyMessage(create_stream_result, CreateStreamResult);
+}
+
+void SetResultNumber(uint8_t* result, double command_number) {
+    uint64_t bits;
+    memcpy(&bits, &command_number, sizeof(bits));
+
+    // AMF0 numbers are big-endian
+    uint8_t* number = result + kResultNumberOffset;
+    for (int i = 0; i < 8; ++i) {
+        number[i] = static_cast<uint8_t>( bits >> (56 - i * 8) );
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef RTMP_RESPONSES_H
+#define RTMP_RESPONSES_H
+
+#include "bytestream.h"
+
+#include <cstdint>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Server Responses
+
+// Serialization of the messages RTMPReceiver sends, kept separate from the
+// socket code so they can be benchmarked and reused.  Messages are written
+// into a FixedByteStreamWriter, so building one never allocates.
+
+// Large enough for any single response below
+static const int kMaxResponseBytes = 512;
+
+// ack_bytes: Total bytes received so far, modulo 2^32
+void WriteChunkAck(FixedByteStreamWriter& msg, uint32_t ack_bytes);
+
+// WINDOW_ACK_SIZE followed by SET_PEER_BANDWIDTH
+void WriteWindowUpdate(
+    FixedByteStreamWriter& msg,
+    uint32_t window_ack_size,
+    uint32_t max_unacked_bytes,
+    int limit_type);
+
+void WriteConnectResult(
+    FixedByteStreamWriter& params,
+    uint32_t window_ack_size,
+    uint32_t max_unacked_bytes,
+    int limit_type,
+    uint32_t chunk_size);
+
+void WriteNullResult(FixedByteStreamWriter& msg, double command_number);
+
+// Stream id the receiver gives every createStream
+static const uint32_t kPublishStreamId = 1;
+
+void WriteCreateStreamResult(FixedByteStreamWriter& msg, double command_number, uint32_t stream_id);
+
+// onStatus, e.g. level = "status", code = "NetStream.Publish.Start"
+void WriteOnStatus(FixedByteStreamWriter& msg, uint32_t stream_id, const char* level, const char* code, const char* description);
+
+
+//------------------------------------------------------------------------------
+// Response Templates
+
+// Every _result starts with the same 12-byte header, "_result" and a number
+// marker, so the transaction number is always at this offset
+static const int kResultNumberOffset = 12 + 1 + 2 + 7 + 1;
+
+// Responses serialized once per server rather than once per session.  Only
+// the transaction number of a _result changes between sessions
+struct RTMPResponseTemplates {
+    void Build(
+        uint32_t window_ack_size,
+        uint32_t max_unacked_bytes,
+        int limit_type,
+        uint32_t chunk_size);
+
+    // Complete responses that can be sent as they are
+    std::vector<uint8_t> ConnectResult;
+    std::vector<uint8_t> PublishStart;
+
+    // Need SetResultNumber() on a copy
+    std::vector<uint8_t> NullResult;
+    std::vector<uint8_t> CreateStreamResult;
+};
+
+// Replaces the transaction number of a _result built from a template
+void SetResultNumber(uint8_t* result, double command_number);
+
+#endif // RTMP_RESPONSES_H
@@ -0,0 +1,269 @@
+#include "rtmp_shm.h"
+#include "rtmp_log.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+using namespace std;
+
+static const uint8_t kShmStartCode[] = {0x00, 0x00, 0x00, 0x01};
+
+// Keeps the record slots and the data area cache-line aligned
+static const uint32_t kMinRecordCount = 64;
+
+static size_t AlignUp(size_t bytes, size_t alignment)
+{
+    return (bytes + alignment - 1) / alignment * alignment;
+}
+
+static uint64_t GetStreamKey(uint32_t connection, uint32_t stream)
+{
+    return (static_cast<uint64_t>( connection ) << 32) | stream;
+}
+
+// Bytes of a frame rewritten with 4-byte start codes
+static size_t GetAnnexBBytes(const std::vector<NalUnitSpan>& units)
+{
+    size_t total = 0;
+    for (const NalUnitSpan& unit : units) {
+        total += sizeof(kShmStartCode) + unit.Bytes;
+    }
+    return total;
+}
+
+static void WriteAnnexB(const std::vector<NalUnitSpan>& units, uint8_t* out)
+{
+    for (const NalUnitSpan& unit : units) {
+        memcpy(out, kShmStartCode, sizeof(kShmStartCode));
+        memcpy(out + sizeof(kShmStartCode), unit.Data, unit.Bytes);
+        out += sizeof(kShmStartCode) + unit.Bytes;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// ShmFrameRing
+
+bool ShmFrameRing::Create(const ShmRingSettings& settings)
+{
+    Close();
+
+    Settings = settings;
+    uint32_t count = kMinRecordCount;
+    while (count < settings.RecordCount) {
+        count *= 2;
+    }
+    Settings.RecordCount = count;
+    Settings.DataBytes = AlignUp(settings.DataBytes, 4096);
+
+    const size_t header_bytes = AlignUp(sizeof(ShmRingHeader), 64);
+    const size_t data_offset = header_bytes + count * sizeof(ShmRecord);
+    MapBytes = data_offset + Settings.DataBytes;
+
+    // A writer that crashed leaves its ring behind: start from scratch
+    ObjectName = GetShmObjectName(settings.Name);
+    shm_unlink(ObjectName.c_str());
+
+    Fd = shm_open(ObjectName.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (Fd < 0) {
+        perror("shm_open failed");
+        return false;
+    }
+    if (ftruncate(Fd, static_cast<off_t>( MapBytes )) < 0) {
+        perror("ftruncate failed");
+        Close();
+        return false;
+    }
+
+    // Fault the pages in now rather than on the first lap of the data area
+    void* map = mmap(nullptr, MapBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        Close();
+        return false;
+    }
+    Map = static_cast<uint8_t*>( map );
+
+    // ftruncate() zero-filled the object, which is also the initial state of
+    // every atomic in it
+    Header = reinterpret_cast<ShmRingHeader*>( Map );
+    Records = reinterpret_cast<ShmRecord*>( Map + header_bytes );
+    Data = Map + data_offset;
+
+    Header->Version = kShmRingVersion;
+    Header->Format = Settings.Format;
+    Header->RecordCount = count;
+    Header->HeaderBytes = static_cast<uint32_t>( header_bytes );
+    Header->DataBytes = Settings.DataBytes;
+    Header->TotalBytes = MapBytes;
+    std::atomic_thread_fence(std::memory_order_release);
+    Header->Magic = kShmRingMagic;
+
+    RTMP_LOG(RTMP_LOG_INFO, "Shared memory ring ", ObjectName, ": ", Settings.DataBytes / 1024,
+        " KB, ", count, " records");
+    return true;
+}
+
+void ShmFrameRing::Close()
+{
+    if (Header) {
+        Header->Closed.store(1);
+        WakeShmReaders(Header);
+    }
+    if (Map) {
+        munmap(Map, MapBytes);
+        Map = nullptr;
+    }
+    if (Fd >= 0) {
+        close(Fd);
+        Fd = -1;
+        shm_unlink(ObjectName.c_str());
+    }
+    Header = nullptr;
+    Records = nullptr;
+    Data = nullptr;
+    Streams.clear();
+}
+
+uint8_t* ShmFrameRing::Reserve(uint32_t bytes, uint64_t& offset)
+{
+    uint64_t head = Header->DataHead.load(std::memory_order_relaxed);
+
+    // Records are contiguous: skip the tail of the data area if it is too short
+    const uint64_t used = head % Settings.DataBytes;
+    if (used + bytes > Settings.DataBytes) {
+        head += Settings.DataBytes - used;
+    }
+    offset = head;
+
+    // Readers that see any byte written below also see the new head
+    Header->DataHead.store(head + bytes, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    return Data + (offset % Settings.DataBytes);
+}
+
+void ShmFrameRing::Publish(
+    uint64_t offset,
+    uint32_t bytes,
+    uint32_t flags,
+    uint32_t connection,
+    uint32_t stream,
+    int64_t dts,
+    int64_t pts)
+{
+    const uint64_t n = Header->NextRecord.load(std::memory_order_relaxed);
+    ShmRecord& record = Records[n & (Settings.RecordCount - 1)];
+
+    // Seqlock: readers of the slot's previous record see it change under them
+    record.Sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record.Offset = offset;
+    record.Bytes = bytes;
+    record.Flags = flags;
+    record.Connection = connection;
+    record.Stream = stream;
+    record.Dts = dts;
+    record.Pts = pts;
+    record.WriteUsec = GetShmClockUsec();
+
+    record.Sequence.store(n + 1, std::memory_order_release);
+    Header->NextRecord.store(n + 1, std::memory_order_release);
+
+    WakeShmReaders(Header);
+}
+
+void ShmFrameRing::WriteSetupRecord(
+    uint32_t connection,
+    uint32_t stream,
+    int64_t dts,
+    const StreamParameters& params)
+{
+    const uint32_t bytes = static_cast<uint32_t>( params.Setup.size() );
+    if (bytes == 0 || bytes > Settings.DataBytes / 2) {
+        return;
+    }
+
+    uint64_t offset = 0;
+    uint8_t* dest = Reserve(bytes, offset);
+    memcpy(dest, params.Setup.data(), bytes);
+    Publish(offset, bytes, SHM_FLAG_SETUP, connection, stream, dts, dts);
+}
+
+void ShmFrameRing::WriteSetup(uint32_t stream, const RTMPSetupResult& result)
+{
+    if (!Header) {
+        return;
+    }
+
+    StreamParameters& params = Streams[GetStreamKey(result.Connection, stream)];
+    params.NalLengthBytes = result.VideoSizeBytes;
+    params.Setup.clear();
+
+    if (Settings.Format == SHM_FORMAT_AVCC) {
+        params.Setup.assign(result.Extradata, result.Extradata + result.ExtradataSize);
+    } else {
+        for (const auto* sets : { &result.SPS, &result.PPS }) {
+            for (const ParameterData& set : *sets) {
+                params.Setup.insert(params.Setup.end(), kShmStartCode, kShmStartCode + sizeof(kShmStartCode));
+                params.Setup.insert(params.Setup.end(), set.Data, set.Data + set.Size);
+            }
+        }
+    }
+
+    WriteSetupRecord(result.Connection, stream, 0, params);
+}
+
+bool ShmFrameRing::WriteFrame(const RTMPVideoFrame& frame)
+{
+    if (!Header) {
+        return false;
+    }
+
+    auto it = Streams.find(GetStreamKey(frame.Connection, frame.Stream));
+    const StreamParameters* params = (it != Streams.end()) ? &it->second : nullptr;
+
+    size_t bytes = static_cast<size_t>( frame.Bytes );
+    const bool annex_b = Settings.Format == SHM_FORMAT_ANNEXB;
+    if (annex_b) {
+        // Without a setup there is no length prefix size to convert with.
+        // A length prefix running past the end of the frame drops it
+        bytes = 0;
+        if (params && FindNalUnits(frame.Data, frame.Bytes, params->NalLengthBytes, NalUnits)) {
+            bytes = GetAnnexBBytes(NalUnits);
+        }
+    }
+    if (bytes == 0 || bytes > Settings.DataBytes / 2) {
+        ++FramesDropped;
+        return false;
+    }
+
+    if (frame.Keyframe && params) {
+        WriteSetupRecord(frame.Connection, frame.Stream, frame.Dts, *params);
+    }
+
+    uint64_t offset = 0;
+    uint8_t* dest = Reserve(static_cast<uint32_t>( bytes ), offset);
+    if (annex_b) {
+        WriteAnnexB(NalUnits, dest);
+    } else {
+        memcpy(dest, frame.Data, bytes);
+    }
+
+    Publish(
+        offset,
+        static_cast<uint32_t>( bytes ),
+        frame.Keyframe ? static_cast<uint32_t>( SHM_FLAG_KEYFRAME ) : 0,
+        frame.Connection,
+        frame.Stream,
+        frame.Dts,
+        frame.Pts);
+
+    ++FramesWritten;
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef RTMP_SHM_H
+#define RTMP_SHM_H
+
+#include "rtmp_receiver.h"
+#include "rtmp_shm_reader.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// ShmFrameRing
+
+struct ShmRingSettings {
+    // POSIX shared memory name, e.g. "rtmp_ingest" for /dev/shm/rtmp_ingest
+    std::string Name;
+
+    ShmFrameFormat Format = SHM_FORMAT_ANNEXB;
+
+    // Frame data.  Readers use frames in place until the writer wraps around,
+    // so this should hold a few seconds of video (4K60 at 50 Mbps is ~6 MB/s)
+    size_t DataBytes = 64 * 1024 * 1024;
+
+    // Record slots, rounded up to a power of two
+    uint32_t RecordCount = 4096;
+};
+
+// Publishes received frames into a shared memory ring that other processes
+// map with ShmFrameReader.  Frames are copied once, from the receive buffer
+// into the ring, and readers wake on a futex in the ring instead of a socket.
+// Call from one thread, normally the receiver callbacks
+class ShmFrameRing {
+public:
+    ~ShmFrameRing() {
+        Close();
+    }
+
+    // Creates and maps the ring, replacing a stale ring with the same name
+    bool Create(const ShmRingSettings& settings);
+
+    // Tells readers the ring is closed and removes the name.  Readers that
+    // have it mapped keep their mapping
+    void Close();
+
+    // From the setup callback: publishes the parameter sets, and keeps them
+    // to publish again before each keyframe of the stream.  Streams are told
+    // apart by result.Connection as well, since every publisher's first
+    // stream ID is 1
+    void WriteSetup(uint32_t stream, const RTMPSetupResult& result);
+
+    // From the frame callback.  Returns false if the frame is malformed or
+    // larger than half the data area, and is dropped
+    bool WriteFrame(const RTMPVideoFrame& frame);
+
+    uint64_t FramesWritten = 0;
+    uint64_t FramesDropped = 0;
+
+private:
+    ShmRingSettings Settings;
+    std::string ObjectName;
+
+    int Fd = -1;
+    uint8_t* Map = nullptr;
+    size_t MapBytes = 0;
+
+    ShmRingHeader* Header = nullptr;
+    ShmRecord* Records = nullptr;
+    uint8_t* Data = nullptr;
+
+    struct StreamParameters {
+        // AVCC NAL unit length prefix size
+        int NalLengthBytes = 4;
+
+        // Setup record in the ring format
+        std::vector<uint8_t> Setup;
+    };
+    // By GetStreamKey(connection, stream)
+    std::unordered_map<uint64_t, StreamParameters> Streams;
+
+    // NAL units of the frame being written, reused across frames
+    std::vector<NalUnitSpan> NalUnits;
+
+    // Reserves contiguous space for the next record and returns it.  Readers
+    // see the reservation before any byte is overwritten
+    uint8_t* Reserve(uint32_t bytes, uint64_t& offset);
+
+    void Publish(
+        uint64_t offset,
+        uint32_t bytes,
+        uint32_t flags,
+        uint32_t connection,
+        uint32_t stream,
+        int64_t dts,
+        int64_t pts);
+
+    void WriteSetupRecord(uint32_t connection, uint32_t stream, int64_t dts, const StreamParameters& params);
+};
+
+#endif // RTMP_SHM_H
@@ -0,0 +1,180 @@
+// Reads a shared memory frame ring published with ShmFrameRing, as a consumer
+// process would, and reports what arrives.  Links only rtmp_shm_reader.
+//
+// Usage:
+//   rtmp_shm_dump <name> [options]
+//
+//   --out PATH         Write every record to PATH.  An Annex B ring gives a
+//                      stream that plays with `ffplay -f h264 PATH`
+//   --oldest           Start at the oldest record still in the ring
+//   --wait MSEC        Wait this long for the ring to appear (default: 10000)
+
+#include "rtmp_shm_reader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+// Options
+
+struct DumpOptions {
+    std::string Name;
+    std::string OutPath;
+    bool FromOldest = false;
+    int WaitMsec = 10000;
+};
+
+static void PrintUsage() {
+    cout << "Usage: rtmp_shm_dump <name> [--out PATH] [--oldest] [--wait MSEC]" << endl;
+}
+
+static bool ParseOptions(int argc, char** argv, DumpOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = (i + 1 < argc);
+
+        if (arg == "--out" && has_value) {
+            options.OutPath = argv[++i];
+        } else if (arg == "--oldest") {
+            options.FromOldest = true;
+        } else if (arg == "--wait" && has_value) {
+            options.WaitMsec = atoi(argv[++i]);
+        } else if (!arg.empty() && arg[0] != '-' && options.Name.empty()) {
+            options.Name = arg;
+        } else {
+            return false;
+        }
+    }
+    return !options.Name.empty() && options.WaitMsec >= 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Report
+
+struct DumpStats {
+    uint64_t Frames = 0;
+    uint64_t Keyframes = 0;
+    uint64_t Setups = 0;
+    uint64_t Bytes = 0;
+    uint64_t Torn = 0;
+
+    // Publish to read, in usec
+    std::vector<uint64_t> HandoffUsec;
+};
+
+static uint64_t Percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>( p * (sorted.size() - 1) + 0.5 );
+    return sorted[index];
+}
+
+static void AddStats(DumpStats& total, const DumpStats& interval) {
+    total.Frames += interval.Frames;
+    total.Keyframes += interval.Keyframes;
+    total.Setups += interval.Setups;
+    total.Bytes += interval.Bytes;
+    total.Torn += interval.Torn;
+    total.HandoffUsec.insert(total.HandoffUsec.end(), interval.HandoffUsec.begin(), interval.HandoffUsec.end());
+}
+
+static void PrintStats(const char* label, DumpStats& stats, double seconds, uint64_t skipped) {
+    std::vector<uint64_t>& handoff = stats.HandoffUsec;
+    std::sort(handoff.begin(), handoff.end());
+
+    cout << label << ": frames=" << stats.Frames << " keyframes=" << stats.Keyframes
+        << " setups=" << stats.Setups
+        << " Mbps=" << (seconds > 0.0 ? stats.Bytes * 8 / seconds / 1000000.0 : 0.0)
+        << " handoff_usec p50=" << Percentile(handoff, 0.5) << " p99=" << Percentile(handoff, 0.99)
+        << " skipped=" << skipped << " torn=" << stats.Torn << endl;
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char** argv) {
+    DumpOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return -1;
+    }
+
+    // The publisher may not have created the ring yet
+    ShmFrameReader reader;
+    const uint64_t t0 = GetShmClockUsec();
+    while (!reader.Open(options.Name, options.FromOldest)) {
+        if (GetShmClockUsec() - t0 >= static_cast<uint64_t>( options.WaitMsec ) * 1000) {
+            cout << "No shared memory ring " << options.Name << endl;
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    cout << "Reading " << GetShmObjectName(options.Name) << " format="
+        << (reader.GetFormat() == SHM_FORMAT_ANNEXB ? "annexb" : "avcc") << endl;
+
+    std::ofstream out;
+    if (!options.OutPath.empty()) {
+        out.open(options.OutPath, std::ios::binary);
+        if (!out) {
+            cout << "Failed to open " << options.OutPath << endl;
+            return -1;
+        }
+    }
+
+    DumpStats total, interval;
+    uint64_t interval_start = GetShmClockUsec();
+    const uint64_t start_usec = interval_start;
+
+    ShmFrameView view;
+    for (;;) {
+        const ShmFrameReader::ReadResult result = reader.Read(view, 1000);
+        if (result == ShmFrameReader::SHM_READ_CLOSED || result == ShmFrameReader::SHM_READ_ERROR) {
+            break;
+        }
+
+        if (result == ShmFrameReader::SHM_READ_RECORD) {
+            const uint64_t handoff_usec = GetShmClockUsec() - view.WriteUsec;
+
+            // Use the bytes in place, then check they were not overwritten meanwhile
+            if (out.is_open()) {
+                out.write(reinterpret_cast<const char*>( view.Data ), view.Bytes);
+            }
+            if (!reader.IsValid(view)) {
+                interval.Torn++;
+            } else if (view.IsSetup()) {
+                interval.Setups++;
+            } else {
+                interval.Frames++;
+                interval.Keyframes += view.IsKeyframe() ? 1 : 0;
+                interval.Bytes += view.Bytes;
+                interval.HandoffUsec.push_back(handoff_usec);
+            }
+        }
+
+        const uint64_t now_usec = GetShmClockUsec();
+        if (now_usec - interval_start >= 1000000) {
+            PrintStats("Interval", interval, (now_usec - interval_start) / 1000000.0, reader.Skipped);
+
+            AddStats(total, interval);
+            interval = DumpStats();
+            interval_start = now_usec;
+        }
+    }
+
+    AddStats(total, interval);
+
+    cout << "Ring closed" << endl;
+    PrintStats("Total", total, (GetShmClockUsec() - start_usec) / 1000000.0, reader.Skipped);
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include "rtmp_shm_reader.h"
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <ctime>
+using namespace std;
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex word must be a plain uint32_t");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ring counters must be lock-free across processes");
+
+
+//------------------------------------------------------------------------------
+// Ring Layout
+
+std::string GetShmObjectName(const std::string& name)
+{
+    if (!name.empty() && name[0] == '/') {
+        return name;
+    }
+    return "/" + name;
+}
+
+uint64_t GetShmClockUsec()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The futex word is in a shared mapping, so these are not FUTEX_PRIVATE
+static uint32_t* GetFutexWord(ShmRingHeader* header)
+{
+    return reinterpret_cast<uint32_t*>( &header->Futex );
+}
+
+void WakeShmReaders(ShmRingHeader* header)
+{
+    // Pairs with WaitForRecord(): the reader registers in Waiters before it
+    // samples Futex, so either the reader sees this bump or we see the reader
+    header->Futex.fetch_add(1);
+    if (header->Waiters.load() > 0) {
+        syscall(SYS_futex, GetFutexWord(header), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// ShmFrameReader
+
+bool ShmFrameReader::Open(const std::string& name, bool from_oldest)
+{
+    Close();
+
+    Fd = shm_open(GetShmObjectName(name).c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (Fd < 0) {
+        // Not created yet is left to the caller to report
+        if (errno != ENOENT) {
+            perror("shm_open failed");
+        }
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(Fd, &st) < 0) {
+        perror("fstat failed");
+        Close();
+        return false;
+    }
+    if (static_cast<size_t>( st.st_size ) < sizeof(ShmRingHeader)) {
+        printf("Shared memory ring %s is too small\n", name.c_str());
+        Close();
+        return false;
+    }
+
+    // Writable because readers register in Waiters before sleeping
+    MapBytes = static_cast<size_t>( st.st_size );
+    void* map = mmap(nullptr, MapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap failed");
+        Map = nullptr;
+        Close();
+        return false;
+    }
+    Map = static_cast<uint8_t*>( map );
+    Header = reinterpret_cast<ShmRingHeader*>( Map );
+
+    const uint32_t count = Header->RecordCount;
+    if (Header->Magic != kShmRingMagic ||
+        Header->Version != kShmRingVersion ||
+        Header->TotalBytes != MapBytes ||
+        count == 0 || (count & (count - 1)) != 0 ||
+        Header->HeaderBytes + count * sizeof(ShmRecord) + Header->DataBytes > MapBytes)
+    {
+        printf("Shared memory ring %s has an unknown layout\n", name.c_str());
+        Close();
+        return false;
+    }
+
+    Records = reinterpret_cast<ShmRecord*>( Map + Header->HeaderBytes );
+    Data = Map + Header->HeaderBytes + count * sizeof(ShmRecord);
+
+    NextRecord = Header->NextRecord.load();
+    if (from_oldest) {
+        NextRecord = (NextRecord > count) ? (NextRecord - count) : 0;
+    }
+    Skipped = 0;
+    return true;
+}
+
+void ShmFrameReader::Close()
+{
+    if (Map) {
+        munmap(Map, MapBytes);
+        Map = nullptr;
+    }
+    if (Fd >= 0) {
+        close(Fd);
+        Fd = -1;
+    }
+    Header = nullptr;
+    Records = nullptr;
+    Data = nullptr;
+}
+
+bool ShmFrameReader::ReadSlot(uint64_t n, ShmFrameView& view) const
+{
+    const ShmRecord& record = Records[n & (Header->RecordCount - 1)];
+
+    // Seqlock: the copy is only good if Sequence was n + 1 before and after
+    if (record.Sequence.load(std::memory_order_acquire) != n + 1) {
+        return false;
+    }
+    view.Offset = record.Offset;
+    view.Bytes = record.Bytes;
+    view.Flags = record.Flags;
+    view.Connection = record.Connection;
+    view.Stream = record.Stream;
+    view.Dts = record.Dts;
+    view.Pts = record.Pts;
+    view.WriteUsec = record.WriteUsec;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (record.Sequence.load(std::memory_order_relaxed) != n + 1) {
+        return false;
+    }
+
+    view.Sequence = n;
+    view.Data = Data + (view.Offset % Header->DataBytes);
+    return IsValid(view);
+}
+
+bool ShmFrameReader::IsValid(const ShmFrameView& view) const
+{
+    // Any byte read from a newer record makes this load see its reservation
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t head = Header->DataHead.load(std::memory_order_relaxed);
+    return head <= view.Offset + Header->DataBytes;
+}
+
+bool ShmFrameReader::WaitForRecord(int timeout_msec)
+{
+    Header->Waiters.fetch_add(1);
+    const uint32_t word = Header->Futex.load();
+
+    int result = 0;
+    if (Header->NextRecord.load() <= NextRecord && !Header->Closed.load()) {
+        timespec timeout;
+        timeout.tv_sec = timeout_msec / 1000;
+        timeout.tv_nsec = (timeout_msec % 1000) * 1000000L;
+
+        // Returns at once with EAGAIN if the writer bumped the word since
+        result = static_cast<int>( syscall(SYS_futex, GetFutexWord(Header), FUTEX_WAIT, word,
+            timeout_msec >= 0 ? &timeout : nullptr, nullptr, 0) );
+    }
+
+    Header->Waiters.fetch_sub(1);
+    return result == 0 || errno != ETIMEDOUT;
+}
+
+ShmFrameReader::ReadResult ShmFrameReader::Read(ShmFrameView& view, int timeout_msec)
+{
+    if (!Header) {
+        return SHM_READ_ERROR;
+    }
+
+    const uint64_t deadline_usec = GetShmClockUsec() + static_cast<uint64_t>( timeout_msec ) * 1000;
+
+    for (;;) {
+        // Closed is set after the last record, so load it first
+        const bool closed = Header->Closed.load() != 0;
+        const uint64_t next = Header->NextRecord.load();
+
+        if (NextRecord < next) {
+            if (next - NextRecord > Header->RecordCount) {
+                Skipped += next - 1 - NextRecord;
+                NextRecord = next - 1;
+            }
+
+            const uint64_t n = NextRecord++;
+            if (ReadSlot(n, view)) {
+                return SHM_READ_RECORD;
+            }
+
+            // Reused while we were looking at it
+            ++Skipped;
+            continue;
+        }
+
+        if (closed) {
+            return SHM_READ_CLOSED;
+        }
+
+        int wait_msec = -1;
+        if (timeout_msec >= 0) {
+            const uint64_t now_usec = GetShmClockUsec();
+            if (now_usec >= deadline_usec) {
+                return SHM_READ_TIMEOUT;
+            }
+            wait_msec = static_cast<int>( (deadline_usec - now_usec + 999) / 1000 );
+        }
+        if (!WaitForRecord(wait_msec)) {
+            return SHM_READ_TIMEOUT;
+        }
+    }
+}
@@ -0,0 +1,186 @@
+#ifndef RTMP_SHM_READER_H
+#define RTMP_SHM_READER_H
+
+// Shared-memory frame ring layout and reader.  Depends only on the C++
+// standard library and Linux, so consumer processes can build these two files
+// without the rest of the receiver.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+//------------------------------------------------------------------------------
+// Ring Layout
+
+// One writer publishes records into a POSIX shared memory object:
+//
+//   ShmRingHeader | ShmRecord[RecordCount] | data[DataBytes]
+//
+// Record N lives in slot N % RecordCount and its bytes at Offset % DataBytes,
+// contiguous (the writer skips to the start of the data area rather than
+// splitting a record).  Readers never block the writer: a reader that falls
+// a lap behind skips ahead, and checks after reading a record in place that
+// the writer has not reused its bytes meanwhile (ShmFrameReader::IsValid).
+
+static const uint64_t kShmRingMagic = 0x474E4952504D5452ULL; // "RTMPRING"
+static const uint32_t kShmRingVersion = 1;
+
+enum ShmFrameFormat : uint32_t {
+    // Frames as received (length-prefixed NAL units).  Setup records hold the
+    // AVCDecoderConfigurationRecord
+    SHM_FORMAT_AVCC = 0,
+
+    // NAL units with 4-byte start codes.  Setup records hold the SPS and PPS
+    // with start codes, so setup + keyframe can be fed straight to a decoder
+    SHM_FORMAT_ANNEXB = 1,
+};
+
+enum ShmRecordFlags : uint32_t {
+    SHM_FLAG_KEYFRAME = 1,
+
+    // Parameter sets for the stream.  Repeated before every keyframe, so a
+    // reader that starts late or skips ahead can start at any keyframe.
+    // Applies to the frames with the same Connection and Stream
+    SHM_FLAG_SETUP = 2,
+};
+
+struct ShmRecord {
+    // Record number + 1 once published, 0 while the writer is filling the slot
+    std::atomic<uint64_t> Sequence;
+
+    // Position of the bytes in the data stream written so far
+    uint64_t Offset;
+    uint32_t Bytes;
+    uint32_t Flags;
+
+    uint32_t Connection;
+    uint32_t Stream;
+
+    // Timeline of RTMPVideoFrame in msec
+    int64_t Dts;
+    int64_t Pts;
+
+    // CLOCK_MONOTONIC usec when the writer published the record
+    uint64_t WriteUsec;
+};
+
+struct ShmRingHeader {
+    uint64_t Magic;
+    uint32_t Version;
+    uint32_t Format; // ShmFrameFormat
+    uint32_t RecordCount; // Power of two
+    uint32_t HeaderBytes; // Offset of the record slots
+    uint64_t DataBytes;
+    uint64_t TotalBytes;
+
+    // Records published so far
+    alignas(64) std::atomic<uint64_t> NextRecord;
+
+    // End of the data the writer has reserved.  Advanced before the bytes are
+    // written, so bytes at Offset are intact while DataHead <= Offset + DataBytes
+    std::atomic<uint64_t> DataHead;
+
+    // Set when the writer closes the ring
+    std::atomic<uint32_t> Closed;
+
+    // Futex word bumped on every publish.  The writer only makes the wake
+    // syscall while Waiters is non-zero
+    alignas(64) std::atomic<uint32_t> Futex;
+    std::atomic<uint32_t> Waiters;
+};
+
+// shm_open() name for a ring name, adding the leading slash if missing
+std::string GetShmObjectName(const std::string& name);
+
+// CLOCK_MONOTONIC in usec, comparable with ShmRecord::WriteUsec
+uint64_t GetShmClockUsec();
+
+// Called by the writer after publishing: bumps the futex word and wakes
+// readers blocked in ShmFrameReader::Read()
+void WakeShmReaders(ShmRingHeader* header);
+
+
+//------------------------------------------------------------------------------
+// ShmFrameReader
+
+// Record read in place from the ring
+struct ShmFrameView {
+    uint64_t Sequence = 0;
+    uint32_t Flags = 0;
+    uint32_t Connection = 0;
+    uint32_t Stream = 0;
+    int64_t Dts = 0;
+    int64_t Pts = 0;
+    uint64_t WriteUsec = 0;
+
+    // Points into the shared mapping.  Only valid until the writer laps it:
+    // call IsValid() after using the bytes
+    const uint8_t* Data = nullptr;
+    uint32_t Bytes = 0;
+
+    // Offset of the record in the data stream
+    uint64_t Offset = 0;
+
+    bool IsKeyframe() const {
+        return (Flags & SHM_FLAG_KEYFRAME) != 0;
+    }
+    bool IsSetup() const {
+        return (Flags & SHM_FLAG_SETUP) != 0;
+    }
+};
+
+class ShmFrameReader {
+public:
+    enum ReadResult {
+        SHM_READ_RECORD, // view holds the next record
+        SHM_READ_TIMEOUT, // Nothing new within the timeout
+        SHM_READ_CLOSED, // The writer closed the ring and every record was read
+        SHM_READ_ERROR
+    };
+
+    ~ShmFrameReader() {
+        Close();
+    }
+
+    // Maps an existing ring.  Starts at the next record published, or at the
+    // oldest record still in the ring if from_oldest is true
+    bool Open(const std::string& name, bool from_oldest = false);
+    void Close();
+
+    // Waits up to timeout_msec (-1 = forever) for the next record.  If the
+    // writer has lapped the reader, skips to the newest record and adds the
+    // records skipped to Skipped
+    ReadResult Read(ShmFrameView& view, int timeout_msec);
+
+    // True if the writer has not reused the bytes of the view.  Call after
+    // using the data: if false, the data may have been torn
+    bool IsValid(const ShmFrameView& view) const;
+
+    ShmFrameFormat GetFormat() const {
+        return static_cast<ShmFrameFormat>( Header->Format );
+    }
+
+    // Records skipped after the reader was lapped or a record was overwritten
+    // before it could be read
+    uint64_t Skipped = 0;
+
+private:
+    int Fd = -1;
+    uint8_t* Map = nullptr;
+    size_t MapBytes = 0;
+
+    ShmRingHeader* Header = nullptr;
+    ShmRecord* Records = nullptr;
+    const uint8_t* Data = nullptr;
+
+    // Next record number to read
+    uint64_t NextRecord = 0;
+
+    // Returns false if the record in the slot is not record number n
+    bool ReadSlot(uint64_t n, ShmFrameView& view) const;
+    bool WaitForRecord(int timeout_msec);
+};
+
+#endif // RTMP_SHM_READER_H
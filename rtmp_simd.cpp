@@ -0,0 +1,194 @@
+#include "rtmp_simd.h"
+
+#include <atomic>
+using namespace std;
+
+#if defined(__x86_64__)
+#define RTMP_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define RTMP_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+using FindPatternFunc = size_t (*)(const uint8_t* data, size_t bytes, uint8_t max_third_byte);
+
+
+//------------------------------------------------------------------------------
+// Scanners
+
+static size_t FindPatternScalar(const uint8_t* data, size_t bytes, uint8_t max_third_byte)
+{
+    for (size_t i = 0; i + 3 <= bytes; ++i) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] <= max_third_byte) {
+            return i;
+        }
+    }
+    return bytes;
+}
+
+// Each vector step compares the block at i, i + 1 and i + 2 so that a match
+// straddling two blocks is still found, and leaves the last few bytes to the
+// scalar loop
+
+#ifdef RTMP_SIMD_X86
+
+static size_t FindPatternSse2(const uint8_t* data, size_t bytes, uint8_t max_third_byte)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max_third = _mm_set1_epi8(static_cast<char>( max_third_byte ));
+
+    size_t i = 0;
+    for (; i + 18 <= bytes; i += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>( data + i ));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>( data + i + 1 ));
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>( data + i + 2 ));
+
+        // c <= max_third when min(c, max_third) == c
+        __m128i match = _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero));
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_min_epu8(c, max_third), c));
+
+        const uint32_t mask = static_cast<uint32_t>( _mm_movemask_epi8(match) );
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + FindPatternScalar(data + i, bytes - i, max_third_byte);
+}
+
+__attribute__((target("avx2")))
+static size_t FindPatternAvx2(const uint8_t* data, size_t bytes, uint8_t max_third_byte)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max_third = _mm256_set1_epi8(static_cast<char>( max_third_byte ));
+
+    size_t i = 0;
+    for (; i + 34 <= bytes; i += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( data + i ));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( data + i + 1 ));
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( data + i + 2 ));
+
+        __m256i match = _mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero));
+        match = _mm256_and_si256(match, _mm256_cmpeq_epi8(_mm256_min_epu8(c, max_third), c));
+
+        const uint32_t mask = static_cast<uint32_t>( _mm256_movemask_epi8(match) );
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + FindPatternSse2(data + i, bytes - i, max_third_byte);
+}
+
+#endif // RTMP_SIMD_X86
+
+#ifdef RTMP_SIMD_NEON
+
+static size_t FindPatternNeon(const uint8_t* data, size_t bytes, uint8_t max_third_byte)
+{
+    const uint8x16_t max_third = vdupq_n_u8(max_third_byte);
+
+    size_t i = 0;
+    for (; i + 18 <= bytes; i += 16) {
+        const uint8x16_t a = vld1q_u8(data + i);
+        const uint8x16_t b = vld1q_u8(data + i + 1);
+        const uint8x16_t c = vld1q_u8(data + i + 2);
+
+        uint8x16_t match = vandq_u8(vceqzq_u8(a), vceqzq_u8(b));
+        match = vandq_u8(match, vcleq_u8(c, max_third));
+
+        // Narrows each byte of the match to 4 bits of a 64-bit mask
+        const uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(match), 4);
+        const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        if (mask != 0) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+    return i + FindPatternScalar(data + i, bytes - i, max_third_byte);
+}
+
+#endif // RTMP_SIMD_NEON
+
+
+//------------------------------------------------------------------------------
+// SimdLevel
+
+static std::atomic<FindPatternFunc> FindPattern = ATOMIC_VAR_INIT(nullptr);
+static std::atomic<int> ActiveLevel = ATOMIC_VAR_INIT(-1);
+
+static FindPatternFunc GetFindPattern(SimdLevel level)
+{
+    switch (level) {
+#ifdef RTMP_SIMD_X86
+    case SIMD_SSE2: return FindPatternSse2;
+    case SIMD_AVX2: return FindPatternAvx2;
+#endif
+#ifdef RTMP_SIMD_NEON
+    case SIMD_NEON: return FindPatternNeon;
+#endif
+    case SIMD_SCALAR: return FindPatternScalar;
+    default: break;
+    }
+    return nullptr;
+}
+
+static SimdLevel DetectSimdLevel()
+{
+#if defined(RTMP_SIMD_X86)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#elif defined(RTMP_SIMD_NEON)
+    return SIMD_NEON;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+const char* SimdLevelToString(SimdLevel level)
+{
+    switch (level) {
+    case SIMD_SCALAR: return "scalar";
+    case SIMD_SSE2: return "sse2";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_NEON: return "neon";
+    default: break;
+    }
+    return "unknown";
+}
+
+SimdLevel GetBestSimdLevel()
+{
+    static const SimdLevel best = DetectSimdLevel();
+    return best;
+}
+
+SimdLevel GetSimdLevel()
+{
+    const int level = ActiveLevel.load(std::memory_order_relaxed);
+    return level >= 0 ? static_cast<SimdLevel>( level ) : GetBestSimdLevel();
+}
+
+bool SetSimdLevel(SimdLevel level)
+{
+    const FindPatternFunc find = GetFindPattern(level);
+    if (!find || level > GetBestSimdLevel()) {
+        return false;
+    }
+
+    FindPattern.store(find, std::memory_order_relaxed);
+    ActiveLevel.store(static_cast<int>( level ), std::memory_order_relaxed);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Byte Pattern Scanner
+
+size_t FindZeroZeroPattern(const uint8_t* data, size_t bytes, uint8_t max_third_byte)
+{
+    FindPatternFunc find = FindPattern.load(std::memory_order_relaxed);
+    if (!find) {
+        find = GetFindPattern(GetBestSimdLevel());
+        FindPattern.store(find, std::memory_order_relaxed);
+    }
+    return find(data, bytes, max_third_byte);
+}
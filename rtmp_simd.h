@@ -0,0 +1,41 @@
+#ifndef RTMP_SIMD_H
+#define RTMP_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+
+//------------------------------------------------------------------------------
+// SimdLevel
+
+// Instruction sets the byte scanners can use.  SSE2 is always available on
+// x86-64 and NEON on aarch64, while AVX2 is checked for at runtime
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_NEON
+};
+
+const char* SimdLevelToString(SimdLevel level);
+
+// Best level this CPU supports
+SimdLevel GetBestSimdLevel();
+
+// Level the scanners currently use.  Defaults to GetBestSimdLevel()
+SimdLevel GetSimdLevel();
+
+// Switches every scanner to a level, e.g. to compare them in benchmarks.
+// Returns false if the CPU or the build does not support it
+bool SetSimdLevel(SimdLevel level);
+
+
+//------------------------------------------------------------------------------
+// Byte Pattern Scanner
+
+// Offset of the first 00 00 XX sequence with XX <= max_third_byte, or bytes
+// if there is none.  max_third_byte = 0 finds the 00 00 00 runs that Annex B
+// escapes, 1 finds start codes, and 3 finds emulation prevention bytes too
+size_t FindZeroZeroPattern(const uint8_t* data, size_t bytes, uint8_t max_third_byte);
+
+#endif // RTMP_SIMD_H
@@ -41,6 +41,22 @@ uint64_t GetMsec() {
     return ms.count();
 }
 
+uint64_t GetMonotonicUsec() {
+    using namespace std::chrono;
+    microseconds us = duration_cast<microseconds>(
+        steady_clock::now().time_since_epoch()
+    );
+    return us.count();
+}
+
+uint64_t GetMonotonicNsec() {
+    using namespace std::chrono;
+    nanoseconds ns = duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()
+    );
+    return ns.count();
+}
+
 void PrintFirst64BytesAsHex(const uint8_t* data, size_t size) {
     size_t bytesToPrint = (size < 512) ? size : 512; // Limit to the first 64 bytes
 
@@ -57,12 +73,6 @@ void PrintFirst64BytesAsHex(const uint8_t* data, size_t size) {
     std::cout << std::dec << std::endl; // Switch back to decimal for any further output
 }
 
-void AppendDataToVector(std::vector<uint8_t>& vec, const uint8_t* data, int bytes) {
-    if (data != nullptr && bytes > 0) {
-        vec.insert(vec.end(), data, data + bytes);
-    }
-}
-
 std::string CreateStringFromBytes(const uint8_t* data, size_t length) {
     // Create a string from the given data and length.
     // The std::string constructor will copy 'length' characters and
@@ -21,9 +21,19 @@ void WriteUInt24(uint8_t* buffer, uint32_t value);
 
 uint64_t GetMsec();
 
+// Monotonic clock for measuring intervals
+uint64_t GetMonotonicUsec();
+uint64_t GetMonotonicNsec();
+
 void PrintFirst64BytesAsHex(const uint8_t* data, size_t size);
 
-void AppendDataToVector(std::vector<uint8_t>& vec, const uint8_t* data, int bytes);
+// Works for any byte vector, e.g. ArenaBytes
+template<typename VectorT>
+void AppendDataToVector(VectorT& vec, const uint8_t* data, int bytes) {
+    if (data != nullptr && bytes > 0) {
+        vec.insert(vec.end(), data, data + bytes);
+    }
+}
 
 std::string CreateStringFromBytes(const uint8_t* data, size_t length);
 
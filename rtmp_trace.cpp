@@ -0,0 +1,136 @@
+#include "rtmp_trace.h"
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+const char* GetLatencyStageName(int stage) {
+    switch (stage) {
+        case LATENCY_STAGE_REASSEMBLY: return "reassembly";
+        case LATENCY_STAGE_PARSE: return "parse";
+        case LATENCY_STAGE_AVCC: return "avcc";
+        case LATENCY_STAGE_DISPATCH: return "dispatch";
+        case LATENCY_STAGE_CALLBACK: return "callback";
+        case LATENCY_STAGE_TOTAL: return "total";
+        default: return "unknown";
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// LatencySnapshot
+
+void LatencySnapshot::Merge(const LatencySnapshot& other)
+{
+    if (Counts.size() < other.Counts.size()) {
+        Counts.resize(other.Counts.size());
+    }
+    for (size_t i = 0; i < other.Counts.size(); ++i) {
+        Counts[i] += other.Counts[i];
+    }
+    Count += other.Count;
+    Sum += other.Sum;
+    if (Max < other.Max) {
+        Max = other.Max;
+    }
+}
+
+uint64_t LatencySnapshot::Percentile(double p) const
+{
+    if (Count == 0) {
+        return 0;
+    }
+
+    uint64_t target = static_cast<uint64_t>( p * Count + 0.5 );
+    if (target < 1) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < Counts.size(); ++i) {
+        seen += Counts[i];
+        if (seen >= target) {
+            uint64_t value = LatencyHistogram::GetBucketUpperBound(static_cast<int>( i ));
+            return value < Max ? value : Max;
+        }
+    }
+    return Max;
+}
+
+double LatencySnapshot::Mean() const
+{
+    if (Count == 0) {
+        return 0.0;
+    }
+    return static_cast<double>( Sum ) / Count;
+}
+
+
+//------------------------------------------------------------------------------
+// LatencyHistogram
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+int LatencyHistogram::GetBucketIndex(uint64_t value)
+{
+    if (value < kSubBuckets) {
+        return static_cast<int>( value );
+    }
+
+    const int magnitude = 63 - __builtin_clzll(value);
+    const int shift = magnitude - kSubBucketBits;
+    const int sub_bucket = static_cast<int>( (value >> shift) & (kSubBuckets - 1) );
+
+    return kSubBuckets + shift * kSubBuckets + sub_bucket;
+}
+
+uint64_t LatencyHistogram::GetBucketUpperBound(int index)
+{
+    if (index < kSubBuckets) {
+        return static_cast<uint64_t>( index );
+    }
+
+    const int shift = (index - kSubBuckets) / kSubBuckets;
+    const uint64_t sub_bucket = (index - kSubBuckets) % kSubBuckets;
+    const uint64_t lower = (kSubBuckets + sub_bucket) << shift;
+
+    return lower + ((1ULL << shift) - 1);
+}
+
+void LatencyHistogram::Record(uint64_t value)
+{
+    Counts[GetBucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    Sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t prev_max = Max.load(std::memory_order_relaxed);
+    while (prev_max < value &&
+        !Max.compare_exchange_weak(prev_max, value, std::memory_order_relaxed))
+    {
+        // Retry with updated prev_max
+    }
+}
+
+void LatencyHistogram::Snapshot(LatencySnapshot& snapshot) const
+{
+    snapshot.Counts.resize(kBucketCount);
+
+    snapshot.Count = 0;
+    for (int i = 0; i < kBucketCount; ++i) {
+        snapshot.Counts[i] = Counts[i].load(std::memory_order_relaxed);
+        snapshot.Count += snapshot.Counts[i];
+    }
+    snapshot.Sum = Sum.load(std::memory_order_relaxed);
+    snapshot.Max = Max.load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Reset()
+{
+    for (int i = 0; i < kBucketCount; ++i) {
+        Counts[i].store(0, std::memory_order_relaxed);
+    }
+    Sum.store(0, std::memory_order_relaxed);
+    Max.store(0, std::memory_order_relaxed);
+}
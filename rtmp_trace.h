@@ -0,0 +1,101 @@
+#ifndef RTMP_TRACE_H
+#define RTMP_TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Tracing
+
+// Build with -DRTMP_ENABLE_TRACING (cmake -DRTMP_ENABLE_TRACING=ON) to record
+// per-frame timestamps from socket arrival to callback.  Otherwise the
+// instrumentation compiles out and RTMPFrameTrace is empty.
+
+#ifdef RTMP_ENABLE_TRACING
+# define RTMP_TRACE(x) x
+#else
+# define RTMP_TRACE(x)
+#endif
+
+// Monotonic nanosecond timestamps for each stage of a video message
+struct RTMPFrameTrace {
+#ifdef RTMP_ENABLE_TRACING
+    // recv() that completed the first and last chunk of the message
+    uint64_t FirstChunkRecvNsec = 0;
+    uint64_t LastChunkRecvNsec = 0;
+
+    // Message reassembled from its chunks
+    uint64_t ReassembledNsec = 0;
+
+    // AVCCParser::parseAvcc() done
+    uint64_t AvccParsedNsec = 0;
+
+    // Video callback invoked.  The exit time is only recorded in the histograms
+    uint64_t CallbackEntryNsec = 0;
+#endif
+};
+
+
+//------------------------------------------------------------------------------
+// LatencyHistogram
+
+enum LatencyStage {
+    LATENCY_STAGE_REASSEMBLY, // First chunk received -> last chunk received
+    LATENCY_STAGE_PARSE, // Last chunk received -> message reassembled
+    LATENCY_STAGE_AVCC, // Message reassembled -> AVCC parsed
+    LATENCY_STAGE_DISPATCH, // AVCC parsed -> callback entry
+    LATENCY_STAGE_CALLBACK, // Callback entry -> callback exit
+    LATENCY_STAGE_TOTAL, // First chunk received -> callback exit
+    LATENCY_STAGE_COUNT
+};
+
+const char* GetLatencyStageName(int stage);
+
+// Copy of a histogram that can be merged and queried
+struct LatencySnapshot {
+    std::vector<uint64_t> Counts;
+    uint64_t Count = 0;
+    uint64_t Sum = 0;
+    uint64_t Max = 0;
+
+    void Merge(const LatencySnapshot& other);
+
+    // Upper bound of the bucket containing the percentile (0..1), within 1/16 of the true value
+    uint64_t Percentile(double p) const;
+
+    double Mean() const;
+};
+
+// Log-linear (HDR-style) histogram: 16 linear sub-buckets per power of two.
+// Record() is lock-free and may be called from any thread.
+class LatencyHistogram {
+public:
+    static const int kSubBucketBits = 4;
+    static const int kSubBuckets = 1 << kSubBucketBits;
+    static const int kBucketCount = kSubBuckets + (64 - kSubBucketBits) * kSubBuckets;
+
+    LatencyHistogram();
+
+    void Record(uint64_t value);
+
+    void Snapshot(LatencySnapshot& snapshot) const;
+    void Reset();
+
+    static int GetBucketIndex(uint64_t value);
+    static uint64_t GetBucketUpperBound(int index);
+
+private:
+    std::atomic<uint64_t> Counts[kBucketCount];
+    std::atomic<uint64_t> Sum;
+    std::atomic<uint64_t> Max;
+};
+
+// Per-stage latency in nanoseconds
+struct RTMPLatencyStats {
+    LatencySnapshot Stages[LATENCY_STAGE_COUNT];
+};
+
+#endif // RTMP_TRACE_H